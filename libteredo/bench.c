@@ -0,0 +1,789 @@
+/*
+ * bench.c - Synthetic Teredo traffic generator and latency probe
+ */
+
+/***********************************************************************
+ *  Copyright © 2004-2007 Rémi Denis-Courmont.                         *
+ *  This program is free software; you can redistribute and/or modify  *
+ *  it under the terms of the GNU General Public License as published  *
+ *  by the Free Software Foundation; version 2 of the license, or (at  *
+ *  your option) any later version.                                    *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *  See the GNU General Public License for more details.               *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, you can get it from:              *
+ *  http://www.gnu.org/copyleft/gpl.html                               *
+ ***********************************************************************/
+
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <sys/resource.h> // setrlimit()
+#include <netinet/in.h>
+#include <netinet/ip6.h>
+#include <netinet/icmp6.h>
+#include <arpa/inet.h> // inet_pton()
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#ifdef __linux__
+# include <sys/epoll.h>
+#else
+# include <poll.h>
+#endif
+#ifdef HAVE_GETOPT_H
+# include <getopt.h>
+#endif
+
+#include <libteredo/teredo.h>
+#include <libteredo/teredo-udp.h>
+
+/* Maximum number of packets per receive burst */
+#define BENCH_BURST 16
+/* Per-peer bubble send times kept for one-way latency (power of two) */
+#define BENCH_SLOTS 64
+/* Latency histogram: 2^HIST_SHIFT buckets per power of two */
+#define HIST_SHIFT 5
+#define HIST_SUB   (1 << HIST_SHIFT)
+#define HIST_SIZE  ((64 - HIST_SHIFT + 1) * HIST_SUB)
+
+typedef enum bench_mode
+{
+	BENCH_ECHO, // ICMPv6 Echo through a relay or teredo-mire
+	BENCH_BUBBLE, // indirect bubbles through a server
+	BENCH_RS, // Router Solicitations to a server
+} bench_mode;
+
+static const char *const mode_names[] = { "echo", "bubble", "rs" };
+
+/**
+ * Emulated Teredo client.
+ */
+typedef struct bench_peer
+{
+	int fd;
+	union teredo_addr addr; // Teredo IPv6 address
+	uint16_t port; // mapped UDP port (network byte order)
+	uint16_t seq;
+	uint64_t sent[BENCH_SLOTS]; // bubble send times, updated atomically
+} bench_peer;
+
+typedef struct bench
+{
+	bench_mode mode;
+	uint32_t server_ip; // target IPv4 (network byte order)
+	uint16_t server_port; // target UDP port (network byte order)
+	struct in6_addr echo_dst; // ICMPv6 Echo Request destination
+	size_t size; // IPv6 packet size
+	unsigned npeers;
+	bench_peer *peers;
+	bool stop; // accessed atomically
+
+	/* Receiver statistics */
+	unsigned long received, rx_bytes;
+	uint64_t lat_min, lat_max;
+	uint64_t hist[HIST_SIZE];
+} bench;
+
+
+static uint64_t bench_now (void)
+{
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * UINT64_C(1000000000) + ts.tv_nsec;
+}
+
+
+/*** Latency histogram ***/
+/*
+ * Values below 2^HIST_SHIFT nanoseconds have their own bucket. Above, each
+ * power of two is split into HIST_SUB buckets, so that the relative error
+ * is less than 1 / HIST_SUB.
+ */
+static unsigned hist_index (uint64_t v)
+{
+	if (v < HIST_SUB)
+		return v;
+
+	unsigned e = 63 - __builtin_clzll (v);
+	return (e - HIST_SHIFT + 1) * HIST_SUB
+	       + ((v >> (e - HIST_SHIFT)) & (HIST_SUB - 1));
+}
+
+
+static uint64_t hist_value (unsigned idx)
+{
+	if (idx < 2 * HIST_SUB)
+		return idx;
+
+	unsigned e = idx / HIST_SUB + HIST_SHIFT - 1;
+	return (uint64_t)(HIST_SUB + idx % HIST_SUB) << (e - HIST_SHIFT);
+}
+
+
+static void bench_record (bench *b, uint64_t sent, uint64_t now)
+{
+	if ((sent == 0) || (sent > now))
+		return; // garbage
+
+	uint64_t v = now - sent;
+	if ((b->received == 0) || (v < b->lat_min))
+		b->lat_min = v;
+	if (v > b->lat_max)
+		b->lat_max = v;
+	b->hist[hist_index (v)]++;
+	b->received++;
+}
+
+
+/**
+ * @return the latency below which a given fraction of the samples lie.
+ */
+static uint64_t bench_percentile (const bench *b, double q)
+{
+	uint64_t rank = q * b->received, n = 0;
+
+	for (unsigned i = 0; i < HIST_SIZE; i++)
+	{
+		n += b->hist[i];
+		if (n > rank)
+		{
+			uint64_t v = hist_value (i);
+			/* Do not report more than was actually seen */
+			if (v < b->lat_min)
+				v = b->lat_min;
+			return (v > b->lat_max) ? b->lat_max : v;
+		}
+	}
+	return b->lat_max;
+}
+
+
+/*** Transmission ***/
+static int send_echo (bench *b, unsigned i, uint64_t now)
+{
+	bench_peer *p = b->peers + i;
+	struct
+	{
+		struct ip6_hdr ip6;
+		struct icmp6_hdr icmp6;
+		uint64_t stamp;
+	} req;
+	static const uint8_t pad[1280];
+	size_t padlen = b->size - sizeof (req);
+
+	req.ip6.ip6_flow = htonl (6 << 28);
+	req.ip6.ip6_plen = htons (b->size - sizeof (req.ip6));
+	req.ip6.ip6_nxt = IPPROTO_ICMPV6;
+	req.ip6.ip6_hlim = 255;
+	req.ip6.ip6_src = p->addr.ip6;
+	req.ip6.ip6_dst = b->echo_dst;
+
+	req.icmp6.icmp6_type = ICMP6_ECHO_REQUEST;
+	req.icmp6.icmp6_code = 0;
+	req.icmp6.icmp6_cksum = 0;
+	req.icmp6.icmp6_id = htons (i);
+	req.icmp6.icmp6_seq = htons (p->seq++);
+	req.stamp = now;
+
+	struct iovec iov[] =
+	{
+		{ &req, sizeof (req) },
+		{ (void *)pad, padlen }
+	};
+	struct iovec ck[] =
+	{
+		{ &req.icmp6, sizeof (req.icmp6) + sizeof (req.stamp) },
+		{ (void *)pad, padlen }
+	};
+
+	req.icmp6.icmp6_cksum = teredo_cksum (&req.ip6.ip6_src, &req.ip6.ip6_dst,
+	                                      IPPROTO_ICMPV6, ck, 2);
+	return teredo_sendv (p->fd, iov, 2, b->server_ip, b->server_port);
+}
+
+
+static int send_bubble (bench *b, unsigned i, uint64_t now)
+{
+	bench_peer *p = b->peers + i;
+	const bench_peer *dst = b->peers + (i + 1) % b->npeers;
+	unsigned slot = p->seq++ & (BENCH_SLOTS - 1);
+	union teredo_addr src = p->addr;
+	struct ip6_hdr ip6;
+
+	/* The slot number is carried in the (unused) source address flags */
+	src.teredo.flags = htons (slot);
+
+	ip6.ip6_flow = htonl (6 << 28);
+	ip6.ip6_plen = 0;
+	ip6.ip6_nxt = IPPROTO_NONE;
+	ip6.ip6_hlim = 0;
+	ip6.ip6_src = src.ip6;
+	ip6.ip6_dst = dst->addr.ip6;
+
+	__atomic_store_n (p->sent + slot, now, __ATOMIC_RELAXED);
+	return teredo_send (p->fd, &ip6, sizeof (ip6), b->server_ip,
+	                    b->server_port);
+}
+
+
+static const struct in6_addr in6addr_allrouters =
+{ { { 0xff, 0x02, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0x2 } } };
+
+static int send_rs (bench *b, unsigned i, uint64_t now)
+{
+	const bench_peer *p = b->peers + i;
+	uint8_t auth[13] = { 0, 1 };
+	struct
+	{
+		struct ip6_hdr ip6;
+		struct nd_router_solicit rs;
+	} rs;
+	struct iovec iov[] =
+	{
+		{ auth, 13 },
+		{ &rs, sizeof (rs) }
+	};
+
+	/* The server echoes the nonce: use it for the send time */
+	memcpy (auth + 4, &now, 8);
+
+	rs.ip6.ip6_flow = htonl (0x60000000);
+	rs.ip6.ip6_plen = htons (sizeof (rs) - sizeof (rs.ip6));
+	rs.ip6.ip6_nxt = IPPROTO_ICMPV6;
+	rs.ip6.ip6_hlim = 255;
+	rs.ip6.ip6_src = teredo_restrict;
+	rs.ip6.ip6_dst = in6addr_allrouters;
+
+	rs.rs.nd_rs_type = ND_ROUTER_SOLICIT;
+	rs.rs.nd_rs_code = 0;
+	rs.rs.nd_rs_cksum = 0;
+	rs.rs.nd_rs_reserved = 0;
+
+	struct iovec ck = { &rs.rs, sizeof (rs.rs) };
+	rs.rs.nd_rs_cksum = teredo_cksum (&rs.ip6.ip6_src, &rs.ip6.ip6_dst,
+	                                  IPPROTO_ICMPV6, &ck, 1);
+
+	return teredo_sendv (p->fd, iov, 2, b->server_ip, b->server_port);
+}
+
+
+/*** Reception ***/
+static void recv_echo (bench *b, unsigned i, const teredo_packet *p,
+                       uint64_t now)
+{
+	const struct ip6_hdr *ip6 = p->ip6;
+	struct icmp6_hdr icmp6;
+	uint64_t stamp;
+
+	if ((p->ip6_len < sizeof (*ip6) + sizeof (icmp6) + sizeof (stamp))
+	 || (ip6->ip6_nxt != IPPROTO_ICMPV6))
+		return;
+
+	memcpy (&icmp6, ip6 + 1, sizeof (icmp6));
+	if ((icmp6.icmp6_type != ICMP6_ECHO_REPLY)
+	 || (icmp6.icmp6_id != htons (i)))
+		return;
+
+	memcpy (&stamp, (const uint8_t *)(ip6 + 1) + sizeof (icmp6),
+	        sizeof (stamp));
+	bench_record (b, stamp, now);
+}
+
+
+static void recv_bubble (bench *b, unsigned i, const teredo_packet *p,
+                         uint64_t now)
+{
+	const struct ip6_hdr *ip6 = p->ip6;
+	/* Peer i only gets bubbles from the previous peer */
+	bench_peer *src = b->peers + (i + b->npeers - 1) % b->npeers;
+	union teredo_addr addr;
+
+	if ((p->ip6_len != sizeof (*ip6)) || (ip6->ip6_nxt != IPPROTO_NONE))
+		return;
+
+	memcpy (&addr, &ip6->ip6_src, sizeof (addr));
+	if ((addr.teredo.client_port != src->addr.teredo.client_port)
+	 || (ntohs (addr.teredo.flags) >= BENCH_SLOTS))
+		return;
+
+	/* Each send time is used once, so that duplicates do not count */
+	bench_record (b, __atomic_exchange_n (src->sent
+	                                      + ntohs (addr.teredo.flags), 0,
+	                                      __ATOMIC_RELAXED), now);
+}
+
+
+static void recv_ra (bench *b, unsigned i, const teredo_packet *p,
+                     uint64_t now)
+{
+	const struct ip6_hdr *ip6 = p->ip6;
+	uint64_t stamp;
+
+	(void)i;
+	if (!p->auth_present
+	 || (p->ip6_len < sizeof (*ip6) + sizeof (struct nd_router_advert))
+	 || (ip6->ip6_nxt != IPPROTO_ICMPV6)
+	 || (((const uint8_t *)(ip6 + 1))[0] != ND_ROUTER_ADVERT))
+		return;
+
+	memcpy (&stamp, p->auth_nonce, sizeof (stamp));
+	bench_record (b, stamp, now);
+}
+
+
+static void bench_receive (bench *b, unsigned i, teredo_packet *pv)
+{
+	int n = teredo_recv_burst (b->peers[i].fd, pv, BENCH_BURST);
+	if (n <= 0)
+		return;
+
+	uint64_t now = bench_now ();
+
+	for (int j = 0; j < n; j++)
+	{
+		if (pv[j].ip6_len == 0)
+			continue;
+
+		unsigned long before = b->received;
+		switch (b->mode)
+		{
+			case BENCH_ECHO:
+				recv_echo (b, i, pv + j, now);
+				break;
+			case BENCH_BUBBLE:
+				recv_bubble (b, i, pv + j, now);
+				break;
+			case BENCH_RS:
+				recv_ra (b, i, pv + j, now);
+				break;
+		}
+		if (b->received != before)
+			b->rx_bytes += pv[j].ip6_len;
+	}
+}
+
+
+static void *receiver_thread (void *data)
+{
+	bench *b = data;
+	teredo_packet *pv = malloc (BENCH_BURST * sizeof (*pv));
+
+	if (pv == NULL)
+		return NULL;
+
+#ifdef __linux__
+	int epfd = epoll_create1 (EPOLL_CLOEXEC);
+	if (epfd == -1)
+	{
+		free (pv);
+		return NULL;
+	}
+
+	for (unsigned i = 0; i < b->npeers; i++)
+	{
+		struct epoll_event ev = { .events = EPOLLIN, .data.u32 = i };
+		epoll_ctl (epfd, EPOLL_CTL_ADD, b->peers[i].fd, &ev);
+	}
+
+	while (!__atomic_load_n (&b->stop, __ATOMIC_ACQUIRE))
+	{
+		struct epoll_event evv[64];
+		int n = epoll_wait (epfd, evv, 64, 100);
+
+		for (int j = 0; j < n; j++)
+			bench_receive (b, evv[j].data.u32, pv);
+	}
+	close (epfd);
+#else
+	struct pollfd *ufds = malloc (b->npeers * sizeof (*ufds));
+	if (ufds == NULL)
+	{
+		free (pv);
+		return NULL;
+	}
+
+	for (unsigned i = 0; i < b->npeers; i++)
+	{
+		ufds[i].fd = b->peers[i].fd;
+		ufds[i].events = POLLIN;
+	}
+
+	while (!__atomic_load_n (&b->stop, __ATOMIC_ACQUIRE))
+		if (poll (ufds, b->npeers, 100) > 0)
+			for (unsigned i = 0; i < b->npeers; i++)
+				if (ufds[i].revents & POLLIN)
+					bench_receive (b, i, pv);
+	free (ufds);
+#endif
+	free (pv);
+	return NULL;
+}
+
+
+/*** Setup ***/
+/**
+ * Finds the local IPv4 address used toward the target.
+ */
+static uint32_t bench_local_ip (uint32_t server_ip, uint16_t port)
+{
+	struct sockaddr_in sin =
+	{
+		.sin_family = AF_INET,
+		.sin_port = port,
+		.sin_addr.s_addr = server_ip
+	};
+	socklen_t len = sizeof (sin);
+	int fd = socket (AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	uint32_t ip = 0;
+
+	if (fd == -1)
+		return 0;
+	if ((connect (fd, (struct sockaddr *)&sin, sizeof (sin)) == 0)
+	 && (getsockname (fd, (struct sockaddr *)&sin, &len) == 0))
+		ip = sin.sin_addr.s_addr;
+	close (fd);
+	return ip;
+}
+
+
+static int bench_open_peers (bench *b, uint32_t bind_ip)
+{
+	uint32_t local_ip = bind_ip ? bind_ip
+	                    : bench_local_ip (b->server_ip, b->server_port);
+	struct rlimit lim;
+
+	/* One socket per emulated client */
+	if (getrlimit (RLIMIT_NOFILE, &lim) == 0)
+	{
+		lim.rlim_cur = lim.rlim_max;
+		setrlimit (RLIMIT_NOFILE, &lim);
+	}
+
+	for (unsigned i = 0; i < b->npeers; i++)
+	{
+		bench_peer *p = b->peers + i;
+		struct sockaddr_in sin;
+		socklen_t len = sizeof (sin);
+
+		p->fd = teredo_socket (bind_ip, 0);
+		if (p->fd == -1)
+		{
+			perror ("teredo_socket");
+			goto error;
+		}
+		if (getsockname (p->fd, (struct sockaddr *)&sin, &len))
+		{
+			perror ("getsockname");
+			teredo_close (p->fd);
+			goto error;
+		}
+
+		p->port = sin.sin_port;
+		p->addr.teredo.prefix = htonl (TEREDO_PREFIX);
+		p->addr.teredo.server_ip = b->server_ip;
+		p->addr.teredo.flags = 0;
+		p->addr.teredo.client_port = ~p->port;
+		p->addr.teredo.client_ip = ~local_ip;
+		continue;
+
+	error:
+		while (i > 0)
+			teredo_close (b->peers[--i].fd);
+		return -1;
+	}
+	return 0;
+}
+
+
+/**
+ * Sends packets at the requested rate, round-robin over the peers.
+ *
+ * @return the number of packets sent.
+ */
+static unsigned long bench_run (bench *b, unsigned long rate,
+                                uint64_t duration, uint64_t *elapsed)
+{
+	int (*const sendfn[]) (bench *, unsigned, uint64_t) =
+		{ send_echo, send_bubble, send_rs };
+	uint64_t start = bench_now (), now = start;
+	unsigned long sent = 0, count = 0;
+	unsigned peer = 0;
+
+	while ((now - start) < duration)
+	{
+		unsigned long due = (now - start) * rate / 1000000000;
+
+		while (count < due)
+		{
+			if (sendfn[b->mode] (b, peer, bench_now ()) > 0)
+				sent++;
+			count++;
+			if (++peer == b->npeers)
+				peer = 0;
+		}
+
+		struct timespec ts = { 0, 100000 };
+		nanosleep (&ts, NULL);
+		now = bench_now ();
+	}
+
+	*elapsed = now - start;
+	return sent;
+}
+
+
+static void bench_report (const bench *b, unsigned long rate,
+                          unsigned long sent, uint64_t elapsed)
+{
+	double secs = elapsed / 1e9;
+	unsigned long lost = (sent > b->received) ? (sent - b->received) : 0;
+	static const double q[] = { .5, .9, .99, .999 };
+	static const char *const qn[] = { "p50", "p90", "p99", "p999" };
+
+	printf ("mode=%s peers=%u size=%zu rate=%lu duration=%.3f "
+	        "sent=%lu received=%lu lost=%lu loss=%.6f "
+	        "tx_pps=%.0f rx_pps=%.0f rx_bps=%.0f latency=%s",
+	        mode_names[b->mode], b->npeers, b->size, rate, secs,
+	        sent, b->received, lost, sent ? (double)lost / sent : 0.,
+	        sent / secs, b->received / secs, b->rx_bytes * 8 / secs,
+	        (b->mode == BENCH_BUBBLE) ? "oneway" : "rtt");
+
+	printf (" min_us=%.1f", b->received ? b->lat_min / 1e3 : 0.);
+	for (unsigned i = 0; i < sizeof (q) / sizeof (q[0]); i++)
+		printf (" %s_us=%.1f", qn[i],
+		        b->received ? bench_percentile (b, q[i]) / 1e3 : 0.);
+	printf (" max_us=%.1f\n", b->lat_max / 1e3);
+}
+
+
+static int usage (const char *path)
+{
+	printf ("Usage: %s [OPTIONS] SERVER_IPV4\n"
+	        "Sends synthetic Teredo traffic from many emulated clients.\n\n"
+	        "  -b, --bind=IPV4      bind the clients to this address\n"
+	        "  -D, --destination=IPV6\n"
+	        "                       Echo Request destination (default: the\n"
+	        "                       Teredo address of teredo-mire on SERVER)\n"
+	        "  -d, --duration=SECS  send for this many seconds (default: 10)\n"
+	        "  -h, --help           display this help and exit\n"
+	        "  -m, --mode=MODE      echo, bubble or rs (default: echo)\n"
+	        "  -n, --peers=N        number of emulated clients (default: 1000)\n"
+	        "  -p, --port=PORT      target UDP port (default: 3545 in echo\n"
+	        "                       mode, 3544 otherwise)\n"
+	        "  -r, --rate=PPS       total packets per second (default: 10000)\n"
+	        "  -s, --size=BYTES     Echo Request IPv6 size (default: 80)\n"
+	        "  -V, --version        display program version and exit\n"
+	        "  -w, --wait=SECS      wait for late replies (default: 1)\n",
+	        path);
+	return 0;
+}
+
+static int version (void)
+{
+	puts (PACKAGE_NAME" v"PACKAGE_VERSION);
+	return 0;
+}
+
+
+static bool parse_ulong (const char *str, unsigned long min,
+                         unsigned long max, unsigned long *res)
+{
+	char *end;
+	unsigned long v = strtoul (str, &end, 10);
+
+	if (*end || (end == str) || (v < min) || (v > max))
+	{
+		fprintf (stderr, "%s: invalid value\n", str);
+		return false;
+	}
+	*res = v;
+	return true;
+}
+
+
+int main (int argc, char *argv[])
+{
+	static const struct option opts[] =
+	{
+		{ "bind",        required_argument, NULL, 'b' },
+		{ "destination", required_argument, NULL, 'D' },
+		{ "duration",    required_argument, NULL, 'd' },
+		{ "help",        no_argument,       NULL, 'h' },
+		{ "mode",        required_argument, NULL, 'm' },
+		{ "peers",       required_argument, NULL, 'n' },
+		{ "port",        required_argument, NULL, 'p' },
+		{ "rate",        required_argument, NULL, 'r' },
+		{ "size",        required_argument, NULL, 's' },
+		{ "version",     no_argument,       NULL, 'V' },
+		{ "wait",        required_argument, NULL, 'w' },
+		{ NULL,          no_argument,       NULL, '\0'}
+	};
+
+	static bench b;
+	unsigned long duration = 10, wait = 1, rate = 10000, npeers = 1000;
+	unsigned long port = 0, size = 80;
+	uint32_t bind_ip = 0;
+	bool has_dst = false;
+	int c;
+
+	b.mode = BENCH_ECHO;
+
+	while ((c = getopt_long (argc, argv, "b:D:d:hm:n:p:r:s:Vw:", opts,
+	                         NULL)) != -1)
+		switch (c)
+		{
+			case 'b':
+				if (inet_pton (AF_INET, optarg, &bind_ip) != 1)
+				{
+					fprintf (stderr, "%s: invalid IPv4 address\n", optarg);
+					return 1;
+				}
+				break;
+
+			case 'D':
+				if (inet_pton (AF_INET6, optarg, &b.echo_dst) != 1)
+				{
+					fprintf (stderr, "%s: invalid IPv6 address\n", optarg);
+					return 1;
+				}
+				has_dst = true;
+				break;
+
+			case 'd':
+				if (!parse_ulong (optarg, 1, 86400, &duration))
+					return 1;
+				break;
+
+			case 'h':
+				return usage (argv[0]);
+
+			case 'm':
+			{
+				unsigned i;
+
+				for (i = 0; i < sizeof (mode_names) / sizeof (mode_names[0]);
+				     i++)
+					if (strcmp (optarg, mode_names[i]) == 0)
+						break;
+				if (i == sizeof (mode_names) / sizeof (mode_names[0]))
+				{
+					fprintf (stderr, "%s: unknown mode\n", optarg);
+					return 1;
+				}
+				b.mode = i;
+				break;
+			}
+
+			case 'n':
+				if (!parse_ulong (optarg, 1, 65535, &npeers))
+					return 1;
+				break;
+
+			case 'p':
+				if (!parse_ulong (optarg, 1, 65535, &port))
+					return 1;
+				break;
+
+			case 'r':
+				if (!parse_ulong (optarg, 1, 100000000, &rate))
+					return 1;
+				break;
+
+			case 's':
+				if (!parse_ulong (optarg, 56, 1280, &size))
+					return 1;
+				break;
+
+			case 'V':
+				return version ();
+
+			case 'w':
+				if (!parse_ulong (optarg, 0, 3600, &wait))
+					return 1;
+				break;
+
+			default:
+				return 1;
+		}
+
+	if ((optind != argc - 1)
+	 || (inet_pton (AF_INET, argv[optind], &b.server_ip) != 1))
+	{
+		usage (argv[0]);
+		return 1;
+	}
+
+	if (port == 0)
+		port = (b.mode == BENCH_ECHO) ? (IPPORT_TEREDO + 1) : IPPORT_TEREDO;
+	b.server_port = htons (port);
+	b.size = size;
+	b.npeers = npeers;
+
+	if (!has_dst)
+	{
+		/* teredo-mire answers on the Teredo address mapped to its client
+		 * port, whatever the prefix and server parts */
+		union teredo_addr *a = (union teredo_addr *)&b.echo_dst;
+
+		a->teredo.prefix = htonl (TEREDO_PREFIX);
+		a->teredo.server_ip = b.server_ip;
+		a->teredo.flags = 0;
+		a->teredo.client_port = ~b.server_port;
+		a->teredo.client_ip = ~b.server_ip;
+	}
+
+	b.peers = calloc (b.npeers, sizeof (*b.peers));
+	if (b.peers == NULL)
+	{
+		perror ("calloc");
+		return 1;
+	}
+
+	int retval = 1;
+	if (bench_open_peers (&b, bind_ip) == 0)
+	{
+		pthread_t th;
+
+		errno = pthread_create (&th, NULL, receiver_thread, &b);
+		if (errno == 0)
+		{
+			uint64_t elapsed;
+			unsigned long sent = bench_run (&b, rate,
+			                                duration * UINT64_C(1000000000),
+			                                &elapsed);
+
+			sleep (wait);
+			__atomic_store_n (&b.stop, true, __ATOMIC_RELEASE);
+			pthread_join (th, NULL);
+
+			bench_report (&b, rate, sent, elapsed);
+			retval = 0;
+		}
+		else
+			perror ("pthread_create");
+
+		for (unsigned i = 0; i < b.npeers; i++)
+			teredo_close (b.peers[i].fd);
+	}
+
+	free (b.peers);
+	return retval;
+}
@@ -0,0 +1,350 @@
+/*
+ * bubble.c - Deferred Teredo bubbles emission
+ *
+ * See "Teredo: Tunneling IPv6 over UDP through NATs"
+ * for more information
+ */
+
+/***********************************************************************
+ *  Copyright © 2004-2007 Rémi Denis-Courmont.                         *
+ *  This program is free software; you can redistribute and/or modify  *
+ *  it under the terms of the GNU General Public License as published  *
+ *  by the Free Software Foundation; version 2 of the license, or (at  *
+ *  your option) any later version.                                    *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *  See the GNU General Public License for more details.               *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, you can get it from:              *
+ *  http://www.gnu.org/copyleft/gpl.html                               *
+ ***********************************************************************/
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdbool.h>
+#include <stdlib.h> // malloc()
+#include <string.h> // memcmp()
+#include <inttypes.h>
+#include <assert.h>
+
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/ip6.h> // struct ip6_hdr
+#include <pthread.h>
+
+#include "teredo.h"
+#include "teredo-udp.h"
+#include "packets.h"
+#include "clock.h"
+#include "bubble.h"
+#include "debug.h"
+
+/* Maximum number of peers with pending bubbles */
+#define BUBBLE_MAX_PENDING 1024
+#define BUBBLE_HASH_SIZE   256 // must be a power of 2
+#define BUBBLE_NONE        0xffff
+
+/* Maximum number of bubbles per batch */
+#define BUBBLE_BATCH       64
+
+/*
+ * Each request is sent once. § 5.2.6 rate limiting is left to the caller,
+ * which requests bubbles again as more packets are queued for the peer.
+ */
+typedef struct teredo_bubble_req
+{
+	struct in6_addr dst;
+	uint16_t        next; // hash chain or free list
+	bool            direct;
+} teredo_bubble_req;
+
+struct teredo_bubbler
+{
+	int fd;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t wait;
+	unsigned pending;
+	bool threaded;
+	uint16_t free;
+	uint16_t hash[BUBBLE_HASH_SIZE];
+	teredo_bubble_req reqs[BUBBLE_MAX_PENDING];
+};
+
+
+static inline unsigned hash_addr (const struct in6_addr *addr)
+{
+	const uint8_t *p = addr->s6_addr;
+
+	/* Client IPv4 and port are the most variable bytes */
+	return (p[10] ^ p[11] ^ p[12] ^ p[13] ^ p[14] ^ p[15])
+	       & (BUBBLE_HASH_SIZE - 1);
+}
+
+
+/**
+ * Looks up a pending request. The lock must be held.
+ *
+ * @return pointer to the hash chain link referencing the request, or to the
+ * end of the chain if not found.
+ */
+static uint16_t *lookup (teredo_bubbler *b, const struct in6_addr *dst)
+{
+	uint16_t *pi = b->hash + hash_addr (dst);
+
+	while (*pi != BUBBLE_NONE)
+	{
+		teredo_bubble_req *r = b->reqs + *pi;
+		if (memcmp (&r->dst, dst, sizeof (*dst)) == 0)
+			break;
+		pi = &r->next;
+	}
+	return pi;
+}
+
+
+/**
+ * Removes the request referenced by a hash chain link. The lock must be held.
+ */
+static void unlink_req (teredo_bubbler *b, uint16_t *pi)
+{
+	uint16_t i = *pi;
+	teredo_bubble_req *r = b->reqs + i;
+
+	*pi = r->next;
+	r->next = b->free;
+	b->free = i;
+	b->pending--;
+}
+
+
+int teredo_bubbler_request (teredo_bubbler *restrict b,
+                            const struct in6_addr *restrict dst, bool direct)
+{
+	pthread_mutex_lock (&b->lock);
+
+	uint16_t *pi = lookup (b, dst);
+	if (*pi != BUBBLE_NONE)
+	{
+		/* Coalesces with the pending request */
+		b->reqs[*pi].direct |= direct;
+		pthread_mutex_unlock (&b->lock);
+		return 0;
+	}
+
+	uint16_t i = b->free;
+	if (i == BUBBLE_NONE)
+	{
+		pthread_mutex_unlock (&b->lock);
+		return -1;
+	}
+
+	teredo_bubble_req *r = b->reqs + i;
+	b->free = r->next;
+	memcpy (&r->dst, dst, sizeof (r->dst));
+	r->direct = direct;
+	r->next = BUBBLE_NONE;
+	*pi = i;
+	b->pending++;
+
+	pthread_cond_signal (&b->wait);
+	pthread_mutex_unlock (&b->lock);
+	return 0;
+}
+
+
+void teredo_bubbler_cancel (teredo_bubbler *restrict b,
+                            const struct in6_addr *restrict dst)
+{
+	pthread_mutex_lock (&b->lock);
+
+	uint16_t *pi = lookup (b, dst);
+	if (*pi != BUBBLE_NONE)
+		unlink_req (b, pi);
+
+	pthread_mutex_unlock (&b->lock);
+}
+
+
+static void cleanup_unlock (void *lock)
+{
+	pthread_mutex_unlock ((pthread_mutex_t *)lock);
+}
+
+
+/**
+ * Collects pending bubbles and removes their requests. The lock must be held.
+ *
+ * @return number of bubbles built.
+ */
+static unsigned collect (teredo_bubbler *b, teredo_bubble *bubbles)
+{
+	unsigned n = 0;
+
+	for (unsigned h = 0; h < BUBBLE_HASH_SIZE; h++)
+	{
+		uint16_t *pi = b->hash + h;
+
+		while (*pi != BUBBLE_NONE)
+		{
+			teredo_bubble_req *r = b->reqs + *pi;
+
+			if (n + 2 > BUBBLE_BATCH)
+				/* Batch full, remaining bubbles go to the next one */
+				return n;
+
+			/*
+			 * Open the return path if we are behind a restricted NAT,
+			 * then send the indirect bubble through the peer's server.
+			 */
+			if (r->direct
+			 && (BuildBubbleFromDst (bubbles + n, &r->dst, false) == 0))
+				n++;
+			if (BuildBubbleFromDst (bubbles + n, &r->dst, true) == 0)
+				n++;
+
+			unlink_req (b, pi);
+		}
+	}
+
+	return n;
+}
+
+
+/**
+ * Sends a batch of bubbles.
+ */
+static void emit (teredo_bubbler *b, const teredo_bubble *bubbles, unsigned n)
+{
+	struct iovec iov[BUBBLE_BATCH];
+	teredo_datagram dgv[BUBBLE_BATCH];
+
+	for (unsigned i = 0; i < n; i++)
+	{
+		iov[i].iov_base = (void *)&bubbles[i].ip6;
+		iov[i].iov_len = sizeof (bubbles[i].ip6);
+		dgv[i].iov = iov + i;
+		dgv[i].iovlen = 1;
+		dgv[i].ip = bubbles[i].ipv4;
+		dgv[i].port = bubbles[i].port;
+	}
+	teredo_sendmv (b->fd, dgv, n);
+}
+
+
+/**
+ * Bubbles emission thread.
+ *
+ * @return never ever.
+ */
+static LIBTEREDO_NORETURN void *bubbler_thread (void *data)
+{
+	teredo_bubbler *b = (teredo_bubbler *)data;
+
+	for (;;)
+	{
+		teredo_bubble bubbles[BUBBLE_BATCH];
+		unsigned n;
+
+		pthread_mutex_lock (&b->lock);
+		pthread_cleanup_push (cleanup_unlock, &b->lock);
+		while (b->pending == 0)
+			pthread_cond_wait (&b->wait, &b->lock);
+
+		n = collect (b, bubbles);
+		pthread_cleanup_pop (1);
+
+		if (n == 0)
+			continue;
+
+		int state;
+		pthread_setcancelstate (PTHREAD_CANCEL_DISABLE, &state);
+		emit (b, bubbles, n);
+		pthread_setcancelstate (state, NULL);
+	}
+}
+
+
+int teredo_bubbler_timeout (teredo_bubbler *b, teredo_clock_t now)
+{
+	int timeout;
+
+	assert (!b->threaded);
+	(void)now;
+
+	pthread_mutex_lock (&b->lock);
+	timeout = (b->pending > 0) ? 0 : -1;
+	pthread_mutex_unlock (&b->lock);
+	return timeout;
+}
+
+
+int teredo_bubbler_process (teredo_bubbler *b, teredo_clock_t now)
+{
+	teredo_bubble bubbles[BUBBLE_BATCH];
+	unsigned n;
+
+	assert (!b->threaded);
+
+	pthread_mutex_lock (&b->lock);
+	n = collect (b, bubbles);
+	pthread_mutex_unlock (&b->lock);
+
+	if (n > 0)
+		emit (b, bubbles, n);
+
+	return teredo_bubbler_timeout (b, now);
+}
+
+
+teredo_bubbler *teredo_bubbler_create (int fd, bool threaded)
+{
+	teredo_bubbler *b = (teredo_bubbler *)malloc (sizeof (*b));
+	if (b == NULL)
+		return NULL;
+
+	b->fd = fd;
+	b->pending = 0;
+	b->threaded = threaded;
+	for (unsigned i = 0; i < BUBBLE_HASH_SIZE; i++)
+		b->hash[i] = BUBBLE_NONE;
+	for (unsigned i = 0; i < BUBBLE_MAX_PENDING; i++)
+		b->reqs[i].next = i + 1;
+	b->reqs[BUBBLE_MAX_PENDING - 1].next = BUBBLE_NONE;
+	b->free = 0;
+
+	pthread_mutex_init (&b->lock, NULL);
+	pthread_cond_init (&b->wait, NULL);
+
+	if (!threaded
+	 || (pthread_create (&b->thread, NULL, bubbler_thread, b) == 0))
+		return b;
+
+	pthread_cond_destroy (&b->wait);
+	pthread_mutex_destroy (&b->lock);
+	free (b);
+	return NULL;
+}
+
+
+void teredo_bubbler_destroy (teredo_bubbler *b)
+{
+	if (b->threaded)
+	{
+		pthread_cancel (b->thread);
+		pthread_join (b->thread, NULL);
+	}
+
+	if (b->pending)
+		debug ("%u peer(s) with pending bubbles", b->pending);
+
+	pthread_cond_destroy (&b->wait);
+	pthread_mutex_destroy (&b->lock);
+	free (b);
+}
@@ -0,0 +1,96 @@
+/**
+ * @file bubble.h
+ * @brief Deferred Teredo bubbles emission
+ */
+
+/***********************************************************************
+ *  Copyright © 2004-2007 Rémi Denis-Courmont.                         *
+ *  This program is free software; you can redistribute and/or modify  *
+ *  it under the terms of the GNU General Public License as published  *
+ *  by the Free Software Foundation; version 2 of the license, or (at  *
+ *  your option) any later version.                                    *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *  See the GNU General Public License for more details.               *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, you can get it from:              *
+ *  http://www.gnu.org/copyleft/gpl.html                               *
+ ***********************************************************************/
+
+#ifndef LIBTEREDO_BUBBLE_H
+# define LIBTEREDO_BUBBLE_H
+
+struct in6_addr;
+
+typedef struct teredo_bubbler teredo_bubbler;
+
+# ifdef __cplusplus
+extern "C" {
+# endif
+
+/**
+ * Creates a bubble scheduler. This sends the requested bubbles in batches.
+ * Bubbles are not repeated: each retry must be requested again, within the
+ * § 5.2.6 rate limits.
+ *
+ * @param fd Teredo socket through which bubbles are sent
+ * @param threaded whether to spawn a thread to send the bubbles.
+ * If false, teredo_bubbler_process() must be called instead.
+ *
+ * @return NULL on error.
+ */
+teredo_bubbler *teredo_bubbler_create (int fd, bool threaded);
+
+/**
+ * Destroys a bubble scheduler. Pending bubbles are discarded.
+ */
+void teredo_bubbler_destroy (teredo_bubbler *b);
+
+/**
+ * Requests bubbles toward a Teredo peer. Requests for a peer that already
+ * has bubbles pending are coalesced with the pending ones.
+ * Thread-safe. Never blocks for I/O.
+ *
+ * @param dst Teredo destination address
+ * @param direct whether to send a direct bubble to the peer (so as to open
+ * the return path through a restricted NAT), in addition to the indirect
+ * bubble sent through the peer's Teredo server.
+ *
+ * @return 0 on success, -1 if the scheduler is full.
+ */
+int teredo_bubbler_request (teredo_bubbler *restrict b,
+                            const struct in6_addr *restrict dst, bool direct);
+
+/**
+ * Cancels pending bubbles toward a Teredo peer, typically because it has
+ * become trusted. Does nothing if there are no pending bubbles.
+ * Thread-safe. Never blocks for I/O.
+ */
+void teredo_bubbler_cancel (teredo_bubbler *restrict b,
+                            const struct in6_addr *restrict dst);
+
+/**
+ * Sends the due bubbles of a scheduler created without its own thread.
+ *
+ * @param now current time (milliseconds, see teredo_clock_ms())
+ *
+ * @return 0 if bubbles are still pending (the batch was full),
+ * -1 otherwise.
+ */
+int teredo_bubbler_process (teredo_bubbler *b, teredo_clock_t now);
+
+/**
+ * @param now current time (milliseconds, see teredo_clock_ms())
+ *
+ * @return 0 if teredo_bubbler_process() is due,
+ * -1 if no bubbles are pending.
+ */
+int teredo_bubbler_timeout (teredo_bubbler *b, teredo_clock_t now);
+
+# ifdef __cplusplus
+}
+# endif /* ifdef __cplusplus */
+#endif /* ifndef LIBTEREDO_BUBBLE_H */
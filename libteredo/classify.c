@@ -0,0 +1,274 @@
+/*
+ * classify.c - Batch IPv6/Teredo packet headers classifier
+ */
+
+/***********************************************************************
+ *  Copyright © 2004-2007 Rémi Denis-Courmont.                         *
+ *  This program is free software; you can redistribute and/or modify  *
+ *  it under the terms of the GNU General Public License as published  *
+ *  by the Free Software Foundation; version 2 of the license, or (at  *
+ *  your option) any later version.                                    *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *  See the GNU General Public License for more details.               *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, you can get it from:              *
+ *  http://www.gnu.org/copyleft/gpl.html                               *
+ ***********************************************************************/
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdbool.h>
+#include <string.h> // memcpy()
+#include <inttypes.h>
+
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <netinet/ip6.h> // struct ip6_hdr
+
+#if defined (__GNUC__) && (defined (__x86_64__) || defined (__i386__))
+# include <immintrin.h>
+# define CLASSIFY_AVX2 1
+#elif defined (__ARM_NEON) || defined (__ARM_NEON__)
+# include <arm_neon.h>
+# define CLASSIFY_NEON 1
+#endif
+
+#include "teredo.h"
+#include "teredo-udp.h"
+#include "classify.h"
+
+/* Number of packets classified at once */
+#define CLASSIFY_LANES 8
+
+/**
+ * Header words of CLASSIFY_LANES packets, in host byte order, laid out so
+ * that each predicate can be evaluated over all lanes at once.
+ */
+typedef struct classify_lanes
+{
+	uint32_t len[CLASSIFY_LANES]; // packet length (saturated)
+	uint32_t vfc[CLASSIFY_LANES]; // version, class and flow label
+	uint32_t pnh[CLASSIFY_LANES]; // payload length, next header, hop limit
+	uint32_t src[CLASSIFY_LANES]; // first word of the source address
+	uint32_t dst[CLASSIFY_LANES]; // first word of the destination address
+} classify_lanes;
+
+
+static void classify_load (classify_lanes *restrict l,
+                           const struct teredo_packet *const *pv,
+                           unsigned count)
+{
+	for (unsigned i = 0; i < count; i++)
+	{
+		const struct ip6_hdr *ip6 = pv[i]->ip6;
+		size_t len = pv[i]->ip6_len;
+
+		if (len < sizeof (*ip6))
+		{
+			l->len[i] = len;
+			l->vfc[i] = l->pnh[i] = l->src[i] = l->dst[i] = 0;
+			continue;
+		}
+
+		/* No alignment guarantee: use memcpy() */
+		uint32_t w[2];
+		memcpy (w, ip6, 8);
+		l->len[i] = (len > 0xffff + sizeof (*ip6)) ? (0xffff + sizeof (*ip6))
+		                                           : len;
+		l->vfc[i] = ntohl (w[0]);
+		l->pnh[i] = ntohl (w[1]);
+		memcpy (w, &ip6->ip6_src, 4);
+		memcpy (w + 1, &ip6->ip6_dst, 4);
+		l->src[i] = ntohl (w[0]);
+		l->dst[i] = ntohl (w[1]);
+	}
+
+	/* Padding lanes are classified as invalid, and ignored */
+	for (unsigned i = count; i < CLASSIFY_LANES; i++)
+		l->len[i] = l->vfc[i] = l->pnh[i] = l->src[i] = l->dst[i] = 0;
+}
+
+
+/**
+ * Reference per-packet classification, from the header words.
+ */
+static uint8_t classify_one (uint32_t len, uint32_t vfc, uint32_t pnh,
+                             uint32_t src, uint32_t dst, uint32_t prefix)
+{
+	uint32_t plen = pnh >> 16;
+	uint8_t nxt = (pnh >> 8) & 0xff;
+
+	if ((len < sizeof (struct ip6_hdr)) || ((vfc >> 28) != 6)
+	 || ((sizeof (struct ip6_hdr) + plen) > len))
+		return 0;
+
+	uint8_t v = TEREDO_CLASS_VALID;
+	if ((plen == 0) && (nxt == IPPROTO_NONE))
+		v |= TEREDO_CLASS_BUBBLE;
+	if (nxt == IPPROTO_ICMPV6)
+		v |= TEREDO_CLASS_ICMPV6;
+	if (src == prefix)
+		v |= TEREDO_CLASS_SRC_TEREDO;
+	if ((src & 0xffc00000) == 0xfe800000)
+		v |= TEREDO_CLASS_SRC_LINKLOCAL;
+	if (dst == prefix)
+		v |= TEREDO_CLASS_DST_TEREDO;
+	if ((dst >> 24) == 0xff)
+		v |= TEREDO_CLASS_DST_MULTICAST;
+	return v;
+}
+
+
+void teredo_classify_scalar (const struct teredo_packet *const *pv,
+                             unsigned count, uint32_t prefix,
+                             uint8_t *verdicts)
+{
+	prefix = ntohl (prefix);
+
+	while (count > 0)
+	{
+		classify_lanes l;
+		unsigned n = (count < CLASSIFY_LANES) ? count : CLASSIFY_LANES;
+
+		classify_load (&l, pv, n);
+		for (unsigned i = 0; i < n; i++)
+			verdicts[i] = classify_one (l.len[i], l.vfc[i], l.pnh[i],
+			                            l.src[i], l.dst[i], prefix);
+		pv += n;
+		verdicts += n;
+		count -= n;
+	}
+}
+
+
+#if defined (CLASSIFY_AVX2)
+__attribute__ ((target ("avx2")))
+static void classify_avx2 (const classify_lanes *restrict l, uint32_t prefix,
+                           uint8_t *restrict verdicts, unsigned n)
+{
+# define V(x) _mm256_set1_epi32 (x)
+# define LOAD(f) _mm256_loadu_si256 ((const __m256i *)l->f)
+# define BIT(mask, bit) _mm256_and_si256 (mask, V (bit))
+	__m256i len = LOAD (len), vfc = LOAD (vfc), pnh = LOAD (pnh);
+	__m256i src = LOAD (src), dst = LOAD (dst);
+	__m256i plen = _mm256_srli_epi32 (pnh, 16);
+	__m256i nxt = _mm256_and_si256 (_mm256_srli_epi32 (pnh, 8), V (0xff));
+
+	/* Lengths are saturated below 2^31: signed comparisons are fine */
+	__m256i valid = _mm256_and_si256 (
+		_mm256_cmpgt_epi32 (len, V (sizeof (struct ip6_hdr) - 1)),
+		_mm256_cmpeq_epi32 (_mm256_srli_epi32 (vfc, 28), V (6)));
+	valid = _mm256_andnot_si256 (
+		_mm256_cmpgt_epi32 (_mm256_add_epi32 (plen,
+		                                      V (sizeof (struct ip6_hdr))),
+		                    len), valid);
+
+	__m256i v = BIT (valid, TEREDO_CLASS_VALID);
+	v = _mm256_or_si256 (v, BIT (_mm256_and_si256 (
+		_mm256_cmpeq_epi32 (plen, _mm256_setzero_si256 ()),
+		_mm256_cmpeq_epi32 (nxt, V (IPPROTO_NONE))), TEREDO_CLASS_BUBBLE));
+	v = _mm256_or_si256 (v, BIT (_mm256_cmpeq_epi32 (nxt, V (IPPROTO_ICMPV6)),
+	                             TEREDO_CLASS_ICMPV6));
+	v = _mm256_or_si256 (v, BIT (_mm256_cmpeq_epi32 (src, V (prefix)),
+	                             TEREDO_CLASS_SRC_TEREDO));
+	v = _mm256_or_si256 (v, BIT (_mm256_cmpeq_epi32 (
+		_mm256_and_si256 (src, V (0xffc00000)), V (0xfe800000)),
+		TEREDO_CLASS_SRC_LINKLOCAL));
+	v = _mm256_or_si256 (v, BIT (_mm256_cmpeq_epi32 (dst, V (prefix)),
+	                             TEREDO_CLASS_DST_TEREDO));
+	v = _mm256_or_si256 (v, BIT (_mm256_cmpeq_epi32 (
+		_mm256_srli_epi32 (dst, 24), V (0xff)), TEREDO_CLASS_DST_MULTICAST));
+	v = _mm256_and_si256 (v, valid);
+# undef BIT
+# undef LOAD
+# undef V
+
+	uint32_t out[CLASSIFY_LANES];
+	_mm256_storeu_si256 ((__m256i *)out, v);
+	for (unsigned i = 0; i < n; i++)
+		verdicts[i] = out[i];
+}
+#elif defined (CLASSIFY_NEON)
+static void classify_neon (const classify_lanes *restrict l, uint32_t prefix,
+                           uint8_t *restrict verdicts, unsigned n)
+{
+	uint32_t out[CLASSIFY_LANES];
+
+	for (unsigned i = 0; i < CLASSIFY_LANES; i += 4)
+	{
+# define V(x) vdupq_n_u32 (x)
+# define BIT(mask, bit) vandq_u32 (mask, V (bit))
+		uint32x4_t len = vld1q_u32 (l->len + i), vfc = vld1q_u32 (l->vfc + i);
+		uint32x4_t pnh = vld1q_u32 (l->pnh + i);
+		uint32x4_t src = vld1q_u32 (l->src + i), dst = vld1q_u32 (l->dst + i);
+		uint32x4_t plen = vshrq_n_u32 (pnh, 16);
+		uint32x4_t nxt = vandq_u32 (vshrq_n_u32 (pnh, 8), V (0xff));
+
+		uint32x4_t valid = vandq_u32 (
+			vcgeq_u32 (len, V (sizeof (struct ip6_hdr))),
+			vceqq_u32 (vshrq_n_u32 (vfc, 28), V (6)));
+		valid = vandq_u32 (valid, vcleq_u32 (
+			vaddq_u32 (plen, V (sizeof (struct ip6_hdr))), len));
+
+		uint32x4_t v = BIT (valid, TEREDO_CLASS_VALID);
+		v = vorrq_u32 (v, BIT (vandq_u32 (vceqq_u32 (plen, V (0)),
+		                                  vceqq_u32 (nxt, V (IPPROTO_NONE))),
+		                       TEREDO_CLASS_BUBBLE));
+		v = vorrq_u32 (v, BIT (vceqq_u32 (nxt, V (IPPROTO_ICMPV6)),
+		                       TEREDO_CLASS_ICMPV6));
+		v = vorrq_u32 (v, BIT (vceqq_u32 (src, V (prefix)),
+		                       TEREDO_CLASS_SRC_TEREDO));
+		v = vorrq_u32 (v, BIT (vceqq_u32 (vandq_u32 (src, V (0xffc00000)),
+		                                  V (0xfe800000)),
+		                       TEREDO_CLASS_SRC_LINKLOCAL));
+		v = vorrq_u32 (v, BIT (vceqq_u32 (dst, V (prefix)),
+		                       TEREDO_CLASS_DST_TEREDO));
+		v = vorrq_u32 (v, BIT (vceqq_u32 (vshrq_n_u32 (dst, 24), V (0xff)),
+		                       TEREDO_CLASS_DST_MULTICAST));
+		vst1q_u32 (out + i, vandq_u32 (v, valid));
+# undef BIT
+# undef V
+	}
+
+	for (unsigned i = 0; i < n; i++)
+		verdicts[i] = out[i];
+}
+#endif
+
+
+void teredo_classify (const struct teredo_packet *const *pv, unsigned count,
+                      uint32_t prefix, uint8_t *verdicts)
+{
+#if defined (CLASSIFY_AVX2) || defined (CLASSIFY_NEON)
+# ifdef CLASSIFY_AVX2
+	if (__builtin_cpu_supports ("avx2"))
+# endif
+	{
+		prefix = ntohl (prefix);
+
+		while (count > 0)
+		{
+			classify_lanes l;
+			unsigned n = (count < CLASSIFY_LANES) ? count : CLASSIFY_LANES;
+
+			classify_load (&l, pv, n);
+# ifdef CLASSIFY_AVX2
+			classify_avx2 (&l, prefix, verdicts, n);
+# else
+			classify_neon (&l, prefix, verdicts, n);
+# endif
+			pv += n;
+			verdicts += n;
+			count -= n;
+		}
+		return;
+	}
+#endif
+	teredo_classify_scalar (pv, count, prefix, verdicts);
+}
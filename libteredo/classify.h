@@ -0,0 +1,70 @@
+/*
+ * classify.h - Batch IPv6/Teredo packet headers classifier
+ */
+
+/***********************************************************************
+ *  Copyright © 2004-2007 Rémi Denis-Courmont.                         *
+ *  This program is free software; you can redistribute and/or modify  *
+ *  it under the terms of the GNU General Public License as published  *
+ *  by the Free Software Foundation; version 2 of the license, or (at  *
+ *  your option) any later version.                                    *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *  See the GNU General Public License for more details.               *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, you can get it from:              *
+ *  http://www.gnu.org/copyleft/gpl.html                               *
+ ***********************************************************************/
+
+#ifndef LIBTEREDO_CLASSIFY_H
+# define LIBTEREDO_CLASSIFY_H
+
+struct teredo_packet;
+
+/* Packet verdict bits. No bits are set for invalid packets. */
+/** IPv6 version 6, with a complete payload */
+# define TEREDO_CLASS_VALID         0x01
+/** Teredo bubble (no payload and no next header) */
+# define TEREDO_CLASS_BUBBLE        0x02
+/** ICMPv6 next header */
+# define TEREDO_CLASS_ICMPV6        0x04
+/** Source address within the Teredo prefix */
+# define TEREDO_CLASS_SRC_TEREDO    0x08
+/** Link-local source address */
+# define TEREDO_CLASS_SRC_LINKLOCAL 0x10
+/** Destination address within the Teredo prefix */
+# define TEREDO_CLASS_DST_TEREDO    0x20
+/** Multicast destination address */
+# define TEREDO_CLASS_DST_MULTICAST 0x40
+
+# ifdef __cplusplus
+extern "C" {
+# endif
+
+/**
+ * Evaluates the cheap header predicates of a vector of received packets,
+ * several packets at a time with SIMD instructions if the CPU supports
+ * them.
+ *
+ * @param pv packets vector
+ * @param count number of packets in the vector
+ * @param prefix Teredo prefix (network byte order)
+ * @param verdicts [OUT] verdict bits for each packet
+ */
+void teredo_classify (const struct teredo_packet *const *pv, unsigned count,
+                      uint32_t prefix, uint8_t *verdicts);
+
+/**
+ * Scalar reference implementation of teredo_classify().
+ */
+void teredo_classify_scalar (const struct teredo_packet *const *pv,
+                             unsigned count, uint32_t prefix,
+                             uint8_t *verdicts);
+
+# ifdef __cplusplus
+}
+# endif /* ifdef __cplusplus */
+#endif /* ifndef LIBTEREDO_CLASSIFY_H */
@@ -37,7 +37,20 @@
 #include "clock.h"
 #include "debug.h"
 
-#ifdef HAVE_TIMER_CREATE
+#if defined (CLOCK_MONOTONIC_COARSE)
+/*
+ * Linux: reading the coarse clock is about as cheap as reading a variable,
+ * so there is no need for a timer (and its notification threads).
+ */
+unsigned long teredo_clock (void)
+{
+	struct timespec ts;
+
+	if (clock_gettime (CLOCK_MONOTONIC_COARSE, &ts))
+		clock_gettime (CLOCK_REALTIME, &ts);
+	return ts.tv_sec;
+}
+#elif defined (HAVE_TIMER_CREATE)
 typedef struct clock_data_t
 {
 	timer_t           handle;
@@ -143,3 +156,20 @@ unsigned long teredo_clock (void)
 }
 #endif
 
+
+
+teredo_clock_t teredo_clock_ms (void)
+{
+	struct timespec ts;
+
+#if defined (CLOCK_MONOTONIC_COARSE)
+	/* Linux: no need for more than jiffy precision, and much cheaper */
+	if (clock_gettime (CLOCK_MONOTONIC_COARSE, &ts))
+#endif
+#if defined (CLOCK_MONOTONIC)
+	if (clock_gettime (CLOCK_MONOTONIC, &ts))
+#endif
+		clock_gettime (CLOCK_REALTIME, &ts);
+
+	return ts.tv_sec * 1000UL + ts.tv_nsec / 1000000;
+}
@@ -45,6 +45,15 @@ extern "C" {
  */
 teredo_clock_t teredo_clock (void);
 
+/**
+ * Millisecond-resolution monotonic clock. Unlike teredo_clock(), this
+ * always works, but the value wraps around; only differences between two
+ * values are meaningful.
+ *
+ * @return current clock value in milliseconds.
+ */
+teredo_clock_t teredo_clock_ms (void);
+
 # ifdef __cplusplus
 }
 # endif /* ifdef __cplusplus */
@@ -0,0 +1,168 @@
+/*
+ * filter.c - Teredo server kernel socket filter
+ */
+
+/***********************************************************************
+ *  Copyright © 2004-2007 Rémi Denis-Courmont.                         *
+ *  This program is free software; you can redistribute and/or modify  *
+ *  it under the terms of the GNU General Public License as published  *
+ *  by the Free Software Foundation; version 2 of the license, or (at  *
+ *  your option) any later version.                                    *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *  See the GNU General Public License for more details.               *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, you can get it from:              *
+ *  http://www.gnu.org/copyleft/gpl.html                               *
+ ***********************************************************************/
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <inttypes.h>
+#include <errno.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#ifdef __linux__
+# include <linux/filter.h>
+# include <linux/sock_diag.h> // SK_MEMINFO_DROPS
+#endif
+
+#include "filter.h"
+
+#ifdef SO_ATTACH_FILTER
+/*
+ * The filter program sees the UDP header at offset 0, then the optional
+ * Teredo authentication and origin indication headers, then the IPv6
+ * packet. It must only drop packets that teredo_process_packet() would
+ * drop anyway. Packets too short for any of the loads are dropped by the
+ * kernel: they could not be valid Teredo packets either.
+ *
+ * Scratch memory: M[0] = IPv6 header offset, M[1] = IPv6 payload length.
+ */
+# define STMT(code, k) BPF_STMT (code, k)
+# define JUMP(pc, code, k, t, f) BPF_JUMP (code, k, (t) - (pc) - 1, \
+                                                  (f) - (pc) - 1)
+# define SRC    37
+# define ACCEPT 57
+# define DROP   58
+# define IPV4_SRC (SKF_NET_OFF + 12)
+
+static const struct sock_filter teredo_server_prog[] =
+{
+	/* Authentication header: 13 bytes + client ID + authentication value */
+	/*  0 */ STMT (BPF_LD|BPF_H|BPF_ABS, 8),
+	/*  1 */ JUMP (1, BPF_JMP|BPF_JEQ|BPF_K, 0x0001, 2, 8),
+	/*  2 */ STMT (BPF_LD|BPF_B|BPF_ABS, 11),
+	/*  3 */ STMT (BPF_MISC|BPF_TAX, 0),
+	/*  4 */ STMT (BPF_LD|BPF_B|BPF_ABS, 10),
+	/*  5 */ STMT (BPF_ALU|BPF_ADD|BPF_X, 0),
+	/*  6 */ STMT (BPF_ALU|BPF_ADD|BPF_K, 8 + 13),
+	/*  7 */ STMT (BPF_JMP|BPF_JA, 9 - 7 - 1),
+	/*  8 */ STMT (BPF_LD|BPF_IMM, 8),
+	/*  9 */ STMT (BPF_MISC|BPF_TAX, 0),
+
+	/* Origin indication header: 8 bytes */
+	/* 10 */ STMT (BPF_LD|BPF_H|BPF_IND, 0),
+	/* 11 */ JUMP (11, BPF_JMP|BPF_JEQ|BPF_K, 0x0000, 12, 15),
+	/* 12 */ STMT (BPF_MISC|BPF_TXA, 0),
+	/* 13 */ STMT (BPF_ALU|BPF_ADD|BPF_K, 8),
+	/* 14 */ STMT (BPF_MISC|BPF_TAX, 0),
+
+	/* IPv6 version and length (server case 1) */
+	/* 15 */ STMT (BPF_MISC|BPF_TXA, 0),
+	/* 16 */ STMT (BPF_ST, 0),
+	/* 17 */ STMT (BPF_LD|BPF_B|BPF_IND, 0),
+	/* 18 */ STMT (BPF_ALU|BPF_AND|BPF_K, 0xf0),
+	/* 19 */ JUMP (19, BPF_JMP|BPF_JEQ|BPF_K, 0x60, 20, DROP),
+	/* 20 */ STMT (BPF_LD|BPF_H|BPF_IND, 4),
+	/* 21 */ STMT (BPF_ST, 1),
+	/* 22 */ STMT (BPF_ALU|BPF_ADD|BPF_X, 0),
+	/* 23 */ STMT (BPF_ALU|BPF_ADD|BPF_K, 40),
+	/* 24 */ STMT (BPF_MISC|BPF_TAX, 0),
+	/* 25 */ STMT (BPF_LD|BPF_W|BPF_LEN, 0),
+	/* 26 */ JUMP (26, BPF_JMP|BPF_JGE|BPF_X, 0, 27, DROP),
+	/* 27 */ STMT (BPF_LDX|BPF_MEM, 0),
+
+	/* Bubble or ICMPv6 (server case 2) */
+	/* 28 */ STMT (BPF_LD|BPF_B|BPF_IND, 6),
+	/* 29 */ JUMP (29, BPF_JMP|BPF_JEQ|BPF_K, IPPROTO_NONE, 30, 32),
+	/* 30 */ STMT (BPF_LD|BPF_MEM, 1),
+	/* 31 */ JUMP (31, BPF_JMP|BPF_JEQ|BPF_K, 0, SRC, DROP),
+	/* 32 */ JUMP (32, BPF_JMP|BPF_JEQ|BPF_K, IPPROTO_ICMPV6, 33, DROP),
+
+	/* Large ICMPv6 payload, unless toward a link-local or multicast
+	 * destination, which might be a router message */
+	/* 33 */ STMT (BPF_LD|BPF_MEM, 1),
+	/* 34 */ JUMP (34, BPF_JMP|BPF_JGT|BPF_K, 88, 35, SRC),
+	/* 35 */ STMT (BPF_LD|BPF_B|BPF_IND, 24),
+	/* 36 */ JUMP (36, BPF_JMP|BPF_JGE|BPF_K, 0xfe, SRC, DROP),
+
+	/* Global unicast IPv4 source (server case 3),
+	 * same as is_ipv4_global_unicast() */
+	/* 37 */ STMT (BPF_LD|BPF_W|BPF_ABS, IPV4_SRC),
+	/* 38 */ STMT (BPF_ALU|BPF_AND|BPF_K, 0xff000000),
+	/* 39 */ JUMP (39, BPF_JMP|BPF_JEQ|BPF_K, 0x00000000, DROP, 40),
+	/* 40 */ JUMP (40, BPF_JMP|BPF_JEQ|BPF_K, 0x0a000000, DROP, 41),
+	/* 41 */ JUMP (41, BPF_JMP|BPF_JEQ|BPF_K, 0x7f000000, DROP, 42),
+	/* 42 */ STMT (BPF_LD|BPF_W|BPF_ABS, IPV4_SRC),
+	/* 43 */ STMT (BPF_ALU|BPF_AND|BPF_K, 0xffff0000),
+	/* 44 */ JUMP (44, BPF_JMP|BPF_JEQ|BPF_K, 0xa9fe0000, DROP, 45),
+	/* 45 */ JUMP (45, BPF_JMP|BPF_JEQ|BPF_K, 0xc0a80000, DROP, 46),
+	/* 46 */ STMT (BPF_LD|BPF_W|BPF_ABS, IPV4_SRC),
+	/* 47 */ STMT (BPF_ALU|BPF_AND|BPF_K, 0xfff00000),
+	/* 48 */ JUMP (48, BPF_JMP|BPF_JEQ|BPF_K, 0xac100000, DROP, 49),
+	/* 49 */ STMT (BPF_LD|BPF_W|BPF_ABS, IPV4_SRC),
+	/* 50 */ STMT (BPF_ALU|BPF_AND|BPF_K, 0xffffff00),
+	/* 51 */ JUMP (51, BPF_JMP|BPF_JEQ|BPF_K, 0xc0586200, DROP, 52),
+	/* 52 */ STMT (BPF_LD|BPF_W|BPF_ABS, IPV4_SRC),
+	/* 53 */ STMT (BPF_ALU|BPF_AND|BPF_K, 0xf0000000),
+	/* 54 */ JUMP (54, BPF_JMP|BPF_JEQ|BPF_K, 0xe0000000, DROP, 55),
+	/* 55 */ STMT (BPF_LD|BPF_W|BPF_ABS, IPV4_SRC),
+	/* 56 */ JUMP (56, BPF_JMP|BPF_JEQ|BPF_K, 0xffffffff, DROP, ACCEPT),
+
+	/* 57 */ STMT (BPF_RET|BPF_K, 0xffffffff), // ACCEPT
+	/* 58 */ STMT (BPF_RET|BPF_K, 0), // DROP
+};
+#endif
+
+
+int teredo_filter_attach (int fd)
+{
+#ifdef SO_ATTACH_FILTER
+	const struct sock_fprog prog =
+	{
+		.len = sizeof (teredo_server_prog) / sizeof (teredo_server_prog[0]),
+		.filter = (struct sock_filter *)teredo_server_prog,
+	};
+
+	return setsockopt (fd, SOL_SOCKET, SO_ATTACH_FILTER, &prog,
+	                   sizeof (prog));
+#else
+	(void)fd;
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+
+unsigned long teredo_filter_drops (int fd)
+{
+#if defined (SO_MEMINFO) && defined (__linux__)
+	uint32_t meminfo[SK_MEMINFO_VARS];
+	socklen_t len = sizeof (meminfo);
+
+	if ((getsockopt (fd, SOL_SOCKET, SO_MEMINFO, meminfo, &len) == 0)
+	 && (len > SK_MEMINFO_DROPS * sizeof (meminfo[0])))
+		return meminfo[SK_MEMINFO_DROPS];
+#else
+	(void)fd;
+#endif
+	return 0;
+}
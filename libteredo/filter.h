@@ -0,0 +1,49 @@
+/*
+ * filter.h - Teredo server kernel socket filter
+ */
+
+/***********************************************************************
+ *  Copyright © 2004-2007 Rémi Denis-Courmont.                         *
+ *  This program is free software; you can redistribute and/or modify  *
+ *  it under the terms of the GNU General Public License as published  *
+ *  by the Free Software Foundation; version 2 of the license, or (at  *
+ *  your option) any later version.                                    *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *  See the GNU General Public License for more details.               *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, you can get it from:              *
+ *  http://www.gnu.org/copyleft/gpl.html                               *
+ ***********************************************************************/
+
+#ifndef LIBTEREDO_FILTER_H
+# define LIBTEREDO_FILTER_H
+
+# ifdef __cplusplus
+extern "C" {
+# endif
+
+/**
+ * Attaches a socket filter to a Teredo server UDP socket, so that the
+ * kernel drops the packets that the server would always discard:
+ * non-IPv6 packets, packets that are neither bubbles nor ICMPv6, large
+ * ICMPv6 packets that cannot be router messages, and packets from
+ * non-global IPv4 addresses. Other packets are left to the server.
+ *
+ * @return 0 on success, -1 on error (e.g. not supported).
+ */
+int teredo_filter_attach (int fd);
+
+/**
+ * @return the number of packets dropped by the kernel on a socket, whether
+ * by the socket filter or because of receive buffer overflow.
+ */
+unsigned long teredo_filter_drops (int fd);
+
+# ifdef __cplusplus
+}
+# endif /* ifdef __cplusplus */
+#endif /* ifndef LIBTEREDO_FILTER_H */
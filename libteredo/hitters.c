@@ -0,0 +1,230 @@
+/*
+ * hitters.c - Teredo server heavy hitters tracking
+ */
+
+/***********************************************************************
+ *  Copyright © 2004-2007 Rémi Denis-Courmont.                         *
+ *  This program is free software; you can redistribute and/or modify  *
+ *  it under the terms of the GNU General Public License as published  *
+ *  by the Free Software Foundation; version 2 of the license, or (at  *
+ *  your option) any later version.                                    *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *  See the GNU General Public License for more details.               *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, you can get it from:              *
+ *  http://www.gnu.org/copyleft/gpl.html                               *
+ ***********************************************************************/
+
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "hitters.h"
+
+/* Count-min sketch dimensions */
+#define HITTERS_ROWS  4
+#define HITTERS_SHIFT 11
+#define HITTERS_WIDTH (1 << HITTERS_SHIFT)
+
+/* Number of tracked busiest sources */
+#define HITTERS_TOP 16
+/* Smallest packet count worth tracking among the busiest sources */
+#define HITTERS_MIN 16
+
+struct teredo_hitters
+{
+	uint32_t sketch[HITTERS_ROWS][HITTERS_WIDTH];
+	uint32_t seed[HITTERS_ROWS];
+	unsigned long epoch; // current window (seconds)
+	unsigned long limit;
+	unsigned long throttled;
+
+	/*
+	 * Busiest sources. Only updated when the count of a source reaches a
+	 * power of two, so the lock is hardly ever taken.
+	 */
+	pthread_mutex_t lock;
+	struct
+	{
+		uint32_t ip;
+		uint32_t count;
+		unsigned long epoch;
+	} top[HITTERS_TOP];
+};
+
+
+static uint32_t mix (uint64_t *state)
+{
+	/* SplitMix64 */
+	uint64_t z = (*state += UINT64_C(0x9e3779b97f4a7c15));
+	z = (z ^ (z >> 30)) * UINT64_C(0xbf58476d1ce4e5b9);
+	z = (z ^ (z >> 27)) * UINT64_C(0x94d049bb133111eb);
+	return (z ^ (z >> 31)) | 1; // odd
+}
+
+
+teredo_hitters *teredo_hitters_create (unsigned long limit)
+{
+	teredo_hitters *h = malloc (sizeof (*h));
+	if (h == NULL)
+		return NULL;
+
+	memset (h, 0, sizeof (*h));
+	h->limit = limit;
+
+	/* Unpredictable hashes, so that sources cannot be made to collide */
+	struct timespec ts;
+	clock_gettime (CLOCK_REALTIME, &ts);
+	uint64_t state = ((uint64_t)ts.tv_sec << 32) ^ ts.tv_nsec
+	               ^ (uintptr_t)h;
+	for (unsigned i = 0; i < HITTERS_ROWS; i++)
+		h->seed[i] = mix (&state);
+
+	pthread_mutex_init (&h->lock, NULL);
+	return h;
+}
+
+
+void teredo_hitters_destroy (teredo_hitters *h)
+{
+	pthread_mutex_destroy (&h->lock);
+	free (h);
+}
+
+
+void teredo_hitters_set_limit (teredo_hitters *h, unsigned long limit)
+{
+	__atomic_store_n (&h->limit, limit, __ATOMIC_RELAXED);
+}
+
+
+static void
+teredo_hitters_record (teredo_hitters *h, uint32_t ip, uint32_t count,
+                       unsigned long now)
+{
+	unsigned victim = 0;
+
+	pthread_mutex_lock (&h->lock);
+	for (unsigned i = 0; i < HITTERS_TOP; i++)
+	{
+		if ((h->top[i].ip == ip) && (h->top[i].epoch == now))
+		{
+			victim = i;
+			break;
+		}
+
+		/* Replaces the least busy source, the stalest first */
+		if ((h->top[i].epoch < h->top[victim].epoch)
+		 || ((h->top[i].epoch == h->top[victim].epoch)
+		  && (h->top[i].count < h->top[victim].count)))
+			victim = i;
+	}
+
+	if ((h->top[victim].epoch != now) || (h->top[victim].count <= count))
+	{
+		h->top[victim].ip = ip;
+		h->top[victim].count = count;
+		h->top[victim].epoch = now;
+	}
+	pthread_mutex_unlock (&h->lock);
+}
+
+
+bool teredo_hitters_count (teredo_hitters *h, uint32_t ip, unsigned long now)
+{
+	unsigned long epoch = __atomic_load_n (&h->epoch, __ATOMIC_RELAXED);
+
+	/* New window: the first thread to notice resets the sketch */
+	if ((epoch != now)
+	 && __atomic_compare_exchange_n (&h->epoch, &epoch, now, false,
+	                                 __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		for (unsigned i = 0; i < HITTERS_ROWS; i++)
+			for (unsigned j = 0; j < HITTERS_WIDTH; j++)
+				__atomic_store_n (&h->sketch[i][j], 0, __ATOMIC_RELAXED);
+
+	uint32_t count = UINT32_MAX;
+
+	for (unsigned i = 0; i < HITTERS_ROWS; i++)
+	{
+		uint32_t *cell = &h->sketch[i][(ip * h->seed[i])
+		                               >> (32 - HITTERS_SHIFT)];
+		uint32_t c = __atomic_add_fetch (cell, 1, __ATOMIC_RELAXED);
+
+		if (c < count)
+			count = c;
+	}
+
+	if ((count >= HITTERS_MIN) && ((count & (count - 1)) == 0))
+		teredo_hitters_record (h, ip, count, now);
+
+	unsigned long limit = __atomic_load_n (&h->limit, __ATOMIC_RELAXED);
+	if ((limit == 0) || (count <= limit))
+		return false;
+
+	__atomic_add_fetch (&h->throttled, 1, __ATOMIC_RELAXED);
+	return true;
+}
+
+
+static int talkercmp (const void *a, const void *b)
+{
+	const teredo_talker *ta = a, *tb = b;
+
+	return (ta->rate < tb->rate) - (ta->rate > tb->rate);
+}
+
+
+unsigned teredo_hitters_top (teredo_hitters *h, teredo_talker *tab,
+                             unsigned max)
+{
+	teredo_talker top[HITTERS_TOP];
+	unsigned n = 0;
+	unsigned long now = __atomic_load_n (&h->epoch, __ATOMIC_RELAXED);
+
+	pthread_mutex_lock (&h->lock);
+	for (unsigned i = 0; i < HITTERS_TOP; i++)
+	{
+		if ((h->top[i].count == 0) || (now - h->top[i].epoch > 1))
+			continue;
+
+		/* A source might appear in both windows: keep the busiest */
+		unsigned j;
+		for (j = 0; j < n; j++)
+			if (top[j].ip == h->top[i].ip)
+				break;
+
+		if (j == n)
+		{
+			top[n].ip = h->top[i].ip;
+			top[n++].rate = h->top[i].count;
+		}
+		else
+		if (top[j].rate < h->top[i].count)
+			top[j].rate = h->top[i].count;
+	}
+	pthread_mutex_unlock (&h->lock);
+
+	qsort (top, n, sizeof (top[0]), talkercmp);
+	if (n > max)
+		n = max;
+	memcpy (tab, top, n * sizeof (*tab));
+	return n;
+}
+
+
+unsigned long teredo_hitters_throttled (const teredo_hitters *h)
+{
+	return __atomic_load_n (&h->throttled, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,91 @@
+/*
+ * hitters.h - Teredo server heavy hitters tracking
+ */
+
+/***********************************************************************
+ *  Copyright © 2004-2007 Rémi Denis-Courmont.                         *
+ *  This program is free software; you can redistribute and/or modify  *
+ *  it under the terms of the GNU General Public License as published  *
+ *  by the Free Software Foundation; version 2 of the license, or (at  *
+ *  your option) any later version.                                    *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *  See the GNU General Public License for more details.               *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, you can get it from:              *
+ *  http://www.gnu.org/copyleft/gpl.html                               *
+ ***********************************************************************/
+
+
+#ifndef LIBTEREDO_HITTERS_H
+# define LIBTEREDO_HITTERS_H
+
+typedef struct teredo_hitters teredo_hitters;
+
+/**
+ * Source IPv4 address and its approximate packet rate.
+ */
+typedef struct teredo_talker
+{
+	uint32_t ip; /* network byte order */
+	unsigned long rate; /* packets per second */
+} teredo_talker;
+
+# ifdef __cplusplus
+extern "C" {
+# endif
+
+/**
+ * Creates a heavy hitters tracker, counting packets per source IPv4
+ * address over one second windows with a count-min sketch.
+ *
+ * @param limit packets per second above which a source is throttled,
+ * zero for no limit.
+ *
+ * @return NULL on error.
+ */
+teredo_hitters *teredo_hitters_create (unsigned long limit);
+
+void teredo_hitters_destroy (teredo_hitters *h);
+
+/**
+ * Changes the rate limit of a tracker.
+ */
+void teredo_hitters_set_limit (teredo_hitters *h, unsigned long limit);
+
+/**
+ * Counts one packet from a source. Thread-safe, constant time.
+ *
+ * @param ip source IPv4 address (network byte order)
+ * @param now current time in seconds
+ *
+ * @return true if the source is above the rate limit, in which case the
+ * packet should be dropped, false otherwise.
+ */
+bool teredo_hitters_count (teredo_hitters *h, uint32_t ip, unsigned long now);
+
+/**
+ * Returns the busiest sources of the current or previous window, busiest
+ * first. Rates are under-estimated by up to half.
+ *
+ * @param tab [OUT] table of sources
+ * @param max size of the table
+ *
+ * @return number of entries written to the table.
+ */
+unsigned teredo_hitters_top (teredo_hitters *h, teredo_talker *tab,
+                             unsigned max);
+
+/**
+ * @return the total number of packets for which teredo_hitters_count()
+ * returned true.
+ */
+unsigned long teredo_hitters_throttled (const teredo_hitters *h);
+
+# ifdef __cplusplus
+}
+# endif /* ifdef __cplusplus */
+#endif /* ifndef LIBTEREDO_HITTERS_H */
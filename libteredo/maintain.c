@@ -39,8 +39,9 @@
 #include <unistd.h> /* sysconf() */
 #include <sys/socket.h> /* AF_INET */
 #include <netinet/in.h> /* struct in6_addr */
+#include <poll.h>
 #include <netinet/ip6.h> /* struct ip6_hdr */
-#include <netdb.h> /* getaddrinfo(), gai_strerror() */
+#include <arpa/inet.h> /* inet_aton() */
 #include <syslog.h>
 #include <stdlib.h> /* malloc(), free() */
 #include <errno.h> /* EINTR */
@@ -54,7 +55,8 @@
 
 #include "security.h"
 #include "maintain.h"
-#include "v4global.h" // is_ipv4_global_unicast()
+#include "resolver.h"
+#include "netwatch.h"
 #include "debug.h"
 
 static inline void gettime (struct timespec *now)
@@ -73,24 +75,110 @@ static inline void gettime (struct timespec *now)
 }
 
 
+/* Maximum number of received packets waiting for the maintenance thread:
+ * all servers are solicited at once, so their replies come in a burst */
+#define MAINTENANCE_RING (2 * TEREDO_MAX_SERVERS)
+/* Maximum IPv6 packet size passed to the maintenance thread */
+#define MAINTENANCE_MTU 1280
+
+/* Events waking the maintenance thread up */
+#define MAINTENANCE_RESOLVED 0x1 // resolver cache updated
+#define MAINTENANCE_CHANGED  0x2 // network configuration changed
+
+/**
+ * Copy of a received packet, waiting for the maintenance thread.
+ */
+typedef struct maintenance_slot
+{
+	uint32_t source_ipv4;
+	uint32_t orig_ipv4;
+	uint32_t dest_ipv4;
+	uint16_t source_port;
+	uint16_t orig_port;
+	bool     auth_present;
+	bool     auth_fail;
+	uint8_t  auth_nonce[8];
+	size_t   ip6_len;
+	union
+	{
+		uint64_t align[1];
+		uint8_t fill[MAINTENANCE_MTU];
+	} buf;
+} maintenance_slot;
+
+/**
+ * Qualification state of one of the Teredo servers.
+ */
+typedef struct maintenance_server
+{
+	char *name;
+	teredo_resolver *resolver;
+	uint32_t ip; // current IPv4 address, 0 if none
+	unsigned index; // index of the current address in the resolver cache
+	unsigned addrs; // number of addresses in the resolver cache
+	unsigned count; // consecutive unanswered solicitations
+	time_t retry; // when to try again once all addresses failed
+	bool replied; // answered the latest solicitation
+	bool resent; // solicited twice in the latest round: RTT is ambiguous
+	bool qualified; // answered recently: active or standby server
+	bool blackhole; // failure already logged
+	bool cached; // ip comes from the cached state, not from the resolver
+	uint8_t nonce[8];
+	struct timespec sent;
+	unsigned long rtt; // smoothed round-trip time (microseconds)
+	teredo_state state; // from the latest router advertisement
+} maintenance_server;
+
+/**
+ * NAT binding lifetime determination state. A secondary socket is left
+ * idle for increasing intervals: if the NAT still maps it to the same
+ * address and port afterwards, the binding lasts at least that long.
+ */
+typedef struct maintenance_probe
+{
+	int fd; // secondary socket, -1 if not open
+	uint16_t port; // secondary socket local port
+	unsigned stage; // interval being tested (seconds), 0 if done
+	unsigned lifetime; // confirmed NAT binding lifetime (seconds), 0 if none
+	unsigned reported; // lifetime last passed to the callback
+	bool armed; // secondary socket mapping known
+	time_t due; // when to solicit from the secondary socket
+	uint32_t server_ip; // server the mapping was learnt from
+	uint32_t mapped_ip;
+	uint16_t mapped_port;
+} maintenance_probe;
+
 struct teredo_maintenance
 {
 	pthread_t thread;
-	pthread_mutex_t outer;
-	pthread_mutex_t inner;
+	pthread_mutex_t push_lock; // serializes receiving threads
+	pthread_mutex_t lock; // only taken to sleep and to wake up
 	pthread_cond_t received;
-	pthread_cond_t processed;
+	bool sleeping;
 
-	const teredo_packet *incoming;
+	/*
+	 * Single-producer single-consumer ring. Head and tail are free-running
+	 * counters: the receiving thread only writes the head, the maintenance
+	 * thread only writes the tail.
+	 */
+	unsigned head;
+	unsigned tail;
+	maintenance_slot ring[MAINTENANCE_RING];
+	unsigned events;
 
 	int fd;
 	struct
 	{
 		teredo_state state;
 		teredo_state_cb cb;
+		teredo_binding_cb binding_cb;
 		void *opaque;
 	} state;
-	char *server;
+	maintenance_server servers[TEREDO_MAX_SERVERS];
+	unsigned server_count;
+	maintenance_server *provisional; // holds the cached address for now
+	teredo_netwatch *netwatch;
+	maintenance_probe probe;
 
 	unsigned qualification_delay;
 	unsigned qualification_retries;
@@ -99,30 +187,6 @@ struct teredo_maintenance
 };
 
 
-/**
- * Resolves an IPv4 address (thread-safe).
- *
- * @return 0 on success, or an error value as defined for getaddrinfo().
- */
-static int getipv4byname (const char *restrict name, uint32_t *restrict ipv4)
-{
-	struct addrinfo hints =
-	{
-		.ai_family = AF_INET,
-		.ai_socktype = SOCK_DGRAM
-	}, *res;
-
-	int val = getaddrinfo (name, NULL, &hints, &res);
-	if (val)
-		return val;
-
-	*ipv4 = ((const struct sockaddr_in *)(res->ai_addr))->sin_addr.s_addr;
-	freeaddrinfo (res);
-
-	return 0;
-}
-
-
 /**
  * Checks and parses a received Router Advertisement.
  *
@@ -156,39 +220,168 @@ maintenance_recv (const teredo_packet *restrict packet, uint32_t server_ip,
 }
 
 
+/**
+ * Copies a received packet into the ring. Receiving thread only.
+ * @return 0 on success, -1 if the ring is full.
+ */
+static int maintenance_push (teredo_maintenance *restrict m,
+                             const teredo_packet *restrict packet)
+{
+	unsigned head = m->head;
+
+	if ((head - __atomic_load_n (&m->tail, __ATOMIC_ACQUIRE))
+	     >= MAINTENANCE_RING)
+		return -1;
+
+	maintenance_slot *s = m->ring + (head % MAINTENANCE_RING);
+
+	s->source_ipv4 = packet->source_ipv4;
+	s->orig_ipv4 = packet->orig_ipv4;
+	s->dest_ipv4 = packet->dest_ipv4;
+	s->source_port = packet->source_port;
+	s->orig_port = packet->orig_port;
+	s->auth_present = packet->auth_present;
+	s->auth_fail = packet->auth_fail;
+	memcpy (s->auth_nonce, packet->auth_nonce, sizeof (s->auth_nonce));
+	s->ip6_len = packet->ip6_len;
+	memcpy (s->buf.fill, packet->ip6, packet->ip6_len);
+
+	__atomic_store_n (&m->head, head + 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+
+/**
+ * Takes the oldest packet from the ring. Maintenance thread only.
+ * @return true if a packet was copied to *packet, false if none is queued.
+ */
+static bool maintenance_pop (teredo_maintenance *restrict m,
+                             teredo_packet *restrict packet)
+{
+	unsigned tail = m->tail;
+
+	if (tail == __atomic_load_n (&m->head, __ATOMIC_ACQUIRE))
+		return false;
+
+	const maintenance_slot *s = m->ring + (tail % MAINTENANCE_RING);
+
+	packet->source_ipv4 = s->source_ipv4;
+	packet->orig_ipv4 = s->orig_ipv4;
+	packet->dest_ipv4 = s->dest_ipv4;
+	packet->source_port = s->source_port;
+	packet->orig_port = s->orig_port;
+	packet->auth_present = s->auth_present;
+	packet->auth_fail = s->auth_fail;
+	memcpy (packet->auth_nonce, s->auth_nonce, sizeof (packet->auth_nonce));
+	packet->ip6_len = s->ip6_len;
+	memcpy (packet->buf.fill, s->buf.fill, s->ip6_len);
+	packet->ip6 = (struct ip6_hdr *)packet->buf.fill;
+
+	__atomic_store_n (&m->tail, tail + 1, __ATOMIC_RELEASE);
+	return true;
+}
+
+
+/**
+ * Wakes the maintenance thread up, if it is waiting.
+ */
+static void maintenance_notify (teredo_maintenance *m)
+{
+	/* Pairs with the sleeping flag store in maintenance_sleep() */
+	__atomic_thread_fence (__ATOMIC_SEQ_CST);
+	if (__atomic_load_n (&m->sleeping, __ATOMIC_RELAXED))
+	{
+		pthread_mutex_lock (&m->lock);
+		pthread_cond_signal (&m->received);
+		pthread_mutex_unlock (&m->lock);
+	}
+}
+
+
+static void cleanup_sleep (void *data)
+{
+	teredo_maintenance *m = (teredo_maintenance *)data;
+
+	__atomic_store_n (&m->sleeping, false, __ATOMIC_RELAXED);
+	pthread_mutex_unlock (&m->lock);
+}
+
+
+/**
+ * Waits until the clock reaches deadline, a packet is queued or one of the
+ * specified events occurs.
+ * @return 0 if woken up, ETIMEDOUT if deadline was reached.
+ */
+static int maintenance_sleep (teredo_maintenance *restrict m,
+                              const struct timespec *restrict deadline,
+                              unsigned events)
+{
+	volatile int val = 0; // live across pthread_cleanup_push()
+
+	pthread_mutex_lock (&m->lock);
+	pthread_cleanup_push (cleanup_sleep, m);
+	__atomic_store_n (&m->sleeping, true, __ATOMIC_SEQ_CST);
+	while ((__atomic_load_n (&m->head, __ATOMIC_SEQ_CST) == m->tail)
+	    && !(__atomic_load_n (&m->events, __ATOMIC_SEQ_CST) & events)
+	    && (val != ETIMEDOUT))
+		val = pthread_cond_timedwait (&m->received, &m->lock, deadline);
+	pthread_cleanup_pop (1);
+
+	return (val == ETIMEDOUT) ? ETIMEDOUT : 0;
+}
+
+
 /**
  * Waits until the clock reaches deadline or a RS packet is received.
  * @return 0 if a packet was received, ETIMEDOUT if deadline was reached.
  */
 static int wait_reply (teredo_maintenance *restrict m,
-                       const struct timespec *restrict deadline)
+                       const struct timespec *restrict deadline,
+                       teredo_packet *restrict packet)
 {
-	while (m->incoming == NULL)
-	{
-		switch (pthread_cond_timedwait (&m->received, &m->inner, deadline))
-		{
-			case 0:
-				break;
-			case ETIMEDOUT:
-				return ETIMEDOUT;
-		}
-	}
-	return 0; // dead code
+	while (!maintenance_pop (m, packet))
+		if (maintenance_sleep (m, deadline, 0))
+			return ETIMEDOUT;
+	return 0;
 }
 
 
 /**
- * Waits until the clock reaches deadline and ignore any RS packet received
- * in the mean time.
+ * Waits until the clock reaches deadline or one of the specified events
+ * occurs, and ignore any RS packet received in the mean time.
  */
-static void wait_reply_ignore (teredo_maintenance *restrict m,
-                               const struct timespec *restrict deadline)
+static void wait_event (teredo_maintenance *restrict m,
+                        const struct timespec *restrict deadline,
+                        teredo_packet *restrict packet, unsigned events)
 {
-	while (wait_reply (m, deadline) == 0)
-	{
-		m->incoming = NULL;
-		pthread_cond_signal (&m->processed);
-	}
+	do
+		while (maintenance_pop (m, packet));
+	while (!(__atomic_load_n (&m->events, __ATOMIC_SEQ_CST) & events)
+	    && (maintenance_sleep (m, deadline, events) == 0));
+}
+
+
+/**
+ * Resolver cache update notification.
+ */
+static void maintenance_resolved (void *opaque)
+{
+	teredo_maintenance *m = (teredo_maintenance *)opaque;
+
+	__atomic_or_fetch (&m->events, MAINTENANCE_RESOLVED, __ATOMIC_SEQ_CST);
+	maintenance_notify (m);
+}
+
+
+/**
+ * Network configuration change notification.
+ */
+static void maintenance_changed (void *opaque)
+{
+	teredo_maintenance *m = (teredo_maintenance *)opaque;
+
+	__atomic_or_fetch (&m->events, MAINTENANCE_CHANGED, __ATOMIC_SEQ_CST);
+	maintenance_notify (m);
 }
 
 
@@ -214,19 +407,13 @@ checkTimeDrift (struct timespec *ts)
 }
 
 
-static void
-cleanup_unlock (void *o)
-{
-	(void)pthread_mutex_unlock ((pthread_mutex_t *)o);
-}
-
-
 /*
  * Implementation notes:
- * - Optional Teredo interval determination procedure was never implemented.
- *   It adds NAT binding maintenance brittleness in addition to implementation
- *   complexity, and is not necessary for RFC4380 compliance.
- *   Also STUN RFC3489bis deprecates this type of behavior.
+ * - The optional Teredo interval determination procedure is implemented
+ *   with router solicitations from the secondary port, rather than with
+ *   bubbles relayed by the server. A NAT that allocates the same port again
+ *   once the binding expired looks long-lived: the learnt lifetime is
+ *   halved if the primary mapping ever changes.
  * - NAT cone type probing was removed in Miredo version 0.9.5. This violated
  *   RFC4380. Since then, draft-krishnan-v6ops-teredo-update has nevertheless
  *   confirmed that the cone type should be dropped.
@@ -235,168 +422,763 @@ cleanup_unlock (void *o)
  *   RFC3489bis.
  */
 
+/**
+ * Picks IPv4 addresses from the resolver caches for the servers which
+ * have none. Sets the deadline to the current time if any server got a new
+ * address, or to the next retry time if no server has an address.
+ *
+ * @return the number of servers with an address.
+ */
+static unsigned maintenance_pick (teredo_maintenance *restrict m,
+                                  struct timespec *restrict deadline)
+{
+	struct timespec now;
+	gettime (&now);
+
+	time_t retry = now.tv_sec + m->restart_delay;
+	unsigned probed = 0;
+	bool picked = false;
+
+	/* Never blocks: names are resolved by the resolver threads */
+	__atomic_and_fetch (&m->events, ~MAINTENANCE_RESOLVED, __ATOMIC_SEQ_CST);
+	for (unsigned i = 0; i < m->server_count; i++)
+	{
+		maintenance_server *s = m->servers + i;
+
+		if ((s->ip == 0) && (s->retry <= now.tv_sec))
+		{
+			s->addrs = teredo_resolver_get (s->resolver, s->index, &s->ip);
+			if (s->ip != 0)
+				picked = true;
+		}
+
+		if (s->ip != 0)
+			probed++;
+		else
+		if ((s->retry > now.tv_sec) && (s->retry < retry))
+			retry = s->retry;
+	}
+
+	if (picked || (probed == 0))
+		*deadline = now;
+	if (probed == 0)
+		deadline->tv_sec = retry;
+	return probed;
+}
+
+
+/**
+ * Gives the cached server address to the server whose name resolves to it,
+ * once the resolvers know. Until then, it is held by the first server (see
+ * maintenance_cache()). If no server resolves to it anymore, the first
+ * server uses its own addresses instead, once the cached address was
+ * confirmed; an unconfirmed one is dropped anyway if it does not reply.
+ *
+ * @return the active server, which follows the cached address if it moved.
+ */
+static maintenance_server *
+maintenance_attribute (teredo_maintenance *restrict m,
+                       maintenance_server *active)
+{
+	maintenance_server *owner = m->provisional;
+	bool pending = false;
+
+	if (!owner->cached)
+	{
+		/* Cached address already replaced: nothing to attribute */
+		m->provisional = NULL;
+		return active;
+	}
+
+	for (unsigned i = 0; i < m->server_count; i++)
+	{
+		maintenance_server *s = m->servers + i;
+		uint32_t ip;
+		unsigned n = teredo_resolver_get (s->resolver, 0, &ip);
+
+		if (n == 0)
+			pending = true;
+
+		for (unsigned j = 0; j < n; j++)
+		{
+			teredo_resolver_get (s->resolver, j, &ip);
+			if (ip != owner->ip)
+				continue;
+
+			m->provisional = NULL;
+			if (s != owner)
+			{
+				char *name = s->name;
+				teredo_resolver *resolver = s->resolver;
+
+				/* Qualification state goes along with the address */
+				*s = *owner;
+				s->name = name;
+				s->resolver = resolver;
+				owner->ip = 0;
+				owner->cached = owner->qualified = owner->replied = false;
+				owner->count = 0;
+				if (active == owner)
+					active = s;
+			}
+			s->index = j;
+			s->addrs = n;
+			return active;
+		}
+	}
+
+	if (!pending && owner->qualified)
+	{
+		/* Not the address of any server anymore */
+		m->provisional = NULL;
+		owner->ip = 0;
+		owner->cached = owner->qualified = owner->replied = false;
+		owner->count = 0;
+	}
+	return active;
+}
+
+
+/**
+ * Schedules an immediate solicitation of all servers, after a network
+ * configuration change: the NAT mapping, or the reachability of servers
+ * which did not reply, might have changed.
+ */
+static void maintenance_restart (teredo_maintenance *restrict m,
+                                 struct timespec *restrict deadline)
+{
+	gettime (deadline);
+
+	for (unsigned i = 0; i < m->server_count; i++)
+	{
+		maintenance_server *s = m->servers + i;
+
+		if (s->ip == 0)
+		{
+			s->retry = 0;
+			teredo_resolver_refresh (s->resolver);
+		}
+	}
+}
+
+
+/**
+ * Matches a received packet against the pending solicitations.
+ * @return the server which sent the advertisement, NULL if invalid.
+ */
+static maintenance_server *
+maintenance_reply (teredo_maintenance *restrict m,
+                   const teredo_packet *restrict packet)
+{
+	for (unsigned i = 0; i < m->server_count; i++)
+	{
+		maintenance_server *s = m->servers + i;
+		teredo_state newst;
+
+		if ((s->ip == 0) || s->replied)
+			continue;
+
+		newst.mtu = 1280;
+		newst.up = true;
+		if (maintenance_recv (packet, s->ip, s->nonce, false, &newst))
+			continue;
+
+		struct timespec now;
+		gettime (&now);
+
+		unsigned long rtt = (now.tv_sec - s->sent.tv_sec) * 1000000
+		                  + (now.tv_nsec - s->sent.tv_nsec) / 1000;
+		/* Smoothed as TCP does (RFC 6298), leaving retries out (Karn) */
+		if (!s->resent)
+			s->rtt = s->qualified ? ((7 * s->rtt + rtt) / 8) : rtt;
+		s->state = newst;
+		s->count = 0;
+		s->replied = s->qualified = true;
+		s->blackhole = false;
+		return s;
+	}
+	return NULL;
+}
+
+
+/* Shortest time to wait before soliciting the active server again */
+static const unsigned MinRetransmit = 500; // milliseconds
+
+/**
+ * Computes when to solicit the active server again within a round, if it
+ * did not reply: four round-trip times, so that both solicitations fit
+ * within the qualification delay.
+ */
+static void maintenance_retry (const teredo_maintenance *restrict m,
+                               const maintenance_server *restrict s,
+                               struct timespec *restrict ts)
+{
+	unsigned long ms = s->rtt / 250;
+	unsigned long max = m->qualification_delay * 1000 / 3;
+
+	if (ms < MinRetransmit)
+		ms = MinRetransmit;
+	if (ms > max)
+		ms = max;
+
+	gettime (ts);
+	ts->tv_sec += ms / 1000;
+	ts->tv_nsec += (ms % 1000) * 1000000;
+	if (ts->tv_nsec >= 1000000000)
+	{
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000;
+	}
+}
+
+
+/**
+ * @return the server with the lowest round-trip time among those which
+ * replied in the current round, NULL if none did.
+ */
+static maintenance_server *maintenance_best (teredo_maintenance *m)
+{
+	maintenance_server *best = NULL;
+
+	for (unsigned i = 0; i < m->server_count; i++)
+	{
+		maintenance_server *s = m->servers + i;
+
+		if ((s->ip != 0) && s->replied
+		 && ((best == NULL) || (s->rtt < best->rtt)))
+			best = s;
+	}
+	return best;
+}
+
+
+/**
+ * Updates the Teredo client state from the active server advertisement.
+ */
+static void maintenance_up (teredo_maintenance *restrict m,
+                            const maintenance_server *restrict active,
+                            time_t now)
+{
+	teredo_state *c_state = &m->state.state;
+	teredo_state newst = active->state;
+
+	/* 12-bits Teredo flags randomization */
+	newst.addr.teredo.flags = c_state->addr.teredo.flags;
+	if (!IN6_ARE_ADDR_EQUAL (&c_state->addr.ip6, &newst.addr.ip6))
+	{
+		uint16_t f = teredo_get_flbits (now);
+		newst.addr.teredo.flags = f & htons (TEREDO_RANDOM_MASK);
+	}
+
+	if ((!c_state->up)
+	 || !IN6_ARE_ADDR_EQUAL (&c_state->addr.ip6, &newst.addr.ip6)
+	 || (c_state->mtu != newst.mtu))
+	{
+		memcpy(c_state, &newst, sizeof (*c_state));
+
+		syslog (LOG_NOTICE, _("New Teredo address/MTU"));
+		m->state.cb (c_state, m->state.opaque);
+	}
+}
+
+
+/* Longest NAT binding lifetime tested */
+static const unsigned MaxBindingLifetime = 900; // seconds
+
+/**
+ * @return the interval between NAT binding refreshes (seconds).
+ */
+static unsigned maintenance_refresh (const teredo_maintenance *m)
+{
+	unsigned lifetime = m->probe.lifetime;
+
+	/*
+	 * Solicitations are also the only way to notice that a server is gone:
+	 * with standby servers, keep checking them often enough to fail over
+	 * quickly, whatever the NAT binding lifetime.
+	 */
+	if (m->server_count > 1)
+		return m->refresh_delay;
+
+	/* Solicit just before the binding would expire */
+	if (lifetime > m->refresh_delay + m->qualification_delay)
+		return lifetime - m->qualification_delay;
+	return m->refresh_delay;
+}
+
+
+/**
+ * Passes the learnt NAT binding lifetime to the callback, if it changed.
+ */
+static void maintenance_report (teredo_maintenance *m)
+{
+	maintenance_probe *p = &m->probe;
+
+	if (p->lifetime == p->reported)
+		return;
+
+	p->reported = p->lifetime;
+	if (p->lifetime)
+		syslog (LOG_INFO, _("NAT binding lifetime: at least %u seconds"),
+		        p->lifetime);
+	m->state.binding_cb (p->lifetime, m->state.opaque);
+}
+
+
+/**
+ * (Re)starts the NAT binding lifetime determination, beginning with the
+ * verification of a previously known lifetime, if any. Until then, the
+ * default refresh interval is used.
+ */
+static void maintenance_probe_reset (teredo_maintenance *m, unsigned known)
+{
+	maintenance_probe *p = &m->probe;
+
+	if (p->fd != -1)
+	{
+		teredo_close (p->fd);
+		p->fd = -1;
+	}
+
+	if (known > MaxBindingLifetime)
+		known = MaxBindingLifetime;
+	p->stage = (m->state.binding_cb != NULL)
+		? (known ?: (2 * m->refresh_delay)) : 0;
+	p->lifetime = 0;
+	p->armed = false;
+	p->due = 0;
+}
+
+
+/**
+ * Opens the secondary socket, on the same local address as the primary.
+ * @return 0 on success, -1 on error.
+ */
+static int maintenance_probe_open (teredo_maintenance *m)
+{
+	maintenance_probe *p = &m->probe;
+	struct sockaddr_in addr;
+	socklen_t len = sizeof (addr);
+
+	if (getsockname (m->fd, (struct sockaddr *)&addr, &len))
+		return -1;
+
+	p->fd = teredo_socket (addr.sin_addr.s_addr, 0);
+	if (p->fd == -1)
+		return -1;
+
+	len = sizeof (addr);
+	if (getsockname (p->fd, (struct sockaddr *)&addr, &len))
+	{
+		teredo_close (p->fd);
+		p->fd = -1;
+		return -1;
+	}
+	p->port = addr.sin_port;
+	return 0;
+}
+
+
+/**
+ * Solicits a server from the secondary socket, and waits for its
+ * advertisement, at most the qualification delay.
+ * @return 0 on success, -1 if no valid advertisement was received.
+ */
+static int maintenance_probe_rs (teredo_maintenance *restrict m,
+                                 const maintenance_server *restrict s,
+                                 teredo_packet *restrict packet,
+                                 teredo_state *restrict state)
+{
+	const maintenance_probe *p = &m->probe;
+	struct timespec now, deadline;
+	uint8_t nonce[8];
+
+	gettime (&now);
+	teredo_get_nonce (now.tv_sec, s->ip, p->port, nonce);
+	if (teredo_send_rs (p->fd, s->ip, nonce, false))
+		return -1;
+
+	deadline = now;
+	deadline.tv_sec += m->qualification_delay;
+
+	for (;;)
+	{
+		gettime (&now);
+
+		long ms = (deadline.tv_sec - now.tv_sec) * 1000
+		        + (deadline.tv_nsec - now.tv_nsec) / 1000000;
+		if (ms <= 0)
+			return -1;
+
+		struct pollfd ufd = { .fd = p->fd, .events = POLLIN };
+		if ((poll (&ufd, 1, ms) <= 0) || teredo_recv (p->fd, packet))
+			continue;
+
+		state->mtu = 1280;
+		state->up = true;
+		if ((packet->source_port == htons (IPPORT_TEREDO))
+		 && packet->auth_present
+		 && (maintenance_recv (packet, s->ip, nonce, false, state) == 0))
+			return 0;
+	}
+}
+
+
+/**
+ * Runs one step of the NAT binding lifetime determination: solicits the
+ * active server from the secondary socket, and checks whether its mapping
+ * survived the interval being tested.
+ */
+static void maintenance_step (teredo_maintenance *restrict m,
+                              const maintenance_server *restrict s,
+                              teredo_packet *restrict packet)
+{
+	maintenance_probe *p = &m->probe;
+	struct timespec now;
+	teredo_state st;
+
+	if ((p->fd == -1) && maintenance_probe_open (m))
+	{
+		syslog (LOG_WARNING, _("Error (%s): %m"), "socket");
+		gettime (&now);
+		p->due = now.tv_sec + m->restart_delay;
+		return;
+	}
+
+	if (maintenance_probe_rs (m, s, packet, &st))
+	{
+		/* Lost solicitation or advertisement: test this interval again */
+		gettime (&now);
+		p->armed = false;
+		p->due = now.tv_sec + maintenance_refresh (m);
+		return;
+	}
+
+	/* Mappings might depend on the destination */
+	if (p->armed && (p->server_ip == s->ip))
+	{
+		if ((p->mapped_ip == st.addr.teredo.client_ip)
+		 && (p->mapped_port == st.addr.teredo.client_port))
+		{
+			/* Binding survived: test twice as long */
+			p->lifetime = p->stage;
+			p->stage = (p->stage >= MaxBindingLifetime) ? 0
+				: (2 * p->stage < MaxBindingLifetime) ? (2 * p->stage)
+				: MaxBindingLifetime;
+		}
+		else
+		if ((p->lifetime == 0) && (p->stage > 2 * m->refresh_delay))
+			/* Known lifetime is not valid anymore: start over */
+			p->stage = 2 * m->refresh_delay;
+		else
+			/* Binding expired: the previous interval is the lifetime */
+			p->stage = 0;
+		maintenance_report (m);
+	}
+
+	if (p->stage == 0)
+	{
+		teredo_close (p->fd);
+		p->fd = -1;
+		return;
+	}
+
+	/* The secondary socket stays idle until the next step */
+	gettime (&now);
+	p->armed = true;
+	p->due = now.tv_sec + p->stage;
+	p->server_ip = s->ip;
+	p->mapped_ip = st.addr.teredo.client_ip;
+	p->mapped_port = st.addr.teredo.client_port;
+}
+
+
+/**
+ * Handles a change of the primary mapping from the active server. If the
+ * refresh interval was learnt, it was too long: the NAT binding expired.
+ */
+static void maintenance_expired (teredo_maintenance *m)
+{
+	maintenance_probe *p = &m->probe;
+
+	if (p->lifetime == 0)
+		return;
+
+	syslog (LOG_WARNING, _("NAT binding expired before refresh"));
+	p->lifetime /= 2;
+	if (p->lifetime <= m->refresh_delay)
+		p->lifetime = 0;
+	p->stage = 0;
+	if (p->fd != -1)
+	{
+		teredo_close (p->fd);
+		p->fd = -1;
+	}
+	maintenance_report (m);
+}
+
+
+/**
+ * Waits until the next solicitation, a network configuration change or the
+ * next NAT binding lifetime determination step.
+ * @return true if the determination step is due, false otherwise.
+ */
+static bool maintenance_wait (teredo_maintenance *restrict m,
+                              const struct timespec *restrict deadline,
+                              teredo_packet *restrict packet)
+{
+	const maintenance_probe *p = &m->probe;
+	struct timespec t = *deadline;
+	bool probe = (p->stage != 0) && (p->due < t.tv_sec);
+
+	if (probe)
+	{
+		t.tv_sec = p->due;
+		t.tv_nsec = 0;
+	}
+
+	wait_event (m, &t, packet, MAINTENANCE_CHANGED);
+	return probe
+	    && !(__atomic_load_n (&m->events, __ATOMIC_SEQ_CST)
+	         & MAINTENANCE_CHANGED);
+}
+
+
+/**
+ * Fails over to a standby server, within a round.
+ * @return the new active server.
+ */
+static maintenance_server *
+maintenance_switch (teredo_maintenance *restrict m,
+                    maintenance_server *restrict s, time_t now)
+{
+	syslog (LOG_NOTICE, _("Switching to Teredo server %s"), s->name);
+	maintenance_up (m, s, now);
+	return s;
+}
+
+
 /*
  * Teredo client maintenance procedure
+ *
+ * All servers are solicited at the same time. The one with the lowest
+ * round-trip time is used, while the others are kept qualified as hot
+ * standbys. The active server is kept as long as it replies, so that the
+ * Teredo address does not change needlessly. If it misses a reply, it is
+ * solicited again after a few round-trip times. If it misses that one too,
+ * the client fails over to a standby server which replied right away,
+ * without waiting for the qualification retries to run out.
  */
 static inline LIBTEREDO_NORETURN
 void maintenance_thread (teredo_maintenance *m)
 {
-	struct timespec deadline = { 0, 0 };
+	struct timespec deadline;
+	teredo_packet packet;
 	teredo_state *c_state = &m->state.state;
-	uint32_t server_ip = 0;
-	unsigned count = 0;
-	enum
+	maintenance_server *active = NULL;
+
+	gettime (&deadline);
+
+	/* Optimistic start: the first advertisement confirms or replaces it */
+	if (c_state->up)
 	{
-		TERR_NONE,
-		TERR_BLACKHOLE
-	} last_error = TERR_NONE;
+		syslog (LOG_NOTICE, _("Using cached Teredo address/MTU"));
+		m->state.cb (c_state, m->state.opaque);
 
-	pthread_mutex_lock (&m->inner);
+		/* Kept, rather than the first server to reply, if it replies */
+		for (unsigned i = 0; i < m->server_count; i++)
+			if (m->servers[i].cached)
+				active = m->servers + i;
+	}
 
 	/*
 	 * Qualification/maintenance procedure
 	 */
-	pthread_cleanup_push (cleanup_unlock, &m->inner);
 	for (;;)
 	{
-		/* Resolve server IPv4 addresses */
-		while (server_ip == 0)
+		if (__atomic_fetch_and (&m->events, ~MAINTENANCE_CHANGED,
+		                        __ATOMIC_SEQ_CST) & MAINTENANCE_CHANGED)
 		{
-			/* FIXME: mutex kept while resolving - very bad */
-			int val = getipv4byname (m->server, &server_ip);
-			gettime (&deadline);
-	
-			if (val)
-			{
-				/* DNS resolution failed */
-				syslog (LOG_ERR,
-				        _("Cannot resolve Teredo server address \"%s\": %s"),
-				        m->server, gai_strerror (val));
-			}
-			else
-			if (!is_ipv4_global_unicast (server_ip))
-			{
-				syslog (LOG_ERR,
-				        _("Teredo server has a non global IPv4 address."));
-			}
-			else
-			{
-				/* DNS resolution succeeded */
-				/* Tells Teredo client about the new server's IP */
-				assert (!c_state->up);
-				c_state->addr.teredo.server_ip = server_ip;
-				m->state.cb (c_state, m->state.opaque);
-				break; /* Done! */
-			}
+			debug ("Network change: soliciting Teredo servers");
+			maintenance_restart (m, &deadline);
+			/* New NAT, maybe: verify the lifetime again */
+			maintenance_probe_reset (m, m->probe.reported);
+		}
 
-			/* wait some time before next resolution attempt */
-			deadline.tv_sec += m->restart_delay;
-			server_ip = 0;
-			wait_reply_ignore (m, &deadline);
+		if (m->provisional != NULL)
+			active = maintenance_attribute (m, active);
+
+		/* Pick server IPv4 addresses from the resolver caches */
+		unsigned probed = maintenance_pick (m, &deadline);
+		if (probed == 0)
+		{
+			/* wait for the resolvers (which log errors) */
+			wait_event (m, &deadline, &packet,
+			            MAINTENANCE_RESOLVED | MAINTENANCE_CHANGED);
+			continue;
 		}
 
-		/* SEND ROUTER SOLICATION */
+		/* SEND ROUTER SOLICATIONS */
 		do
 			deadline.tv_sec += m->qualification_delay;
 		while (!checkTimeDrift (&deadline));
 
-		uint8_t nonce[8];
-		teredo_get_nonce (deadline.tv_sec, server_ip, htons (IPPORT_TEREDO),
-		                  nonce);
-		teredo_send_rs (m->fd, server_ip, nonce, false);
+		for (unsigned i = 0; i < m->server_count; i++)
+		{
+			maintenance_server *s = m->servers + i;
 
-		int val = 0;
-		teredo_state newst;
-		newst.mtu = 1280;
-		newst.up = true;
+			if (s->ip == 0)
+				continue;
 
-		/* RECEIVE ROUTER ADVERTISEMENT */
-		do
-		{
-			val = wait_reply (m, &deadline);
-			if (val)
-				continue; // time out
-
-			/* check received packet */
-			val = maintenance_recv (m->incoming, server_ip,
-			                        nonce, false, &newst);
-			m->incoming = NULL;
-			pthread_cond_signal (&m->processed);
+			teredo_get_nonce (deadline.tv_sec, s->ip, htons (IPPORT_TEREDO),
+			                  s->nonce);
+			s->replied = s->resent = false;
+			gettime (&s->sent);
+			teredo_send_rs (m->fd, s->ip, s->nonce, false);
 		}
-		while ((val != 0) && (val != ETIMEDOUT));
 
-		unsigned delay = 0;
+		/* RECEIVE ROUTER ADVERTISEMENTS */
+		struct timespec retry;
+		unsigned misses = 2; // no retry unless a server is in use
 
-		/* UPDATE FINITE STATE MACHINE */
-		if (val /* == ETIMEDOUT */)
+		if ((active != NULL) && (active->ip != 0))
+		{
+			maintenance_retry (m, active, &retry);
+			misses = 0;
+		}
+
+		for (unsigned replies = 0; replies < probed;)
 		{
-			/* no response */
-			count++;
+			bool waiting = (misses < 2) && !active->replied;
 
-			if (count >= m->qualification_retries)
+			if (wait_reply (m, waiting ? &retry : &deadline, &packet))
 			{
-				count = 0;
+				if (!waiting)
+					break;
 
-				/* No response from server */
-				if (last_error != TERR_BLACKHOLE)
+				if (++misses < 2)
 				{
-					syslog (LOG_INFO, _("No reply from Teredo server"));
-					last_error = TERR_BLACKHOLE;
+					/* Lost solicitation or advertisement, maybe: retry */
+					teredo_send_rs (m->fd, active->ip, active->nonce, false);
+					active->resent = true;
+					maintenance_retry (m, active, &retry);
+					continue;
 				}
 
-				if (c_state->up)
-				{
-					syslog (LOG_NOTICE, _("Lost Teredo connectivity"));
-					c_state->up = false;
-					m->state.cb (c_state, m->state.opaque);
-					server_ip = 0;
-				}
+				/* Missed twice: fail over to the fastest standby */
+				maintenance_server *best = maintenance_best (m);
+				if (best != NULL)
+					active = maintenance_switch (m, best, deadline.tv_sec);
+				continue;
+			}
+
+			maintenance_server *s = maintenance_reply (m, &packet);
+			if (s == NULL)
+				continue;
 
-				/* Wait some time before retrying */
-				delay = m->restart_delay;
+			/* Not qualified yet: the first reply has the lowest RTT */
+			if (active == NULL)
+			{
+				active = s;
+				maintenance_up (m, active, deadline.tv_sec);
 			}
+			else
+			/* Active server missed twice: the first standby is used */
+			if ((misses >= 2) && !active->replied)
+				active = maintenance_switch (m, s, deadline.tv_sec);
+			replies++;
 		}
-		else
-		/* RA received and parsed succesfully */
+
+		/* UPDATE FINITE STATE MACHINE */
+		maintenance_server *best = maintenance_best (m);
+
+		for (unsigned i = 0; i < m->server_count; i++)
 		{
-			count = 0;
+			maintenance_server *s = m->servers + i;
+
+			if ((s->ip == 0) || s->replied)
+				continue;
+
+			/* no response (no retries for an unconfirmed cached address) */
+			if ((++s->count < m->qualification_retries)
+			 && (s->qualified || !s->cached))
+				continue;
 
-			/* 12-bits Teredo flags randomization */
-			newst.addr.teredo.flags = c_state->addr.teredo.flags;
-			if (!IN6_ARE_ADDR_EQUAL (&c_state->addr.ip6, &newst.addr.ip6))
+			/* No response from server */
+			if (!s->blackhole)
 			{
-				uint16_t f = teredo_get_flbits (deadline.tv_sec);
-				newst.addr.teredo.flags =
-					f & htons (TEREDO_RANDOM_MASK);
+				syslog (LOG_INFO, _("No reply from Teredo server"));
+				s->blackhole = true;
 			}
 
-			if ((!c_state->up)
-			 || !IN6_ARE_ADDR_EQUAL (&c_state->addr.ip6, &newst.addr.ip6)
-			 || (c_state->mtu != newst.mtu))
+			/* Try the next server address, if any */
+			s->count = 0;
+			s->qualified = false;
+			s->ip = 0;
+			if (s->cached)
+				/* Cached address: try the resolved ones */
+				s->cached = false;
+			else
+			if ((++s->index % s->addrs) == 0)
 			{
-				memcpy(c_state, &newst, sizeof (*c_state));
+				/* All failed: wait some time before retrying */
+				teredo_resolver_refresh (s->resolver);
+				s->retry = deadline.tv_sec + m->restart_delay;
+			}
+		}
 
-				syslog (LOG_NOTICE, _("New Teredo address/MTU"));
+		if ((active == NULL) || !active->replied)
+		{
+			if (best != NULL)
+			{
+				if (active != NULL)
+					syslog (LOG_NOTICE, _("Switching to Teredo server %s"),
+					        best->name);
+				active = best;
+			}
+			else
+			if ((active != NULL) && !active->qualified)
+				active = NULL;
+		}
+
+		unsigned delay = 0;
+
+		if (active == NULL)
+		{
+			if (c_state->up)
+			{
+				syslog (LOG_NOTICE, _("Lost Teredo connectivity"));
+				c_state->up = false;
 				m->state.cb (c_state, m->state.opaque);
 			}
+		}
+		else
+		if (active->replied)
+		/* RA received and parsed succesfully */
+		{
+			const union teredo_addr *a = &active->state.addr;
+
+			if (c_state->up
+			 && (c_state->addr.teredo.server_ip == a->teredo.server_ip)
+			 && ((c_state->addr.teredo.client_ip != a->teredo.client_ip)
+			  || (c_state->addr.teredo.client_port != a->teredo.client_port)))
+				maintenance_expired (m);
+
+			maintenance_up (m, active, deadline.tv_sec);
 
 			/* Success: schedule next NAT binding maintenance */
-			last_error = TERR_NONE;
-			delay = m->refresh_delay;
+			delay = maintenance_refresh (m);
 		}
 
-		/* WAIT UNTIL NEXT SOLICITATION */
-		/* TODO: watch for new interface events
-		 * (netlink on Linux, PF_ROUTE on BSD) */
+		/* WAIT UNTIL NEXT SOLICITATION, OR NETWORK CHANGE */
 		if (delay)
 		{
 			deadline.tv_sec -= m->qualification_delay;
 			deadline.tv_sec += delay;
-			wait_reply_ignore (m, &deadline);
+			while (maintenance_wait (m, &deadline, &packet))
+				maintenance_step (m, active, &packet);
 		}
 	}
-	/* dead code */
-	pthread_cleanup_pop (1);
 }
 
 
@@ -411,13 +1193,72 @@ static const unsigned QualificationRetries = 3;
 
 static const unsigned RefreshDelay = 30; // seconds
 static const unsigned RestartDelay = 100; // seconds
+/* getaddrinfo() does not tell the DNS TTL */
+static const unsigned ResolverLifetime = 3600; // seconds
+
+/**
+ * Destroys the resolvers and names of the first n servers.
+ */
+static void maintenance_destroy_servers (teredo_maintenance *m, unsigned n)
+{
+	while (n > 0)
+	{
+		maintenance_server *s = m->servers + --n;
+
+		if (s->resolver != NULL)
+			teredo_resolver_destroy (s->resolver);
+		free (s->name);
+	}
+}
+
+
+/**
+ * Starts from a cached state: the tunnel is up right away, while the
+ * server it was obtained from is solicited without waiting for the
+ * resolver. That is the server with the same dotted quad address. If names
+ * are used, the first server solicits it until maintenance_attribute()
+ * finds out which server it belongs to.
+ */
+static void maintenance_cache (teredo_maintenance *restrict m,
+                               const teredo_state *restrict cache)
+{
+	uint32_t ip = cache->addr.teredo.server_ip;
+	maintenance_server *s = NULL;
+
+	for (unsigned i = 0; i < m->server_count; i++)
+	{
+		struct in_addr in;
+
+		if ((inet_aton (m->servers[i].name, &in) != 0)
+		 && (in.s_addr == ip))
+		{
+			s = m->servers + i;
+			break;
+		}
+	}
+
+	if (s == NULL)
+		s = m->provisional = m->servers;
+	s->ip = ip;
+	s->cached = true;
+	m->state.state = *cache;
+}
+
 
 teredo_maintenance *
-teredo_maintenance_start (int fd, teredo_state_cb cb, void *opaque,
-                          const char *s1, const char *s2,
+teredo_maintenance_start (int fd, teredo_state_cb cb,
+                          teredo_binding_cb binding_cb, void *opaque,
+                          const char *const *servers, unsigned count,
                           unsigned q_sec, unsigned q_retries,
-                          unsigned refresh_sec, unsigned restart_sec)
+                          unsigned refresh_sec, unsigned restart_sec,
+                          unsigned lifetime_sec, const teredo_state *cache)
 {
+	if ((count == 0) || (count > TEREDO_MAX_SERVERS))
+	{
+		errno = EINVAL;
+		return NULL;
+	}
+
 	teredo_maintenance *m = (teredo_maintenance *)malloc (sizeof (*m));
 
 	if (m == NULL)
@@ -426,23 +1267,18 @@ teredo_maintenance_start (int fd, teredo_state_cb cb, void *opaque,
 	memset (m, 0, sizeof (*m));
 	m->fd = fd;
 	m->state.cb = cb;
+	m->state.binding_cb = binding_cb;
 	m->state.opaque = opaque;
 
-	assert (s1 != NULL);
-	m->server = strdup (s1);
-	(void)s2;
-
 	m->qualification_delay = q_sec ?: QualificationDelay;
 	m->qualification_retries = q_retries ?: QualificationRetries;
 	m->refresh_delay = refresh_sec ?: RefreshDelay;
 	m->restart_delay = restart_sec ?: RestartDelay;
 
-	if (m->server == NULL)
-	{
-		free (m);
-		return NULL;
-	}
-	else
+	m->probe.fd = -1;
+	maintenance_probe_reset (m, lifetime_sec);
+	m->probe.reported = m->probe.stage ? lifetime_sec : 0;
+
 	{
 		pthread_condattr_t attr;
 
@@ -454,23 +1290,49 @@ teredo_maintenance_start (int fd, teredo_state_cb cb, void *opaque,
 		pthread_condattr_destroy (&attr);
 	}
 
-	pthread_cond_init (&m->processed, NULL);
-	pthread_mutex_init (&m->outer, NULL);
-	pthread_mutex_init (&m->inner, NULL);
+	pthread_mutex_init (&m->push_lock, NULL);
+	pthread_mutex_init (&m->lock, NULL);
+
+	for (m->server_count = 0; m->server_count < count; m->server_count++)
+	{
+		maintenance_server *s = m->servers + m->server_count;
+
+		assert (servers[m->server_count] != NULL);
+		s->name = strdup (servers[m->server_count]);
+		if (s->name != NULL)
+			s->resolver = teredo_resolver_create (s->name, ResolverLifetime,
+			                                      m->restart_delay,
+			                                      maintenance_resolved, m);
+		if (s->resolver == NULL)
+		{
+			m->server_count++;
+			break;
+		}
+	}
+
+	if ((cache != NULL) && cache->up)
+		maintenance_cache (m, cache);
 
-	int err = pthread_create (&m->thread, NULL, do_maintenance, m);
-	if (err == 0)
-		return m;
+	if (m->servers[m->server_count - 1].resolver != NULL)
+	{
+		/* Optional: ENOSYS on other systems than Linux */
+		m->netwatch = teredo_netwatch_create (maintenance_changed, m);
 
-	errno = err;
-	syslog (LOG_ALERT, _("Error (%s): %m"), "pthread_create");
+		int err = pthread_create (&m->thread, NULL, do_maintenance, m);
+		if (err == 0)
+			return m;
 
-	pthread_cond_destroy (&m->processed);
+		errno = err;
+		syslog (LOG_ALERT, _("Error (%s): %m"), "pthread_create");
+		if (m->netwatch != NULL)
+			teredo_netwatch_destroy (m->netwatch);
+	}
+
+	maintenance_destroy_servers (m, m->server_count);
 	pthread_cond_destroy (&m->received);
-	pthread_mutex_destroy (&m->outer);
-	pthread_mutex_destroy (&m->inner);
+	pthread_mutex_destroy (&m->lock);
+	pthread_mutex_destroy (&m->push_lock);
 
-	free (m->server);
 	free (m);
 	return NULL;
 }
@@ -480,13 +1342,17 @@ void teredo_maintenance_stop (teredo_maintenance *m)
 {
 	pthread_cancel (m->thread);
 	pthread_join (m->thread, NULL);
+	/* The callbacks use the mutex and condition variable */
+	if (m->netwatch != NULL)
+		teredo_netwatch_destroy (m->netwatch);
+	maintenance_destroy_servers (m, m->server_count);
+	if (m->probe.fd != -1)
+		teredo_close (m->probe.fd);
 
-	pthread_cond_destroy (&m->processed);
 	pthread_cond_destroy (&m->received);
-	pthread_mutex_destroy (&m->inner);
-	pthread_mutex_destroy (&m->outer);
+	pthread_mutex_destroy (&m->lock);
+	pthread_mutex_destroy (&m->push_lock);
 
-	free (m->server);
 	free (m);
 }
 
@@ -507,19 +1373,21 @@ int teredo_maintenance_process (teredo_maintenance *restrict m,
 	 || !IN6_ARE_ADDR_EQUAL (&packet->ip6->ip6_dst, &teredo_restrict))
 		return -1;
 
-	pthread_mutex_lock (&m->outer);
-	pthread_mutex_lock (&m->inner);
-
-	m->incoming = packet;
-	pthread_cond_signal (&m->received);
-
-	/* Waits for maintenance thread to process packet... */
-	do
-		pthread_cond_wait (&m->processed, &m->inner);
-	while (m->incoming != NULL);
+	/* Router advertisements are much smaller: drop anything else */
+	if (packet->ip6_len > MAINTENANCE_MTU)
+		return 0;
 
-	pthread_mutex_unlock (&m->inner);
-	pthread_mutex_unlock (&m->outer);
+	/*
+	 * Does not wait for the maintenance thread: if the ring is full, the
+	 * packet is dropped, and the Router Solicitation will be retried.
+	 * The lock only serializes concurrent receiving threads; the maintenance
+	 * thread never takes it.
+	 */
+	pthread_mutex_lock (&m->push_lock);
+	int val = maintenance_push (m, packet);
+	pthread_mutex_unlock (&m->push_lock);
 
+	if (val == 0)
+		maintenance_notify (m);
 	return 0;
 }
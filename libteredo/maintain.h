@@ -46,6 +46,9 @@ typedef struct teredo_state
 extern "C" {
 # endif
 
+/** Maximum number of Teredo servers of a maintenance procedure */
+# define TEREDO_MAX_SERVERS 8
+
 /**
  * Teredo client maintenance procedure internal state.
  */
@@ -59,26 +62,42 @@ typedef struct teredo_maintenance teredo_maintenance;
  */
 typedef void (*teredo_state_cb) (const struct teredo_state *s, void *opaque);
 
+/**
+ * Callback prototype for the maintenance procedure to notify about the NAT
+ * binding lifetime it learnt.
+ * @param lifetime NAT binding lifetime (seconds), 0 if unknown
+ * @param opaque data pointer as specified in teredo_maintenance_start()
+ */
+typedef void (*teredo_binding_cb) (unsigned lifetime, void *opaque);
+
 /**
  * Creates and starts a Teredo client maintenance procedure thread.
  *
  * @param fd socket to send router solicitation with
  * @param cb status change notification callback
- * @param opaque data for @a cb callback
- * @param s1 primary server address/hostname
- * @param s2 secondary server address/hostname
+ * @param binding_cb NAT binding lifetime notification callback,
+ * or NULL not to learn the NAT binding lifetime
+ * @param opaque data for @a cb and @a binding_cb callbacks
+ * @param servers server addresses/hostnames
+ * @param count number of servers (at most TEREDO_MAX_SERVERS)
  * @param q_sec qualification time out (seconds), 0 = default
  * @param q_retries qualification retries, 0 = default
  * @param refresh_sec qualification refresh interval (seconds), 0 = default
  * @param restart_sec qualification failure interval (seconds), 0 = default
+ * @param lifetime_sec previously learnt NAT binding lifetime (seconds),
+ * 0 if unknown. It is verified before the refresh interval is extended.
+ * @param cache state from a previous run, or NULL. If it is up, @a cb is
+ * called with it right away, and again if the server does not confirm it.
  *
  * @return NULL on error.
  */
 teredo_maintenance *
-teredo_maintenance_start (int fd, teredo_state_cb cb, void *opaque,
-                          const char *s1, const char *s2,
+teredo_maintenance_start (int fd, teredo_state_cb cb,
+                          teredo_binding_cb binding_cb, void *opaque,
+                          const char *const *servers, unsigned count,
                           unsigned q_sec, unsigned q_retries,
-                          unsigned refresh_sec, unsigned restart_sec);
+                          unsigned refresh_sec, unsigned restart_sec,
+                          unsigned lifetime_sec, const teredo_state *cache);
 
 /**
  * Stops and destroys a maintenance thread created by
@@ -91,9 +110,11 @@ void teredo_maintenance_stop (teredo_maintenance *m);
 
 /**
  * Passes a Teredo packet to a maintenance thread for processing.
+ * The packet is copied, and the function returns without waiting for the
+ * maintenance thread.
  * Thread-safe, not async-cancel safe.
  *
- * @return 0 if processed, -1 if not a valid router solicitation.
+ * @return 0 if queued or discarded, -1 if not a valid router solicitation.
  */
 int teredo_maintenance_process (teredo_maintenance *restrict m,
                                 const teredo_packet *restrict packet);
@@ -19,6 +19,7 @@
  *  http://www.gnu.org/copyleft/gpl.html                               *
  ***********************************************************************/
 
+
 #ifdef HAVE_CONFIG_H
 # include <config.h>
 #endif
@@ -26,6 +27,9 @@
 #include <inttypes.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
 #include <sys/types.h>
 #include <sys/uio.h>
@@ -33,40 +37,93 @@
 #include <netinet/ip6.h>
 #include <netinet/icmp6.h>
 #include <errno.h>
+#include <poll.h>
 #include <pthread.h>
 
 #include <libteredo/teredo-udp.h>
-#include <libteredo/checksum.h>
 #ifdef HAVE_GETOPT_H
 # include <getopt.h>
 #endif
 
 #include <libteredo/teredo.h>
-#include <stdbool.h>
-#include "packets.h"
 #include "debug.h"
 
-//#define MIRE_COUNTER 1
+/* Maximum number of packets per receive burst */
+#define MIRE_BURST 16
+/* Maximum number of threads */
+#define MIRE_MAX_THREADS 64
+
+/**
+ * ICMPv6 error message, sent along with (part of) the offending packet.
+ */
+typedef struct mire_error
+{
+	struct ip6_hdr   ip6;
+	struct icmp6_hdr icmp6;
+	struct iovec     iov[3];
+} mire_error;
+
+/**
+ * Replies to a burst of received packets, sent all at once.
+ * Echo replies and bubbles point into the receive buffers.
+ */
+typedef struct mire_batch
+{
+	teredo_datagram dgv[MIRE_BURST];
+	struct iovec    iov[MIRE_BURST];
+	mire_error      errors[MIRE_BURST];
+	unsigned        count, errors_count;
+} mire_batch;
+
+typedef struct mire_worker
+{
+	pthread_t thread;
+	int fds[2]; // server (3544) and client (3545) sockets
+	struct teredo_packet *packets; // receive buffers
+	unsigned long count_pkt, count_bytes; // updated atomically
+} mire_worker;
+
 
-#ifdef MIRE_COUNTER
-#include <signal.h>
-static unsigned long count_pkt = 0;
-static unsigned long count_bytes = 0;
-static void handler (int signum)
+static void mire_queue (mire_batch *b, const struct iovec *iov,
+                        size_t iovlen, uint32_t ipv4, uint16_t port)
 {
-	signal (signum, handler);
-	count_bytes /= 1000;
-	printf ("%lu packets/s, %lu.%03lu Mbits/s\n", count_pkt,
-		count_bytes / 125, count_bytes % 125 * 8);
-	count_pkt = count_bytes = 0;
-	if (signum == SIGALRM)
-		alarm (1);
+	teredo_datagram *d = b->dgv + b->count++;
+
+	d->iov = iov;
+	d->iovlen = iovlen;
+	d->ip = ipv4;
+	d->port = port;
+}
+
+
+static void mire_queue_inplace (mire_batch *b, void *data, size_t len,
+                                uint32_t ipv4, uint16_t port)
+{
+	struct iovec *iov = b->iov + b->count;
+
+	iov->iov_base = data;
+	iov->iov_len = len;
+	mire_queue (b, iov, 1, ipv4, port);
+}
+
+
+/**
+ * Updates an Internet checksum for a 16-bits word changing from one value to
+ * another (RFC 1624).
+ */
+static inline uint16_t cksum_update (uint16_t cksum, uint16_t from,
+                                     uint16_t to)
+{
+	uint32_t sum = (cksum ^ 0xffff) + (from ^ 0xffff) + to;
+
+	sum = (sum & 0xffff) + (sum >> 16);
+	sum = (sum & 0xffff) + (sum >> 16);
+	return sum ^ 0xffff;
 }
-#endif
 
 
 static void
-process_icmpv6 (int fd, struct ip6_hdr *ip6, size_t plen,
+process_icmpv6 (mire_batch *b, struct ip6_hdr *ip6, size_t plen,
                 uint32_t ipv4, uint16_t port)
 {
 	if (plen < sizeof (struct icmp6_hdr))
@@ -86,81 +143,87 @@ process_icmpv6 (int fd, struct ip6_hdr *ip6, size_t plen,
 
 	ip6->ip6_hlim = 255;
 
+	/* Swapping the addresses leaves the checksum unchanged */
 	struct in6_addr buf;
 	buf = ip6->ip6_dst;
 	ip6->ip6_dst = ip6->ip6_src;
-	ip6->ip6_src = buf;;
+	ip6->ip6_src = buf;
 
+	/* The reply is sent from the request buffer: only the type and code
+	 * word changes, so the checksum is updated incrementally. */
+	uint16_t from, to;
+	memcpy (&from, hdr, 2);
 	hdr->icmp6_type = ICMP6_ECHO_REPLY;
 	hdr->icmp6_code = 0;
-	hdr->icmp6_cksum = 0;
-	hdr->icmp6_cksum = icmp6_checksum (ip6, hdr);
+	memcpy (&to, hdr, 2);
+	hdr->icmp6_cksum = cksum_update (hdr->icmp6_cksum, from, to);
 
-	teredo_send (fd, ip6, sizeof (*ip6) + plen, ipv4, port);
+	mire_queue_inplace (b, ip6, sizeof (*ip6) + plen, ipv4, port);
 }
 
 
 static void
-process_none (int fd, const struct ip6_hdr *ip6, size_t plen,
+process_none (mire_batch *b, struct ip6_hdr *ip6, size_t plen,
               uint32_t ipv4, uint16_t port)
 {
 	if (plen != 0)
 		return;
 
-	teredo_reply_bubble (fd, ipv4, port, ip6);
+	struct in6_addr buf;
+	buf = ip6->ip6_dst;
+	ip6->ip6_dst = ip6->ip6_src;
+	ip6->ip6_src = buf;
+	ip6->ip6_flow = htonl (6 << 28);
+	ip6->ip6_hlim = 0;
+
+	mire_queue_inplace (b, ip6, sizeof (*ip6), ipv4, port);
 }
 
 
 static void
-process_unknown (int fd, const struct ip6_hdr *in, size_t plen,
+process_unknown (mire_batch *b, const struct ip6_hdr *in, size_t plen,
                  uint32_t ipv4, uint16_t port)
 {
 	plen += sizeof (struct ip6_hdr);
 	if (plen > 1232)
 		plen = 1232;
 
-	struct ip6_hdr   ip6;
-	struct icmp6_hdr icmp6;
-	struct iovec iov[] =
-	{
-		{ &ip6, sizeof (ip6) },
-		{ &icmp6, sizeof (icmp6) },
-		{ (void *)in, plen }
-	};
+	mire_error *e = b->errors + b->errors_count++;
 
-	ip6.ip6_flow = htonl (6 << 28);
-	ip6.ip6_plen = htons (sizeof (struct icmp6_hdr) + plen);
-	ip6.ip6_nxt = IPPROTO_ICMPV6;
-	ip6.ip6_hlim = 255;
-	ip6.ip6_src = in->ip6_dst;
-	ip6.ip6_dst = in->ip6_src;
+	e->iov[0].iov_base = &e->ip6;
+	e->iov[0].iov_len = sizeof (e->ip6);
+	e->iov[1].iov_base = &e->icmp6;
+	e->iov[1].iov_len = sizeof (e->icmp6);
+	e->iov[2].iov_base = (void *)in;
+	e->iov[2].iov_len = plen;
 
-	icmp6.icmp6_type = ICMP6_PARAM_PROB;
-	icmp6.icmp6_code = ICMP6_PARAMPROB_NEXTHEADER;
-	icmp6.icmp6_cksum = 0;
-	icmp6.icmp6_pptr = htonl (6);
+	e->ip6.ip6_flow = htonl (6 << 28);
+	e->ip6.ip6_plen = htons (sizeof (struct icmp6_hdr) + plen);
+	e->ip6.ip6_nxt = IPPROTO_ICMPV6;
+	e->ip6.ip6_hlim = 255;
+	e->ip6.ip6_src = in->ip6_dst;
+	e->ip6.ip6_dst = in->ip6_src;
 
-	icmp6.icmp6_cksum = teredo_cksum (&ip6.ip6_src, &ip6.ip6_dst,
-	                                  IPPROTO_ICMPV6, iov + 1, 2);
+	e->icmp6.icmp6_type = ICMP6_PARAM_PROB;
+	e->icmp6.icmp6_code = ICMP6_PARAMPROB_NEXTHEADER;
+	e->icmp6.icmp6_cksum = 0;
+	e->icmp6.icmp6_pptr = htonl (6);
 
-	teredo_sendv (fd, iov, sizeof (iov) / sizeof (iov[0]), ipv4, port);
+	e->icmp6.icmp6_cksum = teredo_cksum (&e->ip6.ip6_src, &e->ip6.ip6_dst,
+	                                     IPPROTO_ICMPV6, e->iov + 1, 2);
+
+	mire_queue (b, e->iov, 3, ipv4, port);
 }
 
 
 /**
- * Receives and validates Teredo packet.
- * @param fd socket from which to receive a packet.
- * @param p pointer to structure where the received packet will be stored.
+ * Validates a received Teredo packet.
  *
- * @return payload byte length of received packet, or -1 on error.
+ * @return payload byte length of the packet, or -1 if it is invalid.
  */
-static ssize_t
-recv_packet (int fd, teredo_packet *p)
+static ssize_t check_packet (mire_worker *w, const teredo_packet *p)
 {
-	if (teredo_wait_recv (fd, p))
-		return -1;
-
-	struct ip6_hdr *ip6 = p->ip6;
+	const struct ip6_hdr *ip6 = p->ip6;
 	uint16_t plen;
 
 	// Check packet size
@@ -169,10 +232,8 @@ recv_packet (int fd, teredo_packet *p)
 
 	// Check packet validity
 	plen = ntohs (ip6->ip6_plen);
-#ifdef MIRE_COUNTER
-	count_pkt++;
-	count_bytes += plen + 40;
-#endif
+	__atomic_fetch_add (&w->count_pkt, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add (&w->count_bytes, plen + 40, __ATOMIC_RELAXED);
 
 	if (((ip6->ip6_vfc >> 4) != 6)
 	 || ((plen + sizeof (*ip6)) > p->ip6_len))
@@ -182,55 +243,153 @@ recv_packet (int fd, teredo_packet *p)
 }
 
 
-static LIBTEREDO_NORETURN void *server_thread (void *data)
+static void process_server (mire_worker *w, mire_batch *b,
+                            teredo_packet *p)
 {
-	int fdserv = ((int *)data)[0], fd = ((int *)data)[1];
+	ssize_t plen = check_packet (w, p);
+	if (plen == -1)
+		return;
 
-	for (;;)
+	if (p->ip6->ip6_nxt == IPPROTO_NONE)
+		process_none (b, p->ip6, plen, p->source_ipv4, p->source_port);
+}
+
+
+static void process_client (mire_worker *w, mire_batch *b,
+                            teredo_packet *p)
+{
+	ssize_t plen = check_packet (w, p);
+	if (plen == -1)
+		return;
+
+	switch (p->ip6->ip6_nxt)
 	{
-		struct teredo_packet p;
-		ssize_t plen = recv_packet (fdserv, &p);
-		if (plen == -1)
-			continue;
+		// TODO: support routing and hop-by-hop headers?
+
+		case IPPROTO_ICMPV6:
+			process_icmpv6 (b, p->ip6, plen, p->source_ipv4, p->source_port);
+			break;
+
+		case IPPROTO_NONE: // ignore direct bubbles
+		case IPPROTO_ROUTING:
+			break;
 
-		if (p.ip6->ip6_nxt == IPPROTO_NONE)
-			process_none (fd, p.ip6, plen, p.source_ipv4, p.source_port);
+		default:
+			process_unknown (b, p->ip6, plen, p->source_ipv4, p->source_port);
 	}
 }
 
 
-static LIBTEREDO_NORETURN int client_thread (int fd)
+static LIBTEREDO_NORETURN void *worker_thread (void *data)
 {
+	mire_worker *w = data;
+	struct pollfd ufds[2] =
+	{
+		{ .fd = w->fds[0], .events = POLLIN },
+		{ .fd = w->fds[1], .events = POLLIN },
+	};
+
 	for (;;)
 	{
-		struct teredo_packet p;
-		ssize_t plen = recv_packet (fd, &p);
-		if (plen == -1)
+		if (poll (ufds, 2, -1) <= 0)
 			continue;
 
-		switch (p.ip6->ip6_nxt)
+		for (unsigned i = 0; i < 2; i++)
 		{
-			// TODO: support routing and hop-by-hop headers?
+			if (!(ufds[i].revents & POLLIN))
+				continue;
 
-			case IPPROTO_ICMPV6:
-				process_icmpv6 (fd, p.ip6, plen,
-				                p.source_ipv4, p.source_port);
-				break;
+			int n = teredo_recv_burst (ufds[i].fd, w->packets, MIRE_BURST);
+			if (n <= 0)
+				continue;
 
-			case IPPROTO_NONE: // ignore direct bubbles
-			case IPPROTO_ROUTING:
-				break;
+			mire_batch b;
+			b.count = b.errors_count = 0;
 
-			default:
-				process_unknown (fd, p.ip6, plen, p.source_ipv4, p.source_port);
+			for (int j = 0; j < n; j++)
+				if (i == 0)
+					process_server (w, &b, w->packets + j);
+				else
+					process_client (w, &b, w->packets + j);
+
+			/* All replies are sent from the client port */
+			if (b.count > 0)
+				teredo_sendmv (w->fds[1], b.dgv, b.count);
+		}
+	}
+}
+
+
+static void mire_worker_close (mire_worker *w)
+{
+	free (w->packets);
+	for (unsigned i = 0; i < 2; i++)
+		if (w->fds[i] != -1)
+			teredo_close (w->fds[i]);
+}
+
+
+static int mire_worker_open (mire_worker *w, bool shared)
+{
+	int (*open_socket) (uint32_t, uint16_t) =
+		shared ? teredo_socket_shared : teredo_socket;
+
+	w->count_pkt = w->count_bytes = 0;
+	w->packets = malloc (MIRE_BURST * sizeof (*w->packets));
+	w->fds[0] = open_socket (0, htons (IPPORT_TEREDO));
+	w->fds[1] = (w->fds[0] != -1)
+		? open_socket (0, htons (IPPORT_TEREDO + 1)) : -1;
+
+	if ((w->packets == NULL) || (w->fds[1] == -1))
+	{
+		perror ((w->packets == NULL) ? "malloc" : "teredo_socket");
+		mire_worker_close (w);
+		return -1;
+	}
+	return 0;
+}
+
+
+/**
+ * Prints the received packets and bits rates every second. Never returns.
+ */
+static LIBTEREDO_NORETURN void report_loop (mire_worker *workers,
+                                            unsigned count)
+{
+	unsigned long last_pkt = 0, last_bytes = 0;
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	for (;;)
+	{
+		ts.tv_sec++;
+		while (clock_nanosleep (CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL));
+
+		unsigned long pkt = 0, bytes = 0;
+		for (unsigned i = 0; i < count; i++)
+		{
+			pkt += __atomic_load_n (&workers[i].count_pkt, __ATOMIC_RELAXED);
+			bytes += __atomic_load_n (&workers[i].count_bytes,
+			                          __ATOMIC_RELAXED);
 		}
+
+		unsigned long kbytes = (bytes - last_bytes) / 1000;
+		printf ("%lu packets/s, %lu.%03lu Mbits/s\n", pkt - last_pkt,
+		        kbytes / 125, kbytes % 125 * 8);
+		fflush (stdout);
+		last_pkt = pkt;
+		last_bytes = bytes;
 	}
 }
 
 
 static int usage (const char *path)
 {
-	printf ("Usage: %s\n", path);
+	printf ("Usage: %s [OPTIONS]\n"
+	        "  -h, --help         display this help and exit\n"
+	        "  -s, --stats        print the received packets rate every second\n"
+	        "  -t, --threads=N    answer from N threads (default: 1)\n"
+	        "  -V, --version      display program version and exit\n", path);
 	return 0;
 }
 
@@ -245,17 +404,40 @@ int main(int argc, char *argv[])
 	static const struct option opts[] =
 	{
 		{ "help",       no_argument,       NULL, 'h' },
+		{ "stats",      no_argument,       NULL, 's' },
+		{ "threads",    required_argument, NULL, 't' },
 		{ "version",    no_argument,       NULL, 'V' },
 		{ NULL,         no_argument,       NULL, '\0'}
 	};
 
+	unsigned threads = 1;
+	bool stats = false;
 	int c;
-	while ((c = getopt_long (argc, argv, "hV", opts, NULL)) != -1)
+	while ((c = getopt_long (argc, argv, "hst:V", opts, NULL)) != -1)
 		switch (c)
 		{
 			case 'h':
 				return usage(argv[0]);
 
+			case 's':
+				stats = true;
+				break;
+
+			case 't':
+			{
+				char *end;
+				unsigned long n = strtoul (optarg, &end, 10);
+
+				if (*end || (n < 1) || (n > MIRE_MAX_THREADS))
+				{
+					fprintf (stderr, "%s: invalid number of threads\n",
+					         optarg);
+					return 1;
+				}
+				threads = n;
+				break;
+			}
+
 			case 'V':
 				return version();
 
@@ -263,37 +445,46 @@ int main(int argc, char *argv[])
 				return 1;
 		}
 
-	int socks[2] = { -1, -1 }, retval = -1;
-	pthread_t thserv;
+	mire_worker workers[MIRE_MAX_THREADS];
+	unsigned opened = 0, started = 0;
+	int retval = -1;
 
-	socks[0] = teredo_socket (0, htons (IPPORT_TEREDO));
-	if (socks[0] != -1)
+	/* Several threads share each port through SO_REUSEPORT */
+	while (opened < threads)
 	{
-		socks[1] = teredo_socket (0, htons (IPPORT_TEREDO + 1));
-		if (socks[1] != -1)
-		{
-			errno = pthread_create (&thserv, NULL, server_thread, socks);
-			if (errno == 0)
-			{
-#ifdef MIRE_COUNTER
-				signal (SIGALRM, handler);
-				alarm (1);
-#endif
-				retval = -client_thread (socks[1]);
-			}
-			else
-				perror ("pthread_create");
+		if (mire_worker_open (workers + opened, threads > 1))
+			goto out;
+		opened++;
+	}
 
-			teredo_close (socks[1]);
+	while (started < threads)
+	{
+		errno = pthread_create (&workers[started].thread, NULL,
+		                        worker_thread, workers + started);
+		if (errno)
+		{
+			perror ("pthread_create");
+			break;
 		}
-		else
-			perror ("teredo_socket");
-		teredo_close (socks[0]);
+		started++;
 	}
-	else
-		perror ("teredo_socket(server)");
 
-	return retval;
+	if (started == threads)
+	{
+		if (stats)
+			report_loop (workers, threads);
+		pthread_join (workers[0].thread, NULL);
+	}
 
-	return 0;
+	while (started > 0)
+	{
+		pthread_cancel (workers[--started].thread);
+		pthread_join (workers[started].thread, NULL);
+	}
+
+out:
+	while (opened > 0)
+		mire_worker_close (workers + --opened);
+
+	return retval;
 }
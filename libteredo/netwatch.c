@@ -0,0 +1,205 @@
+/*
+ * netwatch.c - Network configuration changes watcher
+ */
+
+/***********************************************************************
+ *  Copyright © 2004-2007 Rémi Denis-Courmont.                         *
+ *  This program is free software; you can redistribute and/or modify  *
+ *  it under the terms of the GNU General Public License as published  *
+ *  by the Free Software Foundation; version 2 of the license, or (at  *
+ *  your option) any later version.                                    *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *  See the GNU General Public License for more details.               *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, you can get it from:              *
+ *  http://www.gnu.org/copyleft/gpl.html                               *
+ ***********************************************************************/
+
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <gettext.h>
+
+#include <stdbool.h>
+#include <inttypes.h>
+#include <stdlib.h> /* malloc(), free() */
+#include <errno.h>
+
+#include <sys/types.h>
+#include <unistd.h> /* close() */
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <syslog.h>
+#include <pthread.h>
+#ifdef __linux__
+# include <poll.h>
+# include <net/if.h> /* IFF_UP */
+# include <net/if_arp.h> /* ARPHRD_NONE */
+# include <linux/netlink.h>
+# include <linux/rtnetlink.h>
+#endif
+
+#include "teredo.h"
+#include "netwatch.h"
+#include "debug.h"
+
+/* Quiet time before a burst of changes is notified */
+#define NETWATCH_DEBOUNCE 200 // milliseconds
+
+struct teredo_netwatch
+{
+	pthread_t thread;
+	int fd;
+	teredo_netwatch_cb cb;
+	void *opaque;
+};
+
+#ifdef __linux__
+/**
+ * Receives pending rtnetlink messages.
+ * @return 1 if any of them is a relevant network change, 0 if none is,
+ * -1 on error.
+ */
+static int netwatch_recv (int fd)
+{
+	union
+	{
+		struct nlmsghdr hdr;
+		uint8_t buf[8192];
+	} msg;
+	int changed = 0;
+
+	ssize_t len = recv (fd, &msg, sizeof (msg), MSG_DONTWAIT);
+	if (len < 0)
+		/* ENOBUFS: messages were lost, assume something changed */
+		return (errno == ENOBUFS) ? 1
+		     : ((errno == EAGAIN) || (errno == EINTR)) ? 0 : -1;
+
+	for (const struct nlmsghdr *h = &msg.hdr; NLMSG_OK (h, len);
+	     h = NLMSG_NEXT (h, len))
+	{
+		switch (h->nlmsg_type)
+		{
+			case RTM_NEWLINK:
+			case RTM_DELLINK:
+			{
+				const struct ifinfomsg *ifi =
+					(const struct ifinfomsg *)NLMSG_DATA (h);
+
+				/*
+				 * Ignore MTU and other attributes changes, and IP
+				 * tunnels (ARPHRD_NONE) such as the Teredo interface
+				 * itself, which the client hook brings up and down on
+				 * every qualification. Their IPv4 configuration, if
+				 * any, comes through address and route changes.
+				 */
+				if ((h->nlmsg_len >= NLMSG_LENGTH (sizeof (*ifi)))
+				 && (ifi->ifi_type != ARPHRD_NONE)
+				 && (ifi->ifi_change & (IFF_UP | IFF_RUNNING)))
+					changed = 1;
+				break;
+			}
+
+			case RTM_NEWADDR:
+			case RTM_DELADDR:
+			case RTM_NEWROUTE:
+			case RTM_DELROUTE:
+				/* Only IPv4 groups are subscribed to */
+				changed = 1;
+				break;
+		}
+	}
+	return changed;
+}
+
+
+static LIBTEREDO_NORETURN void *netwatch_thread (void *opaque)
+{
+	teredo_netwatch *w = (teredo_netwatch *)opaque;
+	struct pollfd ufd = { .fd = w->fd, .events = POLLIN };
+
+	for (;;)
+	{
+		int val;
+
+		/* Waits for a change... */
+		do
+		{
+			while (poll (&ufd, 1, -1) < 0);
+			val = netwatch_recv (w->fd);
+		}
+		while (val == 0);
+
+		if (val < 0)
+		{
+			syslog (LOG_ERR, _("Error (%s): %m"), "netlink");
+			/* Do not spin on a broken socket */
+			poll (NULL, 0, 1000);
+			continue;
+		}
+
+		/* ...then until the burst of changes settles */
+		while (poll (&ufd, 1, NETWATCH_DEBOUNCE) > 0)
+			netwatch_recv (w->fd);
+
+		debug ("Network configuration changed");
+		w->cb (w->opaque);
+	}
+}
+#endif
+
+
+teredo_netwatch *teredo_netwatch_create (teredo_netwatch_cb cb,
+                                         void *opaque)
+{
+#ifdef __linux__
+	teredo_netwatch *w = (teredo_netwatch *)malloc (sizeof (*w));
+	if (w == NULL)
+		return NULL;
+
+	w->cb = cb;
+	w->opaque = opaque;
+	w->fd = socket (AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+	if (w->fd != -1)
+	{
+		struct sockaddr_nl addr =
+		{
+			.nl_family = AF_NETLINK,
+			.nl_groups = RTMGRP_LINK | RTMGRP_IPV4_IFADDR
+			           | RTMGRP_IPV4_ROUTE,
+		};
+
+		if (bind (w->fd, (struct sockaddr *)&addr, sizeof (addr)) == 0)
+		{
+			int err = pthread_create (&w->thread, NULL, netwatch_thread, w);
+			if (err == 0)
+				return w;
+
+			errno = err;
+			syslog (LOG_ALERT, _("Error (%s): %m"), "pthread_create");
+		}
+		close (w->fd);
+	}
+	free (w);
+#else
+	(void)cb;
+	(void)opaque;
+	errno = ENOSYS;
+#endif
+	return NULL;
+}
+
+
+void teredo_netwatch_destroy (teredo_netwatch *w)
+{
+	pthread_cancel (w->thread);
+	pthread_join (w->thread, NULL);
+	close (w->fd);
+	free (w);
+}
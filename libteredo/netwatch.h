@@ -0,0 +1,66 @@
+/*
+ * netwatch.h - Network configuration changes watcher
+ */
+
+/***********************************************************************
+ *  Copyright © 2004-2007 Rémi Denis-Courmont.                         *
+ *  This program is free software; you can redistribute and/or modify  *
+ *  it under the terms of the GNU General Public License as published  *
+ *  by the Free Software Foundation; version 2 of the license, or (at  *
+ *  your option) any later version.                                    *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *  See the GNU General Public License for more details.               *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, you can get it from:              *
+ *  http://www.gnu.org/copyleft/gpl.html                               *
+ ***********************************************************************/
+
+
+
+#ifndef LIBTEREDO_NETWATCH_H
+# define LIBTEREDO_NETWATCH_H
+
+# ifdef __cplusplus
+extern "C" {
+# endif
+
+/**
+ * Watcher of local network configuration changes (IPv4 addresses and
+ * routes, and network interfaces going up or down), which might change
+ * the NAT mapping of a Teredo client.
+ */
+typedef struct teredo_netwatch teredo_netwatch;
+
+/**
+ * Callback prototype for network change notifications.
+ * It is called from the watcher thread, with no locks held, once a burst
+ * of changes has settled.
+ */
+typedef void (*teredo_netwatch_cb) (void *opaque);
+
+/**
+ * Creates a network changes watcher thread.
+ *
+ * @param cb change notification callback
+ * @param opaque data for @a cb
+ *
+ * @return NULL on error, including if the operating system is not
+ * supported (errno is then ENOSYS).
+ */
+teredo_netwatch *teredo_netwatch_create (teredo_netwatch_cb cb,
+                                         void *opaque);
+
+/**
+ * Stops and destroys a watcher. The callback is not called anymore after
+ * this function returns.
+ */
+void teredo_netwatch_destroy (teredo_netwatch *w);
+
+# ifdef __cplusplus
+}
+# endif
+#endif /* ifndef LIBTEREDO_NETWATCH_H */
@@ -75,6 +75,16 @@ teredo_send_bubble (int fd, uint32_t ip, uint16_t port,
 }
 
 
+static void
+GetBubbleSource (struct in6_addr *src, uint32_t ip, uint16_t port)
+{
+	memcpy (src->s6_addr, "\xfe\x80\x00\x00\x00\x00\x00\x00", 8);
+	/* TODO: use some time information */
+	teredo_get_nonce (0, ip, port, src->s6_addr + 8);
+	src->s6_addr[8] &= 0xfc; /* Modified EUI-64 */
+}
+
+
 int
 SendBubbleFromDst (int fd, const struct in6_addr *dst, bool indirect)
 {
@@ -82,10 +92,7 @@ SendBubbleFromDst (int fd, const struct in6_addr *dst, bool indirect)
 	uint16_t port = IN6_TEREDO_PORT (dst);
 
 	struct in6_addr src;
-	memcpy (src.s6_addr, "\xfe\x80\x00\x00\x00\x00\x00\x00", 8);
-	/* TODO: use some time information */
-	teredo_get_nonce (0, ip, port, src.s6_addr + 8);
-	src.s6_addr[8] &= 0xfc; /* Modified EUI-64 */
+	GetBubbleSource (&src, ip, port);
 
 	if (indirect)
 	{
@@ -97,6 +104,35 @@ SendBubbleFromDst (int fd, const struct in6_addr *dst, bool indirect)
 }
 
 
+int
+BuildBubbleFromDst (teredo_bubble *restrict b,
+                    const struct in6_addr *restrict dst, bool indirect)
+{
+	uint32_t ip = IN6_TEREDO_IPV4 (dst);
+	uint16_t port = IN6_TEREDO_PORT (dst);
+
+	GetBubbleSource (&b->ip6.ip6_src, ip, port);
+
+	if (indirect)
+	{
+		ip = IN6_TEREDO_SERVER (dst);
+		port = htons (IPPORT_TEREDO);
+	}
+
+	if (!is_ipv4_global_unicast (ip))
+		return -1;
+
+	b->ip6.ip6_flow = htonl (0x60000000);
+	b->ip6.ip6_plen = 0;
+	b->ip6.ip6_nxt = IPPROTO_NONE;
+	b->ip6.ip6_hlim = 0;
+	b->ip6.ip6_dst = *dst;
+	b->ipv4 = ip;
+	b->port = port;
+	return 0;
+}
+
+
 int CheckBubble (const teredo_packet *packet)
 {
 	const struct ip6_hdr *ip6 = packet->ip6;
@@ -51,6 +51,33 @@ static inline bool IsBubble (const struct ip6_hdr *hdr)
 }
 
 
+/**
+ * Teredo bubble with its UDP/IPv4 destination.
+ */
+typedef struct teredo_bubble
+{
+	/** IPv6 header (bubbles have no payload) */
+	struct ip6_hdr ip6;
+	/** Destination IPv4 address (network byte order) */
+	uint32_t ipv4;
+	/** Destination UDP port (network byte order) */
+	uint16_t port;
+} teredo_bubble;
+
+/**
+ * Builds a Teredo Bubble for later transmission.
+ *
+ * @param b bubble to be filled in.
+ * @param dst Teredo destination address.
+ * @param indirect determines whether the bubble is sent to the server (true)
+ * or the client (if indirect is false) - as determined from dst.
+ *
+ * @return 0 on success, -1 if the destination IPv4 address is not global
+ * (in which case, the bubble should not be sent).
+ */
+int BuildBubbleFromDst (teredo_bubble *restrict b,
+                        const struct in6_addr *restrict dst, bool indirect);
+
 /**
  * Sends a Teredo Bubble.
  *
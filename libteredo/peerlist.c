@@ -168,6 +168,8 @@ struct teredo_peerlist
 	teredo_listitem *recent, *old;
 	unsigned left;
 	unsigned expiration;
+	bool threaded;
+	teredo_clock_t last_gc; // milliseconds (event loop only)
 	pthread_t gc;
 	pthread_mutex_t lock;
 #ifdef HAVE_LIBJUDY
@@ -220,6 +222,49 @@ static int listitem_cmp (const void *pa, const void *pb)
 
 #include <sched.h>
 
+/**
+ * Removes the peers that were not used since the previous call,
+ * and ages the other ones. Not cancellation-safe.
+ */
+static void list_expire (teredo_peerlist *l)
+{
+	pthread_mutex_lock (&l->lock);
+
+	// remove expired peers from hash table
+	for (teredo_listitem *p = l->old; p != NULL; p = p->next)
+	{
+#ifdef HAVE_LIBJUDY
+		int Rc_int;
+
+		JHSD (Rc_int, l->PJHSArray, (uint8_t *)&p->key, 16);
+		assert (Rc_int);
+#else
+		teredo_listitem **pp;
+
+		pp = tdelete (&p->key.ip6, &l->root, listitem_cmp);
+		assert (pp != NULL);
+#endif
+		l->left++;
+	}
+
+	// unlinks old peers
+	teredo_listitem *old = l->old;
+
+	// moves recent peers to old peers area
+	l->old = l->recent;
+	l->recent = NULL;
+	if (l->old != NULL)
+		l->old->pprev = &l->old;
+
+	pthread_mutex_unlock (&l->lock);
+
+	// Perform possibly expensive memory release without the lock
+	if (l->threaded)
+		sched_yield ();
+	listitem_recdestroy (old);
+}
+
+
 /**
  * Peer list garbage collector entry point.
  *
@@ -236,49 +281,37 @@ static LIBTEREDO_NORETURN void *garbage_collector (void *data)
 
 		int state;
 		pthread_setcancelstate (PTHREAD_CANCEL_DISABLE, &state);
-		/* cancel-unsafe section starts */
-		pthread_mutex_lock (&l->lock);
-
-		// remove expired peers from hash table
-		for (teredo_listitem *p = l->old; p != NULL; p = p->next)
-		{
-#ifdef HAVE_LIBJUDY
-			int Rc_int;
+		list_expire (l);
+		pthread_setcancelstate (state, NULL);
+		sched_yield ();
+	}
+}
 
-			JHSD (Rc_int, l->PJHSArray, (uint8_t *)&p->key, 16);
-			assert (Rc_int);
-#else
-                        teredo_listitem **pp;
 
-                        pp = tdelete (&p->key.ip6, &l->root, listitem_cmp);
-                        assert (pp != NULL);
-#endif
-			l->left++;
-		}
-
-		// unlinks old peers
-		teredo_listitem *old = l->old;
+int teredo_list_timeout (const teredo_peerlist *l, teredo_clock_t now)
+{
+	long left = (long)(l->last_gc + l->expiration * 1000UL - now);
 
-		// moves recent peers to old peers area
-		l->old = l->recent;
-		l->recent = NULL;
-		if (l->old != NULL)
-			l->old->pprev = &l->old;
+	assert (!l->threaded);
+	return (left > 0) ? left : 0;
+}
 
-		pthread_mutex_unlock (&l->lock);
 
-		// Perform possibly expensive memory release without the lock
-		sched_yield ();
-		listitem_recdestroy (old);
+int teredo_list_process (teredo_peerlist *l, teredo_clock_t now)
+{
+	assert (!l->threaded);
 
-		/* cancel-unsafe section ends */
-		pthread_setcancelstate (state, NULL);
-		sched_yield ();
+	if (teredo_list_timeout (l, now) == 0)
+	{
+		list_expire (l);
+		l->last_gc = now;
 	}
+	return teredo_list_timeout (l, now);
 }
 
 
-teredo_peerlist *teredo_list_create (unsigned max, unsigned expiration)
+teredo_peerlist *teredo_list_create (unsigned max, unsigned expiration,
+                                     bool threaded)
 {
 	/*printf ("Peer size: %u/%u bytes\n",sizeof (teredo_peer),
 	        sizeof (teredo_listitem));*/
@@ -293,13 +326,15 @@ teredo_peerlist *teredo_list_create (unsigned max, unsigned expiration)
 	l->recent = l->old = NULL;
 	l->left = max;
 	l->expiration = expiration;
+	l->threaded = threaded;
+	l->last_gc = teredo_clock_ms ();
 #ifdef HAVE_LIBJUDY
 	l->PJHSArray = (Pvoid_t)NULL;
 #else
 	l->root = NULL;
 #endif
 
-	if (pthread_create (&l->gc, NULL, garbage_collector, l))
+	if (threaded && pthread_create (&l->gc, NULL, garbage_collector, l))
 	{
 		pthread_mutex_destroy (&l->lock);
 		free (l);
@@ -348,21 +383,28 @@ void teredo_list_destroy (teredo_peerlist *l)
 {
 	teredo_list_reset (l, 0);
 
-	pthread_cancel (l->gc);
-	pthread_join (l->gc, NULL);
+	if (l->threaded)
+	{
+		pthread_cancel (l->gc);
+		pthread_join (l->gc, NULL);
+	}
 	pthread_mutex_destroy (&l->lock);
 
 	free (l);
 }
 
 
-teredo_peer *teredo_list_lookup (teredo_peerlist *restrict list,
-                                 const struct in6_addr *restrict addr,
-                                 bool *restrict create)
+void teredo_list_lock (teredo_peerlist *l)
 {
-	teredo_listitem *p;
+	pthread_mutex_lock (&l->lock);
+}
 
-	pthread_mutex_lock (&list->lock);
+
+teredo_peer *teredo_list_lookup_locked (teredo_peerlist *restrict list,
+                                        const struct in6_addr *restrict addr,
+                                        bool *restrict create)
+{
+	teredo_listitem *p;
 
 #ifdef HAVE_LIBJUDY
 	teredo_listitem **pp = NULL;
@@ -476,11 +518,23 @@ teredo_peer *teredo_list_lookup (teredo_peerlist *restrict list,
 	return &p->peer;
 
 error:
-	pthread_mutex_unlock (&list->lock);
 	return NULL;
 }
 
 
+teredo_peer *teredo_list_lookup (teredo_peerlist *restrict list,
+                                 const struct in6_addr *restrict addr,
+                                 bool *restrict create)
+{
+	pthread_mutex_lock (&list->lock);
+
+	teredo_peer *p = teredo_list_lookup_locked (list, addr, create);
+	if (p == NULL)
+		pthread_mutex_unlock (&list->lock);
+	return p;
+}
+
+
 void teredo_list_release (teredo_peerlist *l)
 {
 	pthread_mutex_unlock (&l->lock);
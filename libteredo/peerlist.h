@@ -100,10 +100,30 @@ extern "C" {
  * @param max maximum number of peers in the list
  * @param expiration minimum delay (seconds) before a peer can be removed
  * by the garbage collector. Must not be 0.
+ * @param threaded whether the garbage collector runs in its own thread.
+ * If false, teredo_list_process() must be called instead.
  *
  * @return NULL on error (see errno for actual problem).
  */
-teredo_peerlist *teredo_list_create (unsigned max, unsigned expiration);
+teredo_peerlist *teredo_list_create (unsigned max, unsigned expiration,
+                                     bool threaded);
+
+/**
+ * Runs the garbage collector of a list created without its own thread,
+ * if it is due.
+ *
+ * @param now current time (milliseconds, see teredo_clock_ms())
+ *
+ * @return delay (milliseconds) until the garbage collector is due again.
+ */
+int teredo_list_process (teredo_peerlist *list, teredo_clock_t now);
+
+/**
+ * @param now current time (milliseconds, see teredo_clock_ms())
+ *
+ * @return delay (milliseconds) until teredo_list_process() is due.
+ */
+int teredo_list_timeout (const teredo_peerlist *list, teredo_clock_t now);
 
 
 /**
@@ -143,7 +163,25 @@ teredo_peer *teredo_list_lookup (teredo_peerlist *restrict list,
                                  bool *restrict create);
 
 /**
- * Unlocks a list that was locked by teredo_list_lookup().
+ * Locks the list, so that several peers can be looked up with
+ * teredo_list_lookup_locked() at once.
+ * The list must then be unlocked with teredo_list_release().
+ * @param list peers list
+ */
+void teredo_list_lock (teredo_peerlist *list);
+
+/**
+ * Looks up a peer in a list that is already locked. Unlike
+ * teredo_list_lookup(), the list remains locked in any case.
+ * Parameters and return value are the same as with teredo_list_lookup().
+ */
+teredo_peer *teredo_list_lookup_locked (teredo_peerlist *restrict list,
+                                        const struct in6_addr *restrict addr,
+                                        bool *restrict create);
+
+/**
+ * Unlocks a list that was locked by teredo_list_lookup() or
+ * teredo_list_lock().
  * @param list peers list
  */
 void teredo_list_release (teredo_peerlist *list);
@@ -30,12 +30,15 @@
 
 #include <stdbool.h>
 #include <time.h>
-#include <stdlib.h> // malloc()
+#include <stdlib.h> // malloc(), qsort()
+#include <stddef.h> // offsetof()
+#include <string.h> // memcmp()
 #include <assert.h>
 #include <inttypes.h>
 
 #include <sys/types.h>
 #include <sys/time.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #include <netinet/ip6.h> // struct ip6_hdr
 #include <netinet/icmp6.h> // ICMP6_DST_UNREACH_*
@@ -51,6 +54,10 @@
 #include "maintain.h"
 #include "clock.h"
 #include "peerlist.h"
+#include "unreach.h"
+#include "bubble.h"
+#include "workers.h"
+#include "classify.h"
 #ifdef MIREDO_TEREDO_CLIENT
 # include "security.h"
 #endif
@@ -59,6 +66,12 @@
 # include <sys/socket.h>
 #endif
 
+/* Preallocated packets for the processing threads: number of pools for
+ * transmitting threads, packets per pool, and IPv6 packet size */
+#define WORK_SEND_POOLS 4
+#define WORK_POOL_SIZE  128
+#define WORK_SLOT_SIZE  1500
+
 struct teredo_tunnel
 {
 	struct teredo_peerlist *list;
@@ -68,37 +81,64 @@ struct teredo_tunnel
 	
 	teredo_state_up_cb up_cb;
 	teredo_state_down_cb down_cb;
+
+	// NAT binding lifetime determination (if lifetime_cb is not NULL)
+	teredo_lifetime_cb lifetime_cb;
+	unsigned lifetime;
+	// State from a previous run (if cache.up)
+	teredo_state cache;
 #endif
 	teredo_recv_cb recv_cb;
+	teredo_recv_batch_cb recv_batch_cb;
 	teredo_icmpv6_cb icmpv6_cb;
 
 	teredo_state state;
 	pthread_rwlock_t state_lock;
 
-	// ICMPv6 rate limiting
+	// Deferred, rate-limited ICMPv6 errors
+	struct teredo_unreach *unreach;
+	// Deferred, coalesced bubbles
+	struct teredo_bubbler *bubbler;
+	// Packet processing threads (NULL if packets are processed by I/O threads)
+	struct teredo_workers *workers;
+	// Preallocated packets for the processing threads
 	struct
 	{
-		pthread_mutex_t lock;
-		int count;
-		teredo_clock_t last;
-	} ratelimit;
+		struct teredo_job_pool *recv; // receive thread
+		struct teredo_job_pool *send[WORK_SEND_POOLS]; // transmitting threads
+		bool busy[WORK_SEND_POOLS];
+	} work;
 
 	// Asynchronous packet reception
 	struct
 	{
 		pthread_t thread;
 		bool running;
+		struct teredo_packet *packets;
 	} recv;
 
 	int fd;
+	bool threaded;
 };
 
+/* Maximum number of packets per receive burst */
+#define RECV_BURST 16
+
+/* Maximum number of packets per processing vector */
+#define RECV_VECTOR 256
+
+/* Decapsulated packets pending delivery at the end of a receive burst */
+typedef struct teredo_recv_batch
+{
+	struct iovec pkts[RECV_BURST];
+	unsigned count;
+} teredo_recv_batch;
+
 #ifdef HAVE_LIBJUDY
 # define MAX_PEERS 1048576
 #else
 # define MAX_PEERS 1024
 #endif
-#define ICMP_RATE_LIMIT_MS 100
 
 #if 0
 static unsigned QualificationRetries; // maintain.c
@@ -112,44 +152,88 @@ static unsigned IcmpRateLimitMs;      // here
 #endif
 
 /**
- * Rate limiter around ICMPv6 unreachable error packet emission callback.
+ * Schedules emission of an ICMPv6 unreachable error.
+ * Rate limiting and error message construction are handled by unreach.c,
+ * so this is cheap enough to be called for every dropped packet.
  *
  * @param code ICMPv6 unreachable error code.
  * @param in IPv6 packet that caused the error.
  * @param len byte length of the IPv6 packet at <in>.
  */
-static void
+static inline void
 teredo_send_unreach (teredo_tunnel *restrict tunnel, uint8_t code,
                      const struct ip6_hdr *restrict in, size_t len)
 {
-	struct
-	{
-		struct icmp6_hdr hdr;
-		char fill[1280 - sizeof (struct ip6_hdr) - sizeof (struct icmp6_hdr)];
-	} buf;
-	teredo_clock_t now = teredo_clock ();
+	teredo_unreach_send (tunnel->unreach, code, in, len);
+}
+
+
+/**
+ * ICMPv6 error emission from the deferred errors thread.
+ */
+static void
+teredo_emit_unreach (void *opaque, const struct icmp6_hdr *err, size_t len,
+                     const struct in6_addr *dst)
+{
+	teredo_tunnel *tunnel = (teredo_tunnel *)opaque;
+
+	tunnel->icmpv6_cb (tunnel->opaque, err, len, dst);
+}
+
+
+/**
+ * Passes decapsulated packets to the receive callback(s).
+ */
+static void
+teredo_recv_flush (teredo_tunnel *restrict tunnel,
+                   const struct iovec *restrict pkts, unsigned count)
+{
+	if (count == 0)
+		return;
+
+	if (tunnel->recv_batch_cb != NULL)
+		tunnel->recv_batch_cb (tunnel->opaque, pkts, count);
+	else
+		for (unsigned i = 0; i < count; i++)
+			tunnel->recv_cb (tunnel->opaque, pkts[i].iov_base,
+			                 pkts[i].iov_len);
+}
 
-	/* ICMPv6 rate limit */
-	pthread_mutex_lock (&tunnel->ratelimit.lock);
-	if (now != tunnel->ratelimit.last)
+
+/**
+ * Delivers a decapsulated packet. If a batch is provided, the packet is only
+ * appended to it, and must remain valid until the batch is flushed.
+ * Otherwise, it is delivered immediately.
+ */
+static void
+teredo_recv_deliver (teredo_tunnel *restrict tunnel,
+                     teredo_recv_batch *restrict batch,
+                     const void *data, size_t len)
+{
+	if (batch == NULL)
 	{
-		tunnel->ratelimit.last = now;
-		tunnel->ratelimit.count =
-			ICMP_RATE_LIMIT_MS ? (int)(1000 / ICMP_RATE_LIMIT_MS) : -1;
+		struct iovec iov = { (void *)data, len };
+		teredo_recv_flush (tunnel, &iov, 1);
+		return;
 	}
 
-	if (tunnel->ratelimit.count == 0)
+	batch->pkts[batch->count].iov_base = (void *)data;
+	batch->pkts[batch->count].iov_len = len;
+	if (++batch->count == RECV_BURST)
 	{
-		/* rate limit exceeded */
-		pthread_mutex_unlock (&tunnel->ratelimit.lock);
-		return;
+		teredo_recv_flush (tunnel, batch->pkts, batch->count);
+		batch->count = 0;
 	}
-	if (tunnel->ratelimit.count > 0)
-		tunnel->ratelimit.count--;
-	pthread_mutex_unlock (&tunnel->ratelimit.lock);
+}
 
-	len = BuildICMPv6Error (&buf.hdr, ICMP6_DST_UNREACH, code, in, len);
-	tunnel->icmpv6_cb (tunnel->opaque, &buf.hdr, len, &in->ip6_src);
+
+/**
+ * Receive callback for packets that were queued pending peer validation.
+ * Their buffer is released as soon as this returns.
+ */
+static void teredo_recv_queued (void *opaque, const void *data, size_t len)
+{
+	teredo_recv_deliver ((teredo_tunnel *)opaque, NULL, data, len);
 }
 
 #if 0
@@ -213,6 +297,16 @@ teredo_state_change (const teredo_state *state, void *self)
 	pthread_rwlock_unlock (&tunnel->state_lock);
 }
 
+
+static void
+teredo_binding_change (unsigned lifetime, void *self)
+{
+	teredo_tunnel *tunnel = (teredo_tunnel *)self;
+
+	tunnel->lifetime_cb (tunnel->opaque, lifetime);
+}
+
+
 /**
  * @return 0 if a ping may be sent. 1 if one was sent recently
  * -1 if the peer seems unreachable.
@@ -321,8 +415,10 @@ int teredo_encap (teredo_tunnel *restrict tunnel, teredo_peer *restrict peer,
 }
 
 
-int teredo_transmit (teredo_tunnel *restrict tunnel,
-                     const struct ip6_hdr *restrict packet, size_t length)
+static
+int teredo_transmit_inner (teredo_tunnel *restrict tunnel,
+                           const struct ip6_hdr *restrict packet,
+                           size_t length)
 {
 	assert (tunnel != NULL);
 
@@ -497,7 +593,7 @@ int teredo_transmit (teredo_tunnel *restrict tunnel,
 	/* Client case 5 & relay case 3: untrusted non-cone peer */
 	teredo_enqueue_out (p, packet, length);
 
-	// Sends bubble, if rate limit allows
+	// Schedules bubbles, if rate limit allows
 	int res = CountBubble (p, now);
 	teredo_list_release (list);
 	switch (res)
@@ -507,11 +603,8 @@ int teredo_transmit (teredo_tunnel *restrict tunnel,
 			 * Open the return path if we are behind a
 			 * restricted NAT.
 			 */
-			if (!(s.addr.teredo.flags & htons (TEREDO_FLAG_CONE))
-			 && SendBubbleFromDst (tunnel->fd, &dst->ip6, false))
-				return -1;
-
-			return SendBubbleFromDst (tunnel->fd, &dst->ip6, true);
+			return teredo_bubbler_request (tunnel->bubbler, &dst->ip6,
+			         !(s.addr.teredo.flags & htons (TEREDO_FLAG_CONE)));
 
 		case -1: // Too many bubbles already sent
 			teredo_send_unreach (tunnel, ICMP6_DST_UNREACH_ADDR,
@@ -524,19 +617,201 @@ int teredo_transmit (teredo_tunnel *restrict tunnel,
 }
 
 
+/* Maximum number of packets processed at once by teredo_transmit_batch() */
+#define TRANSMIT_BATCH 64
+
+static int teredo_transmit_cmp (const void *a, const void *b)
+{
+	const struct iovec *const *pa = a, *const *pb = b;
+	const struct ip6_hdr *ha = (*pa)->iov_base, *hb = (*pb)->iov_base;
+
+	int res = memcmp (&ha->ip6_dst, &hb->ip6_dst, sizeof (ha->ip6_dst));
+	if (res == 0) /* keep vector order, so that sorting is stable */
+		res = (*pa > *pb) - (*pa < *pb);
+	return res;
+}
+
+
+static
+int teredo_transmit_batch_inner (teredo_tunnel *restrict tunnel,
+                                 const struct iovec *restrict pkts,
+                                 unsigned count)
+{
+	assert (tunnel != NULL);
+
+	int ret = 0;
+
+	while (count > TRANSMIT_BATCH)
+	{
+		if (teredo_transmit_batch_inner (tunnel, pkts, TRANSMIT_BATCH))
+			ret = -1;
+		pkts += TRANSMIT_BATCH;
+		count -= TRANSMIT_BATCH;
+	}
+
+	teredo_state s;
+	pthread_rwlock_rdlock (&tunnel->state_lock);
+	s = tunnel->state;
+	pthread_rwlock_unlock (&tunnel->state_lock);
+
+	/*
+	 * Only untrusted or trusted Teredo peers (client case 5 & relay case 3)
+	 * are processed as a batch. Other packets are uncommon, and are passed
+	 * to the normal transmission function.
+	 */
+	const struct iovec *v[TRANSMIT_BATCH];
+	unsigned n = 0;
+
+	for (unsigned i = 0; i < count; i++)
+	{
+		const struct ip6_hdr *ip6 = pkts[i].iov_base;
+
+		if (pkts[i].iov_len < sizeof (*ip6))
+			continue;
+
+		const union teredo_addr *dst =
+			(const union teredo_addr *)&ip6->ip6_dst;
+		uint32_t peer_server = IN6_TEREDO_SERVER (dst);
+
+		if ((dst->teredo.prefix == s.addr.teredo.prefix)
+#ifdef MIREDO_TEREDO_CLIENT
+		 && (s.up || !IsClient (tunnel))
+#endif
+		 && is_ipv4_global_unicast (peer_server) && (peer_server != 0))
+			v[n++] = pkts + i;
+		else
+		if (teredo_transmit_inner (tunnel, ip6, pkts[i].iov_len))
+			ret = -1;
+	}
+
+	if (n == 0)
+		return ret;
+
+	/* Groups packets by destination */
+	qsort (v, n, sizeof (v[0]), teredo_transmit_cmp);
+
+	teredo_datagram dgv[TRANSMIT_BATCH];
+	const struct in6_addr *bubbles[TRANSMIT_BATCH];
+	const struct iovec *unreach[TRANSMIT_BATCH];
+	unsigned ndg = 0, nbubbles = 0, nunreach = 0;
+
+	teredo_clock_t now = teredo_clock ();
+	struct teredo_peerlist *list = tunnel->list;
+
+	teredo_list_lock (list);
+	for (unsigned i = 0, j; i < n; i = j)
+	{
+		const struct ip6_hdr *ip6 = v[i]->iov_base;
+		const union teredo_addr *dst =
+			(const union teredo_addr *)&ip6->ip6_dst;
+
+		for (j = i + 1; (j < n)
+		      && (memcmp (dst, &((const struct ip6_hdr *)v[j]->iov_base)
+		                       ->ip6_dst, sizeof (*dst)) == 0); j++);
+
+		bool created;
+		teredo_peer *p = teredo_list_lookup_locked (list, &dst->ip6,
+		                                            &created);
+		if (p == NULL)
+		{
+			ret = -1;
+			continue;
+		}
+
+		if (created)
+		{
+			/* Unknown Teredo clients */
+			p->trusted = p->bubbles = p->pings = 0;
+			SetMapping (p, IN6_TEREDO_IPV4 (dst), IN6_TEREDO_PORT (dst));
+		}
+
+		/* Case 1 (paragraphs 5.2.4 & 5.4.1): trusted peer */
+		bool trusted = p->trusted && IsValid (p, now);
+#ifdef LIBTEREDO_ALLOW_CONE
+		/* Client case 4 & relay case 2: new cone peer */
+		if (!trusted && IN6_IS_TEREDO_ADDR_CONE (dst))
+		{
+			p->trusted = 1;
+			p->bubbles = 0;
+			trusted = true;
+		}
+#endif
+		if (!trusted)
+		{
+			/* Client case 5 & relay case 3: untrusted non-cone peer */
+			for (unsigned k = i; k < j; k++)
+				teredo_enqueue_out (p, v[k]->iov_base, v[k]->iov_len);
+
+			switch (CountBubble (p, now))
+			{
+				case 0:
+					bubbles[nbubbles++] = &dst->ip6;
+					break;
+
+				case -1: // Too many bubbles already sent
+					for (unsigned k = i; k < j; k++)
+						unreach[nunreach++] = v[k];
+			}
+			continue;
+		}
+
+		TouchTransmit (p, now);
+		for (unsigned k = i; k < j; k++)
+		{
+			dgv[ndg].iov = v[k];
+			dgv[ndg].iovlen = 1;
+			dgv[ndg].ip = p->mapped_addr;
+			dgv[ndg].port = p->mapped_port;
+			ndg++;
+		}
+	}
+	teredo_list_release (list);
+
+	if ((ndg > 0) && (teredo_sendmv (tunnel->fd, dgv, ndg) != (int)ndg))
+		ret = -1;
+
+	for (unsigned i = 0; i < nbubbles; i++)
+		if (teredo_bubbler_request (tunnel->bubbler, bubbles[i],
+		        !(s.addr.teredo.flags & htons (TEREDO_FLAG_CONE))))
+			ret = -1;
+
+	for (unsigned i = 0; i < nunreach; i++)
+		teredo_send_unreach (tunnel, ICMP6_DST_UNREACH_ADDR,
+		                     unreach[i]->iov_base, unreach[i]->iov_len);
+
+	return ret;
+}
+
+
 static
 void teredo_predecap (teredo_tunnel *restrict tunnel,
-                      teredo_peer *restrict peer, teredo_clock_t now)
+                      teredo_recv_batch *restrict batch,
+                      teredo_peer *restrict peer,
+                      const struct in6_addr *restrict addr, teredo_clock_t now)
 {
+	bool bubbling = peer->bubbles != 0;
+
 	TouchReceive (peer, now);
 	peer->bubbles = peer->pings = 0;
 	teredo_queue *q = teredo_peer_queue_yield (peer);
 	teredo_list_release (tunnel->list);
 
+	/* The peer answered, there is no point in bubbling it anymore */
+	if (bubbling)
+		teredo_bubbler_cancel (tunnel->bubbler, addr);
+
 	if (q != NULL)
+	{
+		/* Preserve ordering with the packets already in the batch */
+		if (batch != NULL)
+		{
+			teredo_recv_flush (tunnel, batch->pkts, batch->count);
+			batch->count = 0;
+		}
 		teredo_queue_emit (q, tunnel->fd,
 		                   peer->mapped_addr, peer->mapped_port,
-		                   tunnel->recv_cb, tunnel->opaque);
+		                   teredo_recv_queued, tunnel);
+	}
 }
 
 
@@ -548,9 +823,12 @@ void teredo_predecap (teredo_tunnel *restrict tunnel,
  * will return immediatly.
  *
  * Thread-safety: This function is thread-safe.
+ *
+ * @param batch decapsulated packets batch (or NULL to deliver immediately)
  */
 static void
 teredo_run_inner (teredo_tunnel *restrict tunnel,
+                  teredo_recv_batch *restrict batch,
                   const struct teredo_packet *restrict packet)
 {
 	assert (tunnel != NULL);
@@ -713,8 +991,8 @@ teredo_run_inner (teredo_tunnel *restrict tunnel,
 		 && (packet->source_ipv4 == p->mapped_addr)
 		 && (packet->source_port == p->mapped_port))
 		{
-			teredo_predecap (tunnel, p, now);
-			tunnel->recv_cb (tunnel->opaque, ip6, length);
+			teredo_predecap (tunnel, batch, p, &ip6->ip6_src, now);
+			teredo_recv_deliver (tunnel, batch, ip6, length);
 			return;
 		}
 
@@ -729,7 +1007,7 @@ teredo_run_inner (teredo_tunnel *restrict tunnel,
 			p->trusted = 1;
 			SetMappingFromPacket (p, packet);
 
-			teredo_predecap (tunnel, p, now);
+			teredo_predecap (tunnel, batch, p, &ip6->ip6_src, now);
 			return; /* don't pass ping to kernel */
 		}
 #endif /* ifdef MIREDO_TEREDO_CLIENT */
@@ -768,10 +1046,10 @@ teredo_run_inner (teredo_tunnel *restrict tunnel,
 
 			SetMappingFromPacket (p, packet);
 			p->trusted = 1;
-			teredo_predecap (tunnel, p, now);
+			teredo_predecap (tunnel, batch, p, &ip6->ip6_src, now);
 
 			if (!IsBubble (ip6)) // discard Teredo bubble
-				tunnel->recv_cb (tunnel->opaque, ip6, length);
+				teredo_recv_deliver (tunnel, batch, ip6, length);
 			return;
 		}
 
@@ -840,6 +1118,415 @@ teredo_run_inner (teredo_tunnel *restrict tunnel,
 }
 
 
+/**
+ * Checks a received packet against the reception rules that do not depend
+ * on the peer (see teredo_run_inner()), and that would let it through.
+ *
+ * @param verdict classification of the packet (see teredo_classify())
+ *
+ * @return true if the packet can take the fast path of teredo_run_vector(),
+ * false if it must be processed by teredo_run_inner().
+ */
+static inline bool
+teredo_run_check (const teredo_tunnel *restrict tunnel,
+                  const teredo_state *restrict s,
+                  const struct teredo_packet *restrict packet, uint8_t verdict)
+{
+	if ((verdict & (TEREDO_CLASS_VALID | TEREDO_CLASS_DST_MULTICAST))
+	     != TEREDO_CLASS_VALID)
+		return false;
+
+#ifdef MIREDO_TEREDO_CLIENT
+	if (IsClient (tunnel))
+		/* Maintenance and server packets all come from the Teredo port */
+		return s->up
+		    && (packet->source_port != htons (IPPORT_TEREDO))
+		    && !(verdict & TEREDO_CLASS_SRC_LINKLOCAL);
+#else
+	(void)tunnel; (void)s; (void)packet;
+#endif
+	return (verdict & TEREDO_CLASS_SRC_TEREDO) != 0;
+}
+
+
+/**
+ * Receives a vector of packets coming from the Teredo tunnel, with the same
+ * rules as teredo_run_inner(), but in three stages: headers classification
+ * of the whole vector, then peers look up under a single list lock, and
+ * finally batched delivery. Only packets from trusted peers with a matching
+ * mapping, and nothing pending (client case 1), take that path. Any other
+ * packet is handed to teredo_run_inner(), after the packets before it, so
+ * that processing order is unchanged.
+ *
+ * @param batch decapsulated packets batch (flushed by the caller)
+ * @param pv packets vector
+ * @param count number of packets in the vector (at most RECV_VECTOR)
+ */
+static void
+teredo_run_vector (teredo_tunnel *restrict tunnel,
+                   teredo_recv_batch *restrict batch,
+                   const struct teredo_packet *const *pv, unsigned count)
+{
+	teredo_state s;
+	uint8_t verdicts[RECV_VECTOR];
+	unsigned i = 0;
+
+	assert (count <= RECV_VECTOR);
+
+	pthread_rwlock_rdlock (&tunnel->state_lock);
+	s = tunnel->state;
+	pthread_rwlock_unlock (&tunnel->state_lock);
+
+	teredo_classify (pv, count, s.addr.teredo.prefix, verdicts);
+
+	while (i < count)
+	{
+		unsigned first = i, last;
+
+		/* Stage 1: headers validation and classification */
+		while ((i < count)
+		    && teredo_run_check (tunnel, &s, pv[i], verdicts[i]))
+			i++;
+		last = i;
+
+		/* Stage 2: peers look up */
+		if (first < last)
+		{
+			struct teredo_peerlist *list = tunnel->list;
+			teredo_clock_t now = teredo_clock ();
+
+			teredo_list_lock (list);
+			for (i = first; i < last; i++)
+			{
+				const struct teredo_packet *packet = pv[i];
+				teredo_peer *p = teredo_list_lookup_locked (list,
+				                                     &packet->ip6->ip6_src,
+				                                     NULL);
+
+				if ((p == NULL) || !p->trusted
+				 || (packet->source_ipv4 != p->mapped_addr)
+				 || (packet->source_port != p->mapped_port)
+				 || (p->bubbles != 0) || (p->queue != NULL))
+					break;
+
+				/* Same as teredo_predecap() with nothing pending */
+				TouchReceive (p, now);
+				p->pings = 0;
+			}
+			teredo_list_release (list);
+
+			/* Stage 3: delivery */
+			for (unsigned j = first; j < i; j++)
+				teredo_recv_deliver (tunnel, batch, pv[j]->ip6,
+				                     sizeof (struct ip6_hdr)
+				                      + ntohs (pv[j]->ip6->ip6_plen));
+		}
+
+		/* Slow path */
+		if (i < count)
+			teredo_run_inner (tunnel, batch, pv[i++]);
+	}
+}
+
+
+/**
+ * Packet queued for the processing threads. Only the first bytes of the
+ * packet receive buffer are allocated: WORK_SLOT_SIZE bytes for preallocated
+ * packets, as needed for the IPv6 packet otherwise.
+ */
+typedef struct teredo_work
+{
+	teredo_job job;
+	bool transmit;
+	struct teredo_packet packet;
+} teredo_work;
+
+#define WORK_HDR_SIZE offsetof (teredo_work, packet.buf)
+
+
+/**
+ * Releases a packet from the processing threads.
+ */
+static void teredo_work_release (teredo_job *job)
+{
+	if (job->pool != NULL)
+		teredo_job_pool_put (job);
+	else
+		free (job);
+}
+
+
+/**
+ * Takes one of the transmitting threads packet pools, if any is available.
+ * @return pool index, or WORK_SEND_POOLS if none.
+ */
+static unsigned teredo_work_claim (teredo_tunnel *tunnel)
+{
+	for (unsigned i = 0; i < WORK_SEND_POOLS; i++)
+		if (!__atomic_load_n (tunnel->work.busy + i, __ATOMIC_RELAXED)
+		 && !__atomic_exchange_n (tunnel->work.busy + i, true,
+		                          __ATOMIC_ACQUIRE))
+			return i;
+	return WORK_SEND_POOLS;
+}
+
+
+static void teredo_work_unclaim (teredo_tunnel *tunnel, unsigned i)
+{
+	if (i < WORK_SEND_POOLS)
+		__atomic_store_n (tunnel->work.busy + i, false, __ATOMIC_RELEASE);
+}
+
+
+static void teredo_work_pools_destroy (teredo_tunnel *t)
+{
+	if (t->work.recv != NULL)
+		teredo_job_pool_destroy (t->work.recv);
+	t->work.recv = NULL;
+
+	for (unsigned i = 0; i < WORK_SEND_POOLS; i++)
+	{
+		if (t->work.send[i] != NULL)
+			teredo_job_pool_destroy (t->work.send[i]);
+		t->work.send[i] = NULL;
+	}
+}
+
+
+static int teredo_work_pools_create (teredo_tunnel *t)
+{
+	t->work.recv = teredo_job_pool_create (WORK_HDR_SIZE + WORK_SLOT_SIZE,
+	                                       WORK_POOL_SIZE);
+	if (t->work.recv == NULL)
+		return -1;
+
+	for (unsigned i = 0; i < WORK_SEND_POOLS; i++)
+	{
+		t->work.send[i] = teredo_job_pool_create (WORK_HDR_SIZE
+		                                          + WORK_SLOT_SIZE,
+		                                          WORK_POOL_SIZE);
+		if (t->work.send[i] == NULL)
+		{
+			teredo_work_pools_destroy (t);
+			return -1;
+		}
+		t->work.busy[i] = false;
+	}
+	return 0;
+}
+
+
+/**
+ * @return a 32-bits hash of an IPv6 address, as workers ordering key.
+ */
+static inline uint32_t teredo_work_key (const struct in6_addr *addr)
+{
+	uint32_t w[4];
+
+	memcpy (w, addr, sizeof (w));
+	return w[0] ^ w[1] ^ w[2] ^ w[3];
+}
+
+
+/**
+ * Copies a packet and queues it for the processing threads.
+ *
+ * @param pool pool to take the packet copy from, NULL if none
+ * @param packet packet metadata (only used for reception)
+ * @param transmit whether this is a packet to transmit or a received one
+ */
+static int
+teredo_work_submit (teredo_tunnel *restrict tunnel,
+                    struct teredo_job_pool *pool,
+                    const struct teredo_packet *restrict packet,
+                    const struct ip6_hdr *restrict ip6, size_t len,
+                    bool transmit)
+{
+	if (len < sizeof (*ip6))
+		return -1;
+
+	teredo_work *w = NULL;
+
+	if ((pool != NULL) && (len <= WORK_SLOT_SIZE))
+		w = (teredo_work *)teredo_job_pool_get (pool);
+	if (w == NULL)
+	{
+		/* Large packet, or all preallocated packets in use */
+		w = malloc (WORK_HDR_SIZE + len);
+		if (w == NULL)
+			return -1;
+		w->job.pool = NULL;
+	}
+
+	w->transmit = transmit;
+	if (packet != NULL)
+		memcpy (&w->packet, packet, offsetof (struct teredo_packet, buf));
+	memcpy (w->packet.buf.fill, ip6, len);
+	w->packet.ip6 = (struct ip6_hdr *)w->packet.buf.fill;
+	w->packet.ip6_len = len;
+
+	/* Per-peer ordering: by source for reception, by destination for
+	 * transmission */
+	teredo_workers_submit (tunnel->workers, &w->job,
+	                       teredo_work_key (transmit ? &ip6->ip6_dst
+	                                                 : &ip6->ip6_src));
+	return 0;
+}
+
+
+/**
+ * Processes packets from one of the processing threads.
+ */
+static void
+teredo_work_run (void *opaque, teredo_job *const *jobs, unsigned count)
+{
+	teredo_tunnel *tunnel = (teredo_tunnel *)opaque;
+	struct iovec tx[TEREDO_WORKERS_BATCH];
+	const struct teredo_packet *rx[TEREDO_WORKERS_BATCH];
+	teredo_recv_batch batch;
+	unsigned ntx = 0, nrx = 0;
+
+	for (unsigned i = 0; i < count; i++)
+	{
+		teredo_work *w = (teredo_work *)jobs[i];
+
+		if (w->transmit)
+		{
+			tx[ntx].iov_base = w->packet.ip6;
+			tx[ntx].iov_len = w->packet.ip6_len;
+			ntx++;
+		}
+		else
+			rx[nrx++] = &w->packet;
+	}
+
+	if (nrx > 0)
+	{
+		batch.count = 0;
+		teredo_run_vector (tunnel, &batch, rx, nrx);
+		teredo_recv_flush (tunnel, batch.pkts, batch.count);
+	}
+
+	if (ntx > 0)
+		teredo_transmit_batch_inner (tunnel, tx, ntx);
+
+	for (unsigned i = 0; i < count; i++)
+		teredo_work_release (jobs[i]);
+}
+
+
+/**
+ * Releases packets that were not processed before the threads stopped.
+ */
+static void
+teredo_work_discard (void *opaque, teredo_job *const *jobs, unsigned count)
+{
+	(void)opaque;
+
+	for (unsigned i = 0; i < count; i++)
+		teredo_work_release (jobs[i]);
+}
+
+
+int teredo_transmit (teredo_tunnel *restrict tunnel,
+                     const struct ip6_hdr *restrict packet, size_t length)
+{
+	assert (tunnel != NULL);
+
+	if (tunnel->workers != NULL)
+	{
+		unsigned i = teredo_work_claim (tunnel);
+		int ret = teredo_work_submit (tunnel, (i < WORK_SEND_POOLS)
+		                                      ? tunnel->work.send[i] : NULL,
+		                              NULL, packet, length, true);
+		teredo_work_unclaim (tunnel, i);
+		return ret;
+	}
+	return teredo_transmit_inner (tunnel, packet, length);
+}
+
+
+int teredo_transmit_batch (teredo_tunnel *restrict tunnel,
+                           const struct iovec *restrict pkts, unsigned count)
+{
+	assert (tunnel != NULL);
+
+	if (tunnel->workers == NULL)
+		return teredo_transmit_batch_inner (tunnel, pkts, count);
+
+	unsigned p = teredo_work_claim (tunnel);
+	struct teredo_job_pool *pool = (p < WORK_SEND_POOLS)
+		? tunnel->work.send[p] : NULL;
+	int ret = 0;
+
+	for (unsigned i = 0; i < count; i++)
+		if (teredo_work_submit (tunnel, pool, NULL, pkts[i].iov_base,
+		                        pkts[i].iov_len, true))
+			ret = -1;
+	teredo_work_unclaim (tunnel, p);
+	return ret;
+}
+
+
+int teredo_set_workers (teredo_tunnel *t, unsigned count)
+{
+	assert (t != NULL);
+
+	/* Too late, or driven by an event loop */
+	if (t->recv.running || !t->threaded)
+		return -1;
+
+	if (t->workers != NULL)
+	{
+		teredo_workers_destroy (t->workers);
+		t->workers = NULL;
+		teredo_work_pools_destroy (t);
+	}
+
+	if (count == 0)
+		return 0;
+
+	if (teredo_work_pools_create (t))
+		return -1;
+
+	t->workers = teredo_workers_create (count, teredo_work_run,
+	                                    teredo_work_discard, t);
+	if (t->workers == NULL)
+	{
+		teredo_work_pools_destroy (t);
+		return -1;
+	}
+	return 0;
+}
+
+
+unsigned teredo_get_workers (const teredo_tunnel *t)
+{
+	assert (t != NULL);
+
+	return (t->workers != NULL) ? teredo_workers_count (t->workers) : 0;
+}
+
+
+int teredo_get_worker_stats (teredo_tunnel *restrict t, unsigned i,
+                             teredo_worker_stats *restrict stats)
+{
+	assert (t != NULL);
+
+	if (i >= teredo_get_workers (t))
+		return -1;
+
+	teredo_workers_stats ws;
+	teredo_workers_get_stats (t->workers, i, &ws);
+	stats->packets = ws.jobs;
+	stats->steals = ws.steals;
+	stats->busy_us = ws.busy_us;
+	stats->total_us = ws.total_us;
+	return 0;
+}
+
+
+
 
 static void teredo_dummy_recv_cb (void *o, const void *p, size_t l)
 {
@@ -876,7 +1563,14 @@ static void teredo_dummy_state_down_cb (void *o)
 #endif
 
 
-teredo_tunnel *teredo_create (uint32_t ipv4, uint16_t port)
+/**
+ * Creates a tunnel.
+ *
+ * @param threaded whether helpers (peers expiry, bubbles and ICMPv6 errors)
+ * run in their own threads, or from teredo_process_ready().
+ */
+static teredo_tunnel *
+teredo_create_inner (uint32_t ipv4, uint16_t port, bool threaded)
 {
 	teredo_tunnel *tunnel = (teredo_tunnel *)malloc (sizeof (*tunnel));
 	if (tunnel == NULL)
@@ -895,7 +1589,7 @@ teredo_tunnel *teredo_create (uint32_t ipv4, uint16_t port)
 	tunnel->state.addr.teredo.client_ip = ~ipv4;
 
 	tunnel->state.up = false;
-	tunnel->ratelimit.count = 1;
+	tunnel->threaded = threaded;
 
 	tunnel->recv_cb = teredo_dummy_recv_cb;
 	tunnel->icmpv6_cb = teredo_dummy_icmpv6_cb;
@@ -906,11 +1600,22 @@ teredo_tunnel *teredo_create (uint32_t ipv4, uint16_t port)
 
 	if ((tunnel->fd = teredo_socket (ipv4, port)) != -1)
 	{
-		if ((tunnel->list = teredo_list_create (MAX_PEERS, 30)) != NULL)
+		if ((tunnel->list = teredo_list_create (MAX_PEERS, 30, threaded)) != NULL)
 		{
-			(void)pthread_rwlock_init (&tunnel->state_lock, NULL);
-			(void)pthread_mutex_init (&tunnel->ratelimit.lock, NULL);
-			return tunnel;
+			tunnel->unreach = teredo_unreach_create (teredo_emit_unreach,
+			                                         tunnel, threaded);
+			if (tunnel->unreach != NULL)
+			{
+				tunnel->bubbler = teredo_bubbler_create (tunnel->fd,
+				                                         threaded);
+				if (tunnel->bubbler != NULL)
+				{
+					(void)pthread_rwlock_init (&tunnel->state_lock, NULL);
+					return tunnel;
+				}
+				teredo_unreach_destroy (tunnel->unreach);
+			}
+			teredo_list_destroy (tunnel->list);
 		}
 		teredo_close (tunnel->fd);
 	}
@@ -920,6 +1625,28 @@ teredo_tunnel *teredo_create (uint32_t ipv4, uint16_t port)
 }
 
 
+teredo_tunnel *teredo_create (uint32_t ipv4, uint16_t port)
+{
+	return teredo_create_inner (ipv4, port, true);
+}
+
+
+teredo_tunnel *teredo_create_evloop (uint32_t ipv4, uint16_t port)
+{
+	teredo_tunnel *tunnel = teredo_create_inner (ipv4, port, false);
+	if (tunnel == NULL)
+		return NULL;
+
+	tunnel->recv.packets = malloc (RECV_BURST * sizeof (*tunnel->recv.packets));
+	if (tunnel->recv.packets == NULL)
+	{
+		teredo_destroy (tunnel);
+		return NULL;
+	}
+	return tunnel;
+}
+
+
 void teredo_destroy (teredo_tunnel *t)
 {
 	assert (t != NULL);
@@ -940,10 +1667,18 @@ void teredo_destroy (teredo_tunnel *t)
 		pthread_cancel (t->recv.thread);
 		pthread_join (t->recv.thread, NULL);
 	}
+	free (t->recv.packets);
 
+	if (t->workers != NULL)
+	{
+		teredo_workers_destroy (t->workers);
+		teredo_work_pools_destroy (t);
+	}
+
+	teredo_bubbler_destroy (t->bubbler);
+	teredo_unreach_destroy (t->unreach);
 	teredo_list_destroy (t->list);
 	pthread_rwlock_destroy (&t->state_lock);
-	pthread_mutex_destroy (&t->ratelimit.lock);
 	teredo_close (t->fd);
 	free (t);
 }
@@ -952,17 +1687,37 @@ void teredo_destroy (teredo_tunnel *t)
 static LIBTEREDO_NORETURN void *teredo_recv_thread (void *t)
 {
 	teredo_tunnel *tunnel = (teredo_tunnel *)t;
+	struct teredo_packet *packets = tunnel->recv.packets;
 
 	for (;;)
 	{
-		struct teredo_packet packet;
+		teredo_recv_batch batch;
+		int n = teredo_wait_recv_burst (tunnel->fd, packets, RECV_BURST);
+
+		if (n <= 0)
+			continue;
 
-		if (teredo_wait_recv (tunnel->fd, &packet) == 0)
+		pthread_setcancelstate (PTHREAD_CANCEL_DISABLE, NULL);
+		if (tunnel->workers != NULL)
+		{
+			/* Malformatted packets are dropped here */
+			for (int i = 0; i < n; i++)
+				teredo_work_submit (tunnel, tunnel->work.recv, packets + i,
+				                    packets[i].ip6, packets[i].ip6_len,
+				                    false);
+		}
+		else
 		{
-			pthread_setcancelstate (PTHREAD_CANCEL_DISABLE, NULL);
-			teredo_run_inner (tunnel, &packet);
-			pthread_setcancelstate (PTHREAD_CANCEL_ENABLE, NULL);
+			const struct teredo_packet *pv[RECV_BURST];
+
+			for (int i = 0; i < n; i++)
+				pv[i] = packets + i;
+
+			batch.count = 0;
+			teredo_run_vector (tunnel, &batch, pv, n);
+			teredo_recv_flush (tunnel, batch.pkts, batch.count);
 		}
+		pthread_setcancelstate (PTHREAD_CANCEL_ENABLE, NULL);
 	}
 }
 
@@ -971,12 +1726,20 @@ int teredo_run_async (teredo_tunnel *t)
 {
 	assert (t != NULL);
 
-	/* already running */
-	if (t->recv.running)
+	/* already running, or driven by an event loop */
+	if (t->recv.running || !t->threaded)
+		return -1;
+
+	t->recv.packets = malloc (RECV_BURST * sizeof (*t->recv.packets));
+	if (t->recv.packets == NULL)
 		return -1;
 
 	if (pthread_create (&t->recv.thread, NULL, teredo_recv_thread, t))
+	{
+		free (t->recv.packets);
+		t->recv.packets = NULL;
 		return -1;
+	}
 
 	t->recv.running = true;
 	return 0;
@@ -992,7 +1755,91 @@ void teredo_run (teredo_tunnel *tunnel)
 	if (teredo_recv (tunnel->fd, &packet))
 		return;
 
-	teredo_run_inner (tunnel, &packet);
+	teredo_run_inner (tunnel, NULL, &packet);
+}
+
+
+void teredo_run_burst (teredo_tunnel *restrict tunnel,
+                       const struct teredo_packet *restrict pv, unsigned count)
+{
+	assert (tunnel != NULL);
+
+	while (count > 0)
+	{
+		const struct teredo_packet *vector[RECV_VECTOR];
+		teredo_recv_batch batch;
+		unsigned n = (count < RECV_VECTOR) ? count : RECV_VECTOR;
+
+		for (unsigned i = 0; i < n; i++)
+			vector[i] = pv + i;
+
+		batch.count = 0;
+		teredo_run_vector (tunnel, &batch, vector, n);
+		teredo_recv_flush (tunnel, batch.pkts, batch.count);
+
+		pv += n;
+		count -= n;
+	}
+}
+
+
+int teredo_get_fd (const teredo_tunnel *t)
+{
+	assert (t != NULL);
+	return t->fd;
+}
+
+
+/**
+ * Merges two timeouts, where -1 means infinite.
+ */
+static inline int teredo_min_timeout (int a, int b)
+{
+	if (a == -1)
+		return b;
+	if (b == -1)
+		return a;
+	return (a < b) ? a : b;
+}
+
+
+int teredo_get_timeout (teredo_tunnel *t)
+{
+	assert (t != NULL);
+	assert (!t->threaded);
+
+	teredo_clock_t now = teredo_clock_ms ();
+	int timeout = teredo_unreach_timeout (t->unreach);
+
+	timeout = teredo_min_timeout (timeout,
+	                              teredo_list_timeout (t->list, now));
+	return teredo_min_timeout (timeout,
+	                           teredo_bubbler_timeout (t->bubbler, now));
+}
+
+
+void teredo_process_ready (teredo_tunnel *t)
+{
+	assert (t != NULL);
+	assert (!t->threaded);
+
+	struct teredo_packet *packets = t->recv.packets;
+	int n;
+
+	/* Bounded, so that timers are not starved by a packets flood */
+	for (unsigned i = 0; i < 64; i++)
+	{
+		n = teredo_recv_burst (t->fd, packets, RECV_BURST);
+		if (n <= 0)
+			break;
+
+		teredo_run_burst (t, packets, n);
+	}
+
+	teredo_clock_t now = teredo_clock_ms ();
+	teredo_list_process (t->list, now);
+	teredo_bubbler_process (t->bubbler, now);
+	teredo_unreach_process (t->unreach);
 }
 
 
@@ -1059,8 +1906,8 @@ int teredo_set_relay_mode (teredo_tunnel *t)
 }
 
 
-int teredo_set_client_mode (teredo_tunnel *restrict t,
-                            const char *s, const char *s2)
+int teredo_set_client_servers (teredo_tunnel *restrict t,
+                               const char *const *servers, unsigned count)
 {
 #ifdef MIREDO_TEREDO_CLIENT
 	assert (t != NULL);
@@ -1073,8 +1920,11 @@ int teredo_set_client_mode (teredo_tunnel *restrict t,
 	}
 
 	struct teredo_maintenance *m;
-	m = teredo_maintenance_start (t->fd, teredo_state_change, t, s, s2,
-	                              0, 0, 0, 0);
+	teredo_binding_cb binding_cb = (t->lifetime_cb != NULL)
+		? teredo_binding_change : NULL;
+	m = teredo_maintenance_start (t->fd, teredo_state_change, binding_cb, t,
+	                              servers, count, 0, 0, 0, 0, t->lifetime,
+	                              &t->cache);
 	t->maintenance = m;
 	pthread_rwlock_unlock (&t->state_lock);
 
@@ -1082,10 +1932,78 @@ int teredo_set_client_mode (teredo_tunnel *restrict t,
 		return 0;
 #else
 	(void)t;
-	(void)s;
-	(void)s2;
+	(void)servers;
+	(void)count;
+#endif
+	return -1;
+}
+
+
+int teredo_set_binding_lifetime (teredo_tunnel *restrict t, unsigned sec,
+                                 teredo_lifetime_cb cb)
+{
+#ifdef MIREDO_TEREDO_CLIENT
+	assert (t != NULL);
+
+	pthread_rwlock_wrlock (&t->state_lock);
+	if (t->maintenance != NULL)
+	{
+		pthread_rwlock_unlock (&t->state_lock);
+		return -1;
+	}
+
+	t->lifetime_cb = cb;
+	t->lifetime = sec;
+	pthread_rwlock_unlock (&t->state_lock);
+	return 0;
+#else
+	(void)t;
+	(void)sec;
+	(void)cb;
+	return -1;
 #endif
+}
+
+
+int teredo_set_client_cache (teredo_tunnel *restrict t,
+                             const struct in6_addr *restrict addr,
+                             uint16_t mtu)
+{
+#ifdef MIREDO_TEREDO_CLIENT
+	assert (t != NULL);
+	assert (addr != NULL);
+
+	const union teredo_addr *a = (const union teredo_addr *)addr;
+	if (!is_ipv4_global_unicast (a->teredo.server_ip) || (mtu < 1280))
+		return -1;
+
+	pthread_rwlock_wrlock (&t->state_lock);
+	if (t->maintenance != NULL)
+	{
+		pthread_rwlock_unlock (&t->state_lock);
+		return -1;
+	}
+
+	memset (&t->cache, 0, sizeof (t->cache));
+	memcpy (&t->cache.addr, addr, sizeof (t->cache.addr));
+	t->cache.mtu = mtu;
+	t->cache.up = true;
+	pthread_rwlock_unlock (&t->state_lock);
+	return 0;
+#else
+	(void)t;
+	(void)addr;
+	(void)mtu;
 	return -1;
+#endif
+}
+
+
+int teredo_set_client_mode (teredo_tunnel *restrict t,
+                            const char *s, const char *s2)
+{
+	(void)s2;
+	return teredo_set_client_servers (t, &s, 1);
 }
 
 
@@ -1117,6 +2035,18 @@ void teredo_set_recv_callback (teredo_tunnel *restrict t, teredo_recv_cb cb)
 {
 	assert (t != NULL);
 	t->recv_cb = (cb != NULL) ? cb : teredo_dummy_recv_cb;
+	t->recv_batch_cb = NULL;
+}
+
+
+/**
+ * Thread-safety: FIXME.
+ */
+void teredo_set_recv_batch_callback (teredo_tunnel *restrict t,
+                                     teredo_recv_batch_cb cb)
+{
+	assert (t != NULL);
+	t->recv_batch_cb = cb;
 }
 
 
@@ -1131,6 +2061,13 @@ void teredo_set_icmpv6_callback (teredo_tunnel *restrict t,
 }
 
 
+unsigned long teredo_get_icmpv6_drops (teredo_tunnel *t)
+{
+	assert (t != NULL);
+	return teredo_unreach_dropped (t->unreach);
+}
+
+
 void teredo_set_state_cb (teredo_tunnel *restrict t, teredo_state_up_cb u,
                           teredo_state_down_cb d)
 {
@@ -0,0 +1,268 @@
+/*
+ * resolver.c - Asynchronous Teredo server name resolver
+ */
+
+/***********************************************************************
+ *  Copyright © 2004-2007 Rémi Denis-Courmont.                         *
+ *  This program is free software; you can redistribute and/or modify  *
+ *  it under the terms of the GNU General Public License as published  *
+ *  by the Free Software Foundation; version 2 of the license, or (at  *
+ *  your option) any later version.                                    *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *  See the GNU General Public License for more details.               *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, you can get it from:              *
+ *  http://www.gnu.org/copyleft/gpl.html                               *
+ ***********************************************************************/
+
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <gettext.h>
+
+#include <string.h> /* memcmp() */
+#include <stdbool.h>
+#include <inttypes.h>
+#include <stdlib.h> /* malloc(), free() */
+#include <time.h> /* clock_gettime() */
+#include <errno.h> /* ETIMEDOUT */
+
+#include <sys/types.h>
+#include <unistd.h> /* _POSIX_CLOCK_SELECTION */
+#include <sys/socket.h> /* AF_INET */
+#include <netinet/in.h>
+#include <netdb.h> /* getaddrinfo(), gai_strerror() */
+#include <syslog.h>
+#include <pthread.h>
+
+#include "teredo.h"
+#include "resolver.h"
+#include "v4global.h" // is_ipv4_global_unicast()
+#include "debug.h"
+
+#if !defined (CLOCK_MONOTONIC) || (_POSIX_CLOCK_SELECTION - 0 < 0)
+# define pthread_condattr_setclock( a, c ) (((c) != CLOCK_REALTIME) ? EINVAL : 0)
+# ifndef CLOCK_MONOTONIC
+#  define CLOCK_MONOTONIC CLOCK_REALTIME
+# endif
+#endif
+
+struct teredo_resolver
+{
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t wakeup;
+
+	teredo_resolver_cb cb;
+	void *opaque;
+	char *name;
+	unsigned lifetime;
+	unsigned retry;
+
+	bool refresh;
+	unsigned count;
+	uint32_t addrs[TEREDO_RESOLVER_MAX];
+};
+
+
+/**
+ * Resolves all global unicast IPv4 addresses of a host (thread-safe).
+ *
+ * @return 0 on success, or an error value as defined for getaddrinfo().
+ */
+static int getipv4sbyname (const char *restrict name, uint32_t *restrict addrs,
+                           unsigned *restrict count)
+{
+	struct addrinfo hints =
+	{
+		.ai_family = AF_INET,
+		.ai_socktype = SOCK_DGRAM
+	}, *res;
+
+	int val = getaddrinfo (name, NULL, &hints, &res);
+	if (val)
+		return val;
+
+	unsigned n = 0;
+	for (const struct addrinfo *p = res;
+	     (p != NULL) && (n < TEREDO_RESOLVER_MAX); p = p->ai_next)
+	{
+		uint32_t ipv4 =
+			((const struct sockaddr_in *)(p->ai_addr))->sin_addr.s_addr;
+		unsigned i = 0;
+
+		if (!is_ipv4_global_unicast (ipv4))
+			continue;
+
+		while ((i < n) && (addrs[i] != ipv4))
+			i++;
+		if (i == n)
+			addrs[n++] = ipv4;
+	}
+	freeaddrinfo (res);
+
+	*count = n;
+	return 0;
+}
+
+
+static void
+cleanup_unlock (void *o)
+{
+	(void)pthread_mutex_unlock ((pthread_mutex_t *)o);
+}
+
+
+static LIBTEREDO_NORETURN void *resolver_thread (void *opaque)
+{
+	teredo_resolver *r = (teredo_resolver *)opaque;
+	struct timespec expiry = { 0, 0 };
+
+	for (;;)
+	{
+		uint32_t addrs[TEREDO_RESOLVER_MAX];
+		unsigned count = 0;
+		struct timespec now, deadline;
+
+		/* No locks are held while resolving */
+		int val = getipv4sbyname (r->name, addrs, &count);
+		clock_gettime (CLOCK_MONOTONIC, &now);
+
+		if (val)
+			syslog (LOG_ERR,
+			        _("Cannot resolve Teredo server address \"%s\": %s"),
+			        r->name, gai_strerror (val));
+		else
+		if (count == 0)
+			syslog (LOG_ERR,
+			        _("Teredo server has a non global IPv4 address."));
+
+		bool changed = false;
+		deadline = now;
+
+		pthread_mutex_lock (&r->lock);
+		if (count > 0)
+		{
+			changed = (count != r->count)
+			       || memcmp (addrs, r->addrs, count * sizeof (addrs[0]));
+			memcpy (r->addrs, addrs, count * sizeof (addrs[0]));
+			r->count = count;
+
+			/* Resolves again well before expiry */
+			expiry = now;
+			expiry.tv_sec += r->lifetime;
+			deadline.tv_sec += r->lifetime / 2;
+		}
+		else
+		{
+			/* Keeps the previous addresses until they expire */
+			if ((r->count > 0) && (now.tv_sec >= expiry.tv_sec))
+			{
+				syslog (LOG_NOTICE, _("Teredo server address \"%s\" expired"),
+				        r->name);
+				r->count = 0;
+				changed = true;
+			}
+
+			deadline.tv_sec += r->retry;
+			if ((r->count > 0) && (deadline.tv_sec > expiry.tv_sec))
+				deadline = expiry;
+		}
+		pthread_mutex_unlock (&r->lock);
+
+		if (changed && (r->cb != NULL))
+			r->cb (r->opaque);
+
+		pthread_mutex_lock (&r->lock);
+		pthread_cleanup_push (cleanup_unlock, &r->lock);
+		while (!r->refresh
+		    && (pthread_cond_timedwait (&r->wakeup, &r->lock,
+		                                &deadline) != ETIMEDOUT));
+		r->refresh = false;
+		pthread_cleanup_pop (1);
+	}
+}
+
+
+teredo_resolver *teredo_resolver_create (const char *name,
+                                         unsigned lifetime, unsigned retry,
+                                         teredo_resolver_cb cb, void *opaque)
+{
+	teredo_resolver *r = (teredo_resolver *)malloc (sizeof (*r));
+	if (r == NULL)
+		return NULL;
+
+	memset (r, 0, sizeof (*r));
+	r->cb = cb;
+	r->opaque = opaque;
+	r->lifetime = lifetime;
+	r->retry = retry;
+	r->name = strdup (name);
+	if (r->name == NULL)
+	{
+		free (r);
+		return NULL;
+	}
+
+	pthread_condattr_t attr;
+
+	pthread_condattr_init (&attr);
+	(void)pthread_condattr_setclock (&attr, CLOCK_MONOTONIC);
+	/* EINVAL: CLOCK_MONOTONIC unknown */
+	pthread_cond_init (&r->wakeup, &attr);
+	pthread_condattr_destroy (&attr);
+	pthread_mutex_init (&r->lock, NULL);
+
+	int err = pthread_create (&r->thread, NULL, resolver_thread, r);
+	if (err == 0)
+		return r;
+
+	errno = err;
+	syslog (LOG_ALERT, _("Error (%s): %m"), "pthread_create");
+
+	pthread_cond_destroy (&r->wakeup);
+	pthread_mutex_destroy (&r->lock);
+	free (r->name);
+	free (r);
+	return NULL;
+}
+
+
+void teredo_resolver_destroy (teredo_resolver *r)
+{
+	pthread_cancel (r->thread);
+	pthread_join (r->thread, NULL);
+
+	pthread_cond_destroy (&r->wakeup);
+	pthread_mutex_destroy (&r->lock);
+	free (r->name);
+	free (r);
+}
+
+
+unsigned teredo_resolver_get (teredo_resolver *r, unsigned n,
+                              uint32_t *ipv4)
+{
+	pthread_mutex_lock (&r->lock);
+	unsigned count = r->count;
+	if (count > 0)
+		*ipv4 = r->addrs[n % count];
+	pthread_mutex_unlock (&r->lock);
+
+	return count;
+}
+
+
+void teredo_resolver_refresh (teredo_resolver *r)
+{
+	pthread_mutex_lock (&r->lock);
+	r->refresh = true;
+	pthread_cond_signal (&r->wakeup);
+	pthread_mutex_unlock (&r->lock);
+}
@@ -0,0 +1,88 @@
+/*
+ * resolver.h - Asynchronous Teredo server name resolver
+ */
+
+/***********************************************************************
+ *  Copyright © 2004-2007 Rémi Denis-Courmont.                         *
+ *  This program is free software; you can redistribute and/or modify  *
+ *  it under the terms of the GNU General Public License as published  *
+ *  by the Free Software Foundation; version 2 of the license, or (at  *
+ *  your option) any later version.                                    *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *  See the GNU General Public License for more details.               *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, you can get it from:              *
+ *  http://www.gnu.org/copyleft/gpl.html                               *
+ ***********************************************************************/
+
+
+#ifndef LIBTEREDO_RESOLVER_H
+# define LIBTEREDO_RESOLVER_H
+
+/** Maximum number of cached IPv4 addresses per name */
+# define TEREDO_RESOLVER_MAX 16
+
+# ifdef __cplusplus
+extern "C" {
+# endif
+
+/**
+ * Asynchronous cached resolver of a Teredo server host name. A background
+ * thread resolves the name, keeps the global unicast IPv4 addresses, and
+ * resolves it again before they expire.
+ */
+typedef struct teredo_resolver teredo_resolver;
+
+/**
+ * Callback prototype for notifications of resolver cache updates.
+ * It is called from the resolver thread, with no locks held.
+ */
+typedef void (*teredo_resolver_cb) (void *opaque);
+
+/**
+ * Creates a resolver and starts resolving a host name.
+ *
+ * @param name host name or IPv4 address in dotted notation
+ * @param lifetime time (seconds) after which resolved addresses expire;
+ * they are resolved again after half that time
+ * @param retry time (seconds) between attempts after a failure
+ * @param cb cache update callback (or NULL)
+ * @param opaque data for @a cb
+ *
+ * @return NULL on error.
+ */
+teredo_resolver *teredo_resolver_create (const char *name,
+                                         unsigned lifetime, unsigned retry,
+                                         teredo_resolver_cb cb, void *opaque);
+
+/**
+ * Stops and destroys a resolver. The callback is not called anymore after
+ * this function returns.
+ */
+void teredo_resolver_destroy (teredo_resolver *r);
+
+/**
+ * Gets a cached address. Never blocks.
+ *
+ * @param n index of the address, modulo the number of cached addresses
+ * @param ipv4 [OUT] address (network byte order), if any
+ *
+ * @return the number of cached addresses, 0 if there are none (yet).
+ */
+unsigned teredo_resolver_get (teredo_resolver *r, unsigned n,
+                              uint32_t *ipv4);
+
+/**
+ * Requests that the name be resolved again as soon as possible, for
+ * instance when none of the cached addresses works.
+ */
+void teredo_resolver_refresh (teredo_resolver *r);
+
+# ifdef __cplusplus
+}
+# endif
+#endif /* ifndef LIBTEREDO_RESOLVER_H */
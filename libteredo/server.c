@@ -44,7 +44,9 @@
 #include <netinet/icmp6.h>
 #include <fcntl.h>
 #include <pthread.h>
+#include <poll.h>
 #include <syslog.h>
+#include <time.h>
 
 #include "server.h"
 #include "v4global.h"
@@ -54,121 +56,286 @@
 #include "checksum.h"
 #include "debug.h"
 #include "packets.h"
+#include "classify.h"
+#include "filter.h"
+#include "hitters.h"
 
-static pthread_mutex_t raw_mutex = PTHREAD_MUTEX_INITIALIZER;
-static int raw_fd; // raw IPv6 socket
-static unsigned raw_users = 0;
+/* Maximum number of packets per receive burst */
+#define SERVER_BURST 16
+
+/**
+ * Teredo-encapsulated Router Advertisement (without the Teredo headers).
+ */
+typedef struct teredo_ra
+{
+	struct ip6_hdr            ip6;
+	struct nd_router_advert   ra;
+	struct nd_opt_prefix_info pi;
+	struct nd_opt_mtu         mtu;
+} teredo_ra;
+
+typedef struct teredo_server_worker
+{
+	struct teredo_server *server;
+	pthread_t thread;
+	unsigned index; // socket index (for the worker address)
+	bool secondary; // whether the worker serves the secondary address
+	int raw_fd; // raw IPv6 socket
+	struct teredo_packet *packets; // receive buffers
+	struct pollfd *ufds; // worker sockets of each address pair
+} teredo_server_worker;
+
+/**
+ * Server primary and secondary addresses, and their sockets.
+ */
+typedef struct teredo_server_pair
+{
+	/* These are in network byte order */
+	uint32_t server_ip, server_ip2;
+
+	union teredo_addr lladdr; // server link-local IPv6 address
+
+	/*
+	 * UDP/IPv4 sockets: one per worker and per address, all the primary
+	 * address sockets first, then the secondary address ones.
+	 */
+	int *fds;
+} teredo_server_pair;
 
 struct teredo_server
 {
-	pthread_t t1, t2;
+	unsigned workers; // number of workers per server address
+	teredo_server_worker *threads;
 
-	int fd_primary, fd_secondary; // UDP/IPv4 sockets
+	teredo_server_pair **pairs;
+	unsigned npairs;
+
+	int *raw_fds; // raw IPv6 sockets, one per worker (same order)
+
+	teredo_hitters *hitters; // per-source packet rates
 
 	/* These are all in network byte order (including MTU!!) */
-	uint32_t server_ip, server_ip2, prefix, advLinkMTU;
+	uint32_t prefix, advLinkMTU;
 
-	union teredo_addr lladdr; // server link-local IPv6 address
+	/*
+	 * Router Advertisement template, toward the unspecified address, with
+	 * its checksum, and with zeroes instead of the server address of the
+	 * pair. Two buffers, so that changing the prefix or MTU does not alter
+	 * the template workers are copying.
+	 */
+	const teredo_ra *ra;
+	teredo_ra ra_buf[2];
 };
 
 /**
- * Sends a Teredo-encapsulated Router Advertisement.
+ * UDP/IPv4 replies to a burst of received packets, sent all at once when
+ * the whole burst has been processed. Each received packet causes at most
+ * one reply.
  */
-static bool
-SendRA (const teredo_server *restrict s, const struct teredo_packet *p,
-        const struct in6_addr *dest_ip6, bool secondary)
+typedef struct teredo_server_batch
 {
-	const uint8_t *nonce;
-	struct in6_addr *addr;
-	uint8_t auth[13] = { 0, 1 };
-	struct teredo_orig_ind orig;
-	struct
+	struct teredo_server_reply
 	{
-		struct ip6_hdr            ip6;
-		struct nd_router_advert   ra;
-		struct nd_opt_prefix_info pi;
-		struct nd_opt_mtu         mtu;
-	} ra;
-	struct iovec iov[] =
-	{
-		{ auth, 13 },
-		{ &orig, 8 },
-		{ &ra, sizeof (ra) }
-	};
+		uint8_t auth[13];
+		struct teredo_orig_ind orig;
+		teredo_ra ra;
+		struct iovec iov[3];
+	} replies[SERVER_BURST];
+	unsigned replies_count;
 
-	// Authentification header
-	// TODO: support for secure qualification
-	nonce = p->auth_nonce;
-	if (nonce != NULL)
-		memcpy (auth + 4, nonce, 8);
-	else
-		iov[0].iov_len = 0;
+	/* Datagrams to send from the primary and secondary addresses */
+	teredo_datagram dgv[2][SERVER_BURST];
+	unsigned count[2];
 
-	// Origin indication header
-	//memset (&orig, 0, sizeof (orig));
-	orig.orig_zero = 0;
-	orig.orig_code = teredo_orig_ind;
-	orig.orig_port = ~p->source_port; // obfuscate
-	orig.orig_addr = ~p->source_ipv4; // obfuscate
+	/* IPv6 packets to send from the raw IPv6 socket */
+	const struct ip6_hdr *raw[SERVER_BURST];
+	size_t raw_len[SERVER_BURST];
+	unsigned raw_count;
+
+	unsigned long now; // reception time (seconds)
+} teredo_server_batch;
+
+
+static inline int
+teredo_server_fd (const teredo_server *s, const teredo_server_pair *pair,
+                  bool secondary, unsigned i)
+{
+	return pair->fds[(secondary ? s->workers : 0) + i];
+}
+
+
+/**
+ * Queues an UDP/IPv4 datagram for sending from the primary or secondary
+ * server address.
+ */
+static inline void
+teredo_server_queue (teredo_server_batch *restrict b, bool secondary,
+                     const struct iovec *iov, size_t iovlen,
+                     uint32_t ip, uint16_t port)
+{
+	teredo_datagram *dg = &b->dgv[secondary][b->count[secondary]++];
+
+	dg->iov = iov;
+	dg->iovlen = iovlen;
+	dg->ip = ip;
+	dg->port = port;
+}
+
+
+/**
+ * Fills in a server link-local address. The client IPv4 address is left
+ * out if server_ip is zero.
+ */
+static void
+teredo_server_lladdr (union teredo_addr *lladdr, uint32_t server_ip)
+{
+	memset (lladdr, 0, sizeof (*lladdr));
+	lladdr->teredo.prefix = htonl (0xfe800000);
+	//lladdr->teredo.server_ip = 0;
+	lladdr->teredo.flags = htons (TEREDO_FLAG_CONE);
+	lladdr->teredo.client_port = ~htons (IPPORT_TEREDO);
+	lladdr->teredo.client_ip = server_ip ? ~server_ip : 0;
+}
+
+
+/**
+ * Builds the Router Advertisement template, from the current prefix and MTU.
+ */
+static void teredo_server_update_ra (teredo_server *s)
+{
+	teredo_ra *ra = s->ra_buf + (s->ra == s->ra_buf);
+	union teredo_addr *src;
+	struct in6_addr *addr;
 
 	// IPv6 header
-	memset (&ra, 0, sizeof (ra));
-	ra.ip6.ip6_flow = htonl (0x60000000);
-	ra.ip6.ip6_plen = htons (sizeof (ra) - sizeof (ra.ip6));
-	ra.ip6.ip6_nxt = IPPROTO_ICMPV6;
-	ra.ip6.ip6_hlim = 255;
-	ra.ip6.ip6_src = s->lladdr.ip6;
-	ra.ip6.ip6_dst = *dest_ip6;
+	memset (ra, 0, sizeof (*ra));
+	ra->ip6.ip6_flow = htonl (0x60000000);
+	ra->ip6.ip6_plen = htons (sizeof (*ra) - sizeof (ra->ip6));
+	ra->ip6.ip6_nxt = IPPROTO_ICMPV6;
+	ra->ip6.ip6_hlim = 255;
+	src = (union teredo_addr *)&ra->ip6.ip6_src;
+	teredo_server_lladdr (src, 0);
+	//ra->ip6.ip6_dst = in6addr_any;
 
 	// ICMPv6: Router Advertisement
-	ra.ra.nd_ra_type = ND_ROUTER_ADVERT;
-	//ra.ra.nd_ra_code = 0;
-	//ra.ra.nd_ra_cksum = 0;
-	//ra.ra.nd_ra_curhoplimit = 0;
-	//ra.ra.nd_ra_flags_reserved = 0;
-	//ra.ra.nd_ra_router_lifetime = 0;
-	//ra.ra.nd_ra_reachable = 0;
-	ra.ra.nd_ra_retransmit = htonl (2000);
+	ra->ra.nd_ra_type = ND_ROUTER_ADVERT;
+	//ra->ra.nd_ra_code = 0;
+	//ra->ra.nd_ra_cksum = 0;
+	//ra->ra.nd_ra_curhoplimit = 0;
+	//ra->ra.nd_ra_flags_reserved = 0;
+	//ra->ra.nd_ra_router_lifetime = 0;
+	//ra->ra.nd_ra_reachable = 0;
+	ra->ra.nd_ra_retransmit = htonl (2000);
 
 	// ICMPv6 option: Prefix information
-	ra.pi.nd_opt_pi_type = ND_OPT_PREFIX_INFORMATION;
-	ra.pi.nd_opt_pi_len = sizeof (ra.pi) >> 3;
-	ra.pi.nd_opt_pi_prefix_len = 64;
-	ra.pi.nd_opt_pi_flags_reserved = ND_OPT_PI_FLAG_AUTO;
-	ra.pi.nd_opt_pi_valid_time = 0xffffffff;
-	ra.pi.nd_opt_pi_preferred_time = 0xffffffff;
-	addr = &ra.pi.nd_opt_pi_prefix;
+	ra->pi.nd_opt_pi_type = ND_OPT_PREFIX_INFORMATION;
+	ra->pi.nd_opt_pi_len = sizeof (ra->pi) >> 3;
+	ra->pi.nd_opt_pi_prefix_len = 64;
+	ra->pi.nd_opt_pi_flags_reserved = ND_OPT_PI_FLAG_AUTO;
+	ra->pi.nd_opt_pi_valid_time = 0xffffffff;
+	ra->pi.nd_opt_pi_preferred_time = 0xffffffff;
+	addr = &ra->pi.nd_opt_pi_prefix;
 	memcpy (&addr->s6_addr[0], &s->prefix, sizeof (s->prefix));
-	memcpy (&addr->s6_addr[4], &s->server_ip, sizeof (s->server_ip));
-	//memset (addr->ip6.s6_addr + 8, 0, 8);
+	//memset (addr->ip6.s6_addr + 4, 0, 12);
 
 	// ICMPv6 option : MTU
-	ra.mtu.nd_opt_mtu_type = ND_OPT_MTU;
-	ra.mtu.nd_opt_mtu_len = sizeof (ra.mtu) >> 3;
-	//ra.mtu.nd_opt_mtu_reserved = 0;
-	ra.mtu.nd_opt_mtu_mtu = s->advLinkMTU;
+	ra->mtu.nd_opt_mtu_type = ND_OPT_MTU;
+	ra->mtu.nd_opt_mtu_len = sizeof (ra->mtu) >> 3;
+	//ra->mtu.nd_opt_mtu_reserved = 0;
+	ra->mtu.nd_opt_mtu_mtu = s->advLinkMTU;
+
+	// ICMPv6 checksum computation, without the addresses
+	ra->ra.nd_ra_cksum = icmp6_checksum (&ra->ip6,
+	                                     (struct icmp6_hdr *)&ra->ra);
+
+	__atomic_store_n (&s->ra, ra, __ATOMIC_RELEASE);
+}
+
+
+/**
+ * Adds 16-bits aligned data to a checksum computed with zeroes in its
+ * place (RFC 1624).
+ */
+static inline uint16_t cksum_add (uint16_t cksum, const void *data,
+                                  size_t len)
+{
+	const uint16_t *w = data;
+	uint32_t sum = cksum ^ 0xffff;
+
+	for (size_t i = 0; i < len / 2; i++)
+		sum += w[i];
+	while (sum > 0xffff)
+		sum = (sum & 0xffff) + (sum >> 16);
+
+	return sum ^ 0xffff;
+}
+
+
+/**
+ * Queues a Teredo-encapsulated Router Advertisement.
+ */
+static void
+SendRA (const teredo_server *restrict s, const teredo_server_pair *pair,
+        teredo_server_batch *restrict b, const struct teredo_packet *p,
+        const struct in6_addr *dest_ip6, bool secondary)
+{
+	struct teredo_server_reply *r = &b->replies[b->replies_count++];
+	const uint8_t *nonce;
+
+	r->iov[0].iov_base = r->auth;
+	r->iov[0].iov_len = 13;
+	r->iov[1].iov_base = &r->orig;
+	r->iov[1].iov_len = 8;
+	r->iov[2].iov_base = &r->ra;
+	r->iov[2].iov_len = sizeof (r->ra);
 
-	// ICMPv6 checksum computation
-	ra.ra.nd_ra_cksum = icmp6_checksum (&ra.ip6, (struct icmp6_hdr *)&ra.ra);
+	// Authentification header
+	// TODO: support for secure qualification
+	nonce = p->auth_nonce;
+	if (nonce != NULL)
+	{
+		memset (r->auth, 0, sizeof (r->auth));
+		r->auth[1] = 1;
+		memcpy (r->auth + 4, nonce, 8);
+	}
+	else
+		r->iov[0].iov_len = 0;
+
+	// Origin indication header
+	//memset (&r->orig, 0, sizeof (r->orig));
+	r->orig.orig_zero = 0;
+	r->orig.orig_code = teredo_orig_ind;
+	r->orig.orig_port = ~p->source_port; // obfuscate
+	r->orig.orig_addr = ~p->source_ipv4; // obfuscate
+
+	// Router Advertisement, only the addresses change
+	r->ra = *__atomic_load_n (&s->ra, __ATOMIC_ACQUIRE);
+	r->ra.ip6.ip6_src = pair->lladdr.ip6;
+	r->ra.ip6.ip6_dst = *dest_ip6;
+	memcpy (&r->ra.pi.nd_opt_pi_prefix.s6_addr[4], &pair->server_ip,
+	        sizeof (pair->server_ip));
+
+	uint16_t cksum = r->ra.ra.nd_ra_cksum;
+	cksum = cksum_add (cksum, &pair->lladdr.teredo.client_ip, 4);
+	cksum = cksum_add (cksum, &pair->server_ip, 4);
+	r->ra.ra.nd_ra_cksum = cksum_add (cksum, dest_ip6, 16);
 
 	if (IN6_IS_TEREDO_ADDR_CONE (dest_ip6))
 		secondary = !secondary;
 
-	return teredo_sendv (secondary ? s->fd_secondary : s->fd_primary,
-	                     iov, 3, p->source_ipv4, p->source_port) > 0;
+	teredo_server_queue (b, secondary, r->iov, 3, p->source_ipv4,
+	                     p->source_port);
 }
 
 
 /**
- * Forwards a Teredo packet to a client
+ * Queues a Teredo packet for forwarding to a client, from the primary
+ * server address.
  */
 static bool
-teredo_forward_udp (int fd, const struct teredo_packet *packet,
-                       bool insert_orig)
+teredo_forward_udp (teredo_server_batch *restrict b,
+                    const struct teredo_packet *packet, bool insert_orig)
 {
-	struct teredo_orig_ind orig;
-	struct iovec iov[2];
-
 	/* extract the IPv4 destination directly from the Teredo IPv6 destination
 	   within the IPv6 header */
 	uint32_t dest_ipv4 = IN6_TEREDO_IPV4 (&packet->ip6->ip6_dst);
@@ -176,50 +343,141 @@ teredo_forward_udp (int fd, const struct teredo_packet *packet,
 	if (!is_ipv4_global_unicast (dest_ipv4))
 		return 0; // ignore invalid client IP
 
+	struct teredo_server_reply *r = &b->replies[b->replies_count++];
+	struct iovec *iov = r->iov;
+
 	// Origin indication header
 	// if the Teredo server's address is ours
 	// NOTE: I wonder in which legitimate case insert_orig might be
 	// false... but the spec implies it could
-	iov[0].iov_base = &orig;
+	iov[0].iov_base = &r->orig;
 	if (insert_orig)
 	{
-		iov[0].iov_len = sizeof (orig);
-		orig.orig_zero = 0;
-		orig.orig_code = teredo_orig_ind;
-		orig.orig_port = ~packet->source_port; // obfuscate
-		orig.orig_addr = ~packet->source_ipv4; // obfuscate
+		iov[0].iov_len = sizeof (r->orig);
+		r->orig.orig_zero = 0;
+		r->orig.orig_code = teredo_orig_ind;
+		r->orig.orig_port = ~packet->source_port; // obfuscate
+		r->orig.orig_addr = ~packet->source_ipv4; // obfuscate
 	}
 	else
 		iov[0].iov_len = 0;
 
+	/* The receive buffer is not reused until the batch is sent */
 	iov[1].iov_base = packet->ip6;
 	iov[1].iov_len = packet->ip6_len;
 
-	return teredo_sendv (fd, iov, 2, dest_ipv4, dest_port) > 0;
+	teredo_server_queue (b, false, iov, 2, dest_ipv4, dest_port);
+	return true;
 }
 
 
 /**
- * Sends an IPv6 packet of *payload* length <plen> with a raw IPv6 socket.
+ * Opens a non-blocking raw IPv6 socket for sending.
  */
-static bool
-teredo_send_ipv6 (const struct ip6_hdr *p, size_t len)
+static int teredo_raw_socket (void)
 {
-	struct sockaddr_in6 dst;
+	int fd = socket (AF_INET6, SOCK_RAW, IPPROTO_RAW);
+	if (fd == -1)
+		return -1;
+
+	int flags = fcntl (fd, F_GETFL, 0);
+	//shutdown (fd, SHUT_RD); -- won't work
+	fcntl (fd, F_SETFL, O_NONBLOCK | ((flags != -1) ? flags : 0));
+	fcntl (fd, F_SETFD, FD_CLOEXEC);
+#ifdef IPV6_RECVERR
+	/* ICMPv6 errors are queued, and dequeued by teredo_raw_recverr() */
+	setsockopt (fd, IPPROTO_IPV6, IPV6_RECVERR, &(int){ 1 }, sizeof (int));
+#endif
+	return fd;
+}
 
-	memset (&dst, 0, sizeof (dst));
-	dst.sin6_family = AF_INET6;
+
+/**
+ * Discards the ICMPv6 errors queued on a raw IPv6 socket. Never blocks.
+ * Errors cannot be reported to anyone, as the server does not keep track
+ * of the packets it forwarded.
+ * @return the number of discarded errors.
+ */
+static unsigned teredo_raw_recverr (int fd)
+{
+	unsigned i = 0;
+#ifdef MSG_ERRQUEUE
+	struct msghdr msg;
+
+	memset (&msg, 0, sizeof (msg));
+	while ((i < SERVER_BURST)
+	    && (recvmsg (fd, &msg, MSG_ERRQUEUE|MSG_DONTWAIT) != -1))
+		i++;
+#else
+	(void)fd;
+#endif
+	return i;
+}
+
+
+/**
+ * Queues an IPv6 packet for sending with a raw IPv6 socket.
+ */
+static inline void
+teredo_queue_ipv6 (teredo_server_batch *restrict b,
+                   const struct ip6_hdr *p, size_t len)
+{
+	b->raw[b->raw_count] = p;
+	b->raw_len[b->raw_count++] = len;
+}
+
+
+/**
+ * Sends the IPv6 packets queued with teredo_queue_ipv6() without blocking.
+ * Packets rejected because of a pending ICMPv6 error, caused by an earlier
+ * packet, are retried up to ten times; packets rejected on their own are
+ * skipped; packets which do not fit in the socket send buffer are dropped.
+ */
+static void teredo_send_ipv6 (int fd, teredo_server_batch *restrict b)
+{
+	struct sockaddr_in6 dst[SERVER_BURST];
+	unsigned count = b->raw_count;
+
+	memset (dst, 0, count * sizeof (dst[0]));
+	for (unsigned i = 0; i < count; i++)
+	{
+		dst[i].sin6_family = AF_INET6;
 #ifdef HAVE_SA_LEN
-	dst.sin6_len = sizeof (dst);
+		dst[i].sin6_len = sizeof (dst[i]);
 #endif
-	dst.sin6_addr = p->ip6_dst;
+		dst[i].sin6_addr = b->raw[i]->ip6_dst;
+	}
 
-	for (int tries = 0; tries < 10; tries++)
+	for (unsigned i = 0, tries = 0; i < count;)
 	{
-		ssize_t res = sendto (raw_fd, p, len, 0,
-		                      (struct sockaddr *)&dst, sizeof (dst));
-		if (res != -1)
-			return res == (ssize_t)len;
+#if defined (__linux__) && defined (MSG_WAITFORONE)
+		struct mmsghdr msg[SERVER_BURST];
+		struct iovec iov[SERVER_BURST];
+		unsigned n = count - i;
+
+		memset (msg, 0, n * sizeof (msg[0]));
+		for (unsigned j = 0; j < n; j++)
+		{
+			iov[j].iov_base = (void *)b->raw[i + j];
+			iov[j].iov_len = b->raw_len[i + j];
+			msg[j].msg_hdr.msg_name = dst + i + j;
+			msg[j].msg_hdr.msg_namelen = sizeof (dst[0]);
+			msg[j].msg_hdr.msg_iov = iov + j;
+			msg[j].msg_hdr.msg_iovlen = 1;
+		}
+
+		int res = sendmmsg (fd, msg, n, MSG_DONTWAIT);
+#else
+		int res = (sendto (fd, b->raw[i], b->raw_len[i], MSG_DONTWAIT,
+		                   (struct sockaddr *)(dst + i),
+		                   sizeof (dst[i])) != -1) ? 1 : -1;
+#endif
+		if (res > 0)
+		{
+			i += res;
+			tries = 0;
+			continue;
+		}
 
 		switch (errno)
 		{
@@ -232,14 +490,48 @@ teredo_send_ipv6 (const struct ip6_hdr *p, size_t len)
 #ifdef EPROTO
 			case EPROTO: /* ICMPv6 param prob (and other errors) */
 #endif
-				break;
-
-			default:
-				return false;
+				/*
+				 * A queued error comes from an earlier packet: this one
+				 * was not sent, retry it. If no error was queued, the
+				 * error is about this very packet (e.g. local EMSGSIZE):
+				 * skip it.
+				 */
+				if ((teredo_raw_recverr (fd) == 0) || (++tries >= 10))
+				{
+					i++;
+					tries = 0;
+				}
+				continue;
 		}
+		break; // send buffer full or fatal error: drop the rest
 	}
 
-	return false;
+	b->raw_count = 0;
+}
+
+
+/**
+ * Sends the queued replies to a burst of packets.
+ *
+ * @param w worker which received the burst. Replies from the server address
+ * the worker serves are sent from the worker socket, others from the
+ * socket of the same index for the other address of the pair. IPv6 packets are sent
+ * from the worker raw IPv6 socket.
+ */
+static void
+teredo_server_flush (const teredo_server_worker *w,
+                     const teredo_server_pair *pair,
+                     teredo_server_batch *restrict b)
+{
+	if (b->raw_count > 0)
+		teredo_send_ipv6 (w->raw_fd, b);
+
+	for (unsigned i = 0; i < 2; i++)
+		if (b->count[i] > 0)
+			teredo_sendmv (teredo_server_fd (w->server, pair, i, w->index),
+			               b->dgv[i], b->count[i]);
+
+	b->replies_count = b->count[0] = b->count[1] = 0;
 }
 
 
@@ -279,126 +571,141 @@ static void debug_error_header (const uint32_t *v4src,
 # define debug_error_header(a, b, c) (void)0
 #endif
 
+/**
+ * @return whether an IPv4 address is one of the server addresses.
+ */
+static bool teredo_server_is_local (const teredo_server *s, uint32_t ip)
+{
+	for (unsigned i = 0; i < s->npairs; i++)
+		if ((s->pairs[i]->server_ip == ip) || (s->pairs[i]->server_ip2 == ip))
+			return true;
+	return false;
+}
+
+
 /**
  * Checks and handles an Teredo-encapsulated packet.
  * Thread-safety note: prefix and advLinkMTU might be changed by another
  * thread.
+ * @param pair server addresses the packet was received on
+ * @param b replies batch, to be sent with teredo_server_flush()
+ * @param verdict packet classification (see teredo_classify())
  * @return -1 in case of I/O error, -2 if the packet was discarded,
  * 1 if it was processed as a qualification probe,
- * 2 if it was processed as a request for direct IPv6 connectivity check,
- * 3 if it was forwarded over UDP/IPv4 (hole punching).
+ * 2 if it was queued as a request for direct IPv6 connectivity check,
+ * 3 if it was queued for forwarding over UDP/IPv4 (hole punching).
  */
 static int
-teredo_process_packet (const teredo_server *s, bool sec)
+teredo_process_packet (const teredo_server *s, const teredo_server_pair *pair,
+                       teredo_server_batch *b, bool sec,
+                       const struct teredo_packet *restrict packet,
+                       uint8_t verdict)
 {
-	struct teredo_packet packet;
-
-	if (teredo_wait_recv (sec ? s->fd_secondary : s->fd_primary, &packet))
-		return -1;
-
 	// Check IPv6 packet (Teredo server case number 1)
-	const struct ip6_hdr *ip6 = packet.ip6;
-	if (packet.ip6_len < sizeof (*ip6))
+	const struct ip6_hdr *ip6 = packet->ip6;
+	if (!(verdict & TEREDO_CLASS_VALID))
      	{
-		debug_error_header (&packet.source_ipv4, NULL, NULL);
-		debug ("Packet too small: %d bytes", packet.ip6_len);
-		return -2; // too small
+		debug_error_header (&packet->source_ipv4, NULL, NULL);
+		debug ("Not an IPv6 packet: %zu bytes", packet->ip6_len);
+		return -2; // not an IPv6 packet
 	}
 
 	size_t plen = ntohs (ip6->ip6_plen);
-	if (((ip6->ip6_vfc >> 4) != 6)
-	 || ((sizeof (*ip6) + plen) > packet.ip6_len))
-     	{
-		debug_error_header (&packet.source_ipv4, NULL, NULL);
-		debug ("Not an IPv6 packet: Version %d", ip6->ip6_vfc >> 4);
-		return -2; // not an IPv6 packet
-	}
 
 	// NOTE: ptr is not aligned => read single bytes only
 
 	// Teredo server case number 2
-	if (!IsBubble (ip6) // neither a bubble...
-	 && (ip6->ip6_nxt != IPPROTO_ICMPV6)) // nor an ICMPv6 message
+	if (!(verdict & (TEREDO_CLASS_BUBBLE // neither a bubble...
+	               | TEREDO_CLASS_ICMPV6))) // nor an ICMPv6 message
      	{
-		debug_error_header (&packet.source_ipv4,
+		debug_error_header (&packet->source_ipv4,
 		                    &ip6->ip6_src, &ip6->ip6_dst);
 		debug ("Packet not allowed: Protocol %d", ip6->ip6_nxt);
 		return -2; // packet not allowed through server
 	}
 
 	// Teredo server case number 3
-	if (!is_ipv4_global_unicast (packet.source_ipv4))
+	if (!is_ipv4_global_unicast (packet->source_ipv4))
      	{
-	   	debug_error_header (&packet.source_ipv4,
+	   	debug_error_header (&packet->source_ipv4,
 		                    &ip6->ip6_src, &ip6->ip6_dst);
 		debug ("Source is not IPv4 unicast.");
 		return -2;
 	}
 
-	const uint32_t myprefix = s->prefix;
-
 	// Teredo server case number 4
-	if (IN6_IS_ADDR_LINKLOCAL (&ip6->ip6_src)
+	if ((verdict & TEREDO_CLASS_SRC_LINKLOCAL)
 	 && IN6_ARE_ADDR_EQUAL (&in6addr_allrouters, &ip6->ip6_dst)
-	 && (ip6->ip6_nxt == IPPROTO_ICMPV6)
+	 && (verdict & TEREDO_CLASS_ICMPV6)
 	 && (plen >= sizeof (struct nd_router_solicit))
 	 && (((const struct icmp6_hdr *)(ip6 + 1))->icmp6_type == ND_ROUTER_SOLICIT))
 		goto accept;
 
-	if (IN6_TEREDO_PREFIX (&ip6->ip6_src) == myprefix)
+	if (verdict & TEREDO_CLASS_SRC_TEREDO)
 	{
 		/** Source address is Teredo **/
 		// Teredo server case number 5
-		if (IN6_MATCHES_TEREDO_CLIENT (&ip6->ip6_src, packet.source_ipv4,
-		                               packet.source_port))
+		if (IN6_MATCHES_TEREDO_CLIENT (&ip6->ip6_src, packet->source_ipv4,
+		                               packet->source_port))
 			goto accept;
 	}
 	else
 	{
 		/** Source address is NOT Teredo **/
 		// Teredo server case number 6
-		if ((IN6_TEREDO_PREFIX (&ip6->ip6_dst) == myprefix)
-		 && (IN6_TEREDO_SERVER (&ip6->ip6_dst) == s->server_ip))
+		if ((verdict & TEREDO_CLASS_DST_TEREDO)
+		 && (IN6_TEREDO_SERVER (&ip6->ip6_dst) == pair->server_ip))
 			goto accept;
 	}
 
 	// Teredo server case number 7
-	debug_error_header (&packet.source_ipv4, &ip6->ip6_src, &ip6->ip6_dst);
+	debug_error_header (&packet->source_ipv4, &ip6->ip6_src, &ip6->ip6_dst);
 	debug ("Drop packet.");
 	return -2;
 
 accept:
 	/** Packet "accepted" for processing **/
 
+	/* Throttles the busiest sources before doing any work for them */
+	if (teredo_hitters_count (s->hitters, packet->source_ipv4, b->now))
+	{
+		debug_error_header (&packet->source_ipv4, &ip6->ip6_src,
+		                    &ip6->ip6_dst);
+		debug ("Source exceeds the rate limit");
+		return -2;
+	}
+
 	/* Security fix: Prevent infinite local UDP packet loops */
-	if (((packet.source_ipv4 == s->server_ip)
-	  || (packet.source_ipv4 == s->server_ip2))
-	 && (packet.source_port == htons (IPPORT_TEREDO)))
+	if ((packet->source_port == htons (IPPORT_TEREDO))
+	 && teredo_server_is_local (s, packet->source_ipv4))
      	{
-	   	debug_error_header (&packet.source_ipv4, &ip6->ip6_src,
+	   	debug_error_header (&packet->source_ipv4, &ip6->ip6_src,
 		                    &ip6->ip6_dst);
 		debug ("Prevent infinite local UDP packet loops from port %d",
-		       ntohs (packet.source_port));
+		       ntohs (packet->source_port));
 		return -2;
 	}
 
 	if (IN6_ARE_ADDR_EQUAL (&in6addr_allrouters, &ip6->ip6_dst)
-	 || IN6_ARE_ADDR_EQUAL (&s->lladdr.ip6, &ip6->ip6_dst))
+	 || IN6_ARE_ADDR_EQUAL (&pair->lladdr.ip6, &ip6->ip6_dst))
 	{
 		const struct icmp6_hdr *icmp = (const struct icmp6_hdr *)(ip6 + 1);
 
 		if ((ip6->ip6_nxt == IPPROTO_ICMPV6)
 		 && (plen >= sizeof (struct nd_router_solicit))
 		 && (icmp->icmp6_type == ND_ROUTER_SOLICIT))
-			return SendRA (s, &packet, &ip6->ip6_src, sec) ? 1 : -1;
+		{
+			SendRA (s, pair, b, packet, &ip6->ip6_src, sec);
+			return 1;
+		}
 		if(ip6->ip6_nxt == IPPROTO_ICMPV6)
 	     	{
-			debug_error_header(&packet.source_ipv4,
+			debug_error_header(&packet->source_ipv4,
 			                   &ip6->ip6_src, &ip6->ip6_dst);
 			debug ("Unhandled router message: ICMP type %d",
 			       icmp->icmp6_type);
 		} else {
-			debug_error_header(&packet.source_ipv4,
+			debug_error_header(&packet->source_ipv4,
 			                   &ip6->ip6_src, &ip6->ip6_dst);
 			debug ("Unhandled router message: Protocol %d",
 			       ip6->ip6_nxt);
@@ -409,7 +716,7 @@ accept:
 	/* Servers must not forward packets with non-global destination */
 	if (!IN6_IS_ADDR_GLOBAL (&ip6->ip6_dst))
      	{
-		debug_error_header (&packet.source_ipv4,
+		debug_error_header (&packet->source_ipv4,
 		                    &ip6->ip6_src, &ip6->ip6_dst);
 		debug ("Destination is no global IPv6 address");
 		return -2;
@@ -431,19 +738,21 @@ accept:
 	 */
 	if ((ip6->ip6_nxt != IPPROTO_NONE) && (plen > 88))
      	{
-		debug_error_header (&packet.source_ipv4,
+		debug_error_header (&packet->source_ipv4,
 		                    &ip6->ip6_src, &ip6->ip6_dst);
 		debug ("ICMPv6 too large (%zu bytes)", plen);
 		return -2;
 	}
 
-	if (IN6_TEREDO_PREFIX (&ip6->ip6_dst) != myprefix)
-		return teredo_send_ipv6 (packet.ip6,
-		                         sizeof (*ip6) + plen) ? 2 : -1;
+	if (!(verdict & TEREDO_CLASS_DST_TEREDO))
+	{
+		teredo_queue_ipv6 (b, packet->ip6, sizeof (*ip6) + plen);
+		return 2;
+	}
 
 	// Forwards packet over Teredo (destination is a Teredo IPv6 address)
-	return teredo_forward_udp (s->fd_primary, &packet,
-		IN6_TEREDO_SERVER (&ip6->ip6_dst) == s->server_ip) ? 3 : -1;
+	return teredo_forward_udp (b, packet,
+		IN6_TEREDO_SERVER (&ip6->ip6_dst) == pair->server_ip) ? 3 : -1;
 }
 
 
@@ -464,59 +773,106 @@ int teredo_server_check (char *errmsg, size_t len)
 }
 
 
-static LIBTEREDO_NORETURN void *thread_primary (void *data)
+static unsigned long teredo_server_clock (void)
 {
-	for (;;)
-	{
-		pthread_testcancel ();
-		teredo_process_packet ((teredo_server *)data, false);
-	}
+#ifdef CLOCK_MONOTONIC_COARSE
+	struct timespec ts;
+
+	if (clock_gettime (CLOCK_MONOTONIC_COARSE, &ts) == 0)
+		return ts.tv_sec;
+#endif
+	return time (NULL);
 }
 
 
-static LIBTEREDO_NORETURN void *thread_secondary (void *data)
+/**
+ * Classifies and handles a burst of packets received on one of the
+ * sockets of an address pair, then sends the replies all at once.
+ */
+static void
+teredo_server_burst (const teredo_server_worker *w,
+                     const teredo_server_pair *pair,
+                     teredo_server_batch *restrict b, unsigned n)
 {
-	for (;;)
-	{
-		pthread_testcancel ();
-		teredo_process_packet ((teredo_server *)data, true);
-	}
+	const teredo_server *s = w->server;
+	const struct teredo_packet *pv[SERVER_BURST];
+	uint8_t verdicts[SERVER_BURST];
+
+	for (unsigned i = 0; i < n; i++)
+		pv[i] = w->packets + i;
+	teredo_classify (pv, n, s->prefix, verdicts);
+	b->now = teredo_server_clock ();
+
+	for (unsigned i = 0; i < n; i++)
+		teredo_process_packet (s, pair, b, w->secondary, w->packets + i,
+		                       verdicts[i]);
+	teredo_server_flush (w, pair, b);
 }
 
 
-teredo_server *teredo_server_create (uint32_t ip1, uint32_t ip2)
+/**
+ * Receives bursts of packets from the worker sockets.
+ */
+static LIBTEREDO_NORETURN void *teredo_server_thread (void *data)
 {
-	(void)bindtextdomain (PACKAGE_NAME, LOCALEDIR);
+	const teredo_server_worker *w = data;
+	const teredo_server *s = w->server;
+	teredo_server_batch batch;
 
-	/* Initializes shared raw IPv6 socket */
-	pthread_mutex_lock (&raw_mutex);
-	if (raw_users == UINT_MAX) /* integer overflow */
-	{
-		/* piece of code that will probably never ever be executed */
-		pthread_mutex_unlock (&raw_mutex);
-		return NULL;
-	}
-	if (raw_users++ == 0)
+	batch.replies_count = batch.count[0] = batch.count[1] = 0;
+	batch.raw_count = 0;
+
+	if (s->npairs == 1)
 	{
-		raw_fd = socket (AF_INET6, SOCK_RAW, IPPROTO_RAW);
-		if (raw_fd != -1)
+		/* Only one socket: no need to poll */
+		const teredo_server_pair *pair = s->pairs[0];
+		int fd = teredo_server_fd (s, pair, w->secondary, w->index);
+
+		for (;;)
 		{
-			int flags = fcntl (raw_fd, F_GETFL, 0);
-			//shutdown (fd, SHUT_RD); -- won't work
-			fcntl (raw_fd, F_SETFL,
-			       O_NONBLOCK | ((flags != -1) ? flags : 0));
-			fcntl (raw_fd, F_SETFD, FD_CLOEXEC);
+			pthread_testcancel ();
+			int n = teredo_wait_recv_burst (fd, w->packets, SERVER_BURST);
+			if (n > 0)
+				teredo_server_burst (w, pair, &batch, n);
 		}
 	}
-	pthread_mutex_unlock (&raw_mutex);
 
-	if (raw_fd == -1)
+	for (;;)
 	{
-		syslog (LOG_ERR, _("Raw IPv6 socket not working: %m"));
-		return NULL;
+		/* One burst per ready socket, so that no pair starves others */
+		if (poll (w->ufds, s->npairs, -1) <= 0)
+			continue;
+
+		for (unsigned i = 0; i < s->npairs; i++)
+		{
+			if (!(w->ufds[i].revents & POLLIN))
+				continue;
+
+			int n = teredo_recv_burst (w->ufds[i].fd, w->packets,
+			                           SERVER_BURST);
+			if (n > 0)
+				teredo_server_burst (w, s->pairs[i], &batch, n);
+		}
 	}
+}
+
 
-	/* Initializes exclusive UDP/IPv4 sockets */
+static void teredo_server_pair_destroy (teredo_server_pair *pair,
+                                        unsigned workers)
+{
+	for (unsigned i = 0; i < 2 * workers; i++)
+		teredo_close (pair->fds[i]);
+	free (pair->fds);
+	free (pair);
+}
+
+
+/**
+ * Opens the sockets of an address pair.
+ */
+static teredo_server_pair *
+teredo_server_pair_create (uint32_t ip1, uint32_t ip2, unsigned workers)
+{
 	if (!is_ipv4_global_unicast (ip1) || !is_ipv4_global_unicast (ip2))
 	{
 		syslog (LOG_ERR, _("Teredo server UDP socket error: "
@@ -524,58 +880,162 @@ teredo_server *teredo_server_create (uint32_t ip1, uint32_t ip2)
 		return NULL;
 	}
 
-	teredo_server *s = malloc (sizeof (*s));
+	teredo_server_pair *pair = malloc (sizeof (*pair));
+	if (pair == NULL)
+		return NULL;
 
-	if (s != NULL)
+	pair->server_ip = ip1;
+	pair->server_ip2 = ip2;
+	teredo_server_lladdr (&pair->lladdr, ip1);
+
+	pair->fds = malloc (2 * workers * sizeof (*pair->fds));
+	if (pair->fds != NULL)
 	{
-		int fd;
+		unsigned i;
+		bool filter_ok = true;
 
-		memset (s, 0, sizeof (*s));
-		s->server_ip = ip1;
-		s->server_ip2 = ip2;
-		s->prefix = htonl (TEREDO_PREFIX);
-		s->advLinkMTU = htonl (1280);
-		s->lladdr.teredo.prefix = htonl (0xfe800000);
-		//s->lladdr.teredo.server_ip = 0;
-		s->lladdr.teredo.flags = htons (TEREDO_FLAG_CONE);
-		s->lladdr.teredo.client_port = ~htons (IPPORT_TEREDO);
-		s->lladdr.teredo.client_ip = ~s->server_ip;
-
-		fd = s->fd_primary = teredo_socket (ip1, htons (IPPORT_TEREDO));
-		if (fd != -1)
+		for (i = 0; i < 2 * workers; i++)
 		{
-			fd = s->fd_secondary = teredo_socket (ip2, htons (IPPORT_TEREDO));
-			if (fd != -1)
-				return s;
-			else
+			uint32_t ip = (i < workers) ? ip1 : ip2;
+
+			/*
+			 * Sockets are only shared among workers if there are
+			 * several, so that a single server still detects address
+			 * conflicts with other processes.
+			 */
+			int fd = (workers > 1)
+				? teredo_socket_shared (ip, htons (IPPORT_TEREDO))
+				: teredo_socket (ip, htons (IPPORT_TEREDO));
+			if (fd == -1)
 			{
 				char str[INET_ADDRSTRLEN];
 
-				inet_ntop (AF_INET, &ip2, str, sizeof (str));
+				inet_ntop (AF_INET, &ip, str, sizeof (str));
 				syslog (LOG_ERR, _("Error (%s): %m"), str);
+				break;
 			}
+			pair->fds[i] = fd;
 
-			teredo_close (s->fd_primary);
+			/* Drop junk in the kernel, if supported */
+			if (teredo_filter_attach (fd))
+				filter_ok = false;
 		}
-		else
+
+		if (i == 2 * workers)
 		{
-			char str[INET_ADDRSTRLEN];
+			if (!filter_ok)
+				syslog (LOG_WARNING, _("Teredo server socket filter "
+				        "error: %m"));
+			return pair;
+		}
+
+		while (i > 0)
+			teredo_close (pair->fds[--i]);
+		free (pair->fds);
+	}
+	free (pair);
+	return NULL;
+}
+
+
+int teredo_server_add_pair (teredo_server *s, uint32_t ip1, uint32_t ip2)
+{
+	if (teredo_server_is_local (s, ip1) || teredo_server_is_local (s, ip2))
+	{
+		char str[INET_ADDRSTRLEN];
+
+		inet_ntop (AF_INET, teredo_server_is_local (s, ip1) ? &ip1 : &ip2,
+		           str, sizeof (str));
+		syslog (LOG_ERR, _("Teredo server address %s used twice"), str);
+		return -1;
+	}
+
+	teredo_server_pair **tab = realloc (s->pairs,
+	                                    (s->npairs + 1) * sizeof (*tab));
+	if (tab == NULL)
+		return -1;
+	s->pairs = tab;
+
+	teredo_server_pair *pair = teredo_server_pair_create (ip1, ip2,
+	                                                      s->workers);
+	if (pair == NULL)
+		return -1;
+
+	tab[s->npairs++] = pair;
+	return 0;
+}
 
-			inet_ntop (AF_INET, &ip1, str, sizeof (str));
-			syslog (LOG_ERR, _("Error (%s): %m"), str);
+
+unsigned teredo_server_get_pairs (const teredo_server *s)
+{
+	return s->npairs;
+}
+
+
+teredo_server *
+teredo_server_create_workers (uint32_t ip1, uint32_t ip2, unsigned workers)
+{
+	(void)bindtextdomain (PACKAGE_NAME, LOCALEDIR);
+
+	if ((workers == 0) || (workers > UINT_MAX / 2))
+		return NULL;
+
+	teredo_server *s = malloc (sizeof (*s));
+
+	if (s != NULL)
+	{
+		memset (s, 0, sizeof (*s));
+		s->workers = workers;
+		s->prefix = htonl (TEREDO_PREFIX);
+		s->advLinkMTU = htonl (1280);
+		teredo_server_update_ra (s);
+
+		s->raw_fds = malloc (2 * workers * sizeof (*s->raw_fds));
+		s->hitters = teredo_hitters_create (0);
+		if ((s->raw_fds != NULL) && (s->hitters != NULL))
+		{
+			unsigned i;
+
+			/* Raw IPv6 sockets need privileges */
+			for (i = 0; i < 2 * workers; i++)
+			{
+				s->raw_fds[i] = teredo_raw_socket ();
+				if (s->raw_fds[i] == -1)
+				{
+					syslog (LOG_ERR, _("Raw IPv6 socket not working: %m"));
+					break;
+				}
+			}
+
+			if ((i == 2 * workers) && !teredo_server_add_pair (s, ip1, ip2))
+				return s;
+
+			while (i > 0)
+				close (s->raw_fds[--i]);
 		}
 
+		if (s->hitters != NULL)
+			teredo_hitters_destroy (s->hitters);
+		free (s->raw_fds);
+		free (s->pairs);
 		free (s);
 	}
 	return NULL;
 }
 
 
+teredo_server *teredo_server_create (uint32_t ip1, uint32_t ip2)
+{
+	return teredo_server_create_workers (ip1, ip2, 1);
+}
+
+
 int teredo_server_set_prefix (teredo_server *s, uint32_t prefix)
 {
 	if (is_valid_teredo_prefix (prefix))
 	{
 		s->prefix = prefix;
+		teredo_server_update_ra (s);
 		return 0;
 	}
 	return -1;
@@ -593,6 +1053,7 @@ int teredo_server_set_MTU (teredo_server *s, uint16_t mtu)
 		return -1;
 
 	s->advLinkMTU = htonl (mtu);
+	teredo_server_update_ra (s);
 	return 0;
 }
 
@@ -603,37 +1064,126 @@ uint16_t teredo_server_get_MTU (const teredo_server *s)
 }
 
 
+unsigned long teredo_server_get_drops (const teredo_server *s)
+{
+	unsigned long drops = 0;
+
+	for (unsigned i = 0; i < s->npairs; i++)
+		for (unsigned j = 0; j < 2 * s->workers; j++)
+			drops += teredo_filter_drops (s->pairs[i]->fds[j]);
+	return drops;
+}
+
+
+void teredo_server_set_rate_limit (teredo_server *s, unsigned long rate)
+{
+	teredo_hitters_set_limit (s->hitters, rate);
+}
+
+
+unsigned long teredo_server_get_throttled (const teredo_server *s)
+{
+	return teredo_hitters_throttled (s->hitters);
+}
+
+
+unsigned teredo_server_get_talkers (const teredo_server *s,
+                                    teredo_talker *tab, unsigned max)
+{
+	return teredo_hitters_top (s->hitters, tab, max);
+}
+
+
+unsigned teredo_server_get_workers (const teredo_server *s)
+{
+	return s->workers;
+}
+
+
 int teredo_server_start (teredo_server *s)
 {
-	if (pthread_create (&s->t1, NULL, thread_primary, s) == 0)
+	unsigned n = 2 * s->workers, i;
+
+	s->threads = calloc (n, sizeof (*s->threads));
+	if (s->threads == NULL)
+		return -1;
+
+	for (i = 0; i < n; i++)
 	{
-		if (pthread_create (&s->t2, NULL, thread_secondary, s) == 0)
-			return 0;
-		pthread_cancel (s->t1);
-		pthread_join (s->t1, NULL);
+		teredo_server_worker *w = s->threads + i;
+
+		w->server = s;
+		w->secondary = i >= s->workers;
+		w->index = w->secondary ? (i - s->workers) : i;
+		w->raw_fd = s->raw_fds[i];
+		w->packets = malloc (SERVER_BURST * sizeof (*w->packets));
+		w->ufds = malloc (s->npairs * sizeof (*w->ufds));
+		if ((w->packets == NULL) || (w->ufds == NULL))
+		{
+			free (w->ufds);
+			free (w->packets);
+			break;
+		}
+
+		for (unsigned j = 0; j < s->npairs; j++)
+		{
+			w->ufds[j].fd = teredo_server_fd (s, s->pairs[j], w->secondary,
+			                                  w->index);
+			w->ufds[j].events = POLLIN;
+		}
+
+		if (pthread_create (&w->thread, NULL, teredo_server_thread, w))
+		{
+			free (w->ufds);
+			free (w->packets);
+			break;
+		}
 	}
 
+	if (i == n)
+		return 0;
+
+	while (i > 0)
+	{
+		teredo_server_worker *w = s->threads + --i;
+
+		pthread_cancel (w->thread);
+		pthread_join (w->thread, NULL);
+		free (w->ufds);
+		free (w->packets);
+	}
+	free (s->threads);
+	s->threads = NULL;
 	return -1;
 }
 
 
 void teredo_server_stop (teredo_server *s)
 {
-	pthread_cancel (s->t1);
-	pthread_cancel (s->t2);
-	pthread_join (s->t1, NULL);
-	pthread_join (s->t2, NULL);
+	unsigned n = 2 * s->workers;
+
+	for (unsigned i = 0; i < n; i++)
+		pthread_cancel (s->threads[i].thread);
+	for (unsigned i = 0; i < n; i++)
+	{
+		pthread_join (s->threads[i].thread, NULL);
+		free (s->threads[i].ufds);
+		free (s->threads[i].packets);
+	}
+
+	free (s->threads);
+	s->threads = NULL;
 }
 
 
 void teredo_server_destroy (teredo_server *s)
 {
-	teredo_close (s->fd_primary);
-	teredo_close (s->fd_secondary);
+	for (unsigned i = 0; i < s->npairs; i++)
+		teredo_server_pair_destroy (s->pairs[i], s->workers);
+	for (unsigned i = 0; i < 2 * s->workers; i++)
+		close (s->raw_fds[i]);
+	teredo_hitters_destroy (s->hitters);
+	free (s->raw_fds);
+	free (s->pairs);
 	free (s);
-
-	pthread_mutex_lock (&raw_mutex);
-	if (--raw_users == 0)
-		close (raw_fd);
-	pthread_mutex_unlock (&raw_mutex);
 }
@@ -25,6 +25,7 @@
 
 
 typedef struct teredo_server teredo_server;
+struct teredo_talker;
 
 #ifdef __cplusplus
 extern "C" {
@@ -45,6 +46,41 @@ int teredo_server_check (char *errmsg, size_t len);
  */
 teredo_server *teredo_server_create (uint32_t ip1, uint32_t ip2);
 
+/**
+ * Creates a Teredo server handler with several worker threads per server
+ * address. Incoming packets are spread over the workers by the kernel, each
+ * worker having its own socket (SO_REUSEPORT).
+ *
+ * @param ip1 server primary IPv4 address (network byte order),
+ * @param ip2 server secondary IPv4 address (network byte order),
+ * @param workers number of worker threads per server address.
+ *
+ * @return NULL on error.
+ */
+teredo_server *teredo_server_create_workers (uint32_t ip1, uint32_t ip2,
+                                             unsigned workers);
+
+/**
+ * Adds a pair of server addresses to a Teredo server handler, so that one
+ * server process and its worker threads serve several Teredo server
+ * address pairs. This must be called before teredo_server_start(), and
+ * with the same privileges as teredo_server_create().
+ *
+ * @param s server handler as returned from teredo_server_create(),
+ * @param ip1 server primary IPv4 address (network byte order),
+ * @param ip2 server secondary IPv4 address (network byte order).
+ *
+ * @return 0 on success, -1 on error.
+ */
+int teredo_server_add_pair (teredo_server *s, uint32_t ip1, uint32_t ip2);
+
+/**
+ * Returns the number of server address pairs.
+ *
+ * @param s server handler as returned from teredo_server_create(),
+ */
+unsigned teredo_server_get_pairs (const teredo_server *s);
+
 /**
  * Changes the Teredo prefix to be advertised by a Teredo server.
  * If not set, the internal default will be used.
@@ -82,6 +118,53 @@ int teredo_server_set_MTU (teredo_server *s, uint16_t mtu);
  */
 uint16_t teredo_server_get_MTU (const teredo_server *s);
 
+/**
+ * Returns the number of packets dropped by the kernel on the server sockets.
+ * Most of these are rejected by the socket filter as invalid, the others
+ * are dropped because the server is overloaded.
+ *
+ * @param s server handler as returned from teredo_server_create(),
+ */
+unsigned long teredo_server_get_drops (const teredo_server *s);
+
+/**
+ * Sets the rate above which packets from a given source IPv4 address are
+ * dropped before any processing. Rates are estimated over one second
+ * windows, and might be over-estimated under heavy load.
+ *
+ * @param s server handler as returned from teredo_server_create(),
+ * @param rate packets per second, zero (the default) for no limit.
+ */
+void teredo_server_set_rate_limit (teredo_server *s, unsigned long rate);
+
+/**
+ * Returns the number of packets dropped as exceeding the rate limit.
+ *
+ * @param s server handler as returned from teredo_server_create(),
+ */
+unsigned long teredo_server_get_throttled (const teredo_server *s);
+
+/**
+ * Returns the busiest source IPv4 addresses (top talkers) over the last
+ * second or so, busiest first, with their approximate packet rates.
+ * Thread-safe.
+ *
+ * @param s server handler as returned from teredo_server_create(),
+ * @param tab [OUT] table of sources,
+ * @param max size of the table.
+ *
+ * @return number of entries written to the table.
+ */
+unsigned teredo_server_get_talkers (const teredo_server *s,
+                                    struct teredo_talker *tab, unsigned max);
+
+/**
+ * Returns the number of worker threads per server address.
+ *
+ * @param s server handler as returned from teredo_server_create(),
+ */
+unsigned teredo_server_get_workers (const teredo_server *s);
+
 /**
  * Starts a Teredo server processing.
  *
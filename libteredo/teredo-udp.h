@@ -89,6 +89,16 @@ extern "C" {
  */
 int teredo_socket (uint32_t bind_ip, uint16_t port);
 
+/**
+ * Opens a Teredo UDP/IPv4 socket that can be bound to the same address and
+ * port as other such sockets from the same user, with incoming datagrams
+ * spread over them by the kernel (SO_REUSEPORT).
+ * Thread-safe, not cancellation-safe.
+ *
+ * @return -1 on error (including if the system does not support this).
+ */
+int teredo_socket_shared (uint32_t bind_ip, uint16_t port);
+
 /**
  * Sends an UDP/IPv4 datagram.
  * Thread-safe, cancellation safe, cancellation point.
@@ -113,6 +123,34 @@ int teredo_send (int fd, const void *data, size_t len,
 int teredo_sendv (int fd, const struct iovec *iov, size_t count,
                   uint32_t ip, uint16_t port);
 
+/**
+ * Outgoing UDP/IPv4 datagram, as sent by teredo_sendmv().
+ */
+typedef struct teredo_datagram
+{
+	/** Scatter-gather array containing the datagram payload */
+	const struct iovec *iov;
+	/** Number of entries in the scatter-gather array */
+	size_t iovlen;
+	/** Destination IPv4 (network byte order) */
+	uint32_t ip;
+	/** Destination UDP port (network byte order) */
+	uint16_t port;
+} teredo_datagram;
+
+/**
+ * Sends several UDP/IPv4 datagrams with as few system calls as possible.
+ * Datagrams that cannot be sent are skipped.
+ * Thread-safe, cancellation-safe, cancellation point.
+ *
+ * @param fd socket from which to send.
+ * @param dgv array of datagrams.
+ * @param count number of datagrams in the array.
+ *
+ * @return number of datagrams sent, or -1 if none could be sent.
+ */
+int teredo_sendmv (int fd, const teredo_datagram *dgv, unsigned count);
+
 /**
  * Receives and parses a Teredo packet from a socket. Never blocks.
  * Thread-safe, cancellation-safe, cancellation point.
@@ -144,6 +182,36 @@ int teredo_recv (int fd, struct teredo_packet *p);
  */
 int teredo_wait_recv (int fd, struct teredo_packet *p);
 
+/**
+ * Waits for at least one Teredo packet, then receives and parses as many
+ * already pending packets as possible, up to a given count.
+ * Thread-safe, cancellation-safe, cancellation point.
+ *
+ * @param fd socket file descriptor
+ * @param pv array of teredo_packet receive buffers
+ * @param count number of buffers in the array
+ *
+ * @return number of received packets, or -1 on error.
+ * Malformatted packets are returned with a zero ip6_len, and should be
+ * ignored.
+ */
+int teredo_wait_recv_burst (int fd, struct teredo_packet *pv, unsigned count);
+
+/**
+ * Receives and parses as many already pending Teredo packets as possible,
+ * up to a given count. Never blocks.
+ * Thread-safe.
+ *
+ * @param fd socket file descriptor
+ * @param pv array of teredo_packet receive buffers
+ * @param count number of buffers in the array
+ *
+ * @return number of received packets, or -1 on error or if no packets are
+ * pending. Malformatted packets are returned with a zero ip6_len, and
+ * should be ignored.
+ */
+int teredo_recv_burst (int fd, struct teredo_packet *pv, unsigned count);
+
 /**
  * Computes an IPv6 layer-3 checksum.
  * The input buffers do not need to be aligned neither of even length.
@@ -64,7 +64,7 @@ const struct in6_addr teredo_cone =
 	{ { { 0xfe, 0x80, 0, 0, 0, 0, 0, 0,
 		    0x80, 0, 'T', 'E', 'R', 'E', 'D', 'O' } } };
 
-int teredo_socket (uint32_t bind_ip, uint16_t port)
+static int teredo_socket_inner (uint32_t bind_ip, uint16_t port, bool shared)
 {
 	struct sockaddr_in myaddr =
 	{
@@ -82,6 +82,20 @@ int teredo_socket (uint32_t bind_ip, uint16_t port)
 
 	fcntl (fd, F_SETFD, FD_CLOEXEC);
 
+	if (shared)
+	{
+#ifdef SO_REUSEPORT
+		if (setsockopt (fd, SOL_SOCKET, SO_REUSEPORT, &(int){ 1 },
+		                sizeof (int)))
+#else
+		errno = ENOSYS;
+#endif
+		{
+			close (fd);
+			return -1;
+		}
+	}
+
 	if (bind (fd, (struct sockaddr *)&myaddr, sizeof (myaddr)))
 	{
 		close (fd);
@@ -114,6 +128,18 @@ int teredo_socket (uint32_t bind_ip, uint16_t port)
 }
 
 
+int teredo_socket (uint32_t bind_ip, uint16_t port)
+{
+	return teredo_socket_inner (bind_ip, port, false);
+}
+
+
+int teredo_socket_shared (uint32_t bind_ip, uint16_t port)
+{
+	return teredo_socket_inner (bind_ip, port, true);
+}
+
+
 static ssize_t
 teredo_recverr (int fd)
 {
@@ -162,6 +188,68 @@ int teredo_sendv (int fd, const struct iovec *iov, size_t count,
 }
 
 
+#if defined (__linux__) && defined (MSG_WAITFORONE)
+/* Maximum number of datagrams per sendmmsg() call */
+# define TEREDO_SENDMV_BATCH 32
+
+int teredo_sendmv (int fd, const teredo_datagram *dgv, unsigned count)
+{
+	struct mmsghdr msg[TEREDO_SENDMV_BATCH];
+	struct sockaddr_in addr[TEREDO_SENDMV_BATCH];
+	unsigned sent = 0;
+
+	while (count > 0)
+	{
+		unsigned n = (count < TEREDO_SENDMV_BATCH)
+			? count : TEREDO_SENDMV_BATCH;
+
+		memset (msg, 0, n * sizeof (msg[0]));
+		for (unsigned i = 0; i < n; i++)
+		{
+			memset (addr + i, 0, sizeof (addr[i]));
+			addr[i].sin_family = AF_INET;
+			addr[i].sin_port = dgv[i].port;
+			addr[i].sin_addr.s_addr = dgv[i].ip;
+
+			msg[i].msg_hdr.msg_name = addr + i;
+			msg[i].msg_hdr.msg_namelen = sizeof (addr[i]);
+			msg[i].msg_hdr.msg_iov = (struct iovec *)dgv[i].iov;
+			msg[i].msg_hdr.msg_iovlen = dgv[i].iovlen;
+		}
+
+		int res = sendmmsg (fd, msg, n, 0);
+		if (res <= 0)
+		{
+			/* Try again once pending errors are dequeued,
+			 * otherwise skip the offending datagram */
+			if (teredo_recverr (fd) != -1)
+				continue;
+			res = 1;
+		}
+		else
+			sent += res;
+
+		dgv += res;
+		count -= res;
+	}
+
+	return (sent > 0) ? (int)sent : -1;
+}
+#else
+int teredo_sendmv (int fd, const teredo_datagram *dgv, unsigned count)
+{
+	unsigned sent = 0;
+
+	for (unsigned i = 0; i < count; i++)
+		if (teredo_sendv (fd, dgv[i].iov, dgv[i].iovlen,
+		                  dgv[i].ip, dgv[i].port) != -1)
+			sent++;
+
+	return (sent > 0) ? (int)sent : -1;
+}
+#endif
+
+
 int teredo_send (int fd, const void *packet, size_t plen,
                  uint32_t dest_ip, uint16_t dest_port)
 {
@@ -170,48 +258,36 @@ int teredo_send (int fd, const void *packet, size_t plen,
 }
 
 
-static int teredo_recv_inner (int fd, struct teredo_packet *p, int flags)
-{
-	struct sockaddr_in ad;
 #ifdef IP_PKTINFO
-	char cbuf[CMSG_SPACE (sizeof (struct in_pktinfo))];
+# define TEREDO_CMSG_SPACE CMSG_SPACE (sizeof (struct in_pktinfo))
 #elif defined(IP_RECVDSTADDR)
-	char cbuf[CMSG_SPACE (sizeof (struct in_addr))];
-#endif
-	struct iovec iov =
-	{
-		.iov_base = p->buf.fill,
-		.iov_len = TEREDO_PACKET_SIZE
-	};
-	struct msghdr msg =
-	{
-		.msg_iov = &iov,
-		.msg_iovlen = 1,
-		.msg_name = &ad,
-		.msg_namelen = sizeof (ad),
-#if defined(IP_PKTINFO) || defined(IP_RECVDSTADDR)
-		.msg_control = cbuf,
-		.msg_controllen = sizeof (cbuf),
+# define TEREDO_CMSG_SPACE CMSG_SPACE (sizeof (struct in_addr))
 #endif
-	};
 
-	// Receive a UDP packet
-	ssize_t length = recvmsg (fd, &msg, flags);
-	if (length == -1)
-		teredo_recverr (fd);
-	if (length < 2) // too small or error
+/**
+ * Parses a Teredo packet that was received with recvmsg() or recvmmsg().
+ *
+ * @param length byte length of the received UDP payload
+ * @return 0 on success, -1 if the packet is malformatted.
+ */
+static int teredo_parse (struct teredo_packet *restrict p,
+                         const struct msghdr *restrict msg, ssize_t length)
+{
+	const struct sockaddr_in *ad = msg->msg_name;
+
+	if (length < 2) // too small
 		return -1;
 
-	p->source_ipv4 = ad.sin_addr.s_addr;
-	p->source_port = ad.sin_port;
+	p->source_ipv4 = ad->sin_addr.s_addr;
+	p->source_port = ad->sin_port;
 	p->dest_ipv4 = 0;
 
 #if defined(IP_PKTINFO) || defined(IP_RECVDSTADDR)
 	// Internal outer destination IPv4 address
 	// (mostly useful for funky multi-homed hosts)
-	for (struct cmsghdr *cmsg = CMSG_FIRSTHDR (&msg);
+	for (struct cmsghdr *cmsg = CMSG_FIRSTHDR (msg);
 	     cmsg != NULL;
-	     cmsg = CMSG_NXTHDR (&msg, cmsg))
+	     cmsg = CMSG_NXTHDR ((struct msghdr *)msg, cmsg))
 	{
 # ifdef IP_PKTINFO
 		if ((cmsg->cmsg_level == IPPROTO_IP)
@@ -303,6 +379,41 @@ static int teredo_recv_inner (int fd, struct teredo_packet *p, int flags)
 }
 
 
+static int teredo_recv_inner (int fd, struct teredo_packet *p, int flags)
+{
+	struct sockaddr_in ad;
+#ifdef TEREDO_CMSG_SPACE
+	char cbuf[TEREDO_CMSG_SPACE];
+#endif
+	struct iovec iov =
+	{
+		.iov_base = p->buf.fill,
+		.iov_len = TEREDO_PACKET_SIZE
+	};
+	struct msghdr msg =
+	{
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_name = &ad,
+		.msg_namelen = sizeof (ad),
+#ifdef TEREDO_CMSG_SPACE
+		.msg_control = cbuf,
+		.msg_controllen = sizeof (cbuf),
+#endif
+	};
+
+	// Receive a UDP packet
+	ssize_t length = recvmsg (fd, &msg, flags);
+	if (length == -1)
+	{
+		teredo_recverr (fd);
+		return -1;
+	}
+
+	return teredo_parse (p, &msg, length);
+}
+
+
 int teredo_recv (int fd, struct teredo_packet *p)
 {
 	return teredo_recv_inner (fd, p, MSG_DONTWAIT);
@@ -327,6 +438,95 @@ int teredo_wait_recv (int fd, struct teredo_packet *p)
 }
 
 
+#if defined (__linux__) && defined (MSG_WAITFORONE)
+/* Maximum number of datagrams per recvmmsg() call */
+# define TEREDO_RECV_BATCH 32
+
+static int
+teredo_recv_burst_inner (int fd, struct teredo_packet *pv, unsigned count,
+                         int flags)
+{
+	struct mmsghdr msg[TEREDO_RECV_BATCH];
+	struct iovec iov[TEREDO_RECV_BATCH];
+	struct sockaddr_in ad[TEREDO_RECV_BATCH];
+# ifdef TEREDO_CMSG_SPACE
+	char cbuf[TEREDO_RECV_BATCH][TEREDO_CMSG_SPACE];
+# endif
+
+	if (count > TEREDO_RECV_BATCH)
+		count = TEREDO_RECV_BATCH;
+
+	memset (msg, 0, count * sizeof (msg[0]));
+	for (unsigned i = 0; i < count; i++)
+	{
+		iov[i].iov_base = pv[i].buf.fill;
+		iov[i].iov_len = TEREDO_PACKET_SIZE;
+		msg[i].msg_hdr.msg_iov = iov + i;
+		msg[i].msg_hdr.msg_iovlen = 1;
+		msg[i].msg_hdr.msg_name = ad + i;
+		msg[i].msg_hdr.msg_namelen = sizeof (ad[i]);
+# ifdef TEREDO_CMSG_SPACE
+		msg[i].msg_hdr.msg_control = cbuf[i];
+		msg[i].msg_hdr.msg_controllen = sizeof (cbuf[i]);
+# endif
+	}
+
+	int n = recvmmsg (fd, msg, count, flags, NULL);
+	if (n <= 0)
+	{
+		teredo_recverr (fd);
+		return -1;
+	}
+
+	for (int i = 0; i < n; i++)
+		if (teredo_parse (pv + i, &msg[i].msg_hdr, msg[i].msg_len))
+			pv[i].ip6_len = 0;
+
+	return n;
+}
+
+
+int teredo_recv_burst (int fd, struct teredo_packet *pv, unsigned count)
+{
+	return teredo_recv_burst_inner (fd, pv, count, MSG_DONTWAIT);
+}
+
+
+int teredo_wait_recv_burst (int fd, struct teredo_packet *pv, unsigned count)
+{
+	/* Blocks until the first datagram, then gets whatever is pending */
+	return teredo_recv_burst_inner (fd, pv, count, MSG_WAITFORONE);
+}
+#else
+int teredo_recv_burst (int fd, struct teredo_packet *pv, unsigned count)
+{
+	unsigned n = 0;
+
+	/* Stops at the first malformatted packet, as with teredo_recv() */
+	while ((n < count) && (teredo_recv (fd, pv + n) == 0))
+		n++;
+
+	return n ? (int)n : -1;
+}
+
+
+int teredo_wait_recv_burst (int fd, struct teredo_packet *pv, unsigned count)
+{
+	unsigned n = 0;
+
+	if (count == 0)
+		return 0;
+
+	/* Malformatted packets are returned with a zero length */
+	if (teredo_wait_recv (fd, pv) == -1)
+		pv->ip6_len = 0;
+
+	while ((++n < count) && (teredo_recv (fd, pv + n) == 0));
+	return n;
+}
+#endif
+
+
 /* This does not fit anywhere and is needed by both relay and server */
 #include <stdbool.h>
 
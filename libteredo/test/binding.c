@@ -0,0 +1,249 @@
+/*
+ * binding.c - Libteredo NAT binding lifetime determination tests
+ */
+
+/***********************************************************************
+ *  Copyright © 2004-2007 Rémi Denis-Courmont.                         *
+ *  This program is free software; you can redistribute and/or modify  *
+ *  it under the terms of the GNU General Public License as published  *
+ *  by the Free Software Foundation; version 2 of the license, or (at  *
+ *  your option) any later version.                                    *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *  See the GNU General Public License for more details.               *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, you can get it from:              *
+ *  http://www.gnu.org/copyleft/gpl.html                               *
+ ***********************************************************************/
+
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#undef NDEBUG
+#include <assert.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <time.h>
+#include <errno.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <pthread.h>
+
+#include "teredo.h"
+#include "teredo-udp.h"
+#include "tunnel.h"
+#include "maintain.h"
+#include "standin.h"
+
+/* Stand-in server address, which must be global and local */
+#define SERVER "198.51.100.4"
+/* Address without any server, as a standby that never replies */
+#define DEAD_SERVER "198.51.100.5"
+
+#define REFRESH 1 // seconds
+#define TIMEOUT 1 // seconds
+#define NAT_LIFETIME 5 // seconds
+
+#define PORTS 16
+
+/*
+ * Stand-in NAT: a port which stayed idle for longer than NAT_LIFETIME gets
+ * a new mapping.
+ */
+static struct
+{
+	uint16_t primary; // client primary port
+	struct
+	{
+		uint16_t port;
+		uint16_t generation;
+		time_t last;
+	} ports[PORTS];
+	time_t last; // latest solicitation from the primary port
+	time_t gap; // interval between the latest two of them
+} nat;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wait = PTHREAD_COND_INITIALIZER;
+
+
+static uint16_t nat_map (uint16_t port, void *opaque)
+{
+	struct timespec now;
+	unsigned i;
+
+	(void)opaque;
+
+	clock_gettime (CLOCK_MONOTONIC, &now);
+	pthread_mutex_lock (&lock);
+	for (i = 0; (i < PORTS - 1) && (nat.ports[i].port != 0)
+	         && (nat.ports[i].port != port); i++);
+
+	if (nat.ports[i].port != port)
+		nat.ports[i].port = port;
+	else
+	if (now.tv_sec - nat.ports[i].last > NAT_LIFETIME)
+		nat.ports[i].generation++;
+	nat.ports[i].last = now.tv_sec;
+	port = htons (ntohs (port) + 100 * nat.ports[i].generation);
+
+	if (nat.ports[i].port == nat.primary)
+	{
+		if (nat.last)
+			nat.gap = now.tv_sec - nat.last;
+		nat.last = now.tv_sec;
+	}
+	pthread_mutex_unlock (&lock);
+	return port;
+}
+
+
+static unsigned lifetimes[8];
+static unsigned reports = 0;
+
+static void state_change (const teredo_state *s, void *opaque)
+{
+	(void)s;
+	(void)opaque;
+}
+
+
+static void binding_change (unsigned lifetime, void *opaque)
+{
+	(void)opaque;
+
+	pthread_mutex_lock (&lock);
+	if (reports < 8)
+		lifetimes[reports++] = lifetime;
+	pthread_cond_signal (&wait);
+	pthread_mutex_unlock (&lock);
+}
+
+
+static int client_fd;
+
+static void *client_thread (void *data)
+{
+	teredo_maintenance *m = (teredo_maintenance *)data;
+	static teredo_packet p;
+
+	for (;;)
+		if (teredo_wait_recv (client_fd, &p) == 0)
+			teredo_maintenance_process (m, &p);
+	return NULL;
+}
+
+
+int main (void)
+{
+	standin server;
+	pthread_t th;
+
+	/* Stand-in server needs a global IPv4 address on a local interface */
+	if (standin_start (&server, SERVER, 0, nat_map, NULL))
+	{
+		perror (SERVER);
+		return 77;
+	}
+
+	assert (teredo_startup (true) == 0);
+	client_fd = teredo_socket (INADDR_ANY, 0);
+	assert (client_fd != -1);
+
+	struct sockaddr_in addr;
+	socklen_t len = sizeof (addr);
+	assert (getsockname (client_fd, (struct sockaddr *)&addr, &len) == 0);
+	nat.primary = addr.sin_port;
+
+	const char *servers[] = { SERVER };
+	teredo_maintenance *m;
+	m = teredo_maintenance_start (client_fd, state_change, binding_change,
+	                              NULL, servers, 1, TIMEOUT, 3, REFRESH, 60,
+	                              0, NULL);
+	assert (m != NULL);
+	assert (pthread_create (&th, NULL, client_thread, m) == 0);
+
+	/* Intervals of 2 and 4 seconds are confirmed, not 8 seconds */
+	struct timespec deadline;
+	int val = 0;
+
+	clock_gettime (CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += 20;
+
+	pthread_mutex_lock (&lock);
+	while ((reports < 2) && (val != ETIMEDOUT))
+		val = pthread_cond_timedwait (&wait, &lock, &deadline);
+	pthread_mutex_unlock (&lock);
+
+	printf ("Learnt lifetimes: %u, %u\n", lifetimes[0], lifetimes[1]);
+	assert (reports == 2);
+	assert ((lifetimes[0] == 2) && (lifetimes[1] == 4));
+
+	/* The primary binding is refreshed less often, yet not expired */
+	nanosleep (&(struct timespec){ 3 * (4 - TIMEOUT), 0 }, NULL);
+	pthread_mutex_lock (&lock);
+	printf ("Refresh interval: %u s\n", (unsigned)nat.gap);
+	assert ((nat.gap > REFRESH) && (nat.gap < NAT_LIFETIME));
+	for (unsigned i = 0; i < PORTS; i++)
+		if (nat.ports[i].port == nat.primary)
+			assert (nat.ports[i].generation == 0);
+	pthread_mutex_unlock (&lock);
+
+	pthread_cancel (th);
+	pthread_join (th, NULL);
+	teredo_maintenance_stop (m);
+	teredo_close (client_fd);
+
+	/* With a standby server, the learnt lifetime is not used to refresh */
+	client_fd = teredo_socket (INADDR_ANY, 0);
+	assert (client_fd != -1);
+	len = sizeof (addr);
+	assert (getsockname (client_fd, (struct sockaddr *)&addr, &len) == 0);
+	pthread_mutex_lock (&lock);
+	nat.primary = addr.sin_port;
+	nat.last = nat.gap = 0;
+	reports = 0;
+	pthread_mutex_unlock (&lock);
+
+	const char *standby[] = { SERVER, DEAD_SERVER };
+	m = teredo_maintenance_start (client_fd, state_change, binding_change,
+	                              NULL, standby, 2, TIMEOUT, 3, REFRESH, 60,
+	                              0, NULL);
+	assert (m != NULL);
+	assert (pthread_create (&th, NULL, client_thread, m) == 0);
+
+	clock_gettime (CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += 20;
+	val = 0;
+
+	pthread_mutex_lock (&lock);
+	while ((reports < 2) && (val != ETIMEDOUT))
+		val = pthread_cond_timedwait (&wait, &lock, &deadline);
+	assert ((reports == 2) && (lifetimes[1] == 4));
+	nat.last = nat.gap = 0;
+	pthread_mutex_unlock (&lock);
+
+	nanosleep (&(struct timespec){ 2 * (4 - TIMEOUT) + 1, 0 }, NULL);
+	pthread_mutex_lock (&lock);
+	printf ("Refresh interval with a standby: %u s\n", (unsigned)nat.gap);
+	assert ((nat.gap > 0) && (nat.gap <= REFRESH));
+	pthread_mutex_unlock (&lock);
+
+	pthread_cancel (th);
+	pthread_join (th, NULL);
+	teredo_maintenance_stop (m);
+	standin_stop (&server);
+	teredo_close (client_fd);
+	teredo_cleanup (true);
+	return 0;
+}
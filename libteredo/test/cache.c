@@ -0,0 +1,272 @@
+/*
+ * cache.c - Libteredo client cached state tests
+ */
+
+/***********************************************************************
+ *  Copyright © 2004-2007 Rémi Denis-Courmont.                         *
+ *  This program is free software; you can redistribute and/or modify  *
+ *  it under the terms of the GNU General Public License as published  *
+ *  by the Free Software Foundation; version 2 of the license, or (at  *
+ *  your option) any later version.                                    *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *  See the GNU General Public License for more details.               *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, you can get it from:              *
+ *  http://www.gnu.org/copyleft/gpl.html                               *
+ ***********************************************************************/
+
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#undef NDEBUG
+#include <assert.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <time.h>
+#include <errno.h>
+
+#include <sys/types.h>
+#include <stdlib.h> // mkstemp()
+#include <unistd.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <pthread.h>
+#ifdef __linux__
+# include <sched.h> // unshare()
+# include <sys/mount.h>
+#endif
+
+#include "teredo.h"
+#include "teredo-udp.h"
+#include "tunnel.h"
+#include "maintain.h"
+#include "standin.h"
+
+/* Stand-in server address, which must be global and local */
+#define SERVER "198.51.100.2"
+/* Another stand-in server address */
+#define OTHER_SERVER "198.51.100.3"
+/* Global address where no server answers */
+#define DEAD_SERVER "198.51.100.9"
+
+#define TIMEOUT 1 // seconds
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wait = PTHREAD_COND_INITIALIZER;
+static teredo_state states[4];
+static unsigned changes;
+
+static void state_change (const teredo_state *s, void *opaque)
+{
+	(void)opaque;
+
+	pthread_mutex_lock (&lock);
+	if (changes < 4)
+		states[changes++] = *s;
+	pthread_cond_signal (&wait);
+	pthread_mutex_unlock (&lock);
+}
+
+
+/**
+ * Waits until there were n state changes, at most sec seconds.
+ * @return the number of state changes.
+ */
+static unsigned wait_changes (unsigned n, unsigned sec)
+{
+	struct timespec deadline;
+	int val = 0;
+
+	clock_gettime (CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += sec;
+
+	pthread_mutex_lock (&lock);
+	while ((changes < n) && (val != ETIMEDOUT))
+		val = pthread_cond_timedwait (&wait, &lock, &deadline);
+	n = changes;
+	pthread_mutex_unlock (&lock);
+	return n;
+}
+
+
+static int client_fd;
+static pthread_mutex_t client_lock = PTHREAD_MUTEX_INITIALIZER;
+static teredo_maintenance *client;
+
+static void *client_thread (void *data)
+{
+	static teredo_packet p;
+
+	(void)data;
+
+	for (;;)
+		if (teredo_wait_recv (client_fd, &p) == 0)
+		{
+			pthread_mutex_lock (&client_lock);
+			if (client != NULL)
+				teredo_maintenance_process (client, &p);
+			pthread_mutex_unlock (&client_lock);
+		}
+	return NULL;
+}
+
+
+static void start_servers (const char *const *servers, unsigned count,
+                           unsigned refresh, const teredo_state *cache)
+{
+	teredo_maintenance *m;
+
+	pthread_mutex_lock (&lock);
+	changes = 0;
+	pthread_mutex_unlock (&lock);
+
+	m = teredo_maintenance_start (client_fd, state_change, NULL, NULL,
+	                              servers, count, TIMEOUT, 3, refresh, 60, 0,
+	                              cache);
+	assert (m != NULL);
+	pthread_mutex_lock (&client_lock);
+	client = m;
+	pthread_mutex_unlock (&client_lock);
+}
+
+
+static void start (const teredo_state *cache)
+{
+	static const char *servers[] = { SERVER };
+
+	start_servers (servers, 1, 30, cache);
+}
+
+
+/**
+ * Makes host names resolve to the stand-in servers, in a private mount
+ * namespace (as root or in a user namespace). Must be called before any
+ * thread is created.
+ * @return 0 on success, -1 if not possible.
+ */
+static int hosts_override (void)
+{
+#ifdef __linux__
+	char path[] = "/tmp/miredo-hosts.XXXXXX";
+
+	if ((unshare (CLONE_NEWNS) && unshare (CLONE_NEWUSER | CLONE_NEWNS))
+	 || mount (NULL, "/", NULL, MS_REC | MS_PRIVATE, NULL))
+		return -1;
+
+	int fd = mkstemp (path);
+	if (fd == -1)
+		return -1;
+
+	dprintf (fd, "%s teredo-a\n%s teredo-b\n", SERVER, OTHER_SERVER);
+	close (fd);
+
+	int val = mount (path, "/etc/hosts", NULL, MS_BIND, NULL);
+	unlink (path);
+	return val;
+#else
+	return -1;
+#endif
+}
+
+
+static void stop (void)
+{
+	teredo_maintenance *m;
+
+	pthread_mutex_lock (&client_lock);
+	m = client;
+	client = NULL;
+	pthread_mutex_unlock (&client_lock);
+	teredo_maintenance_stop (m);
+}
+
+
+int main (void)
+{
+	standin server, other;
+	pthread_t receiver;
+	bool hosts = hosts_override () == 0;
+
+	if (!hosts)
+		perror ("Host names");
+
+	/* Stand-in servers need global IPv4 addresses on a local interface */
+	if (standin_start (&server, SERVER, 0, NULL, NULL)
+	 || standin_start (&other, OTHER_SERVER, 0, NULL, NULL))
+	{
+		perror (SERVER " or " OTHER_SERVER);
+		return 77;
+	}
+
+	assert (teredo_startup (true) == 0);
+	client_fd = teredo_socket (INADDR_ANY, 0);
+	assert (client_fd != -1);
+	assert (pthread_create (&receiver, NULL, client_thread, NULL) == 0);
+
+	/* Full qualification, to fill the cache */
+	teredo_state cache;
+	start (NULL);
+	assert (wait_changes (1, 5) == 1);
+	cache = states[0];
+	assert (cache.up);
+	stop ();
+
+	/* Up right away, then confirmed without further changes */
+	start (&cache);
+	assert (wait_changes (1, 1) == 1);
+	assert (wait_changes (2, TIMEOUT + 1) == 1);
+	assert (states[0].up);
+	assert (IN6_ARE_ADDR_EQUAL (&states[0].addr.ip6, &cache.addr.ip6));
+	stop ();
+
+	/* Different mapping: replaced by the advertised one */
+	teredo_state stale = cache;
+	stale.addr.teredo.client_port ^= htons (1);
+	start (&stale);
+	assert (wait_changes (2, TIMEOUT + 1) == 2);
+	assert (states[1].up);
+	assert (states[1].addr.teredo.client_port == cache.addr.teredo.client_port);
+	stop ();
+
+	/* Server not replying: brought down, then qualified with the resolver */
+	stale = cache;
+	stale.addr.teredo.server_ip = inet_addr (DEAD_SERVER);
+	start (&stale);
+	assert (wait_changes (3, 2 * TIMEOUT + 2) == 3);
+	assert (states[0].up && !states[1].up && states[2].up);
+	assert (states[2].addr.teredo.server_ip == server.ip);
+	stop ();
+
+	/* Cached from the second named server: the first one is solicited too */
+	if (hosts)
+	{
+		static const char *names[] = { "teredo-a", "teredo-b" };
+		unsigned n = standin_solicitations (&server);
+
+		stale = cache;
+		stale.addr.teredo.server_ip = other.ip;
+		/* Over loopback, the mapped address is that of the server */
+		stale.addr.teredo.client_ip ^= server.ip ^ other.ip;
+		start_servers (names, 2, 1, &stale);
+		assert (wait_changes (2, 3 * TIMEOUT + 1) == 1);
+		assert (states[0].up);
+		assert (standin_solicitations (&server) > n);
+		stop ();
+	}
+
+	pthread_cancel (receiver);
+	pthread_join (receiver, NULL);
+	standin_stop (&server);
+	standin_stop (&other);
+	teredo_close (client_fd);
+	teredo_cleanup (true);
+	return 0;
+}
@@ -0,0 +1,172 @@
+/*
+ * classify.c - Libteredo packet headers classifier differential tests
+ */
+
+/***********************************************************************
+ *  Copyright © 2004-2007 Rémi Denis-Courmont.                         *
+ *  This program is free software; you can redistribute and/or modify  *
+ *  it under the terms of the GNU General Public License as published  *
+ *  by the Free Software Foundation; version 2 of the license, or (at  *
+ *  your option) any later version.                                    *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *  See the GNU General Public License for more details.               *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, you can get it from:              *
+ *  http://www.gnu.org/copyleft/gpl.html                               *
+ ***********************************************************************/
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#undef NDEBUG
+#include <assert.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <netinet/ip6.h>
+
+#include "teredo.h"
+#include "teredo-udp.h"
+#include "classify.h"
+
+#define PACKETS 67 /* not a multiple of the SIMD width */
+#define ROUNDS  2000
+
+/**
+ * Straightforward classification, with the checks spelled out as in the
+ * relay and server code.
+ */
+static uint8_t reference (const teredo_packet *p, uint32_t prefix)
+{
+	const struct ip6_hdr *ip6 = p->ip6;
+	uint8_t v = 0;
+
+	if ((p->ip6_len < sizeof (*ip6)) || ((ip6->ip6_vfc >> 4) != 6)
+	 || ((sizeof (*ip6) + ntohs (ip6->ip6_plen)) > p->ip6_len))
+		return 0;
+
+	v |= TEREDO_CLASS_VALID;
+	if ((ip6->ip6_plen == 0) && (ip6->ip6_nxt == IPPROTO_NONE))
+		v |= TEREDO_CLASS_BUBBLE;
+	if (ip6->ip6_nxt == IPPROTO_ICMPV6)
+		v |= TEREDO_CLASS_ICMPV6;
+	if (IN6_TEREDO_PREFIX (&ip6->ip6_src) == prefix)
+		v |= TEREDO_CLASS_SRC_TEREDO;
+	if (IN6_IS_ADDR_LINKLOCAL (&ip6->ip6_src))
+		v |= TEREDO_CLASS_SRC_LINKLOCAL;
+	if (IN6_TEREDO_PREFIX (&ip6->ip6_dst) == prefix)
+		v |= TEREDO_CLASS_DST_TEREDO;
+	if (IN6_IS_ADDR_MULTICAST (&ip6->ip6_dst))
+		v |= TEREDO_CLASS_DST_MULTICAST;
+	return v;
+}
+
+
+static uint32_t random_prefix (uint32_t prefix)
+{
+	static const uint32_t prefixes[] =
+		{ 0xfe800000, 0xfebf1234, 0xfec00000, 0xff020000, 0x20010db8 };
+
+	switch (rand () % 4)
+	{
+		case 0:
+			return prefix;
+		case 1:
+			return htonl (prefixes[rand () % 5]);
+		case 2:
+			return prefix ^ htonl (1 << (rand () % 32));
+	}
+	return rand ();
+}
+
+
+static void random_header (teredo_packet *p, uint8_t *buf, uint32_t prefix)
+{
+	struct ip6_hdr ip6;
+	uint16_t plen = (rand () % 4) ? (rand () % 200) : 0;
+	static const uint8_t nxt[] =
+		{ IPPROTO_NONE, IPPROTO_ICMPV6, IPPROTO_UDP, IPPROTO_TCP };
+
+	memset (&ip6, 0, sizeof (ip6));
+	ip6.ip6_flow = htonl (rand ());
+	ip6.ip6_vfc = (rand () % 8) ? 0x60 : (rand () & 0xff);
+	ip6.ip6_plen = htons ((rand () % 16) ? plen : rand ());
+	ip6.ip6_nxt = nxt[rand () % 4];
+	ip6.ip6_hlim = rand ();
+
+	uint32_t w = random_prefix (prefix);
+	memcpy (&ip6.ip6_src, &w, 4);
+	w = random_prefix (prefix);
+	memcpy (&ip6.ip6_dst, &w, 4);
+
+	memcpy (buf, &ip6, sizeof (ip6));
+	p->ip6 = (struct ip6_hdr *)buf;
+	p->ip6_len = sizeof (ip6) + plen;
+	switch (rand () % 8)
+	{
+		case 0:
+			p->ip6_len = rand () % sizeof (ip6);
+			break;
+		case 1:
+			p->ip6_len += rand () % 3;
+			p->ip6_len -= rand () % 3;
+			break;
+	}
+}
+
+
+int main (void)
+{
+	static uint8_t bufs[PACKETS][sizeof (struct ip6_hdr) + 1];
+	static teredo_packet pv[PACKETS];
+	const teredo_packet *vec[PACKETS];
+	uint8_t v1[PACKETS], v2[PACKETS];
+	const uint32_t prefix = htonl (TEREDO_PREFIX);
+
+	srand (0);
+
+	for (unsigned round = 0; round < ROUNDS; round++)
+	{
+		unsigned count = rand () % (PACKETS + 1);
+
+		for (unsigned i = 0; i < count; i++)
+		{
+			/* Headers are not necessarily aligned */
+			random_header (pv + i, bufs[i] + (rand () & 1), prefix);
+			vec[i] = pv + i;
+		}
+
+		memset (v1, 0xaa, sizeof (v1));
+		memset (v2, 0x55, sizeof (v2));
+		teredo_classify_scalar (vec, count, prefix, v1);
+		teredo_classify (vec, count, prefix, v2);
+
+		for (unsigned i = 0; i < count; i++)
+		{
+			uint8_t ref = reference (vec[i], prefix);
+
+			if ((v1[i] != ref) || (v2[i] != ref))
+			{
+				fprintf (stderr, "Packet %u: expected 0x%02x, "
+				         "scalar 0x%02x, vector 0x%02x\n", i, ref, v1[i],
+				         v2[i]);
+				return 1;
+			}
+		}
+
+		/* Nothing written past the end */
+		for (unsigned i = count; i < PACKETS; i++)
+			assert ((v1[i] == 0xaa) && (v2[i] == 0x55));
+	}
+	return 0;
+}
@@ -0,0 +1,272 @@
+/*
+ * filter.c - Libteredo server socket filter tests
+ */
+
+/***********************************************************************
+ *  Copyright © 2004-2007 Rémi Denis-Courmont.                         *
+ *  This program is free software; you can redistribute and/or modify  *
+ *  it under the terms of the GNU General Public License as published  *
+ *  by the Free Software Foundation; version 2 of the license, or (at  *
+ *  your option) any later version.                                    *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *  See the GNU General Public License for more details.               *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, you can get it from:              *
+ *  http://www.gnu.org/copyleft/gpl.html                               *
+ ***********************************************************************/
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#undef NDEBUG
+#include <assert.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/udp.h>
+#include <netinet/ip6.h>
+#include <netinet/icmp6.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#ifdef __linux__
+# include <linux/sock_diag.h> // SK_MEMINFO_DROPS
+#endif
+
+#include "filter.h"
+#include "v4global.h"
+
+static int rawfd, fd;
+static uint16_t port;
+
+/**
+ * Checks that the kernel reports socket drops (SO_MEMINFO, Linux 3.19).
+ */
+static bool drops_supported (void)
+{
+#if defined (SO_MEMINFO) && defined (__linux__)
+	uint32_t meminfo[SK_MEMINFO_VARS];
+	socklen_t len = sizeof (meminfo);
+
+	return (getsockopt (fd, SOL_SOCKET, SO_MEMINFO, meminfo, &len) == 0)
+	    && (len > SK_MEMINFO_DROPS * sizeof (meminfo[0]));
+#else
+	return false;
+#endif
+}
+
+/**
+ * Sends a UDP/IPv4 datagram from a spoofed source to the filtered socket.
+ */
+static void send_from (const char *src, const void *data, size_t len)
+{
+	struct
+	{
+		struct iphdr ip;
+		struct udphdr udp;
+		uint8_t payload[256];
+	} pkt;
+	struct sockaddr_in dst;
+
+	assert (len <= sizeof (pkt.payload));
+	memset (&pkt, 0, sizeof (pkt));
+	pkt.ip.version = 4;
+	pkt.ip.ihl = 5;
+	pkt.ip.tot_len = htons (sizeof (pkt.ip) + sizeof (pkt.udp) + len);
+	pkt.ip.ttl = 64;
+	pkt.ip.protocol = IPPROTO_UDP;
+	inet_pton (AF_INET, src, &pkt.ip.saddr);
+	pkt.ip.daddr = htonl (INADDR_LOOPBACK);
+	pkt.udp.source = htons (3544);
+	pkt.udp.dest = port;
+	pkt.udp.len = htons (sizeof (pkt.udp) + len);
+	memcpy (pkt.payload, data, len);
+
+	memset (&dst, 0, sizeof (dst));
+	dst.sin_family = AF_INET;
+	dst.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+
+	len += sizeof (pkt.ip) + sizeof (pkt.udp);
+	assert (sendto (rawfd, &pkt, len, 0, (struct sockaddr *)&dst,
+	                sizeof (dst)) == (ssize_t)len);
+}
+
+
+/**
+ * Builds a Teredo packet, with optional headers.
+ * @return its length.
+ */
+static size_t build (uint8_t *buf, bool auth, bool orig, uint8_t nxt,
+                     uint16_t plen, const char *dst)
+{
+	size_t len = 0;
+
+	if (auth)
+	{
+		/* 2 bytes of client ID, 3 bytes of authentication value */
+		static const uint8_t hdr[18] = { 0, 1, 2, 3 };
+		memcpy (buf, hdr, sizeof (hdr));
+		len += sizeof (hdr);
+	}
+	if (orig)
+	{
+		static const uint8_t hdr[8] = { 0, 0, 0x12, 0x34, 1, 2, 3, 4 };
+		memcpy (buf + len, hdr, sizeof (hdr));
+		len += sizeof (hdr);
+	}
+
+	struct ip6_hdr ip6;
+	memset (&ip6, 0, sizeof (ip6));
+	ip6.ip6_vfc = 0x60;
+	ip6.ip6_plen = htons (plen);
+	ip6.ip6_nxt = nxt;
+	ip6.ip6_hlim = 255;
+	inet_pton (AF_INET6, "fe80::1", &ip6.ip6_src);
+	inet_pton (AF_INET6, dst, &ip6.ip6_dst);
+	memcpy (buf + len, &ip6, sizeof (ip6));
+	len += sizeof (ip6);
+
+	memset (buf + len, 0, plen);
+	if (nxt == IPPROTO_ICMPV6)
+		buf[len] = ND_ROUTER_SOLICIT;
+	return len + plen;
+}
+
+
+/**
+ * Sends a packet, followed by a marker bubble.
+ * @return true if the packet went through the filter.
+ */
+static bool test (const char *src, const void *data, size_t len)
+{
+	uint8_t marker[40], buf[512];
+
+	build (marker, false, false, IPPROTO_NONE, 0, "2001:db8::ffff");
+	send_from (src, data, len);
+	send_from ("198.51.100.1", marker, sizeof (marker));
+
+	ssize_t val = recv (fd, buf, sizeof (buf), 0);
+	if ((val == sizeof (marker)) && !memcmp (buf, marker, val))
+		return false;
+
+	assert ((size_t)val == len);
+	assert (!memcmp (buf, data, len));
+	val = recv (fd, buf, sizeof (buf), 0);
+	assert ((val == sizeof (marker)) && !memcmp (buf, marker, val));
+	return true;
+}
+
+
+int main (void)
+{
+	static const char global[] = "198.51.100.1";
+	uint8_t buf[256];
+	size_t len;
+
+	rawfd = socket (AF_INET, SOCK_RAW, IPPROTO_RAW);
+	if (rawfd == -1)
+		return 77; /* not privileged: skip */
+
+	struct sockaddr_in addr;
+	socklen_t addrlen = sizeof (addr);
+	memset (&addr, 0, sizeof (addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+
+	fd = socket (AF_INET, SOCK_DGRAM, 0);
+	assert (fd != -1);
+	assert (bind (fd, (struct sockaddr *)&addr, sizeof (addr)) == 0);
+	assert (getsockname (fd, (struct sockaddr *)&addr, &addrlen) == 0);
+	port = addr.sin_port;
+
+	if (teredo_filter_attach (fd))
+		return 77; /* not supported */
+
+	unsigned long drops = teredo_filter_drops (fd);
+	unsigned dropped = 0;
+
+	/* Bubbles, with any combination of headers */
+	for (unsigned i = 0; i < 4; i++)
+	{
+		len = build (buf, i & 1, i & 2, IPPROTO_NONE, 0, "2001:db8::1");
+		assert (test (global, buf, len));
+	}
+
+	/* Router solicitation */
+	len = build (buf, true, false, IPPROTO_ICMPV6, 8, "ff02::2");
+	assert (test (global, buf, len));
+
+	/* Small ICMPv6 to anywhere, large ICMPv6 to router addresses only */
+	len = build (buf, false, true, IPPROTO_ICMPV6, 88, "2001:db8::1");
+	assert (test (global, buf, len));
+	len = build (buf, false, false, IPPROTO_ICMPV6, 120, "ff02::2");
+	assert (test (global, buf, len));
+	len = build (buf, true, true, IPPROTO_ICMPV6, 120, "fe80::8000:1");
+	assert (test (global, buf, len));
+	len = build (buf, false, true, IPPROTO_ICMPV6, 89, "2001:db8::1");
+	assert (!test (global, buf, len)); dropped++;
+
+	/* Neither bubble nor ICMPv6 */
+	len = build (buf, false, false, IPPROTO_UDP, 8, "2001:db8::1");
+	assert (!test (global, buf, len)); dropped++;
+	len = build (buf, true, false, IPPROTO_NONE, 8, "2001:db8::1");
+	assert (!test (global, buf, len)); dropped++;
+
+	/* Not IPv6, truncated */
+	len = build (buf, false, false, IPPROTO_NONE, 0, "2001:db8::1");
+	buf[0] = 0x45;
+	assert (!test (global, buf, len)); dropped++;
+	len = build (buf, false, true, IPPROTO_ICMPV6, 16, "ff02::2");
+	assert (!test (global, buf, len - 1)); dropped++;
+	assert (!test (global, buf, 1)); dropped++;
+
+	/* Trailing bytes are accepted */
+	assert (test (global, buf, len + 10));
+
+	/* Non-global IPv4 sources, as per is_ipv4_global_unicast() */
+	static const char *const sources[] =
+		{ "0.1.2.3", "1.2.3.4", "10.1.2.3", "11.0.0.1", "127.0.0.1",
+		  "169.253.1.1", "169.254.1.1", "172.16.5.5", "172.31.255.255",
+		  "172.32.0.1", "192.88.98.1", "192.88.99.1", "192.168.0.1",
+		  "223.255.255.1", "240.0.0.1" };
+
+	len = build (buf, false, false, IPPROTO_NONE, 0, "2001:db8::1");
+	for (unsigned i = 0; i < sizeof (sources) / sizeof (sources[0]); i++)
+	{
+		uint32_t ip;
+
+		inet_pton (AF_INET, sources[i], &ip);
+		if (test (sources[i], buf, len) != is_ipv4_global_unicast (ip))
+		{
+			fprintf (stderr, "%s: wrong verdict\n", sources[i]);
+			return 1;
+		}
+		if (!is_ipv4_global_unicast (ip))
+			dropped++;
+	}
+
+	/* Drop counters, unless the kernel does not report them */
+	int val = drops_supported () ? 0 : 77;
+	drops = teredo_filter_drops (fd) - drops;
+	if ((val == 0) && (drops != dropped))
+	{
+		fprintf (stderr, "%lu packets dropped, instead of %u\n", drops,
+		         dropped);
+		return 1;
+	}
+
+	close (fd);
+	close (rawfd);
+	return val;
+}
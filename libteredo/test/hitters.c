@@ -0,0 +1,86 @@
+/*
+ * hitters.c - Libteredo heavy hitters tracker tests
+ */
+
+/***********************************************************************
+ *  Copyright © 2004-2007 Rémi Denis-Courmont.                         *
+ *  This program is free software; you can redistribute and/or modify  *
+ *  it under the terms of the GNU General Public License as published  *
+ *  by the Free Software Foundation; version 2 of the license, or (at  *
+ *  your option) any later version.                                    *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *  See the GNU General Public License for more details.               *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, you can get it from:              *
+ *  http://www.gnu.org/copyleft/gpl.html                               *
+ ***********************************************************************/
+
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#undef NDEBUG
+#include <assert.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <inttypes.h>
+
+#include <sys/types.h>
+#include <netinet/in.h>
+
+#include "hitters.h"
+
+#define SOURCES 5000
+
+int main (void)
+{
+	teredo_hitters *h = teredo_hitters_create (100);
+	teredo_talker tab[4];
+	unsigned long throttled = 0;
+
+	assert (h != NULL);
+	assert (teredo_hitters_top (h, tab, 4) == 0);
+
+	/* Many light sources, and two heavy ones */
+	for (unsigned i = 0; i < SOURCES; i++)
+	{
+		for (unsigned j = 0; j < 3; j++)
+			assert (!teredo_hitters_count (h, htonl (0x0a000000 + i), 1));
+		if (i < 1000)
+			throttled += teredo_hitters_count (h, htonl (0xc0000201), 1);
+		if (i < 300)
+			throttled += teredo_hitters_count (h, htonl (0xc0000202), 1);
+	}
+
+	/* Count-min sketches never under-estimate */
+	assert (throttled >= (1000 - 100) + (300 - 100));
+	assert (throttled < (1000 - 100) + (300 - 100) + 20);
+	assert (teredo_hitters_throttled (h) == throttled);
+
+	assert (teredo_hitters_top (h, tab, 4) == 2);
+	assert ((tab[0].ip == htonl (0xc0000201)) && (tab[0].rate >= 500));
+	assert ((tab[1].ip == htonl (0xc0000202)) && (tab[1].rate >= 150));
+	assert (teredo_hitters_top (h, tab, 1) == 1);
+	assert (tab[0].ip == htonl (0xc0000201));
+
+	/* Counts restart in each window */
+	assert (!teredo_hitters_count (h, htonl (0xc0000201), 2));
+	assert (teredo_hitters_top (h, tab, 4) == 2); // previous window
+	assert (!teredo_hitters_count (h, htonl (0xc0000201), 4));
+	assert (teredo_hitters_top (h, tab, 4) == 0);
+
+	/* No limit */
+	teredo_hitters_set_limit (h, 0);
+	for (unsigned i = 0; i < 1000; i++)
+		assert (!teredo_hitters_count (h, htonl (0xc0000201), 4));
+	assert (teredo_hitters_top (h, tab, 4) == 1);
+	assert (tab[0].rate == 512);
+
+	teredo_hitters_destroy (h);
+	return 0;
+}
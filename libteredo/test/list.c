@@ -170,7 +170,7 @@ int main (void)
 	putenv ((char *)"MALLOC_CHECK_=2");
 
 	puts ("Basic empty list test...");
-	teredo_peerlist *l = teredo_list_create (0, 3);
+	teredo_peerlist *l = teredo_list_create (0, 3, true);
 	if (l == NULL)
 		return -1;
 	else
@@ -184,7 +184,7 @@ int main (void)
 	}
 
 	puts ("Advanced empty list test...");
-	l = teredo_list_create (0, 3);
+	l = teredo_list_create (0, 3, true);
 	if (l == NULL)
 		return -1;
 	else
@@ -210,7 +210,7 @@ int main (void)
 	}
 
 	puts ("List creation test...");
-	l = teredo_list_create (255, 2);
+	l = teredo_list_create (255, 2, true);
 	if (l == NULL)
 		return -1;
 
@@ -0,0 +1,236 @@
+/*
+ * maintain.c - Libteredo multi-server qualification tests
+ */
+
+/***********************************************************************
+ *  Copyright © 2004-2007 Rémi Denis-Courmont.                         *
+ *  This program is free software; you can redistribute and/or modify  *
+ *  it under the terms of the GNU General Public License as published  *
+ *  by the Free Software Foundation; version 2 of the license, or (at  *
+ *  your option) any later version.                                    *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *  See the GNU General Public License for more details.               *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, you can get it from:              *
+ *  http://www.gnu.org/copyleft/gpl.html                               *
+ ***********************************************************************/
+
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#undef NDEBUG
+#include <assert.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h> // sleep()
+
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <poll.h>
+
+#include "teredo.h"
+#include "teredo-udp.h"
+#include "tunnel.h"
+#include "maintain.h"
+#include "standin.h"
+
+/* Stand-in servers addresses, which must be global and local */
+#define FAST_SERVER "198.51.100.2"
+#define SLOW_SERVER "198.51.100.3"
+/* Servers answering in one burst: more than the former ring size */
+static const char *const burst_servers[] =
+{
+	"198.51.100.1", "198.51.100.2", "198.51.100.3", "198.51.100.4",
+	"198.51.100.5",
+};
+#define BURST_SERVERS (sizeof (burst_servers) / sizeof (burst_servers[0]))
+
+#define REFRESH 2 // seconds
+#define TIMEOUT 1 // seconds
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wait = PTHREAD_COND_INITIALIZER;
+static teredo_state state;
+static unsigned downs = 0;
+static unsigned changes = 0;
+
+static void state_change (const teredo_state *s, void *opaque)
+{
+	(void)opaque;
+
+	pthread_mutex_lock (&lock);
+	state = *s;
+	changes++;
+	if (!s->up)
+		downs++;
+	pthread_cond_signal (&wait);
+	pthread_mutex_unlock (&lock);
+}
+
+
+static bool wait_server (uint32_t ip, unsigned sec)
+{
+	struct timespec deadline;
+	int val = 0;
+
+	clock_gettime (CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += sec;
+
+	pthread_mutex_lock (&lock);
+	while (!(state.up && (state.addr.teredo.server_ip == ip))
+	    && (val != ETIMEDOUT))
+		val = pthread_cond_timedwait (&wait, &lock, &deadline);
+	pthread_mutex_unlock (&lock);
+	return val != ETIMEDOUT;
+}
+
+
+static int client_fd;
+
+static void *client_thread (void *data)
+{
+	teredo_maintenance *m = (teredo_maintenance *)data;
+	static teredo_packet p;
+
+	for (;;)
+		if (teredo_wait_recv (client_fd, &p) == 0)
+			teredo_maintenance_process (m, &p);
+	return NULL;
+}
+
+
+/**
+ * Passes received packets to the maintenance thread in bursts, as a
+ * receiving thread would after a batched receive.
+ */
+static void *client_burst_thread (void *data)
+{
+	teredo_maintenance *m = (teredo_maintenance *)data;
+	static teredo_packet p[BURST_SERVERS];
+	struct pollfd ufd = { .fd = client_fd, .events = POLLIN };
+
+	for (;;)
+	{
+		unsigned n = 0;
+
+		/* Wait for the first packet, then for the rest of the burst */
+		while ((n < BURST_SERVERS) && (poll (&ufd, 1, n ? 100 : -1) > 0))
+			if (teredo_recv (client_fd, p + n) == 0)
+				n++;
+
+		for (unsigned i = 0; i < n; i++)
+			teredo_maintenance_process (m, p + i);
+	}
+	return NULL;
+}
+
+
+int main (void)
+{
+	standin fast, slow;
+	pthread_t th;
+
+	/* Stand-in servers need global IPv4 addresses on a local interface */
+	if (standin_start (&fast, FAST_SERVER, 0, NULL, NULL)
+	 || standin_start (&slow, SLOW_SERVER, 50000000, NULL, NULL))
+	{
+		perror (FAST_SERVER " or " SLOW_SERVER);
+		return 77;
+	}
+
+	assert (teredo_startup (true) == 0);
+	client_fd = teredo_socket (INADDR_ANY, 0);
+	assert (client_fd != -1);
+
+	/* The fastest server is used, whatever the order */
+	const char *servers[] = { SLOW_SERVER, FAST_SERVER };
+	teredo_maintenance *m;
+	m = teredo_maintenance_start (client_fd, state_change, NULL, NULL,
+	                              servers, 2, TIMEOUT, 3, REFRESH, 60, 0,
+	                              NULL);
+	assert (m != NULL);
+	assert (pthread_create (&th, NULL, client_thread, m) == 0);
+	assert (wait_server (fast.ip, 10));
+
+	/* A single lost advertisement does not change the server */
+	pthread_mutex_lock (&lock);
+	unsigned n = changes;
+	pthread_mutex_unlock (&lock);
+	standin_drop (&fast, 1);
+	sleep (REFRESH + TIMEOUT);
+	assert (__atomic_load_n (&fast.drop, __ATOMIC_RELAXED) == 0);
+	pthread_mutex_lock (&lock);
+	assert ((changes == n) && (state.addr.teredo.server_ip == fast.ip));
+	pthread_mutex_unlock (&lock);
+
+	/* Fail over to the hot standby */
+	struct timespec t0, t1;
+	clock_gettime (CLOCK_MONOTONIC, &t0);
+	standin_stop (&fast);
+	assert (wait_server (slow.ip, 10));
+	clock_gettime (CLOCK_MONOTONIC, &t1);
+
+	double ttr = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) * 1e-9;
+	printf ("Time to recover: %.3f s\n", ttr);
+	/* At most one refresh interval and two short retry time outs, well
+	 * within the qualification time out, without going down */
+	assert (ttr < REFRESH + TIMEOUT);
+	assert (downs == 0);
+
+	pthread_cancel (th);
+	pthread_join (th, NULL);
+	teredo_maintenance_stop (m);
+	standin_stop (&slow);
+	teredo_close (client_fd);
+
+	/* Advertisements from all servers at once: none may be lost */
+	standin burst[BURST_SERVERS];
+
+	for (unsigned i = 0; i < BURST_SERVERS; i++)
+		/* Staggered, so that the same server always comes last */
+		if (standin_start (burst + i, burst_servers[i], 2000000 * i,
+		                   NULL, NULL))
+		{
+			perror (burst_servers[i]);
+			return 77;
+		}
+
+	client_fd = teredo_socket (INADDR_ANY, 0);
+	assert (client_fd != -1);
+	m = teredo_maintenance_start (client_fd, state_change, NULL, NULL,
+	                              burst_servers, BURST_SERVERS, TIMEOUT, 3,
+	                              1, 60, 0, NULL);
+	assert (m != NULL);
+	assert (pthread_create (&th, NULL, client_burst_thread, m) == 0);
+
+	/* Unanswered servers are no longer solicited after 3 rounds */
+	sleep (5);
+	pthread_cancel (th);
+	pthread_join (th, NULL);
+	teredo_maintenance_stop (m);
+
+	for (unsigned i = 0; i < BURST_SERVERS; i++)
+	{
+		standin_stop (burst + i);
+		printf ("%s: %u solicitations\n", burst_servers[i],
+		        burst[i].solicitations);
+		assert (burst[i].solicitations + 1 >= burst[0].solicitations);
+		assert (burst[i].solicitations >= 4);
+	}
+
+	teredo_close (client_fd);
+	teredo_cleanup (true);
+	return 0;
+}
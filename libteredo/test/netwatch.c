@@ -0,0 +1,250 @@
+/*
+ * netwatch.c - Libteredo network change requalification tests
+ */
+
+/***********************************************************************
+ *  Copyright © 2004-2007 Rémi Denis-Courmont.                         *
+ *  This program is free software; you can redistribute and/or modify  *
+ *  it under the terms of the GNU General Public License as published  *
+ *  by the Free Software Foundation; version 2 of the license, or (at  *
+ *  your option) any later version.                                    *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *  See the GNU General Public License for more details.               *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, you can get it from:              *
+ *  http://www.gnu.org/copyleft/gpl.html                               *
+ ***********************************************************************/
+
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#undef NDEBUG
+#include <assert.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <time.h>
+#include <errno.h>
+
+#include <sys/types.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <fcntl.h>
+#ifdef __linux__
+# include <sched.h> // unshare()
+# include <linux/if_tun.h>
+#endif
+
+#include "teredo.h"
+#include "teredo-udp.h"
+#include "tunnel.h"
+#include "maintain.h"
+#include "standin.h"
+
+#define SERVER "198.51.100.2"
+#define OTHER  "198.51.100.5"
+
+#define REFRESH 30 // seconds
+
+static uint16_t epoch = 0;
+
+/**
+ * Stand-in NAT: the mapped port changes with the NAT epoch.
+ */
+static uint16_t nat_map (uint16_t port, void *opaque)
+{
+	(void)opaque;
+	return port ^ htons (__atomic_load_n (&epoch, __ATOMIC_SEQ_CST));
+}
+
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wait = PTHREAD_COND_INITIALIZER;
+static teredo_state state;
+
+static void state_change (const teredo_state *s, void *opaque)
+{
+	(void)opaque;
+
+	pthread_mutex_lock (&lock);
+	state = *s;
+	pthread_cond_signal (&wait);
+	pthread_mutex_unlock (&lock);
+}
+
+
+static bool wait_port (uint16_t port, unsigned sec)
+{
+	struct timespec deadline;
+	uint16_t mapped = ~port; // obfuscated in Teredo addresses
+	int val = 0;
+
+	clock_gettime (CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += sec;
+
+	pthread_mutex_lock (&lock);
+	while (!(state.up && (state.addr.teredo.client_port == mapped))
+	    && (val != ETIMEDOUT))
+		val = pthread_cond_timedwait (&wait, &lock, &deadline);
+	pthread_mutex_unlock (&lock);
+	return val != ETIMEDOUT;
+}
+
+
+static int client_fd;
+
+static void *client_thread (void *data)
+{
+	teredo_maintenance *m = (teredo_maintenance *)data;
+	static teredo_packet p;
+
+	for (;;)
+		if (teredo_wait_recv (client_fd, &p) == 0)
+			teredo_maintenance_process (m, &p);
+	return NULL;
+}
+
+
+static int set_addr (int fd, const char *ifname, const char *addr)
+{
+	struct ifreq req;
+	struct sockaddr_in *sin = (struct sockaddr_in *)&req.ifr_addr;
+
+	memset (&req, 0, sizeof (req));
+	strcpy (req.ifr_name, ifname);
+	sin->sin_family = AF_INET;
+	sin->sin_addr.s_addr = inet_addr (addr);
+	if (ioctl (fd, SIOCSIFADDR, &req))
+		return -1;
+
+	if (ioctl (fd, SIOCGIFFLAGS, &req))
+		return -1;
+	req.ifr_flags |= IFF_UP;
+	return ioctl (fd, SIOCSIFFLAGS, &req);
+}
+
+
+/**
+ * Creates a tunnel interface, like the Teredo one.
+ * @return file descriptor, or -1 on error.
+ */
+static int tun_open (const char *ifname)
+{
+#ifdef __linux__
+	struct ifreq req;
+	int fd = open ("/dev/net/tun", O_RDWR);
+	if (fd == -1)
+		return -1;
+
+	memset (&req, 0, sizeof (req));
+	strcpy (req.ifr_name, ifname);
+	req.ifr_flags = IFF_TUN;
+	if (ioctl (fd, TUNSETIFF, &req) == 0)
+		return fd;
+	close (fd);
+#else
+	(void)ifname;
+#endif
+	return -1;
+}
+
+
+static int set_flags (int fd, const char *ifname, bool up)
+{
+	struct ifreq req;
+
+	memset (&req, 0, sizeof (req));
+	strcpy (req.ifr_name, ifname);
+	if (ioctl (fd, SIOCGIFFLAGS, &req))
+		return -1;
+	if (up)
+		req.ifr_flags |= IFF_UP;
+	else
+		req.ifr_flags &= ~IFF_UP;
+	return ioctl (fd, SIOCSIFFLAGS, &req);
+}
+
+
+int main (void)
+{
+#ifdef __linux__
+	/* Private network namespace, as root or in a user namespace */
+	if (unshare (CLONE_NEWNET) && unshare (CLONE_NEWUSER | CLONE_NEWNET))
+#endif
+	{
+		perror ("Network namespace");
+		return 77;
+	}
+
+	int fd = socket (AF_INET, SOCK_DGRAM, 0);
+	assert (fd != -1);
+	assert (set_addr (fd, "lo", "127.0.0.1") == 0);
+	assert (set_addr (fd, "lo:1", SERVER) == 0);
+
+	standin server;
+	pthread_t client;
+	assert (standin_start (&server, SERVER, 0, nat_map, NULL) == 0);
+
+	assert (teredo_startup (true) == 0);
+	client_fd = teredo_socket (INADDR_ANY, 0);
+	assert (client_fd != -1);
+
+	struct sockaddr_in addr;
+	socklen_t addrlen = sizeof (addr);
+	assert (getsockname (client_fd, (struct sockaddr *)&addr, &addrlen) == 0);
+
+	const char *servers[] = { SERVER };
+	teredo_maintenance *m;
+	m = teredo_maintenance_start (client_fd, state_change, NULL, NULL,
+	                              servers, 1, 1, 3, REFRESH, 60, 0,
+	                              NULL);
+	assert (m != NULL);
+	assert (pthread_create (&client, NULL, client_thread, m) == 0);
+	assert (wait_port (addr.sin_port, 10));
+
+	/* The NAT mapping changes along with the network configuration */
+	struct timespec t0, t1;
+	clock_gettime (CLOCK_MONOTONIC, &t0);
+	__atomic_store_n (&epoch, 1, __ATOMIC_SEQ_CST);
+	assert (set_addr (fd, "lo:2", OTHER) == 0);
+	assert (wait_port (addr.sin_port ^ htons (1), REFRESH / 2));
+	clock_gettime (CLOCK_MONOTONIC, &t1);
+
+	double ttr = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) * 1e-9;
+	printf ("Time to recover: %.3f s\n", ttr);
+	assert (ttr < 2.);
+
+	/* The tunnel going up or down does not change the NAT mapping */
+	int tun_fd = tun_open ("teredo");
+	if (tun_fd != -1)
+	{
+		__atomic_store_n (&epoch, 2, __ATOMIC_SEQ_CST);
+		assert (set_flags (fd, "teredo", true) == 0);
+		assert (set_flags (fd, "teredo", false) == 0);
+		assert (!wait_port (addr.sin_port ^ htons (2), 2));
+		close (tun_fd);
+	}
+	else
+		perror ("Tunnel interface");
+
+	pthread_cancel (client);
+	pthread_join (client, NULL);
+	teredo_maintenance_stop (m);
+	standin_stop (&server);
+	teredo_close (client_fd);
+	close (fd);
+	teredo_cleanup (true);
+	return 0;
+}
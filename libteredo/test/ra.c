@@ -0,0 +1,175 @@
+/*
+ * ra.c - Libteredo server Router Advertisement checksum tests
+ */
+
+/***********************************************************************
+ *  Copyright © 2004-2007 Rémi Denis-Courmont.                         *
+ *  This program is free software; you can redistribute and/or modify  *
+ *  it under the terms of the GNU General Public License as published  *
+ *  by the Free Software Foundation; version 2 of the license, or (at  *
+ *  your option) any later version.                                    *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *  See the GNU General Public License for more details.               *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, you can get it from:              *
+ *  http://www.gnu.org/copyleft/gpl.html                               *
+ ***********************************************************************/
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#undef NDEBUG
+#include <assert.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/ip6.h>
+#include <netinet/icmp6.h>
+#include <arpa/inet.h>
+#include <poll.h>
+
+#include "teredo.h"
+#include "teredo-udp.h"
+#include "checksum.h"
+#include "server.h"
+
+/* Server addresses, which must be global and local */
+#define SERVER  "198.51.100.4"
+#define SERVER2 "198.51.100.5"
+
+/* Client addresses and ports, which must be global and local too */
+static const char *const clients[] = {
+	"198.51.100.1", "198.51.100.2", "198.51.100.3" };
+static const uint16_t ports[] = { 0, 3544, 40000, 65535 };
+
+/**
+ * Sends a Router Solicitation from a link-local address that embeds the
+ * client address and port, as Teredo clients do.
+ */
+static void send_rs (int fd, uint32_t server_ip, const unsigned char *nonce,
+                     bool cone)
+{
+	uint8_t auth[13] = { 0, 1 };
+	struct
+	{
+		struct ip6_hdr ip6;
+		struct nd_router_solicit rs;
+	} rs;
+	struct iovec iov[] =
+	{
+		{ auth, 13 },
+		{ &rs, sizeof (rs) }
+	};
+	struct sockaddr_in addr;
+	socklen_t addrlen = sizeof (addr);
+	union teredo_addr *src = (union teredo_addr *)&rs.ip6.ip6_src;
+
+	assert (getsockname (fd, (struct sockaddr *)&addr, &addrlen) == 0);
+	memcpy (auth + 4, nonce, 8);
+
+	memset (&rs, 0, sizeof (rs));
+	rs.ip6.ip6_flow = htonl (0x60000000);
+	rs.ip6.ip6_plen = htons (sizeof (rs.rs));
+	rs.ip6.ip6_nxt = IPPROTO_ICMPV6;
+	rs.ip6.ip6_hlim = 255;
+	src->teredo.prefix = htonl (0xfe800000);
+	src->teredo.flags = cone ? htons (TEREDO_FLAG_CONE) : 0;
+	src->teredo.client_port = ~addr.sin_port;
+	src->teredo.client_ip = ~addr.sin_addr.s_addr;
+	inet_pton (AF_INET6, "ff02::2", &rs.ip6.ip6_dst);
+
+	rs.rs.nd_rs_type = ND_ROUTER_SOLICIT;
+	rs.rs.nd_rs_cksum = icmp6_checksum (&rs.ip6,
+	                                    (struct icmp6_hdr *)&rs.rs);
+
+	assert (teredo_sendv (fd, iov, 2, server_ip, htons (IPPORT_TEREDO))
+	        == (int)(13 + sizeof (rs)));
+}
+
+
+/**
+ * Solicits the server, and checks the checksum of the advertisement against
+ * one computed from scratch.
+ * @return 0 on success, -1 if there is no advertisement or if the checksum
+ * is wrong.
+ */
+static int check_ra (int fd, uint32_t server_ip, bool cone)
+{
+	static const unsigned char nonce[8] = "ChkSum!";
+	struct pollfd ufd = { .fd = fd, .events = POLLIN };
+	teredo_packet packet;
+
+	send_rs (fd, server_ip, nonce, cone);
+	if ((poll (&ufd, 1, 2000) <= 0) || teredo_recv (fd, &packet))
+		return -1;
+
+	assert (packet.auth_present);
+	assert (memcmp (packet.auth_nonce, nonce, 8) == 0);
+	assert (packet.ip6_len >= sizeof (struct ip6_hdr)
+	                           + sizeof (struct nd_router_advert));
+	assert (packet.ip6->ip6_nxt == IPPROTO_ICMPV6);
+
+	struct nd_router_advert *ra =
+		(struct nd_router_advert *)(packet.ip6 + 1);
+	uint16_t cksum = ra->nd_ra_cksum;
+
+	assert (ra->nd_ra_type == ND_ROUTER_ADVERT);
+	ra->nd_ra_cksum = 0;
+	if (icmp6_checksum (packet.ip6, (struct icmp6_hdr *)ra) != cksum)
+	{
+		char b[INET6_ADDRSTRLEN];
+
+		fprintf (stderr, "Bad checksum 0x%04"PRIx16" to %s\n",
+		         ntohs (cksum),
+		         inet_ntop (AF_INET6, &packet.ip6->ip6_dst, b, sizeof (b)));
+		return -1;
+	}
+	return 0;
+}
+
+
+int main (void)
+{
+	uint32_t ip1 = inet_addr (SERVER), ip2 = inet_addr (SERVER2);
+	teredo_server *s = teredo_server_create (ip1, ip2);
+
+	/* Needs privileges, and both addresses on a local interface */
+	if (s == NULL)
+		return 77;
+	assert (teredo_server_start (s) == 0);
+
+	/* Default template, then updated prefix and MTU */
+	for (unsigned t = 0; t < 3; t++)
+	{
+		if (t == 1)
+			assert (teredo_server_set_prefix (s, htonl (0x3ffe831f)) == 0);
+		if (t == 2)
+			assert (teredo_server_set_MTU (s, 1400) == 0);
+
+		for (unsigned i = 0; i < sizeof (clients) / sizeof (clients[0]); i++)
+			for (unsigned j = 0; j < sizeof (ports) / sizeof (ports[0]); j++)
+			{
+				int fd = teredo_socket (inet_addr (clients[i]),
+				                        htons (ports[j]));
+
+				assert (fd != -1);
+				assert (check_ra (fd, ip1, false) == 0);
+				assert (check_ra (fd, ip1, true) == 0);
+				teredo_close (fd);
+			}
+	}
+
+	teredo_server_stop (s);
+	teredo_server_destroy (s);
+	return 0;
+}
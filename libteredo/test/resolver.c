@@ -0,0 +1,104 @@
+/*
+ * resolver.c - Libteredo asynchronous resolver tests
+ */
+
+/***********************************************************************
+ *  Copyright © 2004-2007 Rémi Denis-Courmont.                         *
+ *  This program is free software; you can redistribute and/or modify  *
+ *  it under the terms of the GNU General Public License as published  *
+ *  by the Free Software Foundation; version 2 of the license, or (at  *
+ *  your option) any later version.                                    *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *  See the GNU General Public License for more details.               *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, you can get it from:              *
+ *  http://www.gnu.org/copyleft/gpl.html                               *
+ ***********************************************************************/
+
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#undef NDEBUG
+#include <assert.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <inttypes.h>
+#include <time.h>
+#include <errno.h>
+
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <pthread.h>
+
+#include "resolver.h"
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wait = PTHREAD_COND_INITIALIZER;
+static unsigned updates = 0;
+
+static void updated (void *opaque)
+{
+	assert (opaque == &updates);
+
+	pthread_mutex_lock (&lock);
+	updates++;
+	pthread_cond_signal (&wait);
+	pthread_mutex_unlock (&lock);
+}
+
+
+static bool wait_update (unsigned n)
+{
+	struct timespec deadline;
+	int val = 0;
+
+	clock_gettime (CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += 10;
+
+	pthread_mutex_lock (&lock);
+	while ((updates < n) && (val != ETIMEDOUT))
+		val = pthread_cond_timedwait (&wait, &lock, &deadline);
+	pthread_mutex_unlock (&lock);
+	return updates >= n;
+}
+
+
+int main (void)
+{
+	teredo_resolver *r;
+	uint32_t ipv4 = 0;
+
+	/* Numeric addresses do not need DNS */
+	r = teredo_resolver_create ("192.0.2.1", 3600, 1, updated, &updates);
+	assert (r != NULL);
+	assert (wait_update (1));
+	assert (teredo_resolver_get (r, 0, &ipv4) == 1);
+	assert (ipv4 == htonl (0xc0000201));
+	ipv4 = 0;
+	assert (teredo_resolver_get (r, 7, &ipv4) == 1);
+	assert (ipv4 == htonl (0xc0000201));
+
+	/* Unchanged addresses are not notified again */
+	struct timespec ts = { 0, 200000000 };
+	teredo_resolver_refresh (r);
+	nanosleep (&ts, NULL);
+	assert (updates == 1);
+	teredo_resolver_destroy (r);
+
+	/* Non-global addresses are never returned */
+	updates = 0;
+	r = teredo_resolver_create ("10.1.2.3", 3600, 1, updated, &updates);
+	assert (r != NULL);
+	nanosleep (&ts, NULL);
+	assert (teredo_resolver_get (r, 0, &ipv4) == 0);
+	assert (updates == 0);
+	teredo_resolver_destroy (r);
+
+	return 0;
+}
@@ -0,0 +1,115 @@
+/*
+ * sendmv.c - Libteredo batched UDP transmission and reception tests
+ */
+
+/***********************************************************************
+ *  Copyright © 2004-2007 Rémi Denis-Courmont.                         *
+ *  This program is free software; you can redistribute and/or modify  *
+ *  it under the terms of the GNU General Public License as published  *
+ *  by the Free Software Foundation; version 2 of the license, or (at  *
+ *  your option) any later version.                                    *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *  See the GNU General Public License for more details.               *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, you can get it from:              *
+ *  http://www.gnu.org/copyleft/gpl.html                               *
+ ***********************************************************************/
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#undef NDEBUG
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/ip6.h>
+#include <unistd.h>
+
+#include "teredo.h"
+#include "teredo-udp.h"
+
+#define COUNT 100
+
+int main (void)
+{
+	uint32_t lo = htonl (INADDR_LOOPBACK);
+	int fd = teredo_socket (lo, 0);
+	assert (fd != -1);
+
+	struct sockaddr_in addr;
+	socklen_t addrlen = sizeof (addr);
+	int val = getsockname (fd, (struct sockaddr *)&addr, &addrlen);
+	assert (val == 0);
+
+	uint8_t payload[COUNT];
+	struct iovec iov[COUNT];
+	teredo_datagram dgv[COUNT];
+
+	for (unsigned i = 0; i < COUNT; i++)
+	{
+		payload[i] = i;
+		iov[i].iov_base = payload + i;
+		iov[i].iov_len = 1;
+		dgv[i].iov = iov + i;
+		dgv[i].iovlen = 1;
+		dgv[i].ip = lo;
+		dgv[i].port = addr.sin_port;
+	}
+
+	/* Non-routable destination in the middle of the batch */
+	dgv[COUNT / 2].ip = htonl (INADDR_BROADCAST);
+
+	val = teredo_sendmv (fd, dgv, COUNT);
+	assert (val == COUNT - 1);
+
+	for (unsigned i = 0; i < COUNT; i++)
+	{
+		uint8_t b;
+
+		if (i == COUNT / 2)
+			continue;
+
+		val = recv (fd, &b, 1, MSG_DONTWAIT);
+		assert (val == 1);
+		assert (b == i);
+	}
+
+	/* Burst reception, including a malformatted (too small) packet */
+	static const uint8_t data[8] = { 0x60 };
+	struct teredo_packet *pv = malloc (16 * sizeof (*pv));
+	assert (pv != NULL);
+
+	for (unsigned i = 0; i < 4; i++)
+	{
+		val = teredo_send (fd, data, i ? sizeof (data) : 1, lo,
+		                   addr.sin_port);
+		assert (val == (i ? (int)sizeof (data) : 1));
+	}
+
+	val = teredo_wait_recv_burst (fd, pv, 16);
+	assert (val == 4);
+	assert (pv[0].ip6_len == 0);
+	for (unsigned i = 1; i < 4; i++)
+	{
+		assert (pv[i].ip6_len == sizeof (data));
+		assert (memcmp (pv[i].ip6, data, sizeof (data)) == 0);
+		assert (pv[i].source_ipv4 == lo);
+		assert (pv[i].source_port == addr.sin_port);
+	}
+
+	free (pv);
+	teredo_close (fd);
+	return 0;
+}
@@ -0,0 +1,135 @@
+/*
+ * standin.c - Stand-in Teredo server for the client tests
+ */
+
+/***********************************************************************
+ *  Copyright © 2004-2007 Rémi Denis-Courmont.                         *
+ *  This program is free software; you can redistribute and/or modify  *
+ *  it under the terms of the GNU General Public License as published  *
+ *  by the Free Software Foundation; version 2 of the license, or (at  *
+ *  your option) any later version.                                    *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *  See the GNU General Public License for more details.               *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, you can get it from:              *
+ *  http://www.gnu.org/copyleft/gpl.html                               *
+ ***********************************************************************/
+
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#undef NDEBUG
+#include <assert.h>
+#include <stdbool.h>
+#include <string.h>
+#include <inttypes.h>
+#include <time.h>
+
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/ip6.h>
+#include <netinet/icmp6.h>
+#include <arpa/inet.h>
+#include <pthread.h>
+
+#include "teredo.h"
+#include "teredo-udp.h"
+#include "tunnel.h"
+#include "standin.h"
+
+static void *standin_thread (void *data)
+{
+	standin *s = (standin *)data;
+	teredo_packet p;
+
+	for (;;)
+	{
+		if (teredo_wait_recv (s->fd, &p) || !p.auth_present)
+			continue;
+
+		__atomic_fetch_add (&s->solicitations, 1, __ATOMIC_RELAXED);
+		if (__atomic_load_n (&s->drop, __ATOMIC_RELAXED) > 0)
+		{
+			__atomic_fetch_sub (&s->drop, 1, __ATOMIC_RELAXED);
+			continue;
+		}
+		if (s->delay)
+			nanosleep (&(struct timespec){ 0, s->delay }, NULL);
+
+		uint8_t hdr[21] = { 0, 1, 0, 0 };
+		memcpy (hdr + 4, p.auth_nonce, 8);
+		uint16_t port = (s->map != NULL)
+			? s->map (p.source_port, s->opaque) : p.source_port;
+		port = ~port;
+		uint32_t ipv4 = ~p.source_ipv4;
+		memcpy (hdr + 15, &port, 2);
+		memcpy (hdr + 17, &ipv4, 4);
+
+		struct
+		{
+			struct ip6_hdr ip6;
+			struct nd_router_advert ra;
+			struct nd_opt_prefix_info pi;
+		} ra;
+
+		memset (&ra, 0, sizeof (ra));
+		ra.ip6.ip6_flow = htonl (0x60000000);
+		ra.ip6.ip6_plen = htons (sizeof (ra) - sizeof (ra.ip6));
+		ra.ip6.ip6_nxt = IPPROTO_ICMPV6;
+		ra.ip6.ip6_hlim = 255;
+		ra.ip6.ip6_src.s6_addr[0] = 0xfe;
+		ra.ip6.ip6_src.s6_addr[1] = 0x80;
+		ra.ip6.ip6_dst = teredo_restrict;
+		ra.ra.nd_ra_type = ND_ROUTER_ADVERT;
+		ra.pi.nd_opt_pi_type = ND_OPT_PREFIX_INFORMATION;
+		ra.pi.nd_opt_pi_len = sizeof (ra.pi) >> 3;
+		ra.pi.nd_opt_pi_prefix_len = 64;
+
+		union teredo_addr prefix;
+		memset (&prefix, 0, sizeof (prefix));
+		prefix.teredo.prefix = htonl (TEREDO_PREFIX);
+		prefix.teredo.server_ip = s->ip;
+		ra.pi.nd_opt_pi_prefix = prefix.ip6;
+
+		struct iovec iov[] =
+		{
+			{ hdr, sizeof (hdr) },
+			{ &ra, sizeof (ra) }
+		};
+		teredo_sendv (s->fd, iov, 2, p.source_ipv4, p.source_port);
+	}
+	return NULL;
+}
+
+
+int standin_start (standin *s, const char *ip, long delay,
+                   standin_map_cb map, void *opaque)
+{
+	s->ip = inet_addr (ip);
+	s->delay = delay;
+	s->map = map;
+	s->opaque = opaque;
+	s->solicitations = 0;
+	s->drop = 0;
+	s->fd = teredo_socket (s->ip, htons (IPPORT_TEREDO));
+	if (s->fd == -1)
+		return -1;
+
+	assert (pthread_create (&s->thread, NULL, standin_thread, s) == 0);
+	return 0;
+}
+
+
+void standin_stop (standin *s)
+{
+	pthread_cancel (s->thread);
+	pthread_join (s->thread, NULL);
+	teredo_close (s->fd);
+}
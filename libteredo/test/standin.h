@@ -0,0 +1,82 @@
+/**
+ * @file standin.h
+ * @brief Stand-in Teredo server for the client tests
+ */
+
+/***********************************************************************
+ *  Copyright © 2004-2007 Rémi Denis-Courmont.                         *
+ *  This program is free software; you can redistribute and/or modify  *
+ *  it under the terms of the GNU General Public License as published  *
+ *  by the Free Software Foundation; version 2 of the license, or (at  *
+ *  your option) any later version.                                    *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *  See the GNU General Public License for more details.               *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, you can get it from:              *
+ *  http://www.gnu.org/copyleft/gpl.html                               *
+ ***********************************************************************/
+
+#ifndef MIREDO_LIBTEREDO_TEST_STANDIN_H
+# define MIREDO_LIBTEREDO_TEST_STANDIN_H
+
+/**
+ * Stand-in NAT: maps the source port of a solicitation (network byte
+ * order) to the port the server advertises.
+ */
+typedef uint16_t (*standin_map_cb) (uint16_t port, void *opaque);
+
+/**
+ * Stand-in Teredo server: replies to router solicitations, as seen from
+ * behind a stand-in NAT, after a delay.
+ */
+typedef struct standin
+{
+	pthread_t thread;
+	int fd;
+	uint32_t ip;
+	long delay; // nanoseconds
+	standin_map_cb map; // NULL if no NAT
+	void *opaque;
+	unsigned solicitations; // received so far
+	unsigned drop; // solicitations to ignore
+} standin;
+
+/**
+ * Starts a stand-in server on UDP port 3544 of a local IPv4 address.
+ * The address must be global for the client to accept its advertisements.
+ *
+ * @param ip dotted quad address of the server
+ * @param delay time to wait before replying (nanoseconds)
+ * @param map NAT port mapping callback, or NULL for none
+ *
+ * @return 0 on success, -1 if the address could not be bound.
+ */
+int standin_start (standin *s, const char *ip, long delay,
+                   standin_map_cb map, void *opaque);
+
+/**
+ * Stops a stand-in server and closes its socket.
+ */
+void standin_stop (standin *s);
+
+/**
+ * @return the number of solicitations received so far.
+ */
+static inline unsigned standin_solicitations (const standin *s)
+{
+	return __atomic_load_n (&s->solicitations, __ATOMIC_RELAXED);
+}
+
+/**
+ * Ignores the next n solicitations, as if the replies were lost.
+ */
+static inline void standin_drop (standin *s, unsigned n)
+{
+	__atomic_store_n (&s->drop, n, __ATOMIC_RELAXED);
+}
+
+#endif /* ifndef MIREDO_LIBTEREDO_TEST_STANDIN_H */
@@ -28,8 +28,12 @@
 #include <stdbool.h>
 #include <stdint.h>
 
+#include <string.h>
+
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
+#include <netinet/ip6.h>
 
 #include "teredo.h"
 #include "tunnel.h"
@@ -85,6 +89,25 @@ int main (void)
 	teredo_set_icmpv6_callback (tunnel, NULL);
 	teredo_set_state_cb (tunnel, NULL, NULL);
 
+	// Non-Teredo and multicast destinations, and a truncated packet
+	struct ip6_hdr pkts[3];
+	struct iovec iov[3];
+	memset (pkts, 0, sizeof (pkts));
+	for (unsigned i = 0; i < 3; i++)
+	{
+		pkts[i].ip6_vfc = 0x60;
+		pkts[i].ip6_nxt = IPPROTO_NONE;
+		iov[i].iov_base = pkts + i;
+		iov[i].iov_len = sizeof (pkts[i]);
+	}
+	pkts[0].ip6_dst.s6_addr[0] = 0x20;
+	pkts[1].ip6_dst.s6_addr[0] = 0xff;
+	iov[2].iov_len = 20;
+	val = teredo_transmit_batch (tunnel, iov, 3);
+	assert (val == 0);
+	val = teredo_get_icmpv6_drops (tunnel);
+	assert (val == 0);
+
 	teredo_destroy (tunnel);
 
 	teredo_cleanup (false);
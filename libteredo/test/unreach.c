@@ -0,0 +1,161 @@
+/*
+ * unreach.c - Libteredo deferred ICMPv6 errors tests
+ */
+
+/***********************************************************************
+ *  Copyright © 2004-2007 Rémi Denis-Courmont.                         *
+ *  This program is free software; you can redistribute and/or modify  *
+ *  it under the terms of the GNU General Public License as published  *
+ *  by the Free Software Foundation; version 2 of the license, or (at  *
+ *  your option) any later version.                                    *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *  See the GNU General Public License for more details.               *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, you can get it from:              *
+ *  http://www.gnu.org/copyleft/gpl.html                               *
+ ***********************************************************************/
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#undef NDEBUG
+#include <assert.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <inttypes.h>
+
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <netinet/ip6.h>
+#include <netinet/icmp6.h>
+#include <pthread.h>
+
+#include "clock.h"
+#include "unreach.h"
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned received;
+
+static void emit (void *opaque, const struct icmp6_hdr *err, size_t len,
+                  const struct in6_addr *dst)
+{
+	const struct ip6_hdr *in = (const struct ip6_hdr *)(err + 1);
+
+	assert (opaque == &received);
+	assert (err->icmp6_type == ICMP6_DST_UNREACH);
+	assert (err->icmp6_code == ICMP6_DST_UNREACH_ADDR);
+	assert (len == sizeof (*err) + sizeof (*in) + 8);
+	assert (memcmp (dst, &in->ip6_src, sizeof (*dst)) == 0);
+
+	pthread_mutex_lock (&lock);
+	received++;
+	pthread_mutex_unlock (&lock);
+}
+
+
+static unsigned wait_received (void)
+{
+	unsigned n;
+
+	nanosleep (&(struct timespec){ 0, 200000000 }, NULL);
+	pthread_mutex_lock (&lock);
+	n = received;
+	received = 0;
+	pthread_mutex_unlock (&lock);
+	return n;
+}
+
+
+static struct
+{
+	struct ip6_hdr ip6;
+	uint8_t payload[8];
+} pkt;
+
+/**
+ * Sends a full burst of errors, from a thread with its own token bucket.
+ */
+static void *burst_thread (void *data)
+{
+	teredo_unreach *u = data;
+
+	for (unsigned i = 0; i < 10; i++)
+		teredo_unreach_send (u, ICMP6_DST_UNREACH_ADDR, &pkt.ip6,
+		                     sizeof (pkt));
+	return NULL;
+}
+
+
+int main (void)
+{
+
+	teredo_clock_t start = teredo_clock_ms ();
+	nanosleep (&(struct timespec){ 0, 50000000 }, NULL);
+	assert (teredo_clock_ms () - start >= 40);
+
+	memset (&pkt, 0, sizeof (pkt));
+	pkt.ip6.ip6_vfc = 0x60;
+	pkt.ip6.ip6_plen = htons (sizeof (pkt.payload));
+	pkt.ip6.ip6_nxt = IPPROTO_UDP;
+	pkt.ip6.ip6_hlim = 64;
+	pkt.ip6.ip6_src.s6_addr[0] = 0x20;
+	pkt.ip6.ip6_src.s6_addr[15] = 1;
+	pkt.ip6.ip6_dst.s6_addr[0] = 0x20;
+	pkt.ip6.ip6_dst.s6_addr[15] = 2;
+
+	teredo_unreach *u = teredo_unreach_create (emit, &received, true);
+	assert (u != NULL);
+
+	/* Truncated packets are ignored */
+	teredo_unreach_send (u, ICMP6_DST_UNREACH_ADDR, &pkt.ip6, 20);
+	assert (wait_received () == 0);
+
+	/* Bursts are limited by the token bucket */
+	for (unsigned i = 0; i < 1000; i++)
+		teredo_unreach_send (u, ICMP6_DST_UNREACH_ADDR, &pkt.ip6,
+		                     sizeof (pkt));
+	unsigned n = wait_received ();
+	printf ("%u errors emitted out of 1000\n", n);
+	assert (n > 0);
+	assert (n <= 10 + 3);
+	assert (teredo_unreach_dropped (u) == 0);
+
+	/* Tokens are refilled with sub-second resolution */
+	teredo_unreach_send (u, ICMP6_DST_UNREACH_ADDR, &pkt.ip6, sizeof (pkt));
+	assert (wait_received () == 1);
+
+	teredo_unreach_destroy (u);
+
+	/* Event loop mode: errors are only emitted when processed */
+	u = teredo_unreach_create (emit, &received, false);
+	assert (u != NULL);
+	assert (teredo_unreach_timeout (u) == -1);
+	teredo_unreach_send (u, ICMP6_DST_UNREACH_ADDR, &pkt.ip6, sizeof (pkt));
+	assert (teredo_unreach_timeout (u) == 0);
+	assert (wait_received () == 0);
+	teredo_unreach_process (u);
+	assert (teredo_unreach_timeout (u) == -1);
+	assert (wait_received () == 1);
+
+	/* Queue overflow: 32 errors are kept, the others are counted */
+	for (unsigned i = 0; i < 4; i++)
+	{
+		pthread_t th;
+
+		assert (pthread_create (&th, NULL, burst_thread, u) == 0);
+		assert (pthread_join (th, NULL) == 0);
+	}
+	assert (teredo_unreach_dropped (u) == 4 * 10 - 32);
+	teredo_unreach_process (u);
+	assert (wait_received () == 32);
+	assert (teredo_unreach_timeout (u) == -1);
+	teredo_unreach_destroy (u);
+	return 0;
+}
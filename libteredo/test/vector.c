@@ -0,0 +1,160 @@
+/*
+ * vector.c - Libteredo vectored packets reception test and benchmark
+ */
+
+/***********************************************************************
+ *  Copyright © 2004-2007 Rémi Denis-Courmont.                         *
+ *  This program is free software; you can redistribute and/or modify  *
+ *  it under the terms of the GNU General Public License as published  *
+ *  by the Free Software Foundation; version 2 of the license, or (at  *
+ *  your option) any later version.                                    *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *  See the GNU General Public License for more details.               *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, you can get it from:              *
+ *  http://www.gnu.org/copyleft/gpl.html                               *
+ ***********************************************************************/
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#undef NDEBUG
+#include <assert.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <time.h>
+
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/ip6.h>
+
+#include "teredo.h"
+#include "teredo-udp.h"
+#include "tunnel.h"
+
+#define PEERS  256
+#define ROUNDS 4096
+
+static unsigned long received;
+
+static void recv_cb (void *opaque, const struct iovec *pkts, unsigned count)
+{
+	assert (opaque == &received);
+
+	for (unsigned i = 0; i < count; i++)
+		assert (pkts[i].iov_len == sizeof (struct ip6_hdr));
+	received += count;
+}
+
+
+static uint64_t now_ns (void)
+{
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * UINT64_C(1000000000) + ts.tv_nsec;
+}
+
+
+/**
+ * Receives ROUNDS times each of the packets, in vectors of the given size.
+ * @return packets per second
+ */
+static double bench (teredo_tunnel *t, const teredo_packet *pv, unsigned size)
+{
+	unsigned long expected = received + (unsigned long)PEERS * ROUNDS;
+	uint64_t start = now_ns ();
+
+	for (unsigned i = 0; i < ROUNDS; i++)
+		for (unsigned j = 0; j < PEERS; j += size)
+			teredo_run_burst (t, pv + j, size);
+
+	uint64_t duration = now_ns () - start;
+
+	assert (received == expected);
+	return (double)PEERS * ROUNDS * 1e9 / (duration ? duration : 1);
+}
+
+
+int main (void)
+{
+	static struct ip6_hdr hdrs[PEERS], out;
+	teredo_packet *pv = calloc (PEERS, sizeof (*pv));
+	assert (pv != NULL);
+
+	assert (teredo_startup (false) == 0);
+
+	teredo_tunnel *t = teredo_create (htonl (INADDR_LOOPBACK), 0);
+	assert (t != NULL);
+	assert (teredo_set_relay_mode (t) == 0);
+	teredo_set_privdata (t, &received);
+	teredo_set_recv_batch_callback (t, recv_cb);
+
+	memset (&out, 0, sizeof (out));
+	out.ip6_vfc = 0x60;
+	out.ip6_hlim = 64;
+	out.ip6_src.s6_addr[0] = 0x20;
+	out.ip6_src.s6_addr[1] = 0x01;
+	out.ip6_src.s6_addr[2] = 0x0d;
+	out.ip6_src.s6_addr[3] = 0xb8;
+	out.ip6_src.s6_addr[15] = 1;
+
+	for (unsigned i = 0; i < PEERS; i++)
+	{
+		union teredo_addr *addr = (union teredo_addr *)&out.ip6_dst;
+		uint16_t port = htons (40000 + i);
+
+		addr->teredo.prefix = htonl (TEREDO_PREFIX);
+		addr->teredo.server_ip = htonl (0x08080808);
+		addr->teredo.flags = 0;
+		addr->teredo.client_port = ~port;
+		addr->teredo.client_ip = ~htonl (INADDR_LOOPBACK);
+
+		/* Registers the peer, as an untrusted Teredo client */
+		assert (teredo_transmit (t, &out, sizeof (out)) == 0);
+
+		hdrs[i] = out;
+		hdrs[i].ip6_src = out.ip6_dst;
+		hdrs[i].ip6_dst = out.ip6_src;
+
+		pv[i].ip6 = hdrs + i;
+		pv[i].ip6_len = sizeof (hdrs[i]);
+		pv[i].source_ipv4 = htonl (INADDR_LOOPBACK);
+		pv[i].source_port = port;
+	}
+
+	/* First packets from the peers make them trusted (relay case 3) */
+	teredo_run_burst (t, pv, PEERS);
+	assert (received == PEERS);
+
+	/* Packets with a mismatching mapping are dropped */
+	pv[PEERS / 2].source_port ^= 1;
+	teredo_run_burst (t, pv, PEERS);
+	assert (received == 2 * PEERS - 1);
+	pv[PEERS / 2].source_port ^= 1;
+
+	/* Invalid packets in the middle of the vector are dropped */
+	pv[1].ip6_len = 20;
+	teredo_run_burst (t, pv, PEERS);
+	assert (received == 3 * PEERS - 2);
+	pv[1].ip6_len = sizeof (hdrs[1]);
+
+	static const unsigned sizes[] = { 1, 64, 256 };
+	for (unsigned i = 0; i < sizeof (sizes) / sizeof (sizes[0]); i++)
+		printf ("%3u packets per vector: %10.0f packets/s\n", sizes[i],
+		        bench (t, pv, sizes[i]));
+
+	teredo_destroy (t);
+	teredo_cleanup (false);
+	free (pv);
+	return 0;
+}
@@ -0,0 +1,191 @@
+/*
+ * workers.c - Libteredo packet processing threads pool tests
+ */
+
+/***********************************************************************
+ *  Copyright © 2004-2007 Rémi Denis-Courmont.                         *
+ *  This program is free software; you can redistribute and/or modify  *
+ *  it under the terms of the GNU General Public License as published  *
+ *  by the Free Software Foundation; version 2 of the license, or (at  *
+ *  your option) any later version.                                    *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *  See the GNU General Public License for more details.               *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, you can get it from:              *
+ *  http://www.gnu.org/copyleft/gpl.html                               *
+ ***********************************************************************/
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#undef NDEBUG
+#include <assert.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <time.h>
+
+#include <pthread.h>
+
+#include "workers.h"
+
+#define KEYS     64
+#define PRODUCERS 4
+#define PER_KEY  2000
+#define POOL_SIZE 64
+
+typedef struct test_job
+{
+	teredo_job job;
+	unsigned key, seq;
+} test_job;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t done = PTHREAD_COND_INITIALIZER;
+static unsigned next_seq[KEYS], received, discarded;
+
+static void release (teredo_job *job)
+{
+	if (job->pool != NULL)
+		teredo_job_pool_put (job);
+	else
+		free (job);
+}
+
+static void run (void *opaque, teredo_job *const *jobs, unsigned count)
+{
+	assert (opaque == &received);
+	assert (count > 0 && count <= TEREDO_WORKERS_BATCH);
+
+	for (unsigned i = 0; i < count; i++)
+	{
+		test_job *j = (test_job *)jobs[i];
+
+		/* Ordering is preserved per key, without any locking */
+		assert (j->seq == next_seq[j->key]);
+		next_seq[j->key]++;
+		release (jobs[i]);
+	}
+
+	pthread_mutex_lock (&lock);
+	received += count;
+	if (received == KEYS * PER_KEY)
+		pthread_cond_signal (&done);
+	pthread_mutex_unlock (&lock);
+}
+
+
+static void discard (void *opaque, teredo_job *const *jobs, unsigned count)
+{
+	assert (opaque == &received);
+
+	for (unsigned i = 0; i < count; i++)
+		release (jobs[i]);
+	discarded += count;
+}
+
+
+static teredo_workers *pool;
+static teredo_job_pool *pools[PRODUCERS];
+
+/* Each producer submits the jobs of its own keys */
+static void *producer (void *data)
+{
+	unsigned id = (uintptr_t)data;
+
+	for (unsigned seq = 0; seq < PER_KEY; seq++)
+		for (unsigned key = id; key < KEYS; key += PRODUCERS)
+		{
+			/* From the producer's pool, or allocated if it is empty */
+			test_job *j = (test_job *)teredo_job_pool_get (pools[id]);
+			if (j == NULL)
+			{
+				j = malloc (sizeof (*j));
+				assert (j != NULL);
+				j->job.pool = NULL;
+			}
+			else
+				assert (j->job.pool == pools[id]);
+			j->key = key;
+			j->seq = seq;
+			teredo_workers_submit (pool, &j->job, key * 0x9e3779b9);
+		}
+	return NULL;
+}
+
+
+int main (void)
+{
+	pthread_t th[PRODUCERS];
+
+	pool = teredo_workers_create (4, run, discard, &received);
+	assert (pool != NULL);
+	assert (teredo_workers_count (pool) == 4);
+
+	for (unsigned i = 0; i < PRODUCERS; i++)
+	{
+		pools[i] = teredo_job_pool_create (sizeof (test_job), POOL_SIZE);
+		assert (pools[i] != NULL);
+	}
+
+	for (uintptr_t i = 0; i < PRODUCERS; i++)
+		assert (pthread_create (th + i, NULL, producer, (void *)i) == 0);
+	for (unsigned i = 0; i < PRODUCERS; i++)
+		pthread_join (th[i], NULL);
+
+	pthread_mutex_lock (&lock);
+	while (received < KEYS * PER_KEY)
+		pthread_cond_wait (&done, &lock);
+	pthread_mutex_unlock (&lock);
+
+	for (unsigned i = 0; i < KEYS; i++)
+		assert (next_seq[i] == PER_KEY);
+
+	/* Statistics are updated once the callback returns */
+	uint64_t jobs;
+	do
+	{
+		nanosleep (&(struct timespec){ 0, 10000000 }, NULL);
+		jobs = 0;
+		for (unsigned i = 0; i < 4; i++)
+		{
+			teredo_workers_stats st;
+
+			teredo_workers_get_stats (pool, i, &st);
+			assert (st.busy_us <= st.total_us);
+			jobs += st.jobs;
+		}
+	}
+	while (jobs < KEYS * PER_KEY);
+	assert (jobs == KEYS * PER_KEY);
+
+	for (unsigned i = 0; i < 4; i++)
+	{
+		teredo_workers_stats st;
+
+		teredo_workers_get_stats (pool, i, &st);
+		printf ("worker %u: %"PRIu64" jobs, %"PRIu64" steals, "
+		        "%"PRIu64"/%"PRIu64" us busy\n", i, st.jobs, st.steals,
+		        st.busy_us, st.total_us);
+	}
+	teredo_workers_destroy (pool);
+	assert (discarded == 0);
+
+	/* All pooled jobs were returned */
+	for (unsigned i = 0; i < PRODUCERS; i++)
+	{
+		unsigned n = 0;
+
+		while (teredo_job_pool_get (pools[i]) != NULL)
+			n++;
+		assert (n == POOL_SIZE);
+		teredo_job_pool_destroy (pools[i]);
+	}
+	return 0;
+}
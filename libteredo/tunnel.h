@@ -76,6 +76,7 @@ void teredo_cleanup (bool use_client);
 
 struct in6_addr;
 struct ip6_hdr;
+struct teredo_packet;
 
 /**
  * Teredo tunnel instance.
@@ -132,6 +133,23 @@ void teredo_destroy (teredo_tunnel *t);
  */
 void teredo_run (teredo_tunnel *t);
 
+/**
+ * Processes a burst of packets received from the Teredo socket, as with
+ * teredo_run(), but with the whole burst at once: packets are validated,
+ * then peers are looked up, then decapsulated packets are delivered, each
+ * stage running over the whole vector. This is much faster than processing
+ * the packets one by one, but yields the same results.
+ *
+ * Thread-safety: This function is thread-safe.
+ *
+ * @param t Teredo tunnel instance
+ * @param pv packets, as returned by teredo_recv_burst()
+ * @param count number of packets
+ */
+void teredo_run_burst (teredo_tunnel *restrict t,
+                       const struct teredo_packet *restrict pv,
+                       unsigned count);
+
 /**
  * Spawns a new thread to perform Teredo packet reception in the background.
  * The thread will be automatically terminated when the tunnel is destroyed.
@@ -150,6 +168,94 @@ void teredo_run (teredo_tunnel *t);
  */
 int teredo_run_async (teredo_tunnel *t);
 
+/**
+ * Creates a teredo_tunnel instance for use with an external event loop.
+ * Unlike teredo_create(), this does not spawn any thread for packet
+ * reception, peers expiry, bubbles or ICMPv6 errors; instead the caller
+ * must poll the descriptor from teredo_get_fd() and call
+ * teredo_process_ready() when it is readable, or when the delay from
+ * teredo_get_timeout() has elapsed. teredo_run_async() must not be used.
+ *
+ * Thread-safety: This function is thread-safe.
+ *
+ * @param ipv4 IPv4 (network byte order) to bind to, or 0 if unspecified.
+ * @param port UDP/IPv4 port number (network byte order) or 0 if unspecified.
+ *
+ * @return NULL in case of failure.
+ */
+teredo_tunnel *teredo_create_evloop (uint32_t ipv4, uint16_t port);
+
+/**
+ * @return the Teredo socket file descriptor of a tunnel, to be polled for
+ * input by an event loop. The caller must not perform any I/O on it.
+ */
+int teredo_get_fd (const teredo_tunnel *t);
+
+/**
+ * @return delay (milliseconds) until teredo_process_ready() must be called
+ * even if the Teredo socket is not readable, or -1 if there is no deadline.
+ * Only meaningful for tunnels created with teredo_create_evloop().
+ */
+int teredo_get_timeout (teredo_tunnel *t);
+
+/**
+ * Processes all pending Teredo packets without blocking, then performs
+ * due peers expiry, bubbles and ICMPv6 errors emission.
+ * Only meaningful for tunnels created with teredo_create_evloop().
+ *
+ * Thread-safety: This function is not re-entrant; it should only ever be
+ * called from the event loop thread.
+ *
+ * @param t Teredo tunnel instance
+ */
+void teredo_process_ready (teredo_tunnel *t);
+
+/**
+ * Spreads packet processing over a pool of threads, rather than processing
+ * packets in the threads that read them (the reception thread, and those
+ * calling teredo_transmit() or teredo_transmit_batch()). Packets are
+ * partitioned by peer address, so that the packets of a given peer are
+ * processed in order; idle threads take over peers from busy ones.
+ *
+ * This must be called before teredo_run_async(), and cannot be used with
+ * teredo_create_evloop().
+ *
+ * @param t Teredo tunnel instance
+ * @param count number of processing threads, 0 to disable the pool
+ *
+ * @return 0 on success, -1 on error.
+ */
+int teredo_set_workers (teredo_tunnel *t, unsigned count);
+
+/**
+ * @return the number of packet processing threads (see teredo_set_workers()).
+ */
+unsigned teredo_get_workers (const teredo_tunnel *t);
+
+/**
+ * Packet processing thread statistics.
+ * Utilisation is busy_us divided by total_us.
+ */
+typedef struct teredo_worker_stats
+{
+	uint64_t packets;  /**< processed packets */
+	uint64_t steals;   /**< peers taken over from other threads */
+	uint64_t busy_us;  /**< time spent processing packets (microseconds) */
+	uint64_t total_us; /**< time since the thread started (microseconds) */
+} teredo_worker_stats;
+
+/**
+ * Reads the statistics of a packet processing thread.
+ *
+ * @param t Teredo tunnel instance
+ * @param i thread index, smaller than teredo_get_workers()
+ * @param stats [OUT] statistics
+ *
+ * @return 0 on success, -1 if there is no such thread.
+ */
+int teredo_get_worker_stats (teredo_tunnel *restrict t, unsigned i,
+                             teredo_worker_stats *restrict stats);
+
 /**
  * Overrides the Teredo prefix of a Teredo relay.
  * Currently ignored for Teredo client (but might later restrict accepted
@@ -212,6 +318,63 @@ int teredo_set_relay_mode (teredo_tunnel *t);
 int teredo_set_client_mode (teredo_tunnel *restrict t, const char *s1,
                             const char *s2);
 
+/**
+ * Enables Teredo client mode with several Teredo servers. All servers are
+ * qualified in parallel: the one with the lowest round-trip time is used,
+ * and the others are kept as hot standbys in case it fails.
+ * Otherwise identical to teredo_set_client_mode().
+ *
+ * @param t Teredo tunnel instance
+ * @param servers Teredo servers' host names or “dotted quad” primary IPv4
+ * addresses
+ * @param count number of servers (between 1 and 8)
+ *
+ * @return 0 on success, -1 in case of error.
+ */
+int teredo_set_client_servers (teredo_tunnel *restrict t,
+                               const char *const *servers, unsigned count);
+
+/**
+ * Prototype for NAT binding lifetime notification.
+ * @param opaque private data pointer, set by teredo_set_privdata()
+ * @param sec NAT binding lifetime (seconds), 0 if unknown
+ */
+typedef void (*teredo_lifetime_cb) (void *opaque, unsigned sec);
+
+/**
+ * Enables the determination of the NAT binding lifetime by the Teredo
+ * client maintenance procedure. The NAT binding refresh interval is then
+ * extended to just under the learnt lifetime.
+ * This must be called before teredo_set_client_mode().
+ *
+ * @param t Teredo tunnel instance
+ * @param sec previously learnt NAT binding lifetime (seconds), 0 if
+ * unknown. It is verified before it is used.
+ * @param cb callback notified of newly learnt lifetimes (may be NULL)
+ *
+ * @return 0 on success, -1 in case of error.
+ */
+int teredo_set_binding_lifetime (teredo_tunnel *restrict t, unsigned sec,
+                                 teredo_lifetime_cb cb);
+
+/**
+ * Sets the Teredo client state saved from a previous run, so that the
+ * tunnel comes up as soon as the client mode is enabled. The Teredo server
+ * confirms it in the background. If the server advertises another address
+ * or MTU, or does not reply, the state callbacks are called again
+ * accordingly. The server address is the one embedded in @p addr.
+ * This must be called before teredo_set_client_mode().
+ *
+ * @param t Teredo tunnel instance
+ * @param addr Teredo address, as passed to teredo_state_up_cb
+ * @param mtu MTU, as passed to teredo_state_up_cb
+ *
+ * @return 0 on success, -1 in case of error.
+ */
+int teredo_set_client_cache (teredo_tunnel *restrict t,
+                             const struct in6_addr *restrict addr,
+                             uint16_t mtu);
+
 /**
  * Sets the private data pointer of a Teredo tunnel instance.
  * This value is passed to callbacks.
@@ -251,6 +414,31 @@ typedef void (*teredo_recv_cb) (void *opaque, const void *data, size_t len);
  */
 void teredo_set_recv_callback (teredo_tunnel *restrict t, teredo_recv_cb cb);
 
+struct iovec;
+
+/**
+ * Prototype for callback to receive batches of decapsulated IPv6 packets.
+ * The packets are only valid until the callback returns.
+ *
+ * @param opaque private data pointer, set by teredo_set_privdata()
+ * @param pkts array of IPv6 packets (header and payload)
+ * @param count number of packets in the array (at least one)
+ */
+typedef void (*teredo_recv_batch_cb) (void *opaque, const struct iovec *pkts,
+                                      unsigned count);
+
+/**
+ * Sets a callback to receive IPv6 packets decapsulated from the Teredo
+ * tunnel in batches, typically once at the end of each receive burst.
+ * This takes precedence over the callback set by teredo_set_recv_callback(),
+ * until that function is called again.
+ *
+ * @param t Teredo tunnel instance
+ * @param cb callback (or NULL to go back to the per-packet callback)
+ */
+void teredo_set_recv_batch_callback (teredo_tunnel *restrict t,
+                                     teredo_recv_batch_cb cb);
+
 /**
  * Transmits a packet coming from the IPv6 Internet, toward a Teredo node
  * (as specified per paragraph 5.4.1). That's what the specification calls
@@ -272,6 +460,29 @@ void teredo_set_recv_callback (teredo_tunnel *restrict t, teredo_recv_cb cb);
 int teredo_transmit (teredo_tunnel *restrict t,
                      const struct ip6_hdr *restrict buf, size_t n);
 
+/**
+ * Transmits several packets coming from the IPv6 Internet, such as a burst
+ * read from a tunnel interface. This is equivalent to calling
+ * teredo_transmit() for each packet, but packets toward the same Teredo
+ * peer are grouped, the peers list is locked once, and packets toward
+ * trusted peers are sent with as few system calls as possible.
+ *
+ * Packets toward the same destination are sent in the same order as in the
+ * vector. Ordering between distinct destinations is not preserved.
+ *
+ * The same assumptions as with teredo_transmit() apply to each packet.
+ * Packets shorter than 40 bytes are ignored.
+ *
+ * Thread-safety: This function is thread-safe.
+ *
+ * @param pkts vector of IPv6 packets
+ * @param count number of packets in the vector
+ *
+ * @return 0 on success, -1 if any packet could not be processed.
+ */
+int teredo_transmit_batch (teredo_tunnel *restrict t,
+                           const struct iovec *restrict pkts, unsigned count);
+
 /**
  * Prototype for callback to process ICMPv6 messages generated by the Teredo
  * tunnel.
@@ -288,12 +499,25 @@ typedef void (*teredo_icmpv6_cb) (void *opaque, const void *data, size_t len,
  * Registers a callback to emit ICMPv6 messages when the Teredo tunnel wants
  * to report an error back. If not set, error messages are not sent.
  *
+ * The callback is invoked asynchronously from a low-priority libteredo
+ * thread, some time after the offending packet was processed. Errors are
+ * rate limited per calling thread, and discarded if they cannot be queued
+ * (see teredo_get_icmpv6_drops()).
+ *
  * @param t Teredo tunnel instance
  * @param cb callback (ot NULL to ignore ICMPv6 errors)
  */
 void teredo_set_icmpv6_callback (teredo_tunnel *restrict t,
                                  teredo_icmpv6_cb cb);
 
+/**
+ * Thread-safety: This function is thread-safe.
+ *
+ * @return the number of ICMPv6 errors that were discarded because the
+ * deferred emission queue was full.
+ */
+unsigned long teredo_get_icmpv6_drops (teredo_tunnel *t);
+
 /**
  * Prototype for Teredo tunnel readiness event notification.
  * @param opaque private data pointer, set by teredo_set_privdata()
@@ -0,0 +1,351 @@
+/*
+ * unreach.c - Deferred ICMPv6 errors emission
+ */
+
+/***********************************************************************
+ *  Copyright © 2004-2007 Rémi Denis-Courmont.                         *
+ *  This program is free software; you can redistribute and/or modify  *
+ *  it under the terms of the GNU General Public License as published  *
+ *  by the Free Software Foundation; version 2 of the license, or (at  *
+ *  your option) any later version.                                    *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *  See the GNU General Public License for more details.               *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, you can get it from:              *
+ *  http://www.gnu.org/copyleft/gpl.html                               *
+ ***********************************************************************/
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdbool.h>
+#include <stdlib.h> // malloc()
+#include <string.h> // memcpy()
+#include <inttypes.h>
+#include <assert.h>
+
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <netinet/ip6.h> // struct ip6_hdr
+#include <netinet/icmp6.h> // ICMP6_DST_UNREACH
+#include <pthread.h>
+#include <sched.h>
+
+#include "teredo.h"
+#include "teredo-udp.h"
+#include "unreach.h"
+#include "packets.h"
+#include "clock.h"
+#include "debug.h"
+
+/* Each thread may emit one error every ICMP_RATE_LIMIT_MS milliseconds,
+ * with bursts of up to ICMP_RATE_BURST errors. */
+#define ICMP_RATE_LIMIT_MS 100
+#define ICMP_RATE_BURST    10
+
+/* Maximum number of errors waiting for the worker thread */
+#define ICMP_QUEUE_LEN 32
+
+/* Offending packet bytes that fit in a minimum MTU ICMPv6 error */
+#define ICMP_ERROR_PAYLOAD \
+	(1280 - sizeof (struct ip6_hdr) - sizeof (struct icmp6_hdr))
+
+typedef struct teredo_bucket
+{
+	struct teredo_bucket *next;
+	teredo_clock_t last; // milliseconds
+	unsigned credit; // milliseconds
+} teredo_bucket;
+
+typedef struct teredo_unreach_slot
+{
+	union
+	{
+		struct ip6_hdr ip6;
+		uint8_t        bytes[ICMP_ERROR_PAYLOAD];
+	} in;
+	uint16_t len;
+	uint8_t  code;
+} teredo_unreach_slot;
+
+struct teredo_unreach
+{
+	teredo_unreach_cb cb;
+	void *opaque;
+
+	pthread_key_t bucket_key;
+	teredo_bucket *buckets;
+
+	bool threaded;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t wait;
+	unsigned head, count;
+	unsigned long dropped;
+	teredo_unreach_slot queue[ICMP_QUEUE_LEN];
+};
+
+
+/**
+ * Returns the calling thread token bucket, allocating it if needed.
+ */
+static teredo_bucket *get_bucket (teredo_unreach *u)
+{
+	teredo_bucket *b = pthread_getspecific (u->bucket_key);
+	if (b != NULL)
+		return b;
+
+	b = malloc (sizeof (*b));
+	if (b == NULL)
+		return NULL;
+
+	b->last = teredo_clock_ms ();
+	b->credit = ICMP_RATE_LIMIT_MS * ICMP_RATE_BURST;
+
+	if (pthread_setspecific (u->bucket_key, b))
+	{
+		free (b);
+		return NULL;
+	}
+
+	/* Buckets are only released with the emitter, as the owner thread
+	 * might be destroyed before or after it. */
+	pthread_mutex_lock (&u->lock);
+	b->next = u->buckets;
+	u->buckets = b;
+	pthread_mutex_unlock (&u->lock);
+	return b;
+}
+
+
+/**
+ * Token bucket rate limiter.
+ *
+ * @return true if an error may be emitted, false if it must be dropped.
+ */
+static bool bucket_take (teredo_bucket *b)
+{
+	teredo_clock_t now = teredo_clock_ms ();
+	unsigned long credit = b->credit + (unsigned long)(now - b->last);
+
+	b->last = now;
+	if (credit > ICMP_RATE_LIMIT_MS * ICMP_RATE_BURST)
+		credit = ICMP_RATE_LIMIT_MS * ICMP_RATE_BURST;
+
+	if (credit < ICMP_RATE_LIMIT_MS)
+	{
+		b->credit = credit;
+		return false;
+	}
+
+	b->credit = credit - ICMP_RATE_LIMIT_MS;
+	return true;
+}
+
+
+void teredo_unreach_send (teredo_unreach *restrict u, uint8_t code,
+                          const struct ip6_hdr *restrict in, size_t len)
+{
+	/* don't waste tokens on truncated packets */
+	if (len < sizeof (*in))
+		return;
+
+	teredo_bucket *b = get_bucket (u);
+	if ((b == NULL) || !bucket_take (b))
+		return;
+
+	if (len > ICMP_ERROR_PAYLOAD)
+		len = ICMP_ERROR_PAYLOAD;
+
+	pthread_mutex_lock (&u->lock);
+	if (u->count >= ICMP_QUEUE_LEN)
+	{
+		u->dropped++;
+		pthread_mutex_unlock (&u->lock);
+		return;
+	}
+
+	teredo_unreach_slot *slot =
+		u->queue + ((u->head + u->count) % ICMP_QUEUE_LEN);
+	memcpy (&slot->in, in, len);
+	slot->len = len;
+	slot->code = code;
+	u->count++;
+	if (u->threaded)
+		pthread_cond_signal (&u->wait);
+	pthread_mutex_unlock (&u->lock);
+}
+
+
+static void cleanup_unlock (void *lock)
+{
+	pthread_mutex_unlock ((pthread_mutex_t *)lock);
+}
+
+
+/**
+ * Builds and emits a queued ICMPv6 error.
+ */
+static void emit (teredo_unreach *u, const teredo_unreach_slot *slot)
+{
+	struct
+	{
+		struct icmp6_hdr hdr;
+		char fill[ICMP_ERROR_PAYLOAD];
+	} buf;
+
+	size_t len = BuildICMPv6Error (&buf.hdr, ICMP6_DST_UNREACH, slot->code,
+	                               &slot->in.ip6, slot->len);
+	if (len > 0)
+		u->cb (u->opaque, &buf.hdr, len, &slot->in.ip6.ip6_src);
+}
+
+
+/**
+ * ICMPv6 errors emission thread.
+ *
+ * @return never ever.
+ */
+static LIBTEREDO_NORETURN void *unreach_thread (void *data)
+{
+	teredo_unreach *u = (teredo_unreach *)data;
+
+#ifdef SCHED_IDLE
+	/* Errors are best effort: only use otherwise idle CPU time. */
+	struct sched_param param = { .sched_priority = 0 };
+	pthread_setschedparam (pthread_self (), SCHED_IDLE, &param);
+#endif
+
+	for (;;)
+	{
+		teredo_unreach_slot slot;
+
+		pthread_mutex_lock (&u->lock);
+		pthread_cleanup_push (cleanup_unlock, &u->lock);
+		while (u->count == 0)
+			pthread_cond_wait (&u->wait, &u->lock);
+
+		slot = u->queue[u->head];
+		u->head = (u->head + 1) % ICMP_QUEUE_LEN;
+		u->count--;
+		pthread_cleanup_pop (1);
+
+		int state;
+		pthread_setcancelstate (PTHREAD_CANCEL_DISABLE, &state);
+		emit (u, &slot);
+		pthread_setcancelstate (state, NULL);
+	}
+}
+
+
+int teredo_unreach_timeout (teredo_unreach *u)
+{
+	unsigned count;
+
+	assert (!u->threaded);
+
+	pthread_mutex_lock (&u->lock);
+	count = u->count;
+	pthread_mutex_unlock (&u->lock);
+	return (count > 0) ? 0 : -1;
+}
+
+
+void teredo_unreach_process (teredo_unreach *u)
+{
+	assert (!u->threaded);
+
+	for (unsigned i = 0; i < ICMP_QUEUE_LEN; i++)
+	{
+		teredo_unreach_slot slot;
+
+		pthread_mutex_lock (&u->lock);
+		if (u->count == 0)
+		{
+			pthread_mutex_unlock (&u->lock);
+			break;
+		}
+		slot = u->queue[u->head];
+		u->head = (u->head + 1) % ICMP_QUEUE_LEN;
+		u->count--;
+		pthread_mutex_unlock (&u->lock);
+
+		emit (u, &slot);
+	}
+}
+
+
+teredo_unreach *teredo_unreach_create (teredo_unreach_cb cb, void *opaque,
+                                       bool threaded)
+{
+	assert (cb != NULL);
+
+	teredo_unreach *u = (teredo_unreach *)malloc (sizeof (*u));
+	if (u == NULL)
+		return NULL;
+
+	u->cb = cb;
+	u->opaque = opaque;
+	u->buckets = NULL;
+	u->head = u->count = 0;
+	u->dropped = 0;
+	u->threaded = threaded;
+
+	if (pthread_key_create (&u->bucket_key, NULL) == 0)
+	{
+		pthread_mutex_init (&u->lock, NULL);
+		pthread_cond_init (&u->wait, NULL);
+
+		if (!threaded
+		 || (pthread_create (&u->thread, NULL, unreach_thread, u) == 0))
+			return u;
+
+		pthread_cond_destroy (&u->wait);
+		pthread_mutex_destroy (&u->lock);
+		pthread_key_delete (u->bucket_key);
+	}
+
+	free (u);
+	return NULL;
+}
+
+
+void teredo_unreach_destroy (teredo_unreach *u)
+{
+	if (u->threaded)
+	{
+		pthread_cancel (u->thread);
+		pthread_join (u->thread, NULL);
+	}
+
+	if (u->dropped)
+		debug ("%lu ICMPv6 error(s) dropped (queue overflow)", u->dropped);
+
+	pthread_key_delete (u->bucket_key);
+	while (u->buckets != NULL)
+	{
+		teredo_bucket *b = u->buckets->next;
+		free (u->buckets);
+		u->buckets = b;
+	}
+
+	pthread_cond_destroy (&u->wait);
+	pthread_mutex_destroy (&u->lock);
+	free (u);
+}
+
+
+unsigned long teredo_unreach_dropped (teredo_unreach *u)
+{
+	unsigned long dropped;
+
+	pthread_mutex_lock (&u->lock);
+	dropped = u->dropped;
+	pthread_mutex_unlock (&u->lock);
+	return dropped;
+}
@@ -0,0 +1,100 @@
+/**
+ * @file unreach.h
+ * @brief Deferred and rate-limited ICMPv6 errors emission
+ */
+
+/***********************************************************************
+ *  Copyright © 2004-2007 Rémi Denis-Courmont.                         *
+ *  This program is free software; you can redistribute and/or modify  *
+ *  it under the terms of the GNU General Public License as published  *
+ *  by the Free Software Foundation; version 2 of the license, or (at  *
+ *  your option) any later version.                                    *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *  See the GNU General Public License for more details.               *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, you can get it from:              *
+ *  http://www.gnu.org/copyleft/gpl.html                               *
+ ***********************************************************************/
+
+#ifndef LIBTEREDO_UNREACH_H
+# define LIBTEREDO_UNREACH_H
+
+struct ip6_hdr;
+struct icmp6_hdr;
+struct in6_addr;
+
+typedef struct teredo_unreach teredo_unreach;
+
+/**
+ * ICMPv6 error emission callback, invoked from the deferred worker thread.
+ *
+ * @param opaque data pointer as given to teredo_unreach_create()
+ * @param err ICMPv6 error message (header and payload)
+ * @param len byte length of the ICMPv6 error message
+ * @param dst destination of the error (source of the offending packet)
+ */
+typedef void (*teredo_unreach_cb) (void *opaque, const struct icmp6_hdr *err,
+                                   size_t len, const struct in6_addr *dst);
+
+# ifdef __cplusplus
+extern "C" {
+# endif
+
+/**
+ * Creates an ICMPv6 Destination Unreachable emitter. This spawns a
+ * low-priority thread which builds the error messages and invokes the
+ * emission callback outside of the caller's thread.
+ *
+ * @param cb emission callback
+ * @param opaque data pointer for the emission callback
+ * @param threaded whether to spawn the emission thread.
+ * If false, teredo_unreach_process() must be called instead.
+ *
+ * @return NULL on error.
+ */
+teredo_unreach *teredo_unreach_create (teredo_unreach_cb cb, void *opaque,
+                                       bool threaded);
+
+/**
+ * Destroys an emitter created by teredo_unreach_create().
+ * Errors that are still pending are discarded.
+ */
+void teredo_unreach_destroy (teredo_unreach *u);
+
+/**
+ * Schedules emission of an ICMPv6 Destination Unreachable error.
+ * Each calling thread has its own token bucket, so that this never contends
+ * with other threads unless the error is actually queued. The offending
+ * packet is copied; the caller need not keep it.
+ *
+ * @param code ICMPv6 unreachable error code
+ * @param in IPv6 packet that caused the error
+ * @param len byte length of the IPv6 packet at <in>
+ */
+void teredo_unreach_send (teredo_unreach *restrict u, uint8_t code,
+                          const struct ip6_hdr *restrict in, size_t len);
+
+/**
+ * @return the number of ICMPv6 errors that passed the rate limiter, but were
+ * discarded because the deferred emission queue was full.
+ */
+unsigned long teredo_unreach_dropped (teredo_unreach *u);
+
+/**
+ * Emits the queued errors of an emitter created without its own thread.
+ */
+void teredo_unreach_process (teredo_unreach *u);
+
+/**
+ * @return 0 if errors are queued for teredo_unreach_process(), -1 otherwise.
+ */
+int teredo_unreach_timeout (teredo_unreach *u);
+
+# ifdef __cplusplus
+}
+# endif /* ifdef __cplusplus */
+#endif /* ifndef LIBTEREDO_UNREACH_H */
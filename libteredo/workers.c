@@ -0,0 +1,548 @@
+/*
+ * workers.c - Work-stealing packet processing threads pool
+ */
+
+/***********************************************************************
+ *  Copyright © 2004-2007 Rémi Denis-Courmont.                         *
+ *  This program is free software; you can redistribute and/or modify  *
+ *  it under the terms of the GNU General Public License as published  *
+ *  by the Free Software Foundation; version 2 of the license, or (at  *
+ *  your option) any later version.                                    *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *  See the GNU General Public License for more details.               *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, you can get it from:              *
+ *  http://www.gnu.org/copyleft/gpl.html                               *
+ ***********************************************************************/
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdbool.h>
+#include <stdlib.h> // malloc()
+#include <inttypes.h>
+#include <time.h>
+#include <assert.h>
+
+#include <pthread.h>
+
+#include "workers.h"
+
+/*
+ * Jobs are hashed by key into shards. Each shard is a FIFO of jobs which is
+ * scheduled on at most one worker at a time, which preserves the ordering of
+ * jobs with the same key. Scheduled shards (not jobs) are what the workers
+ * exchange: each worker owns a Chase-Lev deque of shards which the other
+ * workers steal from when they run out of work.
+ */
+#define WORKERS_SHARDS 256 // must be a power of 2
+#define WORKERS_NONE   0xffff
+#define WORKERS_BATCH  TEREDO_WORKERS_BATCH
+
+typedef struct teredo_shard
+{
+	pthread_mutex_t lock;
+	teredo_job *head, **tailp;
+	bool scheduled; // in a deque, in an injection stack, or being run
+	uint16_t next; // injection stack link
+} teredo_shard;
+
+typedef struct teredo_worker
+{
+	struct teredo_workers *pool;
+	pthread_t thread;
+
+	/* Deque of shards: bottom is only written by the owner */
+	long top, bottom;
+	uint16_t deque[WORKERS_SHARDS];
+
+	/* Shards scheduled by non-worker threads (lock-free stack) */
+	uint32_t inject;
+
+	pthread_mutex_t stats_lock;
+	uint64_t jobs, steals, busy_us, start_us;
+} teredo_worker;
+
+struct teredo_workers
+{
+	teredo_workers_cb cb, discard;
+	void *opaque;
+
+	pthread_mutex_t lock;
+	pthread_cond_t wait;
+	unsigned sleepers;
+	bool stop;
+
+	unsigned count;
+	teredo_shard shards[WORKERS_SHARDS];
+	teredo_worker workers[];
+};
+
+
+static uint64_t now_us (void)
+{
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * UINT64_C(1000000) + ts.tv_nsec / 1000;
+}
+
+
+/**
+ * Appends a shard to the deque. Owner only.
+ */
+static void deque_push (teredo_worker *w, unsigned s)
+{
+	long b = __atomic_load_n (&w->bottom, __ATOMIC_RELAXED);
+
+	/* A shard is in at most one deque, so this never overflows */
+	__atomic_store_n (w->deque + (b & (WORKERS_SHARDS - 1)), s,
+	                  __ATOMIC_RELAXED);
+	__atomic_store_n (&w->bottom, b + 1, __ATOMIC_RELEASE);
+}
+
+
+/**
+ * Removes the most recently pushed shard from the deque. Owner only.
+ */
+static unsigned deque_take (teredo_worker *w)
+{
+	long b = __atomic_load_n (&w->bottom, __ATOMIC_RELAXED) - 1;
+	__atomic_store_n (&w->bottom, b, __ATOMIC_RELAXED);
+	__atomic_thread_fence (__ATOMIC_SEQ_CST);
+
+	long t = __atomic_load_n (&w->top, __ATOMIC_RELAXED);
+	unsigned s = WORKERS_NONE;
+
+	if (t <= b)
+	{
+		s = __atomic_load_n (w->deque + (b & (WORKERS_SHARDS - 1)),
+		                     __ATOMIC_RELAXED);
+		if (t != b)
+			return s;
+
+		/* Last shard: race against thieves */
+		if (!__atomic_compare_exchange_n (&w->top, &t, t + 1, false,
+		                                  __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+			s = WORKERS_NONE;
+	}
+	__atomic_store_n (&w->bottom, b + 1, __ATOMIC_RELAXED);
+	return s;
+}
+
+
+/**
+ * Removes the least recently pushed shard from another worker's deque.
+ */
+static unsigned deque_steal (teredo_worker *w)
+{
+	long t = __atomic_load_n (&w->top, __ATOMIC_ACQUIRE);
+	__atomic_thread_fence (__ATOMIC_SEQ_CST);
+	long b = __atomic_load_n (&w->bottom, __ATOMIC_ACQUIRE);
+
+	if (t >= b)
+		return WORKERS_NONE;
+
+	unsigned s = __atomic_load_n (w->deque + (t & (WORKERS_SHARDS - 1)),
+	                              __ATOMIC_RELAXED);
+	if (!__atomic_compare_exchange_n (&w->top, &t, t + 1, false,
+	                                  __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+		return WORKERS_NONE; // lost the race, the shard is not lost
+	return s;
+}
+
+
+/**
+ * Moves all the shards from a worker injection stack to the deque of the
+ * calling worker.
+ *
+ * @return true if any shard was moved.
+ */
+static bool inject_drain (teredo_workers *p, teredo_worker *from,
+                          teredo_worker *self)
+{
+	uint32_t s = __atomic_exchange_n (&from->inject, WORKERS_NONE,
+	                                  __ATOMIC_ACQUIRE);
+	if (s == WORKERS_NONE)
+		return false;
+
+	do
+	{
+		uint32_t next = p->shards[s].next;
+		deque_push (self, s);
+		s = next;
+	}
+	while (s != WORKERS_NONE);
+
+	return true;
+}
+
+
+static bool has_work (const teredo_workers *p)
+{
+	for (unsigned i = 0; i < p->count; i++)
+	{
+		const teredo_worker *w = p->workers + i;
+
+		if ((__atomic_load_n (&w->inject, __ATOMIC_SEQ_CST) != WORKERS_NONE)
+		 || (__atomic_load_n (&w->top, __ATOMIC_SEQ_CST)
+		      < __atomic_load_n (&w->bottom, __ATOMIC_SEQ_CST)))
+			return true;
+	}
+	return false;
+}
+
+
+/**
+ * Finds a scheduled shard: first locally, then from the other workers.
+ */
+static unsigned find_work (teredo_workers *p, teredo_worker *self)
+{
+	unsigned s = deque_take (self);
+	if (s != WORKERS_NONE)
+		return s;
+
+	if (inject_drain (p, self, self))
+		return deque_take (self);
+
+	unsigned id = self - p->workers;
+	for (unsigned i = 1; i < p->count; i++)
+	{
+		teredo_worker *victim = p->workers + ((id + i) % p->count);
+
+		s = deque_steal (victim);
+		if ((s == WORKERS_NONE) && inject_drain (p, victim, self))
+			s = deque_take (self);
+
+		if (s != WORKERS_NONE)
+		{
+			pthread_mutex_lock (&self->stats_lock);
+			self->steals++;
+			pthread_mutex_unlock (&self->stats_lock);
+			return s;
+		}
+	}
+	return WORKERS_NONE;
+}
+
+
+/**
+ * Processes a batch of jobs from a shard, then reschedules the shard
+ * locally if it still has pending jobs.
+ */
+static void run_shard (teredo_workers *p, teredo_worker *self, unsigned s)
+{
+	teredo_shard *sh = p->shards + s;
+	teredo_job *jobs[WORKERS_BATCH];
+	unsigned n = 0;
+
+	pthread_mutex_lock (&sh->lock);
+	while ((n < WORKERS_BATCH) && (sh->head != NULL))
+	{
+		jobs[n++] = sh->head;
+		sh->head = sh->head->next;
+	}
+	if (sh->head == NULL)
+		sh->tailp = &sh->head;
+	pthread_mutex_unlock (&sh->lock);
+
+	if (n > 0)
+	{
+		uint64_t start = now_us ();
+
+		p->cb (p->opaque, jobs, n);
+
+		uint64_t busy = now_us () - start;
+		pthread_mutex_lock (&self->stats_lock);
+		self->jobs += n;
+		self->busy_us += busy;
+		pthread_mutex_unlock (&self->stats_lock);
+	}
+
+	pthread_mutex_lock (&sh->lock);
+	bool more = sh->head != NULL;
+	if (!more)
+		sh->scheduled = false;
+	pthread_mutex_unlock (&sh->lock);
+
+	if (more)
+		deque_push (self, s);
+}
+
+
+/**
+ * Worker thread.
+ */
+static void *worker_thread (void *data)
+{
+	teredo_worker *self = (teredo_worker *)data;
+	teredo_workers *p = self->pool;
+
+	while (!__atomic_load_n (&p->stop, __ATOMIC_RELAXED))
+	{
+		unsigned s = find_work (p, self);
+		if (s != WORKERS_NONE)
+		{
+			run_shard (p, self, s);
+			continue;
+		}
+
+		/* Sleeps; see teredo_workers_submit() for the wake up side */
+		pthread_mutex_lock (&p->lock);
+		__atomic_add_fetch (&p->sleepers, 1, __ATOMIC_SEQ_CST);
+		while (!p->stop && !has_work (p))
+			pthread_cond_wait (&p->wait, &p->lock);
+		__atomic_sub_fetch (&p->sleepers, 1, __ATOMIC_SEQ_CST);
+		pthread_mutex_unlock (&p->lock);
+	}
+	return NULL;
+}
+
+
+void teredo_workers_submit (teredo_workers *restrict p,
+                            teredo_job *restrict job, uint32_t key)
+{
+	/* Fibonacci hashing, in case the key is not well distributed */
+	unsigned s = (key * UINT32_C(2654435761)) >> 24;
+	teredo_shard *sh = p->shards + s;
+	bool schedule;
+
+	job->next = NULL;
+
+	pthread_mutex_lock (&sh->lock);
+	*sh->tailp = job;
+	sh->tailp = &job->next;
+	schedule = !sh->scheduled;
+	sh->scheduled = true;
+	pthread_mutex_unlock (&sh->lock);
+
+	if (!schedule)
+		return; // the shard's worker will get to it
+
+	teredo_worker *w = p->workers + (s % p->count);
+	uint32_t head = __atomic_load_n (&w->inject, __ATOMIC_RELAXED);
+	do
+		sh->next = head;
+	while (!__atomic_compare_exchange_n (&w->inject, &head, s, true,
+	                                     __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
+
+	if (__atomic_load_n (&p->sleepers, __ATOMIC_SEQ_CST) > 0)
+	{
+		pthread_mutex_lock (&p->lock);
+		pthread_cond_signal (&p->wait);
+		pthread_mutex_unlock (&p->lock);
+	}
+}
+
+
+/**
+ * Stops and joins the first n worker threads.
+ */
+static void stop_workers (teredo_workers *p, unsigned n)
+{
+	pthread_mutex_lock (&p->lock);
+	__atomic_store_n (&p->stop, true, __ATOMIC_RELAXED);
+	pthread_cond_broadcast (&p->wait);
+	pthread_mutex_unlock (&p->lock);
+
+	for (unsigned i = 0; i < n; i++)
+		pthread_join (p->workers[i].thread, NULL);
+}
+
+
+teredo_workers *teredo_workers_create (unsigned count, teredo_workers_cb cb,
+                                       teredo_workers_cb discard,
+                                       void *opaque)
+{
+	assert (count > 0);
+	assert (cb != NULL);
+	assert (discard != NULL);
+
+	teredo_workers *p = malloc (sizeof (*p) + count * sizeof (p->workers[0]));
+	if (p == NULL)
+		return NULL;
+
+	p->cb = cb;
+	p->discard = discard;
+	p->opaque = opaque;
+	p->sleepers = 0;
+	p->stop = false;
+	p->count = 0;
+	pthread_mutex_init (&p->lock, NULL);
+	pthread_cond_init (&p->wait, NULL);
+
+	for (unsigned i = 0; i < WORKERS_SHARDS; i++)
+	{
+		teredo_shard *sh = p->shards + i;
+
+		pthread_mutex_init (&sh->lock, NULL);
+		sh->head = NULL;
+		sh->tailp = &sh->head;
+		sh->scheduled = false;
+	}
+
+	uint64_t now = now_us ();
+	for (unsigned i = 0; i < count; i++)
+	{
+		teredo_worker *w = p->workers + i;
+
+		w->pool = p;
+		w->top = w->bottom = 0;
+		w->inject = WORKERS_NONE;
+		pthread_mutex_init (&w->stats_lock, NULL);
+		w->jobs = w->steals = w->busy_us = 0;
+		w->start_us = now;
+	}
+
+	/* All workers must be initialized before any can steal */
+	p->count = count;
+	for (unsigned i = 0; i < count; i++)
+		if (pthread_create (&p->workers[i].thread, NULL, worker_thread,
+		                    p->workers + i))
+		{
+			stop_workers (p, i);
+			for (i = 0; i < WORKERS_SHARDS; i++)
+				pthread_mutex_destroy (&p->shards[i].lock);
+			for (i = 0; i < count; i++)
+				pthread_mutex_destroy (&p->workers[i].stats_lock);
+			pthread_cond_destroy (&p->wait);
+			pthread_mutex_destroy (&p->lock);
+			free (p);
+			return NULL;
+		}
+
+	return p;
+}
+
+
+void teredo_workers_destroy (teredo_workers *p)
+{
+	stop_workers (p, p->count);
+
+	for (unsigned i = 0; i < WORKERS_SHARDS; i++)
+	{
+		teredo_shard *sh = p->shards + i;
+
+		while (sh->head != NULL)
+		{
+			teredo_job *jobs[WORKERS_BATCH];
+			unsigned n = 0;
+
+			while ((n < WORKERS_BATCH) && (sh->head != NULL))
+			{
+				jobs[n++] = sh->head;
+				sh->head = sh->head->next;
+			}
+			p->discard (p->opaque, jobs, n);
+		}
+		pthread_mutex_destroy (&sh->lock);
+	}
+
+	for (unsigned i = 0; i < p->count; i++)
+		pthread_mutex_destroy (&p->workers[i].stats_lock);
+
+	pthread_cond_destroy (&p->wait);
+	pthread_mutex_destroy (&p->lock);
+	free (p);
+}
+
+
+/*
+ * Jobs returned by other threads are pushed onto a lock-free stack. The
+ * producer, which is the only one taking jobs, grabs the whole stack at
+ * once when its private list runs out, so there is no ABA problem.
+ */
+struct teredo_job_pool
+{
+	teredo_job *local; // producer private
+	teredo_job *returned; // lock-free stack
+	uint64_t slots[]; // jobs
+};
+
+
+teredo_job_pool *teredo_job_pool_create (size_t size, unsigned count)
+{
+	assert (size >= sizeof (teredo_job));
+	assert (count > 0);
+
+	size = (size + sizeof (uint64_t) - 1) & ~(sizeof (uint64_t) - 1);
+
+	teredo_job_pool *pool = malloc (sizeof (*pool) + size * count);
+	if (pool == NULL)
+		return NULL;
+
+	teredo_job *next = NULL;
+	for (unsigned i = count; i-- > 0;)
+	{
+		teredo_job *job = (teredo_job *)((uint8_t *)pool->slots + i * size);
+
+		job->next = next;
+		job->pool = pool;
+		next = job;
+	}
+	pool->local = next;
+	pool->returned = NULL;
+	return pool;
+}
+
+
+void teredo_job_pool_destroy (teredo_job_pool *pool)
+{
+	free (pool);
+}
+
+
+teredo_job *teredo_job_pool_get (teredo_job_pool *pool)
+{
+	teredo_job *job = pool->local;
+
+	if (job == NULL)
+	{
+		job = __atomic_exchange_n (&pool->returned, NULL, __ATOMIC_ACQUIRE);
+		if (job == NULL)
+			return NULL;
+	}
+
+	pool->local = job->next;
+	return job;
+}
+
+
+void teredo_job_pool_put (teredo_job *job)
+{
+	teredo_job_pool *pool = job->pool;
+	teredo_job *head = __atomic_load_n (&pool->returned, __ATOMIC_RELAXED);
+
+	do
+		job->next = head;
+	while (!__atomic_compare_exchange_n (&pool->returned, &head, job, true,
+	                                     __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+
+unsigned teredo_workers_count (const teredo_workers *p)
+{
+	return p->count;
+}
+
+
+void teredo_workers_get_stats (const teredo_workers *restrict p, unsigned i,
+                               teredo_workers_stats *restrict stats)
+{
+	assert (i < p->count);
+
+	teredo_worker *w = (teredo_worker *)(p->workers + i);
+	uint64_t now = now_us ();
+
+	pthread_mutex_lock (&w->stats_lock);
+	stats->jobs = w->jobs;
+	stats->steals = w->steals;
+	stats->busy_us = w->busy_us;
+	stats->total_us = now - w->start_us;
+	pthread_mutex_unlock (&w->stats_lock);
+}
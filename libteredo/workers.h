@@ -0,0 +1,146 @@
+/**
+ * @file workers.h
+ * @brief Work-stealing packet processing threads pool
+ */
+
+/***********************************************************************
+ *  Copyright © 2004-2007 Rémi Denis-Courmont.                         *
+ *  This program is free software; you can redistribute and/or modify  *
+ *  it under the terms of the GNU General Public License as published  *
+ *  by the Free Software Foundation; version 2 of the license, or (at  *
+ *  your option) any later version.                                    *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *  See the GNU General Public License for more details.               *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, you can get it from:              *
+ *  http://www.gnu.org/copyleft/gpl.html                               *
+ ***********************************************************************/
+
+#ifndef LIBTEREDO_WORKERS_H
+# define LIBTEREDO_WORKERS_H
+
+typedef struct teredo_workers teredo_workers;
+typedef struct teredo_job_pool teredo_job_pool;
+
+/* Maximum number of jobs per processing callback */
+# define TEREDO_WORKERS_BATCH 16
+
+/**
+ * Work item. This is meant to be the first member of a larger structure
+ * holding the actual data.
+ */
+typedef struct teredo_job
+{
+	struct teredo_job *next;
+	teredo_job_pool *pool; // owning pool, NULL if allocated otherwise
+} teredo_job;
+
+/**
+ * Work processing callback, invoked from one of the worker threads.
+ * Jobs with the same key are always passed in submission order, and never
+ * concurrently. The callback is responsible for releasing the jobs.
+ *
+ * @param opaque data pointer as given to teredo_workers_create()
+ * @param jobs vector of jobs
+ * @param count number of jobs in the vector (at least 1)
+ */
+typedef void (*teredo_workers_cb) (void *opaque, teredo_job *const *jobs,
+                                   unsigned count);
+
+/**
+ * Worker thread statistics.
+ */
+typedef struct teredo_workers_stats
+{
+	uint64_t jobs;     /**< processed jobs */
+	uint64_t steals;   /**< job queues taken from other workers */
+	uint64_t busy_us;  /**< time spent processing jobs (microseconds) */
+	uint64_t total_us; /**< time since the worker started (microseconds) */
+} teredo_workers_stats;
+
+# ifdef __cplusplus
+extern "C" {
+# endif
+
+/**
+ * Creates a pool of worker threads.
+ *
+ * @param count number of worker threads (at least 1)
+ * @param cb processing callback
+ * @param discard callback to release jobs that are still pending when the
+ * pool is destroyed
+ * @param opaque data pointer for the callbacks
+ *
+ * @return NULL on error.
+ */
+teredo_workers *teredo_workers_create (unsigned count, teredo_workers_cb cb,
+                                       teredo_workers_cb discard,
+                                       void *opaque);
+
+/**
+ * Stops the worker threads and destroys the pool. Pending jobs are passed
+ * to the discard callback.
+ */
+void teredo_workers_destroy (teredo_workers *w);
+
+/**
+ * Queues a job for processing. Thread-safe. Never blocks for I/O.
+ *
+ * @param job job to queue; the pool owns it until it is processed
+ * @param key ordering key (typically a hash of the peer address)
+ */
+void teredo_workers_submit (teredo_workers *restrict w,
+                            teredo_job *restrict job, uint32_t key);
+
+/**
+ * Creates a pool of preallocated jobs, so that submitting jobs does not
+ * go through the memory allocator. Jobs are taken from the pool by a single
+ * thread at a time (the producer), and returned by any thread.
+ *
+ * @param size size of each job (bytes), including the teredo_job header
+ * @param count number of jobs in the pool
+ *
+ * @return NULL on error.
+ */
+teredo_job_pool *teredo_job_pool_create (size_t size, unsigned count);
+
+/**
+ * Destroys a pool of jobs. All its jobs must have been returned.
+ */
+void teredo_job_pool_destroy (teredo_job_pool *pool);
+
+/**
+ * Takes a job from a pool. Only one thread at a time may take jobs from a
+ * given pool. Never blocks.
+ *
+ * @return a job, or NULL if they are all in use.
+ */
+teredo_job *teredo_job_pool_get (teredo_job_pool *pool);
+
+/**
+ * Returns a job to the pool it was taken from. Thread-safe. Never blocks.
+ */
+void teredo_job_pool_put (teredo_job *job);
+
+/**
+ * @return the number of worker threads in the pool.
+ */
+unsigned teredo_workers_count (const teredo_workers *w);
+
+/**
+ * Reads the statistics of a worker thread.
+ *
+ * @param i worker index, smaller than teredo_workers_count()
+ * @param stats [OUT] statistics
+ */
+void teredo_workers_get_stats (const teredo_workers *restrict w, unsigned i,
+                               teredo_workers_stats *restrict stats);
+
+# ifdef __cplusplus
+}
+# endif /* ifdef __cplusplus */
+#endif /* ifndef LIBTEREDO_WORKERS_H */
@@ -37,6 +37,11 @@
 #include <errno.h>
 
 #include <sys/socket.h> // socket(AF_INET6, SOCK_DGRAM, 0)
+#if defined (__linux__)
+# include <sys/ioctl.h>
+# include <net/if.h>
+# include <linux/if_tun.h> // TUNGETFEATURES
+#endif
 #include <libtun6/tun6.h>
 
 extern const char os_driver[];
@@ -70,9 +75,17 @@ int tun6_driver_diagnose (char *errbuf)
 	fd = open (tundev, O_RDWR);
 	if (fd != -1)
 	{
+		bool mq = false;
+# ifdef IFF_MULTI_QUEUE
+		unsigned int features;
+
+		mq = (ioctl (fd, TUNGETFEATURES, &features) == 0)
+		  && (features & IFF_MULTI_QUEUE);
+# endif
 		(void)close (fd);
 		snprintf (errbuf, LIBTUN6_ERRBUF_SIZE,
-		          "%s tunneling driver found.", os_driver);
+		          "%s tunneling driver found%s.", os_driver,
+		          mq ? " (multi-queue supported)" : "");
 		return 0;
 	}
 
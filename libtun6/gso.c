@@ -0,0 +1,199 @@
+/*
+ * gso.c - User-space segmentation of offloaded IPv6 packets
+ */
+
+/***********************************************************************
+ *  Copyright © 2004-2009 Rémi Denis-Courmont.                         *
+ *  This program is free software; you can redistribute and/or modify  *
+ *  it under the terms of the GNU General Public License as published  *
+ *  by the Free Software Foundation; version 2 of the license, or (at  *
+ *  your option) any later version.                                    *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *  See the GNU General Public License for more details.               *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, you can get it from:              *
+ *  http://www.gnu.org/copyleft/gpl.html                               *
+ ***********************************************************************/
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdbool.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include <sys/types.h>
+#include <netinet/in.h>
+
+#include "gso.h"
+
+#define IPV6_HDR_LEN 40
+#define TCP_HDR_MIN  20
+#define UDP_HDR_LEN  8
+
+/* TCP flags */
+#define TCP_FIN 0x01
+#define TCP_PSH 0x08
+#define TCP_CWR 0x80
+
+
+static uint32_t csum_add (uint32_t sum, const uint8_t *p, size_t len)
+{
+	for (; len >= 2; len -= 2, p += 2)
+		sum += (p[0] << 8) | p[1];
+	if (len)
+		sum += p[0] << 8;
+	return sum;
+}
+
+
+static uint16_t csum_fold (uint32_t sum)
+{
+	while (sum >> 16)
+		sum = (sum & 0xffff) + (sum >> 16);
+	return sum;
+}
+
+
+static inline void put16 (uint8_t *p, uint16_t v)
+{
+	p[0] = v >> 8;
+	p[1] = v;
+}
+
+
+static inline uint32_t get32 (const uint8_t *p)
+{
+	return ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+
+static inline void put32 (uint8_t *p, uint32_t v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+
+int gso_prepare (tun6_gso *restrict g, const void *frame, size_t len,
+                 uint8_t proto, size_t l4_off, size_t mss)
+{
+	const uint8_t *p = frame;
+	size_t hdr_len;
+
+	g->frame = NULL;
+
+	if ((l4_off < IPV6_HDR_LEN) || (mss == 0))
+		return -1;
+
+	switch (proto)
+	{
+		case IPPROTO_TCP:
+			if (len < l4_off + TCP_HDR_MIN)
+				return -1;
+			hdr_len = l4_off + ((p[l4_off + 12] >> 4) * 4);
+			if (hdr_len < l4_off + TCP_HDR_MIN)
+				return -1;
+			break;
+
+		case IPPROTO_UDP:
+			hdr_len = l4_off + UDP_HDR_LEN;
+			break;
+
+		default:
+			return -1;
+	}
+
+	if ((len <= hdr_len) || ((p[0] >> 4) != 6))
+		return -1;
+
+	g->frame = p;
+	g->len = len;
+	g->l4_off = l4_off;
+	g->hdr_len = hdr_len;
+	g->mss = mss;
+	g->offset = 0;
+	g->proto = proto;
+	return 0;
+}
+
+
+size_t gso_next (tun6_gso *restrict g, void *restrict buf, size_t size)
+{
+	if (g->frame == NULL)
+		return 0;
+
+	size_t total = g->len - g->hdr_len;
+	size_t plen = total - g->offset;
+	if (plen > g->mss)
+		plen = g->mss;
+
+	size_t seglen = g->hdr_len + plen;
+	if (seglen > size)
+	{
+		g->frame = NULL;
+		return 0;
+	}
+
+	uint8_t *seg = buf, *l4 = seg + g->l4_off;
+	bool first = g->offset == 0, last = g->offset + plen == total;
+
+	memcpy (seg, g->frame, g->hdr_len);
+	memcpy (seg + g->hdr_len, g->frame + g->hdr_len + g->offset, plen);
+
+	/* IPv6 payload length */
+	put16 (seg + 4, seglen - IPV6_HDR_LEN);
+
+	uint8_t *cksum;
+	if (g->proto == IPPROTO_TCP)
+	{
+		put32 (l4 + 4, get32 (l4 + 4) + g->offset);
+		if (!last)
+			l4[13] &= ~(TCP_FIN | TCP_PSH);
+		if (!first)
+			l4[13] &= ~TCP_CWR;
+		cksum = l4 + 16;
+	}
+	else
+	{
+		put16 (l4 + 4, seglen - g->l4_off);
+		cksum = l4 + 6;
+	}
+
+	/* Pseudo-header and upper-layer checksum */
+	uint32_t sum = csum_add (0, seg + 8, 32);
+	sum += seglen - g->l4_off;
+	sum += g->proto;
+	put16 (cksum, 0);
+	sum = csum_add (sum, l4, seglen - g->l4_off);
+
+	uint16_t res = ~csum_fold (sum);
+	if ((res == 0) && (g->proto == IPPROTO_UDP))
+		res = 0xffff;
+	put16 (cksum, res);
+
+	g->offset += plen;
+	if (last)
+		g->frame = NULL;
+	return seglen;
+}
+
+
+int gso_checksum (void *pkt, size_t len, size_t start, size_t offset)
+{
+	uint8_t *p = pkt;
+
+	if ((start > len) || (offset + 2 > len - start))
+		return -1;
+
+	uint16_t res = ~csum_fold (csum_add (0, p + start, len - start));
+	put16 (p + start + offset, res ? res : 0xffff);
+	return 0;
+}
@@ -0,0 +1,96 @@
+/*
+ * gso.h - User-space segmentation of offloaded IPv6 packets
+ */
+
+/***********************************************************************
+ *  Copyright © 2004-2009 Rémi Denis-Courmont.                         *
+ *  This program is free software; you can redistribute and/or modify  *
+ *  it under the terms of the GNU General Public License as published  *
+ *  by the Free Software Foundation; version 2 of the license, or (at  *
+ *  your option) any later version.                                    *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *  See the GNU General Public License for more details.               *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, you can get it from:              *
+ *  http://www.gnu.org/copyleft/gpl.html                               *
+ ***********************************************************************/
+
+#ifndef LIBTUN6_GSO_H
+# define LIBTUN6_GSO_H
+
+/*
+ * Internal interface: these functions are not exported.
+ */
+
+typedef struct tun6_gso
+{
+	const uint8_t *frame; // NULL if no segmentation is pending
+	size_t len;     // frame length (bytes)
+	size_t l4_off;  // offset of the TCP or UDP header
+	size_t hdr_len; // length of all headers
+	size_t mss;     // payload bytes per segment
+	size_t offset;  // payload bytes already segmented
+	uint8_t proto;  // IPPROTO_TCP or IPPROTO_UDP
+} tun6_gso;
+
+# ifdef __cplusplus
+extern "C" {
+# endif
+
+/**
+ * Prepares the segmentation of a large IPv6 packet.
+ * The packet buffer must remain valid until all segments were produced.
+ *
+ * @param frame IPv6 packet, with a TCP or UDP payload
+ * @param len byte length of the packet
+ * @param proto IPPROTO_TCP or IPPROTO_UDP
+ * @param l4_off offset of the TCP or UDP header from the start of the packet
+ * @param mss maximum number of payload bytes per segment
+ *
+ * @return 0 on success, -1 if the packet is invalid.
+ */
+int gso_prepare (tun6_gso *restrict g, const void *frame, size_t len,
+                 uint8_t proto, size_t l4_off, size_t mss);
+
+/**
+ * @return whether segments remain to be produced.
+ */
+static inline bool gso_pending (const tun6_gso *g)
+{
+	return g->frame != NULL;
+}
+
+/**
+ * Produces the next segment, with fixed-up IPv6 and TCP or UDP headers,
+ * including the checksum.
+ *
+ * @param buf buffer for the segment
+ * @param size byte length of the buffer
+ *
+ * @return the segment length, or 0 if there are no more segments or if the
+ * buffer is too small (in which case the remaining segments are dropped).
+ */
+size_t gso_next (tun6_gso *restrict g, void *restrict buf, size_t size);
+
+/**
+ * Completes a partial checksum, as requested by the checksum offload.
+ * The checksum field must contain the pseudo-header checksum.
+ *
+ * @param pkt packet
+ * @param len byte length of the packet
+ * @param start offset from which to compute the checksum
+ * @param offset offset of the checksum field, relative to start
+ *
+ * @return 0 on success, -1 if the offsets are out of bounds.
+ */
+int gso_checksum (void *pkt, size_t len, size_t start, size_t offset);
+
+# ifdef __cplusplus
+}
+# endif
+
+#endif /* ifndef LIBTUN6_GSO_H */
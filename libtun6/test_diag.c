@@ -85,6 +85,15 @@ int main (void)
 	if (res)
 		return 1;
 
+	t = tun6_create_mq (NULL, 4, TUN6_OFFLOAD);
+	if (t == NULL)
+		return 1;
+	unsigned queues = tun6_getQueues (t);
+	printf ("%u tunnel queue(s)\n", queues);
+	tun6_destroy (t);
+	if ((queues == 0) || (queues > 4))
+		return 1;
+
 	closelog ();
 	return 0;
 }
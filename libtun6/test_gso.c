@@ -0,0 +1,149 @@
+/*
+ * test_gso.c - libtun6 user-space segmentation tests
+ */
+
+/***********************************************************************
+ *  Copyright © 2004-2009 Rémi Denis-Courmont.                         *
+ *  This program is free software; you can redistribute and/or modify  *
+ *  it under the terms of the GNU General Public License as published  *
+ *  by the Free Software Foundation; version 2 of the license, or (at  *
+ *  your option) any later version.                                    *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *  See the GNU General Public License for more details.               *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, you can get it from:              *
+ *  http://www.gnu.org/copyleft/gpl.html                               *
+ ***********************************************************************/
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#undef NDEBUG
+#include <assert.h>
+#include <stdbool.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include <sys/types.h>
+#include <netinet/in.h>
+
+#include "gso.h"
+
+#define PAYLOAD 3000
+#define MSS     1000
+
+static uint8_t frame[40 + 20 + PAYLOAD];
+static uint8_t seg[2000];
+
+/* Verifies the upper-layer checksum of an IPv6 packet */
+static bool checksum_ok (const uint8_t *p, size_t len, size_t l4_off,
+                         uint8_t proto)
+{
+	uint32_t sum = (len - l4_off) + proto;
+
+	for (size_t i = 8; i < 40; i += 2)
+		sum += (p[i] << 8) | p[i + 1];
+	for (size_t i = l4_off; i < len; i += 2)
+		sum += (p[i] << 8) | ((i + 1 < len) ? p[i + 1] : 0);
+	while (sum >> 16)
+		sum = (sum & 0xffff) + (sum >> 16);
+	return sum == 0xffff;
+}
+
+
+static void build (uint8_t proto, size_t l4_len)
+{
+	memset (frame, 0, sizeof (frame));
+	frame[0] = 0x60;
+	frame[6] = proto;
+	frame[7] = 64;
+	frame[8] = 0x20;
+	frame[23] = 1;
+	frame[24] = 0x20;
+	frame[39] = 2;
+
+	for (size_t i = 40 + l4_len; i < sizeof (frame); i++)
+		frame[i] = i;
+}
+
+
+int main (void)
+{
+	tun6_gso g;
+	size_t len;
+
+	/* TCP segmentation */
+	build (IPPROTO_TCP, 20);
+	frame[40 + 4] = 0x12; // sequence number
+	frame[40 + 7] = 0xff;
+	frame[40 + 12] = 5 << 4;
+	frame[40 + 13] = 0x80 | 0x10 | 0x08 | 0x01; // CWR, ACK, PSH, FIN
+
+	assert (gso_prepare (&g, frame, sizeof (frame), IPPROTO_TCP, 40, MSS)
+	        == 0);
+	for (unsigned i = 0; i < PAYLOAD / MSS; i++)
+	{
+		assert (gso_pending (&g));
+		len = gso_next (&g, seg, sizeof (seg));
+		assert (len == 40 + 20 + MSS);
+		assert (((seg[4] << 8) | seg[5]) == 20 + MSS);
+		assert (seg[40 + 4] == 0x12);
+		assert (((seg[40 + 6] << 8) | seg[40 + 7]) == 0xff + i * MSS);
+		assert (seg[40 + 13] == ((i == 0) ? 0x90 : (i == 2) ? 0x19 : 0x10));
+		assert (memcmp (seg + 60, frame + 60 + i * MSS, MSS) == 0);
+		assert (checksum_ok (seg, len, 40, IPPROTO_TCP));
+	}
+	assert (!gso_pending (&g));
+	assert (gso_next (&g, seg, sizeof (seg)) == 0);
+
+	/* UDP segmentation, with a shorter last segment */
+	build (IPPROTO_UDP, 8);
+	assert (gso_prepare (&g, frame, sizeof (frame) - 5, IPPROTO_UDP, 40,
+	                     MSS) == 0);
+	for (size_t left = sizeof (frame) - 5 - 48; gso_pending (&g);)
+	{
+		size_t plen = (left > MSS) ? MSS : left;
+
+		len = gso_next (&g, seg, sizeof (seg));
+		assert (len == 40 + 8 + plen);
+		assert (((seg[40 + 4] << 8) | seg[40 + 5]) == 8 + plen);
+		assert (checksum_ok (seg, len, 40, IPPROTO_UDP));
+		left -= plen;
+		assert (gso_pending (&g) == (left > 0));
+	}
+
+	/* Buffer too small */
+	assert (gso_prepare (&g, frame, sizeof (frame), IPPROTO_UDP, 40, MSS)
+	        == 0);
+	assert (gso_next (&g, seg, 100) == 0);
+	assert (!gso_pending (&g));
+
+	/* Invalid packets */
+	assert (gso_prepare (&g, frame, 48, IPPROTO_UDP, 40, MSS) == -1);
+	assert (gso_prepare (&g, frame, sizeof (frame), IPPROTO_UDP, 20, MSS)
+	        == -1);
+	assert (gso_prepare (&g, frame, sizeof (frame), IPPROTO_ICMPV6, 40,
+	                     MSS) == -1);
+	assert (gso_prepare (&g, frame, sizeof (frame), IPPROTO_UDP, 40, 0)
+	        == -1);
+
+	/* Checksum offload: pseudo-header checksum in the checksum field */
+	build (IPPROTO_UDP, 8);
+	len = 40 + 8 + 101;
+	frame[4] = 0;
+	frame[5] = 8 + 101;
+	frame[40 + 5] = 8 + 101;
+	uint32_t sum = (len - 40) + IPPROTO_UDP + 0x2000 + 1 + 0x2000 + 2;
+	frame[40 + 6] = sum >> 8;
+	frame[40 + 7] = sum;
+	assert (gso_checksum (frame, len, 40, 6) == 0);
+	assert (checksum_ok (frame, len, 40, IPPROTO_UDP));
+	assert (gso_checksum (frame, len, 40, len) == -1);
+
+	return 0;
+}
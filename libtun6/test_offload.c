@@ -0,0 +1,138 @@
+/*
+ * test_offload.c - libtun6 tunnel segmentation offload test
+ */
+
+/***********************************************************************
+ *  Copyright © 2004-2009 Rémi Denis-Courmont.                         *
+ *  This program is free software; you can redistribute and/or modify  *
+ *  it under the terms of the GNU General Public License as published  *
+ *  by the Free Software Foundation; version 2 of the license, or (at  *
+ *  your option) any later version.                                    *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *  See the GNU General Public License for more details.               *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, you can get it from:              *
+ *  http://www.gnu.org/copyleft/gpl.html                               *
+ ***********************************************************************/
+
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#undef NDEBUG
+#include <assert.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <syslog.h>
+#include <errno.h>
+
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/ip6.h>
+#include <netinet/udp.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include "tun6.h"
+
+#define SEGMENT 1000
+#define PAYLOAD (3 * SEGMENT)
+
+static const struct in6_addr local =
+	{ { { 0x20, 0x01, 0x0d, 0xb8, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1 } } };
+static const struct in6_addr remote =
+	{ { { 0x20, 0x01, 0x0d, 0xb8, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 2 } } };
+
+static uint8_t bufs[4][65535];
+
+/* Checks that a packet is one of the UDP segments sent to the remote */
+static bool is_segment (const uint8_t *p, int len)
+{
+	const struct ip6_hdr *ip6 = (const struct ip6_hdr *)p;
+
+	return (len > (int)sizeof (*ip6))
+	    && (ip6->ip6_nxt == IPPROTO_UDP)
+	    && (memcmp (&ip6->ip6_dst, &remote, sizeof (remote)) == 0);
+}
+
+
+int main (void)
+{
+#ifdef UDP_SEGMENT
+	openlog ("libtun6-offload", LOG_PERROR, LOG_USER);
+
+	tun6 *t = tun6_create_mq (NULL, 1, TUN6_OFFLOAD);
+	if (t == NULL)
+	{
+		puts ("Warning: cannot perform tunnel offload test");
+		return 77;
+	}
+
+	assert (tun6_setMTU (t, 1280) == 0);
+	assert (tun6_bringUp (t) == 0);
+	assert (tun6_addAddress (t, &local, 64) == 0);
+
+	int fd = socket (AF_INET6, SOCK_DGRAM, 0);
+	assert (fd != -1);
+
+	int gso_size = SEGMENT;
+	if (setsockopt (fd, IPPROTO_UDP, UDP_SEGMENT, &gso_size,
+	                sizeof (gso_size)))
+	{
+		perror ("UDP_SEGMENT");
+		return 77;
+	}
+
+	struct sockaddr_in6 dst =
+	{
+		.sin6_family = AF_INET6,
+		.sin6_port = htons (9),
+		.sin6_addr = remote,
+	};
+	memset (bufs[0], 'x', PAYLOAD);
+	assert (sendto (fd, bufs[0], PAYLOAD, 0, (struct sockaddr *)&dst,
+	                sizeof (dst)) == PAYLOAD);
+
+	/* First segment, skipping whatever else the kernel sent */
+	int len;
+	do
+		len = tun6_wait_recv (t, bufs[0], sizeof (bufs[0]));
+	while ((len != -1) && !is_segment (bufs[0], len));
+	assert (len == 40 + 8 + SEGMENT);
+
+	/* The kernel passed a single frame: nothing more to read */
+	struct pollfd ufd = { .fd = tun6_getQueueFd (t, 0), .events = POLLIN };
+	assert (poll (&ufd, 1, 0) == 0);
+
+	/* Other segments come from the user-space segmentation */
+	struct iovec iov[4];
+	for (unsigned i = 0; i < 4; i++)
+	{
+		iov[i].iov_base = bufs[i];
+		iov[i].iov_len = sizeof (bufs[i]);
+	}
+	assert (tun6_try_recv_burst (t, 0, iov, 4) == 2);
+	for (unsigned i = 0; i < 2; i++)
+	{
+		assert (is_segment (bufs[i], iov[i].iov_len));
+		assert (iov[i].iov_len == 40 + 8 + SEGMENT);
+		assert (((bufs[i][40 + 4] << 8) | bufs[i][40 + 5]) == 8 + SEGMENT);
+	}
+
+	close (fd);
+	tun6_destroy (t);
+	closelog ();
+	return 0;
+#else
+	return 77;
+#endif
+}
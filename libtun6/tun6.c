@@ -38,6 +38,7 @@
 #include <sys/ioctl.h>
 #include <unistd.h>
 #include <sys/uio.h> // readv() & writev()
+#include <poll.h>
 #include <syslog.h>
 #include <errno.h>
 #include <netinet/in.h> // htons(), struct in6_addr
@@ -54,6 +55,7 @@ const char os_driver[] = "Linux";
 # define USE_LINUX 1
 
 # include <linux/if_tun.h> // TUNSETIFF - Linux tunnel driver
+# include <linux/virtio_net.h> // struct virtio_net_hdr
 /*
  * <linux/ipv6.h> conflicts with <netinet/in.h> and <arpa/inet.h>,
  * so we've got to declare this structure by hand.
@@ -127,18 +129,57 @@ const char os_driver[] = "Generic";
 #endif
 
 #include <libtun6/tun6.h>
+#include "gso.h"
 
 #define safe_strcpy( tgt, src ) \
 	((strlcpy (tgt, src, sizeof (tgt)) >= sizeof (tgt)) ? -1 : 0)
 
+#if defined (USE_LINUX) && defined (IFF_VNET_HDR) && defined (TUNSETOFFLOAD)
+# define USE_OFFLOAD 1
+/* Linux 6.2 kernel ABI, missing from older headers */
+# ifndef TUN_F_USO4
+#  define TUN_F_USO4 0x20
+#  define TUN_F_USO6 0x40
+# endif
+# ifndef VIRTIO_NET_HDR_GSO_UDP_L4
+#  define VIRTIO_NET_HDR_GSO_UDP_L4 5
+# endif
+
+/* Per-queue segmentation offload state */
+typedef struct tun6_offload
+{
+	tun6_gso gso;
+	uint8_t frame[65536];
+} tun6_offload;
+#endif
+
 struct tun6
 {
-	int  id, fd, reqfd;
+	int  id, reqfd;
 #if defined (USE_BSD)
 	char orig_name[IFNAMSIZ];
 #endif
+#ifdef USE_OFFLOAD
+	tun6_offload *offload; // one per queue, NULL if disabled
+#endif
+	unsigned queues;
+	int  fd[]; // one per queue
 };
 
+/**
+ * Sets up a tunnel queue file descriptor.
+ * The descriptor is non-blocking, so that packet bursts can be read
+ * until the queue is empty. Blocking functions poll() instead.
+ */
+static void tun6_setup_fd (int fd)
+{
+	fcntl (fd, F_SETFD, FD_CLOEXEC);
+
+	int val = fcntl (fd, F_GETFL);
+	fcntl (fd, F_SETFL, ((val != -1) ? val : 0) | O_NONBLOCK);
+}
+
+
 /**
  * Tries to allocate a tunnel interface from the kernel.
  *
@@ -149,12 +190,59 @@ struct tun6
  * @return NULL on error.
  */
 tun6 *tun6_create (const char *req_name)
+{
+	return tun6_create_mq (req_name, 1, 0);
+}
+
+
+/**
+ * Tries to allocate a multi-queue tunnel interface from the kernel.
+ * Each queue has its own file descriptor, so that packets can be received
+ * and sent from several threads in parallel.
+ *
+ * @param req_name may be an interface name for the virtual network device
+ * (it might be ignored on some OSes).
+ * If NULL, an internal default will be used.
+ * @param queues number of queues, at most TUN6_MAX_QUEUES; if the operating
+ * system does not support multi-queue tunnels, only one queue is created.
+ * @param flags TUN6_OFFLOAD to let the kernel pass large TCP and UDP
+ * segmentation offload packets, which are then segmented in user space
+ * by the receive functions. Ignored if the operating system does not
+ * support it.
+ *
+ * @return NULL on error.
+ */
+tun6 *tun6_create_mq (const char *req_name, unsigned queues, int flags)
 {
 	(void)bindtextdomain (PACKAGE_NAME, LOCALEDIR);
-	tun6 *t = (tun6 *)malloc (sizeof (*t));
+
+	if (queues == 0)
+		queues = 1;
+	if (queues > TUN6_MAX_QUEUES)
+	{
+		errno = EINVAL;
+		return NULL;
+	}
+#if !defined (USE_LINUX) || !defined (IFF_MULTI_QUEUE)
+	if (queues > 1)
+	{
+		syslog (LOG_WARNING, _("Multi-queue tunnels are not supported. "
+		        "Using only one queue."));
+		queues = 1;
+	}
+#endif
+
+#ifndef USE_OFFLOAD
+	if (flags & TUN6_OFFLOAD)
+		syslog (LOG_WARNING, _("Tunnel segmentation offload is not "
+		        "supported."));
+#endif
+
+	tun6 *t = (tun6 *)malloc (sizeof (*t) + queues * sizeof (t->fd[0]));
 	if (t == NULL)
 		return NULL;
 	memset (t, 0, sizeof (*t));
+	t->queues = 1;
 
 	int reqfd = t->reqfd = socket (AF_INET6, SOCK_DGRAM, 0);
 	if (reqfd == -1)
@@ -190,6 +278,43 @@ tun6 *tun6_create (const char *req_name)
 		return NULL;
 	}
 
+# ifdef IFF_MULTI_QUEUE
+	if (queues > 1)
+	{
+		unsigned int features;
+
+		if (ioctl (fd, TUNGETFEATURES, &features)
+		 || !(features & IFF_MULTI_QUEUE))
+		{
+			syslog (LOG_WARNING, _("Multi-queue tunnels are not supported. "
+			        "Using only one queue."));
+			queues = 1;
+		}
+		else
+			req.ifr_flags |= IFF_MULTI_QUEUE;
+	}
+# endif
+# ifdef USE_OFFLOAD
+	if (flags & TUN6_OFFLOAD)
+	{
+		unsigned int features;
+
+		if (ioctl (fd, TUNGETFEATURES, &features)
+		 || !(features & IFF_VNET_HDR))
+			syslog (LOG_WARNING, _("Tunnel segmentation offload is not "
+			        "supported."));
+		else
+		{
+			t->offload = malloc (queues * sizeof (*t->offload));
+			if (t->offload == NULL)
+				goto error;
+			for (unsigned i = 0; i < queues; i++)
+				t->offload[i].gso.frame = NULL;
+			req.ifr_flags |= IFF_VNET_HDR;
+		}
+	}
+# endif
+
 	// Allocates the tunneling virtual network interface
 	if (ioctl (fd, TUNSETIFF, (void *)&req))
 	{
@@ -204,6 +329,42 @@ tun6 *tun6_create (const char *req_name)
 	int id = if_nametoindex (req.ifr_name);
 	if (id == 0)
 		goto error;
+
+# ifdef USE_OFFLOAD
+	if (t->offload != NULL)
+	{
+		/* IPv6 TCP and UDP segmentation offload require checksum offload.
+		 * Linux only accepts UDP segmentation for both IP versions. */
+		unsigned long offload = TUN_F_CSUM | TUN_F_TSO6 | TUN_F_TSO_ECN;
+		/* Older kernels do not know UDP segmentation: retry without */
+		if (ioctl (fd, TUNSETOFFLOAD, offload | TUN_F_USO4 | TUN_F_USO6)
+		 && ioctl (fd, TUNSETOFFLOAD, offload))
+			syslog (LOG_WARNING, _("Tunneling driver error (%s): %m"),
+			        "TUNSETOFFLOAD");
+	}
+# endif
+
+	// Attaches the other queues to the interface
+	while (t->queues < queues)
+	{
+		int qfd = open (tundev, O_RDWR);
+		if (qfd == -1)
+		{
+			syslog (LOG_ERR, _("Tunneling driver error (%s): %m"), tundev);
+			goto error;
+		}
+
+		if (ioctl (qfd, TUNSETIFF, (void *)&req))
+		{
+			syslog (LOG_ERR, _("Tunneling driver error (%s): %m"),
+			        "TUNSETIFF");
+			(void)close (qfd);
+			goto error;
+		}
+
+		tun6_setup_fd (qfd);
+		t->fd[t->queues++] = qfd;
+	}
 #elif defined (USE_BSD)
 # ifdef HAVE_KLDLOAD
 	kldload ("if_tun");
@@ -331,18 +492,21 @@ tun6 *tun6_create (const char *req_name)
 # error No tunneling driver implemented on your platform!
 #endif /* HAVE_os */
 
-	fcntl (fd, F_SETFD, FD_CLOEXEC);
-	/*int val = fcntl (fd, F_GETFL);
-	fcntl (fd, F_SETFL, ((val != -1) ? val : 0) | O_NONBLOCK);*/
+	tun6_setup_fd (fd);
 
 	t->id = id;
-	t->fd = fd;
+	t->fd[0] = fd;
 	return t;
 
 error:
 	(void)close (reqfd);
 	if (fd != -1)
 		(void)close (fd);
+	for (unsigned i = 1; i < t->queues; i++)
+		(void)close (t->fd[i]);
+#ifdef USE_OFFLOAD
+	free (t->offload);
+#endif
 	syslog (LOG_ERR, _("%s tunneling interface creation failure"), os_driver);
 	free (t);
 	return NULL;
@@ -359,7 +523,7 @@ error:
 void tun6_destroy (tun6* t)
 {
 	assert (t != NULL);
-	assert (t->fd != -1);
+	assert (t->fd[0] != -1);
 	assert (t->reqfd != -1);
 	assert (t->id != 0);
 
@@ -389,8 +553,12 @@ void tun6_destroy (tun6* t)
 # endif
 #endif
 
-	(void)close (t->fd);
+	for (unsigned i = 0; i < t->queues; i++)
+		(void)close (t->fd[i]);
 	(void)close (t->reqfd);
+#ifdef USE_OFFLOAD
+	free (t->offload);
+#endif
 	free (t);
 }
 
@@ -412,6 +580,32 @@ int tun6_getId (const tun6 *t)
 }
 
 
+/**
+ * @return the number of queues of the tunnel device
+ */
+unsigned tun6_getQueues (const tun6 *t)
+{
+	assert (t != NULL);
+	assert (t->queues > 0);
+
+	return t->queues;
+}
+
+
+/**
+ * @return the file descriptor of a given queue of the tunnel device,
+ * for use with an external event loop (poll(), epoll...).
+ * The caller must not perform any I/O on it directly.
+ */
+int tun6_getQueueFd (const tun6 *t, unsigned queue)
+{
+	assert (t != NULL);
+	assert (queue < t->queues);
+
+	return t->fd[queue];
+}
+
+
 #if defined (USE_LINUX)
 static int
 proc_write_zero (const char *path)
@@ -845,11 +1039,11 @@ tun6_registerReadSet (const tun6 *t, fd_set *readset)
 {
 	assert (t != NULL);
 
-	if (t->fd >= (int)FD_SETSIZE)
+	if (t->fd[0] >= (int)FD_SETSIZE)
 		return -1;
 
-	FD_SET (t->fd, readset);
-	return t->fd;
+	FD_SET (t->fd[0], readset);
+	return t->fd[0];
 }
 
 
@@ -858,9 +1052,10 @@ tun6_registerReadSet (const tun6 *t, fd_set *readset)
  * @param buffer address to store packet
  * @param maxlen buffer length in bytes (should be 65535)
  *
- * This function will block if there is no input.
+ * This function will not block if there is no input.
  *
- * @return the packet length on success, -1 if no packet were to be received.
+ * @return the packet length on success, -1 if no packet were to be received
+ * (errno is ENOMSG if a non-IPv6 packet was discarded).
  */
 static inline int
 tun6_recv_inner (int fd, void *buffer, size_t maxlen)
@@ -874,14 +1069,129 @@ tun6_recv_inner (int fd, void *buffer, size_t maxlen)
 	vect[1].iov_len = maxlen;
 
 	int len = readv (fd, vect, 2);
+	if (len == -1)
+		return -1;
+
 	if ((len < (int)sizeof (head))
 	 || !tun_head_is_ipv6 (head))
+	{
+		errno = ENOMSG;
 		return -1; /* only accept IPv6 packets */
+	}
 
 	return len - sizeof (head);
 }
 
 
+#ifdef USE_OFFLOAD
+/**
+ * Receives a packet from a tunnel device with segmentation offload.
+ * Large offloaded packets are copied aside, and returned one segment at a
+ * time by this and the following calls.
+ *
+ * This function will not block if there is no input.
+ *
+ * @return the packet length on success, -1 if no packet were to be received
+ * (errno is ENOMSG if a non-IPv6 or invalid packet was discarded).
+ */
+static int
+tun6_recv_offload (tun6_offload *o, int fd, void *buffer, size_t maxlen)
+{
+	if (gso_pending (&o->gso))
+	{
+		size_t len = gso_next (&o->gso, buffer, maxlen);
+		if (len > 0)
+			return len;
+	}
+
+	struct iovec vect[3];
+	struct virtio_net_hdr vh;
+	tun_head_t head;
+
+	vect[0].iov_base = (char *)&head;
+	vect[0].iov_len = sizeof (head);
+	vect[1].iov_base = (char *)&vh;
+	vect[1].iov_len = sizeof (vh);
+	vect[2].iov_base = (char *)buffer;
+	vect[2].iov_len = maxlen;
+
+	int len = readv (fd, vect, 3);
+	if (len == -1)
+		return -1;
+
+	len -= sizeof (head) + sizeof (vh);
+	if ((len < 0) || !tun_head_is_ipv6 (head))
+		goto drop;
+
+	uint8_t proto;
+
+	switch (vh.gso_type & ~VIRTIO_NET_HDR_GSO_ECN)
+	{
+		case VIRTIO_NET_HDR_GSO_NONE:
+			if ((vh.flags & VIRTIO_NET_HDR_F_NEEDS_CSUM)
+			 && gso_checksum (buffer, len, vh.csum_start, vh.csum_offset))
+				goto drop;
+			return len;
+
+		case VIRTIO_NET_HDR_GSO_TCPV6:
+			proto = IPPROTO_TCP;
+			break;
+		case VIRTIO_NET_HDR_GSO_UDP_L4:
+			proto = IPPROTO_UDP;
+			break;
+		default:
+			goto drop;
+	}
+
+	/* The upper-layer header offset is only known from the checksum
+	 * offload parameters, which are always set for offloaded packets. */
+	if (!(vh.flags & VIRTIO_NET_HDR_F_NEEDS_CSUM))
+		goto drop;
+
+	memcpy (o->frame, buffer, len);
+	if (gso_prepare (&o->gso, o->frame, len, proto, vh.csum_start,
+	                 vh.gso_size))
+		goto drop;
+
+	len = gso_next (&o->gso, buffer, maxlen);
+	if (len > 0)
+		return len;
+
+drop:
+	errno = ENOMSG;
+	return -1;
+}
+#endif
+
+
+/**
+ * Receives a packet from a given queue of a tunnel device.
+ * This function will not block if there is no input.
+ */
+static int
+tun6_recv_queue (tun6 *t, unsigned queue, void *buffer, size_t maxlen)
+{
+#ifdef USE_OFFLOAD
+	if (t->offload != NULL)
+		return tun6_recv_offload (t->offload + queue, t->fd[queue], buffer,
+		                          maxlen);
+#endif
+	return tun6_recv_inner (t->fd[queue], buffer, maxlen);
+}
+
+
+/**
+ * Waits until the tunnel device is ready for I/O.
+ * This is a cancellation point.
+ */
+static void tun6_poll (int fd, short events)
+{
+	struct pollfd ufd = { .fd = fd, .events = events };
+
+	while ((poll (&ufd, 1, -1) == -1) && (errno == EINTR));
+}
+
+
 /**
  * Checks an fd_set, and receives a packet if available.
  * @param buffer address to store packet
@@ -897,13 +1207,17 @@ tun6_recv (tun6 *t, const fd_set *readset, void *buffer, size_t maxlen)
 {
 	assert (t != NULL);
 
-	int fd = t->fd;
-	if ((fd < (int)FD_SETSIZE) && !FD_ISSET (fd, readset))
+	int fd = t->fd[0];
+	if ((fd < (int)FD_SETSIZE) && !FD_ISSET (fd, readset)
+#ifdef USE_OFFLOAD
+	 && ((t->offload == NULL) || !gso_pending (&t->offload[0].gso))
+#endif
+	   )
 	{
 		errno = EAGAIN;
 		return -1;
 	}
-	return tun6_recv_inner (fd, buffer, maxlen);
+	return tun6_recv_queue (t, 0, buffer, maxlen);
 }
 
 
@@ -919,7 +1233,93 @@ tun6_recv (tun6 *t, const fd_set *readset, void *buffer, size_t maxlen)
 int
 tun6_wait_recv (tun6 *t, void *buffer, size_t maxlen)
 {
-	return tun6_recv_inner (t->fd, buffer, maxlen);
+	for (;;)
+	{
+		int val = tun6_recv_queue (t, 0, buffer, maxlen);
+		if ((val != -1) || (errno != EAGAIN))
+			return val;
+
+		tun6_poll (t->fd[0], POLLIN);
+	}
+}
+
+
+/**
+ * Waits for at least one packet, and receives as many pending packets as
+ * possible without blocking.
+ * @param bufs vector of buffers: on entry, the buffer lengths in bytes
+ * (should be 65535); on return, the received packet lengths.
+ * @param count number of buffers in the vector
+ *
+ * Non-IPv6 packets are silently discarded.
+ *
+ * @return the number of received packets on success,
+ * -1 if no packet were to be received.
+ */
+int
+tun6_recv_burst (tun6 *t, struct iovec *bufs, unsigned count)
+{
+	return tun6_recv_burst_queue (t, 0, bufs, count);
+}
+
+
+static int
+tun6_recv_burst_inner (tun6 *t, unsigned queue, struct iovec *bufs,
+                       unsigned count, bool wait)
+{
+	unsigned n = 0;
+
+	assert (t != NULL);
+	assert (queue < t->queues);
+
+	int fd = t->fd[queue];
+
+	while (n < count)
+	{
+		int val = tun6_recv_queue (t, queue, bufs[n].iov_base,
+		                           bufs[n].iov_len);
+		if (val == -1)
+		{
+			if (errno == ENOMSG)
+				continue;
+			if ((errno != EAGAIN) || (n > 0) || !wait)
+				break;
+
+			tun6_poll (fd, POLLIN);
+			continue;
+		}
+
+		bufs[n++].iov_len = val;
+	}
+
+	return (n > 0) ? (int)n : -1;
+}
+
+
+/**
+ * Same as tun6_recv_burst(), but from a given queue of the tunnel device.
+ * @param queue queue index, smaller than tun6_getQueues()
+ */
+int
+tun6_recv_burst_queue (tun6 *t, unsigned queue, struct iovec *bufs,
+                       unsigned count)
+{
+	return tun6_recv_burst_inner (t, queue, bufs, count, true);
+}
+
+
+/**
+ * Same as tun6_recv_burst_queue(), but never blocks.
+ * If less than count packets are returned, the queue has been drained.
+ *
+ * @return the number of received packets on success,
+ * -1 if no packet were to be received.
+ */
+int
+tun6_try_recv_burst (tun6 *t, unsigned queue, struct iovec *bufs,
+                     unsigned count)
+{
+	return tun6_recv_burst_inner (t, queue, bufs, count, false);
 }
 
 
@@ -933,24 +1333,51 @@ tun6_wait_recv (tun6 *t, void *buffer, size_t maxlen)
  */
 int
 tun6_send (tun6 *t, const void *packet, size_t len)
+{
+	return tun6_send_queue (t, 0, packet, len);
+}
+
+
+/**
+ * Same as tun6_send(), but through a given queue of the tunnel device.
+ * @param queue queue index, smaller than tun6_getQueues()
+ */
+int
+tun6_send_queue (tun6 *t, unsigned queue, const void *packet, size_t len)
 {
 	assert (t != NULL);
+	assert (queue < t->queues);
 
 	if (len > 65535)
 		return -1;
 
 	tun_head_t head = TUN_HEAD_IPV6_INITIALIZER;
-	struct iovec vect[2];
-	vect[0].iov_base = (char *)&head;
-	vect[0].iov_len = sizeof (head);
-	vect[1].iov_base = (char *)packet; /* necessary cast to non-const */
-	vect[1].iov_len = len;
-
-	int val = writev (t->fd, vect, 2);
+	struct iovec vect[3];
+	unsigned n = 0;
+	vect[n].iov_base = (char *)&head;
+	vect[n++].iov_len = sizeof (head);
+#ifdef USE_OFFLOAD
+	/* Packets toward the kernel are neither offloaded nor checksummed */
+	struct virtio_net_hdr vh = { .gso_type = VIRTIO_NET_HDR_GSO_NONE };
+	if (t->offload != NULL)
+	{
+		vect[n].iov_base = (char *)&vh;
+		vect[n++].iov_len = sizeof (vh);
+	}
+#endif
+	size_t hlen = 0;
+	for (unsigned i = 0; i < n; i++)
+		hlen += vect[i].iov_len;
+	vect[n].iov_base = (char *)packet; /* necessary cast to non-const */
+	vect[n++].iov_len = len;
+
+	int fd = t->fd[queue], val;
+	while (((val = writev (fd, vect, n)) == -1) && (errno == EAGAIN))
+		tun6_poll (fd, POLLOUT);
 	if (val == -1)
 		return -1;
 
-	val -= sizeof (head);
+	val -= hlen;
 	if (val < 0)
 		return -1;
 
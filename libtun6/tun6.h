@@ -57,6 +57,7 @@
 # endif
 
 struct in6_addr;
+struct iovec;
 
 typedef struct tun6 tun6;
 
@@ -73,9 +74,19 @@ int tun6_driver_diagnose (char *errbuf) LIBTUN6_NONNULL;
  */
 
 tun6 *tun6_create (const char *req_name) LIBTUN6_WARN_UNUSED;
+/* tun6_create_mq() flags */
+# define TUN6_OFFLOAD 0x1 /* segmentation offload */
+/* Largest number of queues of a tunnel (Linux MAX_TAP_QUEUES) */
+# define TUN6_MAX_QUEUES 256
+
+tun6 *tun6_create_mq (const char *req_name, unsigned queues, int flags)
+	LIBTUN6_WARN_UNUSED;
 void tun6_destroy (tun6 *t) LIBTUN6_NONNULL;
 
 int tun6_getId (const tun6 *t) LIBTUN6_NONNULL;
+unsigned tun6_getQueues (const tun6 *t) LIBTUN6_NONNULL LIBTUN6_PURE;
+int tun6_getQueueFd (const tun6 *t, unsigned queue)
+	LIBTUN6_NONNULL LIBTUN6_PURE;
 
 int tun6_setState (tun6 *t, bool up) LIBTUN6_NONNULL;
 static inline int tun6_bringUp (tun6 *t)
@@ -106,9 +117,24 @@ int tun6_registerReadSet (const tun6 *restrict t, fd_set *restrict readset)
 int tun6_recv (tun6 *restrict t, const fd_set *restrict readset,
                void *buf, size_t len) LIBTUN6_NONNULL;
 int tun6_wait_recv (tun6 *restrict t, void *buf, size_t len) LIBTUN6_NONNULL;
+int tun6_recv_burst (tun6 *restrict t, struct iovec *restrict bufs,
+                     unsigned count) LIBTUN6_NONNULL;
 int tun6_send (tun6 *restrict t, const void *packet, size_t len)
 	LIBTUN6_NONNULL;
 
+/*
+ * Multi-queue I/O: the queue index must be smaller than tun6_getQueues().
+ * The functions above use the first queue.
+ */
+int tun6_recv_burst_queue (tun6 *restrict t, unsigned queue,
+                           struct iovec *restrict bufs, unsigned count)
+	LIBTUN6_NONNULL;
+int tun6_try_recv_burst (tun6 *restrict t, unsigned queue,
+                         struct iovec *restrict bufs, unsigned count)
+	LIBTUN6_NONNULL;
+int tun6_send_queue (tun6 *restrict t, unsigned queue,
+                     const void *packet, size_t len) LIBTUN6_NONNULL;
+
 # ifdef __cplusplus
 }
 # endif /* C++ */
@@ -36,6 +36,7 @@
 #include <unistd.h>
 #include <inttypes.h>
 #include <netinet/in.h>
+#include <libtun6/tun6.h> // TUN6_MAX_QUEUES
 #include "miredo.h"
 #include "conf.h"
 
@@ -88,6 +89,7 @@ static int miredo_checkconf (miredo_conf *conf)
 
 	uint32_t u32;
 	uint16_t u16;
+	bool b;
 
 	if (client)
 	{
@@ -103,6 +105,18 @@ static int miredo_checkconf (miredo_conf *conf)
 			fprintf (stderr, "%s\n", _("Server address not specified"));
 			res = -1;
 		}
+
+		/* Further ServerAddress directives add standby servers */
+		for (unsigned i = 1; (ip != 0) && (i < 8); i++)
+		{
+			ip = 0;
+			if (!miredo_conf_parse_IPv4 (conf, "ServerAddress", &ip))
+				res = -1;
+		}
+
+		char *path = miredo_conf_get (conf, "StateFile", NULL);
+		if (path != NULL)
+			free (path);
 #else
 		fprintf (stderr, "%s\n", _("Unsupported Teredo client mode"));
 		res = -1;
@@ -117,8 +131,24 @@ static int miredo_checkconf (miredo_conf *conf)
 	}
 
 	if (!miredo_conf_parse_IPv4 (conf, "BindAddress", &u32)
-	 || !miredo_conf_get_int16 (conf, "BindPort", &u16, NULL))
+	 || !miredo_conf_get_int16 (conf, "BindPort", &u16, NULL)
+	 || !miredo_conf_get_bool (conf, "InterfaceOffload", &b, NULL)
+	 || !miredo_conf_get_bool (conf, "EventLoop", &b, NULL)
+	 || !miredo_conf_get_int16 (conf, "Workers", &u16, NULL)
+	 || !miredo_conf_get_bool (conf, "Pipeline", &b, NULL))
+		res = -1;
+
+	u16 = 1;
+	if (!miredo_conf_get_int16 (conf, "InterfaceQueues", &u16, &line))
 		res = -1;
+	else
+	if (u16 > TUN6_MAX_QUEUES)
+	{
+		fprintf (stderr, _("Too many interface queues (%u) at line %u: "
+		                   "at most %u"), (unsigned)u16, line, TUN6_MAX_QUEUES);
+		fputc ('\n', stderr);
+		res = -1;
+	}
 
 	char *str = miredo_conf_get (conf, "InterfaceName", NULL);
 	if (str != NULL)
@@ -334,11 +334,10 @@ bool miredo_conf_get_int16 (miredo_conf *conf, const char *name,
 }
 
 
-#if 0
-/* This is supposedly bad for DSO (but we are not a DSO atm) */
-static const char *true_strings[] = { "yes", "true", "on", "enabled", NULL };
-static const char *false_strings[] =
-	{ "no", "false", "off", "disabled", NULL };
+/* Arrays of arrays rather than of pointers, so as not to need relocations */
+static const char true_strings[][9] = { "yes", "true", "on", "enabled", "" };
+static const char false_strings[][9] =
+	{ "no", "false", "off", "disabled", "" };
 
 bool miredo_conf_get_bool (miredo_conf *conf, const char *name,
                            bool *value, unsigned *line)
@@ -363,7 +362,7 @@ bool miredo_conf_get_bool (miredo_conf *conf, const char *name,
 		}
 	}
 
-	for (const char **ptr = true_strings; *ptr != NULL; ptr++)
+	for (const char (*ptr)[9] = true_strings; **ptr; ptr++)
 		if (!strcasecmp (val, *ptr))
 		{
 			*value = true;
@@ -371,7 +370,7 @@ bool miredo_conf_get_bool (miredo_conf *conf, const char *name,
 			return true;
 		}
 
-	for (const char **ptr = false_strings; *ptr != NULL; ptr++)
+	for (const char (*ptr)[9] = false_strings; **ptr; ptr++)
 		if (!strcasecmp (val, *ptr))
 		{
 			*value = false;
@@ -383,7 +382,6 @@ bool miredo_conf_get_bool (miredo_conf *conf, const char *name,
 	free (val);
 	return false;
 }
-#endif
 
 /* Utilities function */
 
@@ -123,6 +123,9 @@ miredo (const char *confpath, const char *server_name, int pidfd)
 	sigaddset (&set, SIGHUP);
 	reload_set = set;
 
+	/* Statistics signal, passed on to the child */
+	sigaddset (&set, SIGUSR1);
+
 	/* No-op signal */
 	sigaddset (&set, SIGCHLD);
 
@@ -177,6 +180,12 @@ miredo (const char *confpath, const char *server_name, int pidfd)
 			 && waitpid (pid, &status, WNOHANG) == pid)
 				break; /* child died */
 
+			if (signum == SIGUSR1)
+			{
+				kill (pid, SIGUSR1);
+				continue;
+			}
+
 			if (sigismember (&exit_set, signum))
 			{
 				syslog (LOG_NOTICE, _("Exiting on signal %d (%s)"),
@@ -40,6 +40,7 @@
 #include <pthread.h>
 
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #include <netinet/ip6.h>
 #include <netinet/icmp6.h>
@@ -48,6 +49,10 @@
 #ifdef HAVE_SYS_CAPABILITY_H
 # include <sys/capability.h>
 #endif
+#ifdef __linux__
+# include <sys/epoll.h>
+# include <sys/signalfd.h>
+#endif
 #ifndef SOL_IPV6
 # define SOL_IPV6 IPPROTO_IPV6
 #endif
@@ -66,6 +71,8 @@
 #include "privproc.h"
 #include "miredo.h"
 #include "conf.h"
+#include "ring.h"
+#include "state.h"
 
 static void miredo_setup_fd (int fd);
 static void miredo_setup_nonblock_fd (int fd);
@@ -88,6 +95,14 @@ typedef struct miredo_tunnel
 	tun6 *tunnel;
 	int priv_fd;
 	teredo_tunnel *relay;
+
+	/* Decapsulated packets toward the tunnel writer (pipeline mode) */
+	miredo_ring *decap_ring;
+	pthread_t writer;
+
+	/* Client state file (-1 if none) */
+	int state_fd;
+	miredo_state state;
 } miredo_tunnel;
 
 static int icmp6_fd = -1;
@@ -127,11 +142,24 @@ static void miredo_deinit (bool client)
  * Callback to transmit decapsulated Teredo IPv6 packets to the kernel.
  */
 static void
-miredo_recv_callback (void *data, const void *packet, size_t length)
+miredo_recv_callback (void *data, const struct iovec *pkts, unsigned count)
 {
 	assert (data != NULL);
 
-	(void)tun6_send (((miredo_tunnel *)data)->tunnel, packet, length);
+	miredo_tunnel *t = (miredo_tunnel *)data;
+
+	if (t->decap_ring != NULL)
+	{
+		/* Packets are dropped if the tunnel writer lags too much */
+		for (unsigned i = 0; i < count; i++)
+			(void)miredo_ring_push (t->decap_ring, pkts[i].iov_base,
+			                        pkts[i].iov_len);
+		miredo_ring_notify (t->decap_ring);
+		return;
+	}
+
+	for (unsigned i = 0; i < count; i++)
+		(void)tun6_send (t->tunnel, pkts[i].iov_base, pkts[i].iov_len);
 }
 
 
@@ -164,6 +192,9 @@ miredo_icmp6_callback (void *data, const void *packet, size_t length,
 #define TEREDO_RESTRICT 1
 #define TEREDO_CLIENT   2
 
+/* Maximum number of Teredo servers, see teredo_set_client_servers() */
+#define MAX_SERVERS 8
+
 static bool
 ParseRelayType (miredo_conf *conf, const char *name, int *type)
 {
@@ -201,9 +232,10 @@ ParseRelayType (miredo_conf *conf, const char *name, int *type)
 
 #ifdef MIREDO_TEREDO_CLIENT
 static tun6 *
-create_dynamic_tunnel (const char *ifname, int *pfd)
+create_dynamic_tunnel (const char *ifname, unsigned queues, int flags,
+                       int *pfd)
 {
-	tun6 *tunnel = tun6_create (ifname);
+	tun6 *tunnel = tun6_create_mq (ifname, queues, flags);
 	if (tunnel == NULL)
 		return NULL;
 
@@ -277,6 +309,18 @@ destroy_dynamic_tunnel (tun6 *tunnel, int fd)
 }
 
 
+/**
+ * Rewrites the client state file, if any. Only called from the Teredo
+ * client maintenance thread.
+ */
+static void
+miredo_save_state (miredo_tunnel *t)
+{
+	if ((t->state_fd != -1) && miredo_state_write (t->state_fd, &t->state))
+		syslog (LOG_WARNING, _("Error (%s): %m"), "pwrite");
+}
+
+
 /**
  * Callback to configure a Teredo tunneling interface.
  */
@@ -292,7 +336,14 @@ miredo_up_callback (void *data, const struct in6_addr *addr, uint16_t mtu)
 
 	assert (data != NULL);
 
-	configure_tunnel (((miredo_tunnel *)data)->priv_fd, addr, mtu);
+	miredo_tunnel *t = (miredo_tunnel *)data;
+
+	configure_tunnel (t->priv_fd, addr, mtu);
+
+	/* Saved for a fast start next time */
+	t->state.addr = *addr;
+	t->state.mtu = mtu;
+	miredo_save_state (t);
 }
 
 
@@ -304,34 +355,62 @@ miredo_down_callback (void *data)
 {
 	assert (data != NULL);
 
-	configure_tunnel (((miredo_tunnel *)data)->priv_fd, &in6addr_any,
-	                         1280);
+	miredo_tunnel *t = (miredo_tunnel *)data;
+
+	configure_tunnel (t->priv_fd, &in6addr_any, 1280);
 	syslog (LOG_NOTICE, _("Teredo pseudo-tunnel stopped"));
+
+	t->state.addr = in6addr_any;
+	miredo_save_state (t);
+}
+
+
+/**
+ * Callback to save the learnt NAT binding lifetime.
+ */
+static void
+miredo_lifetime_callback (void *data, unsigned sec)
+{
+	assert (data != NULL);
+
+	miredo_tunnel *t = (miredo_tunnel *)data;
+
+	t->state.lifetime = sec;
+	miredo_save_state (t);
 }
 
 
 static int
-setup_client (teredo_tunnel *client, const char *server, const char *server2)
+setup_client (teredo_tunnel *client, const char *const *servers,
+              unsigned count, const char *server2)
 {
+	const miredo_tunnel *data = teredo_get_privdata (client);
+
 	teredo_set_state_cb (client, miredo_up_callback, miredo_down_callback);
-	return teredo_set_client_mode (client, server, server2);
+	teredo_set_binding_lifetime (client, data->state.lifetime,
+	                             miredo_lifetime_callback);
+	if (!IN6_IS_ADDR_UNSPECIFIED (&data->state.addr))
+		teredo_set_client_cache (client, &data->state.addr,
+		                         data->state.mtu);
+	return (count > 1) ? teredo_set_client_servers (client, servers, count)
+	                   : teredo_set_client_mode (client, servers[0], server2);
 }
 #else
-# define create_dynamic_tunnel( a, b )   NULL
+# define create_dynamic_tunnel( a, b, c, d ) NULL
 # define destroy_dynamic_tunnel( a, b )   (void)0
-# define setup_client( a, b, c )         (-1)
+# define setup_client( a, b, c, d )      (-1)
 #endif
 
 
 static tun6 *
-create_static_tunnel (const char *restrict ifname,
-                      const struct in6_addr *restrict prefix,
+create_static_tunnel (const char *restrict ifname, unsigned queues,
+                      int flags, const struct in6_addr *restrict prefix,
                       uint16_t mtu)
 {
-	tun6 *tunnel = tun6_create (ifname);
+	tun6 *tunnel = tun6_create_mq (ifname, queues, flags);
 
 	if ((tunnel == NULL) && (ifname != NULL) && (errno == ENOSYS))
-		tunnel = tun6_create (NULL);
+		tunnel = tun6_create_mq (NULL, queues, flags);
 	if (tunnel == NULL)
 		return NULL;
 
@@ -378,59 +457,395 @@ setup_relay (teredo_tunnel *relay, uint32_t prefix, bool cone)
 }
 
 
+/* Maximum number of IPv6 packets read from the tunnel at once */
+#define ENCAP_BURST 16
+
+/* Pipeline mode: ring size (bytes) and maximum packets per ring drain */
+#define PIPELINE_RING_SIZE (1 << 20)
+#define PIPELINE_BURST     64
+
+typedef struct miredo_encap
+{
+	miredo_tunnel *data;
+	unsigned queue;
+	pthread_t thread;
+
+	/* IPv6 packets toward the UDP sender (pipeline mode) */
+	miredo_ring *ring;
+	pthread_t sender;
+} miredo_encap;
+
+
+static void log_ring (const char *name, unsigned i, miredo_ring *ring)
+{
+	miredo_ring_stats st;
+
+	miredo_ring_get_stats (ring, &st);
+	syslog (LOG_INFO, _("%s %u: %lu packets, %lu dropped, "
+	                    "peak %zu out of %zu bytes"), name, i,
+	        st.pushed, st.dropped, st.max_used, st.size);
+}
+
+
 /**
- * Thread to encapsulate IPv6 packets into UDP.
+ * Thread to write decapsulated packets to the tunnel (pipeline mode).
  * Cancellation safe.
  */
-static LIBTEREDO_NORETURN void *miredo_encap_thread (void *d)
+static void *miredo_writer_thread (void *d)
 {
-	teredo_tunnel *relay = ((miredo_tunnel *)d)->relay;
-	tun6 *tunnel = ((miredo_tunnel *)d)->tunnel;
+	miredo_tunnel *data = (miredo_tunnel *)d;
 
 	for (;;)
 	{
-		/* Handle incoming data */
-		struct
+		struct iovec pkts[PIPELINE_BURST];
+		unsigned n = miredo_ring_peek (data->decap_ring, pkts,
+		                               PIPELINE_BURST);
+
+		pthread_setcancelstate (PTHREAD_CANCEL_DISABLE, NULL);
+		for (unsigned i = 0; i < n; i++)
+			(void)tun6_send (data->tunnel, pkts[i].iov_base,
+			                 pkts[i].iov_len);
+		miredo_ring_release (data->decap_ring);
+		pthread_setcancelstate (PTHREAD_CANCEL_ENABLE, NULL);
+	}
+	return NULL;
+}
+
+
+static int miredo_writer_start (miredo_tunnel *data)
+{
+	data->decap_ring = miredo_ring_create (PIPELINE_RING_SIZE);
+	if (data->decap_ring == NULL)
+		return -1;
+
+	if (pthread_create (&data->writer, NULL, miredo_writer_thread, data))
+	{
+		miredo_ring_destroy (data->decap_ring);
+		data->decap_ring = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+
+/**
+ * Stops the tunnel writer. The Teredo tunnel must be destroyed first.
+ */
+static void miredo_writer_stop (miredo_tunnel *data)
+{
+	if (data->decap_ring == NULL)
+		return;
+
+	pthread_cancel (data->writer);
+	pthread_join (data->writer, NULL);
+	log_ring (_("Decapsulation ring"), 0, data->decap_ring);
+	miredo_ring_destroy (data->decap_ring);
+	data->decap_ring = NULL;
+}
+
+
+/**
+ * Thread to send encapsulated packets from one tunnel queue
+ * (pipeline mode). Cancellation safe.
+ */
+static void *miredo_sender_thread (void *d)
+{
+	miredo_encap *encap = (miredo_encap *)d;
+	teredo_tunnel *relay = encap->data->relay;
+
+	for (;;)
+	{
+		struct iovec pkts[PIPELINE_BURST];
+		unsigned n = miredo_ring_peek (encap->ring, pkts, PIPELINE_BURST);
+
+		pthread_setcancelstate (PTHREAD_CANCEL_DISABLE, NULL);
+		teredo_transmit_batch (relay, pkts, n);
+		miredo_ring_release (encap->ring);
+		pthread_setcancelstate (PTHREAD_CANCEL_ENABLE, NULL);
+	}
+	return NULL;
+}
+
+/**
+ * Thread to encapsulate IPv6 packets from one tunnel queue into UDP.
+ * Cancellation safe.
+ */
+static void *miredo_encap_thread (void *d)
+{
+	miredo_encap *encap = (miredo_encap *)d;
+	teredo_tunnel *relay = encap->data->relay;
+	tun6 *tunnel = encap->data->tunnel;
+
+	/* Buffers are too large for the stack */
+	uint8_t *pbuf = malloc (ENCAP_BURST * 65535);
+	if (pbuf == NULL)
+	{
+		syslog (LOG_ALERT, _("Error (%s): %m"), "malloc");
+		return NULL;
+	}
+
+	pthread_cleanup_push (free, pbuf);
+	for (;;)
+	{
+		struct iovec iov[ENCAP_BURST];
+
+		for (unsigned i = 0; i < ENCAP_BURST; i++)
 		{
-			struct ip6_hdr ip6;
-			uint8_t fill[65467];
-		} pbuf;
+			iov[i].iov_base = pbuf + (i * 65535);
+			iov[i].iov_len = 65535;
+		}
 
-		/* Forwards IPv6 packet to Teredo
+		/* Forwards IPv6 packets to Teredo
 		 * (Packet transmission) */
-		int val = tun6_wait_recv (tunnel, &pbuf.ip6, sizeof (pbuf));
-		if (val >= 40)
+		int val = tun6_recv_burst_queue (tunnel, encap->queue, iov,
+		                                 ENCAP_BURST);
+		if (val > 0)
 		{
 			pthread_setcancelstate (PTHREAD_CANCEL_DISABLE, NULL);
-			teredo_transmit (relay, &pbuf.ip6, val);
+			if (encap->ring != NULL)
+			{
+				for (int i = 0; i < val; i++)
+					(void)miredo_ring_push (encap->ring, iov[i].iov_base,
+					                        iov[i].iov_len);
+				miredo_ring_notify (encap->ring);
+			}
+			else
+				teredo_transmit_batch (relay, iov, val);
 			pthread_setcancelstate (PTHREAD_CANCEL_ENABLE, NULL);
 		}
 		else
 			pthread_testcancel ();
 	}
+	pthread_cleanup_pop (1);
+	return NULL;
+}
+
+
+/**
+ * Starts the encapsulation thread(s) of one tunnel queue.
+ */
+static int miredo_encap_start (miredo_encap *encap, bool pipeline)
+{
+	encap->ring = NULL;
+	if (pipeline)
+	{
+		encap->ring = miredo_ring_create (PIPELINE_RING_SIZE);
+		if (encap->ring == NULL)
+			return -1;
+
+		if (pthread_create (&encap->sender, NULL, miredo_sender_thread,
+		                    encap))
+		{
+			miredo_ring_destroy (encap->ring);
+			return -1;
+		}
+	}
+
+	if (pthread_create (&encap->thread, NULL, miredo_encap_thread, encap))
+	{
+		if (encap->ring != NULL)
+		{
+			pthread_cancel (encap->sender);
+			pthread_join (encap->sender, NULL);
+			miredo_ring_destroy (encap->ring);
+		}
+		return -1;
+	}
+	return 0;
+}
+
+
+static void miredo_encap_stop (miredo_encap *encap)
+{
+	pthread_cancel (encap->thread);
+	pthread_join (encap->thread, NULL);
+
+	if (encap->ring != NULL)
+	{
+		pthread_cancel (encap->sender);
+		pthread_join (encap->sender, NULL);
+		log_ring (_("Encapsulation ring"), encap->queue, encap->ring);
+		miredo_ring_destroy (encap->ring);
+	}
 }
 
 
 /**
  * Miredo main daemon function, with UDP datagrams and IPv6 packets
  * receive loop.
+ *
+ * @param pipeline whether encapsulated packets are sent by a separate
+ * thread from the one reading the tunnel
  */
 static int
-run_tunnel (miredo_tunnel *tunnel)
+run_tunnel (miredo_tunnel *tunnel, bool pipeline)
 {
-	pthread_t encap_th;
-	if (teredo_run_async (tunnel->relay)
-	 || pthread_create (&encap_th, NULL, miredo_encap_thread, tunnel))
+	unsigned queues = tun6_getQueues (tunnel->tunnel), n = 0;
+	miredo_encap *encap = malloc (queues * sizeof (*encap));
+
+	if (encap == NULL)
 		return -1;
 
+	int retval = -1;
+	if (teredo_run_async (tunnel->relay) == 0)
+	{
+		/* One encapsulation thread per tunnel queue */
+		while (n < queues)
+		{
+			encap[n].data = tunnel;
+			encap[n].queue = n;
+			if (miredo_encap_start (encap + n, pipeline))
+				break;
+			n++;
+		}
+
+		if (n == queues)
+		{
+			sigset_t dummyset, set;
+			sigemptyset (&dummyset);
+			pthread_sigmask (SIG_BLOCK, &dummyset, &set);
+			sigdelset (&set, SIGUSR1); /* does nothing, stays blocked */
+			while (sigwait (&set, &(int){ 0 }));
+			retval = 0;
+		}
+	}
+
+	while (n > 0)
+		miredo_encap_stop (encap + --n);
+	free (encap);
+	return retval;
+}
+
+
+#ifdef __linux__
+/**
+ * Encapsulates all pending IPv6 packets from one tunnel queue.
+ */
+static void
+miredo_encap_ready (miredo_tunnel *tunnel, unsigned queue, uint8_t *pbuf)
+{
+	int val;
+
+	do
+	{
+		struct iovec iov[ENCAP_BURST];
+
+		for (unsigned i = 0; i < ENCAP_BURST; i++)
+		{
+			iov[i].iov_base = pbuf + (i * 65535);
+			iov[i].iov_len = 65535;
+		}
+
+		val = tun6_try_recv_burst (tunnel->tunnel, queue, iov, ENCAP_BURST);
+		if (val > 0)
+			teredo_transmit_batch (tunnel->relay, iov, val);
+	}
+	while (val == ENCAP_BURST);
+}
+
+
+/**
+ * Single-threaded alternative to run_tunnel(): both directions and the
+ * libteredo timers are driven from one epoll loop. Signals are received
+ * through a signalfd.
+ */
+static int
+run_event_loop (miredo_tunnel *tunnel)
+{
+	unsigned queues = tun6_getQueues (tunnel->tunnel);
 	sigset_t dummyset, set;
 	sigemptyset (&dummyset);
 	pthread_sigmask (SIG_BLOCK, &dummyset, &set);
-	while (sigwait (&set, &(int){ 0 }));
+	sigdelset (&set, SIGUSR1); /* does nothing, stays blocked */
 
-	pthread_cancel (encap_th);
-	pthread_join (encap_th, NULL);
-	return 0;
+	/* Buffers are too large for the stack */
+	uint8_t *pbuf = malloc (ENCAP_BURST * 65535);
+	if (pbuf == NULL)
+		return -1;
+
+	int retval = -1;
+	int epfd = epoll_create1 (EPOLL_CLOEXEC);
+	int sigfd = signalfd (-1, &set, SFD_NONBLOCK | SFD_CLOEXEC);
+
+	if ((epfd == -1) || (sigfd == -1))
+		syslog (LOG_ALERT, _("Error (%s): %m"), "epoll");
+	else
+	{
+		/* Event data: tunnel queue index, or one of those */
+		const uint32_t teredo_ev = queues, signal_ev = queues + 1;
+		struct epoll_event ev = { .events = EPOLLIN };
+		bool ok = true;
+
+		ev.data.u32 = teredo_ev;
+		ok &= epoll_ctl (epfd, EPOLL_CTL_ADD,
+		                 teredo_get_fd (tunnel->relay), &ev) == 0;
+		ev.data.u32 = signal_ev;
+		ok &= epoll_ctl (epfd, EPOLL_CTL_ADD, sigfd, &ev) == 0;
+		for (unsigned i = 0; i < queues; i++)
+		{
+			ev.data.u32 = i;
+			ok &= epoll_ctl (epfd, EPOLL_CTL_ADD,
+			                 tun6_getQueueFd (tunnel->tunnel, i), &ev) == 0;
+		}
+
+		if (!ok)
+			syslog (LOG_ALERT, _("Error (%s): %m"), "epoll_ctl");
+
+		while (ok)
+		{
+			struct epoll_event evv[16];
+			int n = epoll_wait (epfd, evv, 16,
+			                    teredo_get_timeout (tunnel->relay));
+			if ((n == -1) && (errno != EINTR))
+			{
+				syslog (LOG_ALERT, _("Error (%s): %m"), "epoll_wait");
+				break;
+			}
+
+			for (int i = 0; i < n; i++)
+			{
+				uint32_t id = evv[i].data.u32;
+
+				if (id == signal_ev)
+				{
+					retval = 0;
+					ok = false;
+				}
+				else
+				if (id < queues)
+					/* Forwards IPv6 packets to Teredo
+					 * (Packet transmission) */
+					miredo_encap_ready (tunnel, id, pbuf);
+			}
+
+			/* Teredo packets reception and timers */
+			teredo_process_ready (tunnel->relay);
+		}
+	}
+
+	if (sigfd != -1)
+		close (sigfd);
+	if (epfd != -1)
+		close (epfd);
+	free (pbuf);
+	return retval;
+}
+#endif
+
+
+/**
+ * Logs the utilisation of the packet processing threads.
+ */
+static void log_workers (teredo_tunnel *relay)
+{
+	teredo_worker_stats st;
+
+	for (unsigned i = 0; teredo_get_worker_stats (relay, i, &st) == 0; i++)
+		syslog (LOG_INFO, _("Worker %u: %llu packets, %llu steals, "
+		                    "%u%% busy"), i,
+		        (unsigned long long)st.packets,
+		        (unsigned long long)st.steals,
+		        st.total_us ? (unsigned)(st.busy_us * 100 / st.total_us) : 0);
 }
 
 
@@ -452,27 +867,38 @@ relay_run (miredo_conf *conf, const char *server_name)
 	}
 
 #ifdef MIREDO_TEREDO_CLIENT
-	const char *server_name2 = NULL;
-	char namebuf[NI_MAXHOST], namebuf2[NI_MAXHOST];
+	const char *server_names[MAX_SERVERS], *server_name2 = NULL;
+	char namebuf[MAX_SERVERS][NI_MAXHOST], namebuf2[NI_MAXHOST];
+	unsigned server_count = 0;
 #endif
-	uint16_t mtu = 1280;
-	bool cone = false;
+	uint16_t mtu = 1280, queues = 1, workers = 0;
+	unsigned queues_line = 0;
+	bool cone = false, offload = false, evloop = false, pipeline = false;
 
 	if (mode & TEREDO_CLIENT)
 	{
 #ifdef MIREDO_TEREDO_CLIENT
 		if (server_name == NULL)
 		{
-			char *name = miredo_conf_get (conf, "ServerAddress", NULL);
-			if (name == NULL)
+			char *name;
+
+			/* Further ServerAddress directives add standby servers */
+			while ((server_count < MAX_SERVERS)
+			    && ((name = miredo_conf_get (conf, "ServerAddress",
+			                                 NULL)) != NULL))
+			{
+				strlcpy (namebuf[server_count], name, sizeof (namebuf[0]));
+				free (name);
+				server_names[server_count] = namebuf[server_count];
+				server_count++;
+			}
+
+			if (server_count == 0)
 			{
 				syslog (LOG_ALERT, _("Server address not specified"));
 				syslog (LOG_ALERT, _("Fatal configuration error"));
 				return -2;
 			}
-			strlcpy (namebuf, name, sizeof (namebuf));
-			free (name);
-			server_name = namebuf;
 
 			name = miredo_conf_get (conf, "ServerAddress2", NULL);
 			if (name != NULL)
@@ -482,6 +908,8 @@ relay_run (miredo_conf *conf, const char *server_name)
 				server_name2 = namebuf2;
 			}
 		}
+		else
+			server_names[server_count++] = server_name;
 #else
 		syslog (LOG_ALERT, _("Unsupported Teredo client mode"));
 		syslog (LOG_ALERT, _("Fatal configuration error"));
@@ -520,15 +948,52 @@ relay_run (miredo_conf *conf, const char *server_name)
 #endif
 
 	if (!miredo_conf_parse_IPv4 (conf, "BindAddress", &bind_ip)
-	 || !miredo_conf_get_int16 (conf, "BindPort", &bind_port, NULL))
+	 || !miredo_conf_get_int16 (conf, "BindPort", &bind_port, NULL)
+	 || !miredo_conf_get_int16 (conf, "InterfaceQueues", &queues,
+	                            &queues_line)
+	 || !miredo_conf_get_bool (conf, "InterfaceOffload", &offload, NULL)
+	 || !miredo_conf_get_bool (conf, "EventLoop", &evloop, NULL)
+	 || !miredo_conf_get_int16 (conf, "Workers", &workers, NULL)
+	 || !miredo_conf_get_bool (conf, "Pipeline", &pipeline, NULL))
+	{
+		syslog (LOG_ALERT, _("Fatal configuration error"));
+		return -2;
+	}
+
+	if (queues > TUN6_MAX_QUEUES)
 	{
+		syslog (LOG_ALERT, _("Too many interface queues (%u) at line %u: "
+		                     "at most %u"), (unsigned)queues, queues_line,
+		        TUN6_MAX_QUEUES);
 		syslog (LOG_ALERT, _("Fatal configuration error"));
 		return -2;
 	}
 
 	bind_port = htons (bind_port);
 
+#ifndef __linux__
+	if (evloop)
+	{
+		syslog (LOG_WARNING, _("Event loop not supported on this system"));
+		evloop = false;
+	}
+#endif
+	if (evloop && workers)
+	{
+		syslog (LOG_WARNING, _("Packet processing threads ignored "
+		                       "with the event loop"));
+		workers = 0;
+	}
+	if (pipeline && (evloop || workers))
+	{
+		/* The decapsulation ring needs a single producer thread */
+		syslog (LOG_WARNING, _("Pipeline ignored with the event loop "
+		                       "or packet processing threads"));
+		pipeline = false;
+	}
+
 	char *ifname = miredo_conf_get (conf, "InterfaceName", NULL);
+	char *statefile = miredo_conf_get (conf, "StateFile", NULL);
 
 	miredo_conf_clear (conf, 5);
 
@@ -539,18 +1004,52 @@ relay_run (miredo_conf *conf, const char *server_name)
 	// Tunneling interface initialization
 	int privfd = -1;
 	tun6 *tunnel = (mode & TEREDO_CLIENT)
-		? create_dynamic_tunnel (ifname, &privfd)
-		: create_static_tunnel (ifname, &prefix.ip6, mtu);
+		? create_dynamic_tunnel (ifname, queues,
+		                         offload ? TUN6_OFFLOAD : 0, &privfd)
+		: create_static_tunnel (ifname, queues, offload ? TUN6_OFFLOAD : 0,
+		                        &prefix.ip6, mtu);
 
 	if (ifname != NULL)
 		free (ifname);
 
+	/* Opened while privileged: the directory may not be writable later */
+	miredo_state state = { .lifetime = 0 };
+	int statefd = -1;
+
+	if ((statefile != NULL) && (mode & TEREDO_CLIENT))
+	{
+		statefd = miredo_state_open (statefile);
+		if (statefd != -1)
+			miredo_setup_fd (statefd);
+		if ((statefd == -1) || miredo_state_read (statefd, &state))
+			syslog (LOG_WARNING, _("Error (%s): %m"), statefile);
+	}
+	if (statefile != NULL)
+		free (statefile);
+
+#ifdef MIREDO_TEREDO_CLIENT
+	/* Cached Teredo address from other servers is of no use */
+	if (mode & TEREDO_CLIENT)
+	{
+		uint32_t servers = miredo_state_hash (server_names, server_count);
+
+		if ((state.servers != servers) || (state.mtu == 0))
+		{
+			state.addr = in6addr_any;
+			state.port = 0;
+		}
+		state.servers = servers;
+	}
+#endif
+
 	int retval = -1;
 
 	if (tunnel == NULL)
 	{
 		syslog (LOG_ALERT, _("Miredo setup failure: %s"),
 		        _("Cannot create IPv6 tunnel"));
+		if (statefd != -1)
+			close (statefd);
 		return -1;
 	}
 
@@ -561,24 +1060,58 @@ relay_run (miredo_conf *conf, const char *server_name)
 	{
 		if (drop_privileges () == 0)
 		{
-			teredo_tunnel *relay = teredo_create (bind_ip, bind_port);
+			teredo_tunnel *(*create) (uint32_t, uint16_t) = evloop
+				? teredo_create_evloop : teredo_create;
+			teredo_tunnel *relay = NULL;
+
+			/* The NAT binding of the cached address might still hold */
+			if ((bind_port == 0) && (state.port != 0))
+				relay = create (bind_ip, htons (state.port));
+			if (relay == NULL)
+				relay = create (bind_ip, bind_port);
 			if (relay != NULL)
 			{
-				miredo_tunnel data = { tunnel, privfd, relay };
+				struct sockaddr_in addr;
+				socklen_t len = sizeof (addr);
+				uint16_t port = 0;
+
+				if (getsockname (teredo_get_fd (relay),
+				                 (struct sockaddr *)&addr, &len) == 0)
+					port = ntohs (addr.sin_port);
+				/* No NAT binding for the cached address on other ports */
+				if (port != state.port)
+					state.addr = in6addr_any;
+				state.port = port;
+
+				miredo_tunnel data = { .tunnel = tunnel, .priv_fd = privfd,
+				                      .relay = relay, .state_fd = statefd,
+				                      .state = state };
 				teredo_set_privdata (relay, &data);
-				teredo_set_recv_callback (relay, miredo_recv_callback);
+				teredo_set_recv_batch_callback (relay, miredo_recv_callback);
 				teredo_set_icmpv6_callback (relay, miredo_icmp6_callback);
 
 				retval = (mode & TEREDO_CLIENT)
-					? setup_client (relay, server_name, server_name2)
+					? setup_client (relay, server_names, server_count,
+					                server_name2)
 					: setup_relay (relay, prefix.teredo.prefix, cone);
+				if ((retval == 0) && workers)
+					retval = teredo_set_workers (relay, workers);
+				if ((retval == 0) && pipeline)
+					retval = miredo_writer_start (&data);
 	
 				/*
 				 * RUN
 				 */
 				if (retval == 0)
-					retval = run_tunnel (&data);
+#ifdef __linux__
+					retval = evloop ? run_event_loop (&data)
+					                : run_tunnel (&data, pipeline);
+#else
+					retval = run_tunnel (&data, pipeline);
+#endif
+				log_workers (relay);
 				teredo_destroy (relay);
+				miredo_writer_stop (&data);
 			}
 
 			if (retval)
@@ -592,6 +1125,8 @@ relay_run (miredo_conf *conf, const char *server_name)
 		destroy_dynamic_tunnel (tunnel, privfd);
 	else
 		destroy_static_tunnel (tunnel, &prefix.ip6);
+	if (statefd != -1)
+		close (statefd);
 
 	return retval;
 }
@@ -0,0 +1,219 @@
+/*
+ * ring.c - Lock-free single-producer/single-consumer packets ring
+ */
+
+/***********************************************************************
+ *  Copyright © 2004-2007 Rémi Denis-Courmont.                         *
+ *  This program is free software; you can redistribute and/or modify  *
+ *  it under the terms of the GNU General Public License as published  *
+ *  by the Free Software Foundation; version 2 of the license, or (at  *
+ *  your option) any later version.                                    *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *  See the GNU General Public License for more details.               *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, you can get it from:              *
+ *  http://www.gnu.org/copyleft/gpl.html                               *
+ ***********************************************************************/
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdbool.h>
+#include <stdlib.h> // malloc()
+#include <string.h> // memcpy()
+#include <inttypes.h>
+
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <pthread.h>
+
+#include "ring.h"
+
+/*
+ * Each packet is stored contiguously after an 8-bytes header holding its
+ * length, so that packets are 64-bits aligned. A packet that would not fit
+ * before the end of the buffer is stored at the start instead, after a
+ * wrap marker. Head and tail are free-running byte counters: the producer
+ * only writes the head, the consumer only writes the tail.
+ */
+#define RING_HDR  8
+#define RING_WRAP UINT32_MAX
+#define RING_ALIGN(len) (((len) + 7) & ~(size_t)7)
+
+struct miredo_ring
+{
+	size_t size; // power of 2
+	size_t head; // producer
+	size_t tail; // consumer
+	size_t peek; // consumer private
+
+	pthread_mutex_t lock;
+	pthread_cond_t wait;
+	bool sleeping;
+
+	unsigned long pushed, dropped;
+	size_t max_used;
+
+	uint64_t buf[];
+};
+
+
+static inline uint32_t *ring_hdr (miredo_ring *r, size_t pos)
+{
+	return (uint32_t *)((uint8_t *)r->buf + (pos & (r->size - 1)));
+}
+
+
+int miredo_ring_push (miredo_ring *restrict r, const void *data, size_t len)
+{
+	size_t rec = RING_ALIGN (RING_HDR + len);
+	size_t head = r->head;
+	size_t tail = __atomic_load_n (&r->tail, __ATOMIC_ACQUIRE);
+	size_t off = head & (r->size - 1);
+	size_t skip = (off + rec > r->size) ? (r->size - off) : 0;
+
+	if (head + skip + rec - tail > r->size)
+	{
+		__atomic_store_n (&r->dropped, r->dropped + 1, __ATOMIC_RELAXED);
+		return -1;
+	}
+
+	if (skip)
+	{
+		*ring_hdr (r, head) = RING_WRAP;
+		head += skip;
+	}
+
+	uint32_t *hdr = ring_hdr (r, head);
+	*hdr = len;
+	memcpy ((uint8_t *)hdr + RING_HDR, data, len);
+	head += rec;
+	__atomic_store_n (&r->head, head, __ATOMIC_RELEASE);
+
+	__atomic_store_n (&r->pushed, r->pushed + 1, __ATOMIC_RELAXED);
+	if (head - tail > r->max_used)
+		__atomic_store_n (&r->max_used, head - tail, __ATOMIC_RELAXED);
+	return 0;
+}
+
+
+void miredo_ring_notify (miredo_ring *r)
+{
+	/* Pairs with the sleeping flag store in miredo_ring_peek() */
+	__atomic_thread_fence (__ATOMIC_SEQ_CST);
+	if (__atomic_load_n (&r->sleeping, __ATOMIC_RELAXED))
+	{
+		pthread_mutex_lock (&r->lock);
+		pthread_cond_signal (&r->wait);
+		pthread_mutex_unlock (&r->lock);
+	}
+}
+
+
+static void cleanup_sleep (void *data)
+{
+	miredo_ring *r = (miredo_ring *)data;
+
+	__atomic_store_n (&r->sleeping, false, __ATOMIC_RELAXED);
+	pthread_mutex_unlock (&r->lock);
+}
+
+
+/**
+ * Waits until the ring is not empty. Consumer only.
+ */
+static void ring_sleep (miredo_ring *r)
+{
+	pthread_mutex_lock (&r->lock);
+	pthread_cleanup_push (cleanup_sleep, r);
+	__atomic_store_n (&r->sleeping, true, __ATOMIC_SEQ_CST);
+	while (__atomic_load_n (&r->head, __ATOMIC_SEQ_CST) == r->tail)
+		pthread_cond_wait (&r->wait, &r->lock);
+	pthread_cleanup_pop (1);
+}
+
+
+unsigned miredo_ring_peek (miredo_ring *restrict r,
+                           struct iovec *restrict pkts, unsigned max)
+{
+	size_t head = __atomic_load_n (&r->head, __ATOMIC_ACQUIRE);
+
+	if (head == r->tail)
+	{
+		ring_sleep (r);
+		head = __atomic_load_n (&r->head, __ATOMIC_ACQUIRE);
+	}
+
+	size_t pos = r->tail;
+
+	unsigned n = 0;
+	while ((n < max) && (pos != head))
+	{
+		uint32_t *hdr = ring_hdr (r, pos);
+
+		if (*hdr == RING_WRAP)
+		{
+			pos += r->size - (pos & (r->size - 1));
+			continue;
+		}
+
+		pkts[n].iov_base = (uint8_t *)hdr + RING_HDR;
+		pkts[n].iov_len = *hdr;
+		pos += RING_ALIGN (RING_HDR + *hdr);
+		n++;
+	}
+
+	r->peek = pos;
+	return n;
+}
+
+
+void miredo_ring_release (miredo_ring *r)
+{
+	__atomic_store_n (&r->tail, r->peek, __ATOMIC_RELEASE);
+}
+
+
+void miredo_ring_get_stats (miredo_ring *restrict r,
+                            miredo_ring_stats *restrict stats)
+{
+	stats->pushed = __atomic_load_n (&r->pushed, __ATOMIC_RELAXED);
+	stats->dropped = __atomic_load_n (&r->dropped, __ATOMIC_RELAXED);
+	stats->max_used = __atomic_load_n (&r->max_used, __ATOMIC_RELAXED);
+	stats->size = r->size;
+}
+
+
+miredo_ring *miredo_ring_create (size_t size)
+{
+	size_t s = 4096;
+
+	while (s < size)
+		s <<= 1;
+
+	miredo_ring *r = malloc (sizeof (*r) + s);
+	if (r == NULL)
+		return NULL;
+
+	r->size = s;
+	r->head = r->tail = r->peek = 0;
+	r->sleeping = false;
+	r->pushed = r->dropped = 0;
+	r->max_used = 0;
+	pthread_mutex_init (&r->lock, NULL);
+	pthread_cond_init (&r->wait, NULL);
+	return r;
+}
+
+
+void miredo_ring_destroy (miredo_ring *r)
+{
+	pthread_cond_destroy (&r->wait);
+	pthread_mutex_destroy (&r->lock);
+	free (r);
+}
@@ -0,0 +1,89 @@
+/*
+ * ring.h - Lock-free single-producer/single-consumer packets ring
+ */
+
+/***********************************************************************
+ *  Copyright © 2004-2007 Rémi Denis-Courmont.                         *
+ *  This program is free software; you can redistribute and/or modify  *
+ *  it under the terms of the GNU General Public License as published  *
+ *  by the Free Software Foundation; version 2 of the license, or (at  *
+ *  your option) any later version.                                    *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *  See the GNU General Public License for more details.               *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, you can get it from:              *
+ *  http://www.gnu.org/copyleft/gpl.html                               *
+ ***********************************************************************/
+
+#ifndef MIREDO_RING_H
+# define MIREDO_RING_H
+
+struct iovec;
+
+/**
+ * Ring of variable-length packets, passed from exactly one producer thread
+ * to exactly one consumer thread. Packets are copied into the ring.
+ */
+typedef struct miredo_ring miredo_ring;
+
+typedef struct miredo_ring_stats
+{
+	unsigned long pushed;  /**< packets queued */
+	unsigned long dropped; /**< packets dropped because the ring was full */
+	size_t max_used;       /**< high watermark (bytes) */
+	size_t size;           /**< capacity (bytes) */
+} miredo_ring_stats;
+
+# ifdef __cplusplus
+extern "C" {
+# endif
+
+/**
+ * Creates a ring.
+ * @param size capacity in bytes (rounded up to a power of 2)
+ * @return NULL on error.
+ */
+miredo_ring *miredo_ring_create (size_t size);
+void miredo_ring_destroy (miredo_ring *r);
+
+/**
+ * Copies a packet into the ring. Producer only. Never blocks.
+ * The consumer is only woken up by miredo_ring_notify().
+ *
+ * @return 0 on success, -1 if the ring is full (the packet is dropped).
+ */
+int miredo_ring_push (miredo_ring *restrict r, const void *data, size_t len);
+
+/**
+ * Wakes the consumer up, if it is waiting. Producer only.
+ * Call this once after pushing a batch of packets.
+ */
+void miredo_ring_notify (miredo_ring *r);
+
+/**
+ * Maps up to a given number of packets from the ring, waiting for at least
+ * one. Consumer only. This is a thread cancellation point.
+ * The packets remain valid until miredo_ring_release().
+ *
+ * @return the number of packets (at least 1).
+ */
+unsigned miredo_ring_peek (miredo_ring *restrict r,
+                           struct iovec *restrict pkts, unsigned max);
+
+/**
+ * Releases all the packets returned by the last miredo_ring_peek() call.
+ * Consumer only.
+ */
+void miredo_ring_release (miredo_ring *r);
+
+void miredo_ring_get_stats (miredo_ring *restrict r,
+                            miredo_ring_stats *restrict stats);
+
+# ifdef __cplusplus
+}
+# endif
+#endif
@@ -43,14 +43,40 @@
 #include <signal.h> // sigwait()
 
 #include <netinet/in.h>
+#include <arpa/inet.h> // inet_ntop()
 #include <libteredo/teredo.h>
 
 #include "miredo.h"
 #include "conf.h"
 
 #include <libteredo/server.h>
+#include <libteredo/hitters.h>
 
 
+/**
+ * Logs the dropped packets counters and the current top talkers.
+ */
+static void log_stats (const teredo_server *server)
+{
+	teredo_talker tab[8];
+	unsigned n = teredo_server_get_talkers (server, tab,
+	                                        sizeof (tab) / sizeof (tab[0]));
+
+	syslog (LOG_INFO, _("%lu packet(s) dropped by the kernel"),
+	        teredo_server_get_drops (server));
+	syslog (LOG_INFO, _("%lu packet(s) dropped as exceeding the rate limit"),
+	        teredo_server_get_throttled (server));
+
+	for (unsigned i = 0; i < n; i++)
+	{
+		char str[INET_ADDRSTRLEN];
+
+		inet_ntop (AF_INET, &tab[i].ip, str, sizeof (str));
+		syslog (LOG_INFO, _("Top talker %s: about %lu packet(s) per second"),
+		        str, tab[i].rate);
+	}
+}
+
 static int
 server_diagnose (void)
 {
@@ -65,13 +91,33 @@ server_diagnose (void)
 }
 
 
+/**
+ * Adds the server address pairs from further ServerBindAddress directives.
+ * The secondary address of each pair is the one after the primary address.
+ */
+static bool server_add_pairs (miredo_conf *conf, teredo_server *server)
+{
+	for (;;)
+	{
+		uint32_t ip = INADDR_ANY;
+
+		if (!miredo_conf_parse_IPv4 (conf, "ServerBindAddress", &ip))
+			return false;
+		if (ip == INADDR_ANY)
+			return true;
+		if (teredo_server_add_pair (server, ip, htonl (ntohl (ip) + 1)))
+			return false;
+	}
+}
+
+
 static int
 server_run (miredo_conf *conf, const char *server_name)
 {
 	teredo_server *server;
 	union teredo_addr prefix;
 	uint32_t server_ip = INADDR_ANY, server_ip2 = INADDR_ANY;
-	uint16_t mtu = 1280;
+	uint16_t mtu = 1280, workers = 1, ratelimit = 0;
 
 	memset (&prefix, 0, sizeof (prefix));
 	prefix.teredo.prefix = htonl (TEREDO_PREFIX);
@@ -115,37 +161,68 @@ server_run (miredo_conf *conf, const char *server_name)
 
 	if (!miredo_conf_parse_teredo_prefix (conf, "Prefix",
 	                                      &prefix.teredo.prefix)
-	 || !miredo_conf_get_int16 (conf, "InterfaceMTU", &mtu, NULL))
+	 || !miredo_conf_get_int16 (conf, "InterfaceMTU", &mtu, NULL)
+	 || !miredo_conf_get_int16 (conf, "Workers", &workers, NULL)
+	 || !miredo_conf_get_int16 (conf, "RateLimit", &ratelimit, NULL))
 	{
 		syslog (LOG_ALERT, _("Fatal configuration error"));
 		return -2;
 	}
 
-	miredo_conf_clear (conf, 5);
-
 	// Sets up server (needs privileges to create raw socket)
-	server = teredo_server_create (server_ip, server_ip2);
+	if (workers == 0)
+		workers = 1;
+	else
+	{
+		/* More workers than processors only add contention */
+		long cpus = sysconf (_SC_NPROCESSORS_ONLN);
+		if ((cpus > 0) && (workers > cpus))
+		{
+			syslog (LOG_WARNING, _("Only %ld worker(s) used: one per CPU"),
+			        cpus);
+			workers = cpus;
+		}
+	}
+	server = teredo_server_create_workers (server_ip, server_ip2, workers);
+	if ((server != NULL) && (server_name == NULL)
+	 && !server_add_pairs (conf, server))
+	{
+		teredo_server_destroy (server);
+		server = NULL;
+	}
+
+	miredo_conf_clear (conf, 5);
 
 	if (drop_privileges ())
 		return -1;
 
 	if (server != NULL)
 	{
+		teredo_server_set_rate_limit (server, ratelimit);
+
 		if ((teredo_server_set_prefix (server, prefix.teredo.prefix) == 0)
 		 && (teredo_server_set_MTU (server, mtu) == 0)
 		 && (teredo_server_start (server) == 0))
 		{
 			sigset_t dummyset, set;
-			int dummy;
+			int signum;
 
 			/* changes nothing, only gets the current mask */
 			sigemptyset (&dummyset);
 			pthread_sigmask (SIG_BLOCK, &dummyset, &set);
 
-			/* wait for fatal signal */
-			while (sigwait (&set, &dummy) != 0);
+			/* wait for fatal signal, logging statistics on SIGUSR1 */
+			for (;;)
+			{
+				if (sigwait (&set, &signum))
+					continue;
+				if (signum != SIGUSR1)
+					break;
+				log_stats (server);
+			}
 
 			teredo_server_stop (server);
+			log_stats (server);
 			teredo_server_destroy (server);
 
 			// parent's been signaled or died
@@ -0,0 +1,135 @@
+/*
+ * state.c - Teredo client state saved across restarts
+ */
+
+/***********************************************************************
+ *  Copyright © 2004-2007 Rémi Denis-Courmont.                         *
+ *  This program is free software; you can redistribute and/or modify  *
+ *  it under the terms of the GNU General Public License as published  *
+ *  by the Free Software Foundation; version 2 of the license, or (at  *
+ *  your option) any later version.                                    *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *  See the GNU General Public License for more details.               *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, you can get it from:              *
+ *  http://www.gnu.org/copyleft/gpl.html                               *
+ ***********************************************************************/
+
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdbool.h>
+#include <stdio.h> // snprintf()
+#include <string.h>
+#include <stdlib.h> // strtoul()
+
+#include <inttypes.h>
+#include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <arpa/inet.h> // inet_pton()
+
+#include "state.h"
+
+/*
+ * The state file is made of "name value" lines. It is small, and rewritten
+ * in place at once.
+ */
+#define STATE_MAX 1024
+
+int miredo_state_open (const char *path)
+{
+	return open (path, O_RDWR | O_CREAT, 0600);
+}
+
+
+int miredo_state_read (int fd, miredo_state *st)
+{
+	char buf[STATE_MAX];
+	ssize_t len = pread (fd, buf, sizeof (buf) - 1, 0);
+
+	if (len == -1)
+		return -1;
+	buf[len] = '\0';
+
+	for (char *line = buf, *next; line != NULL; line = next)
+	{
+		next = strchr (line, '\n');
+		if (next != NULL)
+			*next++ = '\0';
+
+		char *val = strchr (line, ' ');
+		if (val == NULL)
+			continue;
+		*val++ = '\0';
+
+		if (strcmp (line, "Address") == 0)
+		{
+			struct in6_addr addr;
+
+			if (inet_pton (AF_INET6, val, &addr) == 1)
+				st->addr = addr;
+			continue;
+		}
+
+		bool hex = (strcmp (line, "Servers") == 0);
+		char *end;
+		unsigned long n = strtoul (val, &end, hex ? 16 : 10);
+		if ((*end != '\0') || (end == val))
+			continue;
+
+		if ((strcmp (line, "Lifetime") == 0) && (n <= 86400))
+			st->lifetime = n;
+		else
+		if (hex && (n <= UINT32_MAX))
+			st->servers = n;
+		else
+		if ((strcmp (line, "MTU") == 0) && (n >= 1280) && (n <= 65535))
+			st->mtu = n;
+		else
+		if ((strcmp (line, "Port") == 0) && (n <= 65535))
+			st->port = n;
+	}
+	return 0;
+}
+
+
+int miredo_state_write (int fd, const miredo_state *st)
+{
+	char buf[STATE_MAX], addr[INET6_ADDRSTRLEN] = "";
+	int len = snprintf (buf, sizeof (buf), "Lifetime %u\nServers %08"PRIx32
+	                    "\n", st->lifetime, st->servers);
+
+	/* The Teredo address is only saved while the tunnel is up */
+	if (!IN6_IS_ADDR_UNSPECIFIED (&st->addr)
+	 && (inet_ntop (AF_INET6, &st->addr, addr, sizeof (addr)) != NULL))
+		len += snprintf (buf + len, sizeof (buf) - len,
+		                 "Address %s\nMTU %"PRIu16"\nPort %"PRIu16"\n",
+		                 addr, st->mtu, st->port);
+
+	if ((pwrite (fd, buf, len, 0) != len) || ftruncate (fd, len))
+		return -1;
+	return 0;
+}
+
+
+uint32_t miredo_state_hash (const char *const *names, unsigned count)
+{
+	/* FNV-1a, with the names separated by new lines */
+	uint32_t h = 2166136261;
+
+	for (unsigned i = 0; i < count; i++)
+	{
+		for (const char *p = names[i]; *p; p++)
+			h = (h ^ (uint8_t)*p) * 16777619;
+		h = (h ^ '\n') * 16777619;
+	}
+	return h;
+}
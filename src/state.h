@@ -0,0 +1,72 @@
+/*
+ * state.h - Teredo client state saved across restarts
+ */
+
+/***********************************************************************
+ *  Copyright © 2004-2007 Rémi Denis-Courmont.                         *
+ *  This program is free software; you can redistribute and/or modify  *
+ *  it under the terms of the GNU General Public License as published  *
+ *  by the Free Software Foundation; version 2 of the license, or (at  *
+ *  your option) any later version.                                    *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *  See the GNU General Public License for more details.               *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, you can get it from:              *
+ *  http://www.gnu.org/copyleft/gpl.html                               *
+ ***********************************************************************/
+
+
+#ifndef MIREDO_STATE_H
+# define MIREDO_STATE_H
+
+/**
+ * Teredo client state saved in the state file, so that it survives
+ * restarts of the daemon.
+ */
+typedef struct miredo_state
+{
+	unsigned lifetime; /**< NAT binding lifetime (seconds), 0 if unknown */
+	uint32_t servers; /**< miredo_state_hash() of the Teredo servers */
+	struct in6_addr addr; /**< Teredo address, unspecified if none */
+	uint16_t mtu; /**< Teredo tunnel MTU */
+	uint16_t port; /**< local UDP port (host byte order), 0 if unknown */
+} miredo_state;
+
+# ifdef __cplusplus
+extern "C" {
+# endif
+
+/**
+ * Opens (or creates) a state file. This is done before privileges are
+ * dropped: the file is then rewritten through the returned descriptor.
+ * @return file descriptor, or -1 on error.
+ */
+int miredo_state_open (const char *path);
+
+/**
+ * Reads a state file. Unknown or malformed entries are ignored, and the
+ * corresponding fields are left unchanged.
+ * @return 0 on success, -1 on I/O error.
+ */
+int miredo_state_read (int fd, miredo_state *st);
+
+/**
+ * Replaces the content of a state file.
+ * @return 0 on success, -1 on I/O error.
+ */
+int miredo_state_write (int fd, const miredo_state *st);
+
+/**
+ * Hashes a list of Teredo server names, so as to find out whether the
+ * saved state was obtained with the same servers.
+ */
+uint32_t miredo_state_hash (const char *const *names, unsigned count);
+
+# ifdef __cplusplus
+}
+# endif
+#endif
@@ -0,0 +1,227 @@
+/*
+ * test_ring.c - Packets ring tests
+ */
+
+/***********************************************************************
+ *  Copyright © 2004-2007 Rémi Denis-Courmont.                         *
+ *  This program is free software; you can redistribute and/or modify  *
+ *  it under the terms of the GNU General Public License as published  *
+ *  by the Free Software Foundation; version 2 of the license, or (at  *
+ *  your option) any later version.                                    *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *  See the GNU General Public License for more details.               *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, you can get it from:              *
+ *  http://www.gnu.org/copyleft/gpl.html                               *
+ ***********************************************************************/
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#undef NDEBUG
+#include <assert.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <inttypes.h>
+
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <pthread.h>
+
+#include "ring.h"
+
+/**
+ * Fills a packet with a pattern that depends on its sequence number.
+ */
+static void fill (uint8_t *buf, size_t len, unsigned seq)
+{
+	for (size_t i = 0; i < len; i++)
+		buf[i] = seq + i;
+}
+
+
+static bool check (const struct iovec *pkt, size_t len, unsigned seq)
+{
+	const uint8_t *buf = pkt->iov_base;
+
+	if (pkt->iov_len != len)
+		return false;
+	for (size_t i = 0; i < len; i++)
+		if (buf[i] != (uint8_t)(seq + i))
+			return false;
+	return true;
+}
+
+
+/* Packet lengths, not multiples of 8, so that some do not fit before the
+ * end of the buffer */
+static size_t length (unsigned seq)
+{
+	return 1 + (seq * 397) % 1500;
+}
+
+
+static miredo_ring *ring;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned consumed;
+
+static void *consumer_thread (void *data)
+{
+	struct iovec pkt;
+
+	(void)data;
+	for (;;)
+	{
+		unsigned n = miredo_ring_peek (ring, &pkt, 1);
+
+		assert (n == 1);
+		pthread_mutex_lock (&lock);
+		assert (check (&pkt, length (consumed), consumed));
+		consumed++;
+		pthread_mutex_unlock (&lock);
+		miredo_ring_release (ring);
+	}
+	return NULL;
+}
+
+
+static unsigned wait_consumed (unsigned n)
+{
+	unsigned val;
+
+	for (unsigned i = 0; i < 50; i++)
+	{
+		pthread_mutex_lock (&lock);
+		val = consumed;
+		pthread_mutex_unlock (&lock);
+		if (val >= n)
+			break;
+		nanosleep (&(struct timespec){ 0, 20000000 }, NULL);
+	}
+	return val;
+}
+
+
+int main (void)
+{
+	uint8_t buf[1500];
+	struct iovec pkts[16];
+	miredo_ring_stats stats;
+	unsigned seq = 0, next = 0;
+
+	/* Capacity is rounded up, to at least one page */
+	ring = miredo_ring_create (0);
+	assert (ring != NULL);
+	miredo_ring_get_stats (ring, &stats);
+	assert (stats.size == 4096);
+	assert ((stats.pushed == 0) && (stats.dropped == 0));
+	miredo_ring_destroy (ring);
+
+	ring = miredo_ring_create (5000);
+	assert (ring != NULL);
+	miredo_ring_get_stats (ring, &stats);
+	assert (stats.size == 8192);
+
+	/* Wrap-around: packets come out whole and in order, many times over */
+	for (unsigned round = 0; round < 1000; round++)
+	{
+		for (unsigned i = 0; i < 3; i++)
+		{
+			fill (buf, length (seq), seq);
+			assert (miredo_ring_push (ring, buf, length (seq)) == 0);
+			seq++;
+		}
+
+		while (next < seq)
+		{
+			unsigned n = miredo_ring_peek (ring, pkts, 2);
+
+			assert ((n >= 1) && (n <= 2));
+			for (unsigned i = 0; i < n; i++, next++)
+				assert (check (pkts + i, length (next), next));
+			miredo_ring_release (ring);
+		}
+	}
+
+	miredo_ring_get_stats (ring, &stats);
+	assert (stats.pushed == seq);
+	assert (stats.dropped == 0);
+	assert ((stats.max_used > 0) && (stats.max_used <= stats.size));
+
+	/* Full ring: packets are dropped and counted, the queued ones kept */
+	unsigned queued = 0, dropped = 0;
+
+	memset (buf, 0, sizeof (buf));
+	for (unsigned i = 0; i < 100; i++)
+	{
+		buf[0] = i;
+		if (miredo_ring_push (ring, buf, 1000))
+			dropped++;
+		else
+		{
+			assert (dropped == 0);
+			queued++;
+		}
+	}
+	/* 8192 bytes hold 8 records of 1008 bytes, minus one wrap skip */
+	assert ((queued >= 7) && (queued <= 8));
+	assert (queued + dropped == 100);
+
+	miredo_ring_get_stats (ring, &stats);
+	assert (stats.pushed == seq + queued);
+	assert (stats.dropped == dropped);
+	assert (stats.max_used <= stats.size);
+
+	for (unsigned i = 0; i < queued;)
+	{
+		unsigned n = miredo_ring_peek (ring, pkts, 16);
+
+		for (unsigned j = 0; j < n; j++, i++)
+		{
+			assert (pkts[j].iov_len == 1000);
+			assert (((uint8_t *)pkts[j].iov_base)[0] == i);
+		}
+		miredo_ring_release (ring);
+	}
+
+	/* Room again once released */
+	assert (miredo_ring_push (ring, buf, 1000) == 0);
+	assert (miredo_ring_peek (ring, pkts, 16) == 1);
+	miredo_ring_release (ring);
+	miredo_ring_destroy (ring);
+
+	/* Sleep/notify handshake: the consumer waits on an empty ring */
+	pthread_t th;
+
+	ring = miredo_ring_create (0);
+	assert (ring != NULL);
+	assert (pthread_create (&th, NULL, consumer_thread, NULL) == 0);
+
+	seq = 0;
+	for (unsigned round = 0; round < 200; round++)
+	{
+		/* Let the consumer go to sleep, half of the time */
+		if (round & 1)
+			nanosleep (&(struct timespec){ 0, 1000000 }, NULL);
+
+		fill (buf, length (seq), seq);
+		assert (miredo_ring_push (ring, buf, length (seq)) == 0);
+		seq++;
+		miredo_ring_notify (ring);
+		assert (wait_consumed (seq) == seq);
+	}
+
+	/* The consumer is cancelled while sleeping */
+	nanosleep (&(struct timespec){ 0, 10000000 }, NULL);
+	pthread_cancel (th);
+	assert (pthread_join (th, NULL) == 0);
+	miredo_ring_destroy (ring);
+	return 0;
+}